@@ -0,0 +1,934 @@
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include <unistd.h>
+
+#include <benchmark/benchmark.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/util/delimited_message_util.h>
+#include <sqlite3.h>
+
+#include "Benchmark.pb.h"
+
+
+extern "C"
+int sqlite3_sqliteprotobuf_init(sqlite3 *db,
+                                char **pzErrMsg,
+                                const sqlite3_api_routines *pApi);
+
+
+/// An in-memory database with the extension loaded and a table of messages
+class BenchDatabase {
+public:
+    BenchDatabase() : db_(nullptr), total_bytes_(0) {
+        sqlite3_auto_extension(
+            reinterpret_cast<void (*)(void)>(sqlite3_sqliteprotobuf_init));
+        sqlite3_open(":memory:", &db_);
+        exec("CREATE TABLE people (protobuf BLOB)");
+    }
+
+    ~BenchDatabase() {
+        sqlite3_close(db_);
+    }
+
+    void exec(const std::string& sql) {
+        char *errmsg = nullptr;
+        if (sqlite3_exec(db_, sql.c_str(), nullptr, nullptr, &errmsg)
+            != SQLITE_OK) {
+            std::string error = errmsg ? errmsg : "unknown error";
+            sqlite3_free(errmsg);
+            throw std::runtime_error(error);
+        }
+    }
+
+    /// Fills the table with people with the given number of phones. Each row
+    /// has a different id, so that no two messages are the same.
+    void populate(int rows, int phones) {
+        BenchPerson person;
+        person.set_name("Kaila Dutton");
+        for (int i = 0; i < phones; i ++) {
+            BenchPerson::PhoneNumber *phone = person.add_phones();
+            phone->set_number("(607) 555-" + std::to_string(1000 + i));
+            phone->set_type(BenchPerson::WORK);
+        }
+        person.set_score(98.6);
+        insert(rows, person);
+    }
+
+    /// Fills the table with copies of a person, each with a different id
+    void insert(int rows, BenchPerson person) {
+        sqlite3_stmt *stmt;
+        exec("BEGIN");
+        sqlite3_prepare_v2(db_, "INSERT INTO people VALUES (?)", -1, &stmt,
+            nullptr);
+        total_bytes_ = 0;
+        for (int i = 0; i < rows; i ++) {
+            person.set_id(1337 + i);
+            const std::string data = person.SerializeAsString();
+            sqlite3_bind_blob(stmt, 1, data.data(), data.size(),
+                SQLITE_TRANSIENT);
+            sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+            total_bytes_ += data.size();
+        }
+        sqlite3_finalize(stmt);
+        exec("COMMIT");
+    }
+
+    /// Steps through every row of a query, returning the number of rows
+    int64_t run(const std::string& sql) {
+        sqlite3_stmt *stmt;
+        sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr);
+        int64_t rows = 0;
+        int err;
+        while ((err = sqlite3_step(stmt)) == SQLITE_ROW) rows ++;
+        sqlite3_finalize(stmt);
+        if (err != SQLITE_DONE)
+            throw std::runtime_error(sqlite3_errmsg(db_));
+        return rows;
+    }
+
+    /// Returns the integer in the first column of the first row of a query
+    int64_t scalar(const std::string& sql) {
+        sqlite3_stmt *stmt;
+        sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr);
+        int err = sqlite3_step(stmt);
+        int64_t value = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+        if (err != SQLITE_ROW)
+            throw std::runtime_error(sqlite3_errmsg(db_));
+        return value;
+    }
+
+    int64_t total_bytes() const { return total_bytes_; }
+
+    sqlite3 *handle() const { return db_; }
+
+private:
+    sqlite3 *db_;
+    int64_t total_bytes_;
+};
+
+
+/// Extracts one field from messages with a varying number of phones, using
+/// the wire engine, reflection, or the extractors generated for BenchPerson
+static void extract_engine(benchmark::State& state, const char *engine,
+                           const char *path)
+{
+    const int rows = 1000;
+    BenchDatabase db;
+    db.populate(rows, static_cast<int>(state.range(0)));
+    db.exec(std::string("SELECT protobuf_config('extract_engine', '")
+        + engine + "')");
+    if (std::string(engine) == "auto") {
+        sqlite3_enable_load_extension(db.handle(), 1);
+        db.exec("SELECT protobuf_load('" BENCH_EXTRACTORS "')");
+    }
+
+    const std::string query = std::string(
+        "SELECT protobuf_extract(protobuf, 'BenchPerson', '") + path
+        + "') FROM people";
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.run(query));
+    }
+    state.SetItemsProcessed(state.iterations() * rows);
+    state.SetBytesProcessed(state.iterations() * db.total_bytes());
+}
+
+BENCHMARK_CAPTURE(extract_engine, wire_scalar, "wire", "$.score")
+    ->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(extract_engine, generated_scalar, "auto", "$.score")
+    ->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(extract_engine, reflection_scalar, "reflection", "$.score")
+    ->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(extract_engine, wire_first_phone, "wire",
+                  "$.phones[0].number")
+    ->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(extract_engine, generated_first_phone, "auto",
+                  "$.phones[0].number")
+    ->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(extract_engine, reflection_first_phone, "reflection",
+                  "$.phones[0].number")
+    ->RangeMultiplier(8)->Range(1, 512);
+
+
+/// Extracts a field that follows a bytes field of varying size, which the wire
+/// engine skips over without copying
+static void extract_size(benchmark::State& state)
+{
+    const int rows = 1000;
+    BenchPerson person;
+    person.set_payload(std::string(static_cast<size_t>(state.range(0)), 'x'));
+    person.set_score(98.6);
+    BenchDatabase db;
+    db.insert(rows, person);
+
+    const std::string query = "SELECT protobuf_extract(protobuf, "
+        "'BenchPerson', '$.score') FROM people";
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.run(query));
+    }
+    state.SetItemsProcessed(state.iterations() * rows);
+    state.SetBytesProcessed(state.iterations() * db.total_bytes());
+}
+
+BENCHMARK(extract_size)->RangeMultiplier(16)->Range(16, 64 << 10);
+
+
+/// Extracts a value at the bottom of a chain of nested messages
+static void extract_depth(benchmark::State& state)
+{
+    const int rows = 1000;
+    const int depth = static_cast<int>(state.range(0));
+    BenchPerson person;
+    BenchNode *node = person.mutable_tree();
+    std::string path = "$.tree";
+    for (int i = 1; i < depth; i ++) {
+        node = node->mutable_child();
+        path += ".child";
+    }
+    node->set_value(42);
+    path += ".value";
+    BenchDatabase db;
+    db.insert(rows, person);
+
+    const std::string query = "SELECT protobuf_extract(protobuf, "
+        "'BenchPerson', '" + path + "') FROM people";
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.run(query));
+    }
+    state.SetItemsProcessed(state.iterations() * rows);
+    state.SetBytesProcessed(state.iterations() * db.total_bytes());
+}
+
+BENCHMARK(extract_depth)->RangeMultiplier(4)->Range(1, 64);
+
+
+/// Extracts one element of a repeated field with 512 elements, by index
+static void extract_index(benchmark::State& state)
+{
+    const int rows = 100;
+    BenchDatabase db;
+    db.populate(rows, 512);
+
+    const std::string query = "SELECT protobuf_extract(protobuf, "
+        "'BenchPerson', '$.phones[" + std::to_string(state.range(0))
+        + "].number') FROM people";
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.run(query));
+    }
+    state.SetItemsProcessed(state.iterations() * rows);
+    state.SetBytesProcessed(state.iterations() * db.total_bytes());
+}
+
+BENCHMARK(extract_index)->Arg(0)->Arg(8)->Arg(64)->Arg(511)->Arg(-1);
+
+
+/// Extracts a field of each type, to compare how each one is decoded and
+/// returned to SQLite
+static void extract_type(benchmark::State& state, const char *path)
+{
+    const int rows = 1000;
+    BenchDatabase db;
+    db.populate(rows, 4);
+
+    const std::string query = std::string("SELECT protobuf_extract(protobuf, "
+        "'BenchPerson', '") + path + "') FROM people";
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.run(query));
+    }
+    state.SetItemsProcessed(state.iterations() * rows);
+    state.SetBytesProcessed(state.iterations() * db.total_bytes());
+}
+
+BENCHMARK_CAPTURE(extract_type, int32, "$.id");
+BENCHMARK_CAPTURE(extract_type, double, "$.score");
+BENCHMARK_CAPTURE(extract_type, string, "$.name");
+BENCHMARK_CAPTURE(extract_type, enum, "$.phones[0].type");
+BENCHMARK_CAPTURE(extract_type, enum_name, "$.phones[0].type.name");
+BENCHMARK_CAPTURE(extract_type, message, "$.phones[0]");
+
+
+/// Extracts a field by number with protobuf_extract_raw, which needs no message
+/// type, compared with protobuf_extract on the wire engine
+static void extract_raw(benchmark::State& state, const char *function,
+                        const char *path)
+{
+    const int rows = 1000;
+    BenchDatabase db;
+    db.populate(rows, static_cast<int>(state.range(0)));
+    db.exec("SELECT protobuf_config('extract_engine', 'wire')");
+
+    const std::string query = std::string("SELECT ") + function + "(protobuf, "
+        + path + ") FROM people";
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.run(query));
+    }
+    state.SetItemsProcessed(state.iterations() * rows);
+    state.SetBytesProcessed(state.iterations() * db.total_bytes());
+}
+
+BENCHMARK_CAPTURE(extract_raw, typed_scalar, "protobuf_extract",
+                  "'BenchPerson', '$.score'")
+    ->Arg(1)->Arg(64);
+BENCHMARK_CAPTURE(extract_raw, raw_scalar, "protobuf_extract_raw",
+                  "'$.#6', 'double'")
+    ->Arg(1)->Arg(64);
+BENCHMARK_CAPTURE(extract_raw, typed_first_phone, "protobuf_extract",
+                  "'BenchPerson', '$.phones[0].number'")
+    ->Arg(1)->Arg(64);
+BENCHMARK_CAPTURE(extract_raw, raw_first_phone, "protobuf_extract_raw",
+                  "'$.#4[0].#1', 'string'")
+    ->Arg(1)->Arg(64);
+
+
+/// Extracts a field with a path that is either a constant, which is compiled
+/// once per statement, or read from a table, which makes the function look up
+/// the message type and compile the path again for every row
+static void extract_lookup(benchmark::State& state, bool warm)
+{
+    const int rows = 1000;
+    BenchDatabase db;
+    db.populate(rows, 4);
+    db.exec("CREATE TABLE paths (path TEXT)");
+    db.exec("INSERT INTO paths VALUES ('$.phones[0].number')");
+
+    const std::string query = warm
+        ? "SELECT protobuf_extract(protobuf, 'BenchPerson', "
+          "'$.phones[0].number') FROM people"
+        : "SELECT protobuf_extract(protobuf, 'BenchPerson', paths.path) "
+          "FROM people, paths";
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.run(query));
+    }
+    state.SetItemsProcessed(state.iterations() * rows);
+    state.SetBytesProcessed(state.iterations() * db.total_bytes());
+}
+
+BENCHMARK_CAPTURE(extract_lookup, warm, true);
+BENCHMARK_CAPTURE(extract_lookup, cold, false);
+
+
+/// Extracts a field on several threads at once, each with its own connection,
+/// with a path read from a table so that the message type is looked up for
+/// every row. Throughput should grow with the number of threads.
+static void extract_threads(benchmark::State& state)
+{
+    const int rows = 1000;
+    BenchDatabase db;
+    db.populate(rows, 4);
+    db.exec("CREATE TABLE paths (path TEXT)");
+    db.exec("INSERT INTO paths VALUES ('$.phones[0].number')");
+
+    const std::string query =
+        "SELECT protobuf_extract(protobuf, 'BenchPerson', paths.path) "
+        "FROM people, paths";
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.run(query));
+    }
+    state.SetItemsProcessed(state.iterations() * rows);
+    state.SetBytesProcessed(state.iterations() * db.total_bytes());
+}
+
+BENCHMARK(extract_threads)->ThreadRange(1, 8)->UseRealTime();
+
+
+/// Extracts one field with each level of statistics collection, to measure
+/// its overhead
+static void extract_stats(benchmark::State& state, const char *level)
+{
+    const int rows = 1000;
+    BenchDatabase db;
+    db.populate(rows, 4);
+    db.exec(std::string("SELECT protobuf_config('stats', '") + level + "')");
+
+    const std::string query = "SELECT protobuf_extract(protobuf, "
+        "'BenchPerson', '$.phones[0].number') FROM people";
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.run(query));
+    }
+    state.SetItemsProcessed(state.iterations() * rows);
+    state.SetBytesProcessed(state.iterations() * db.total_bytes());
+}
+
+BENCHMARK_CAPTURE(extract_stats, off, "off");
+BENCHMARK_CAPTURE(extract_stats, counters, "counters");
+BENCHMARK_CAPTURE(extract_stats, timing, "timing");
+
+
+/// Opens a new connection, loads the descriptors of the message type, and
+/// extracts a single field, so that the descriptors are built from scratch
+static void extract_first(benchmark::State& state)
+{
+    google::protobuf::FileDescriptorSet file_set;
+    BenchPerson::descriptor()->file()->CopyTo(file_set.add_file());
+    const std::string descriptors = file_set.SerializeAsString();
+
+    BenchPerson person;
+    person.set_name("Kaila Dutton");
+    const std::string data = person.SerializeAsString();
+
+    for (auto _ : state) {
+        BenchDatabase db;
+        sqlite3_stmt *stmt;
+        sqlite3_prepare_v2(db.handle(),
+            "SELECT protobuf_load_descriptors(?1), "
+            "protobuf_extract(?2, 'BenchPerson', '$.name')", -1, &stmt,
+            nullptr);
+        sqlite3_bind_blob(stmt, 1, descriptors.data(), descriptors.size(),
+            SQLITE_STATIC);
+        sqlite3_bind_blob(stmt, 2, data.data(), data.size(), SQLITE_STATIC);
+        if (sqlite3_step(stmt) != SQLITE_ROW)
+            throw std::runtime_error(sqlite3_errmsg(db.handle()));
+        sqlite3_finalize(stmt);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(extract_first);
+
+
+/// Extracts five fields per row, either with one protobuf_extract call per
+/// field or with a single protobuf_fields call
+static void extract_many(benchmark::State& state, const char *engine,
+                         bool use_fields)
+{
+    const int rows = 1000;
+    BenchDatabase db;
+    db.populate(rows, static_cast<int>(state.range(0)));
+    db.exec(std::string("SELECT protobuf_config('extract_engine', '")
+        + engine + "')");
+
+    const char *paths[] = { "$.id", "$.name", "$.score",
+        "$.phones[0].number", "$.phones[-1].type" };
+    std::string query = "SELECT ";
+    for (int i = 0; i < 5; i ++) {
+        if (i) query += ", ";
+        if (use_fields)
+            query += "f.value" + std::to_string(i + 1);
+        else
+            query += std::string("protobuf_extract(protobuf, 'BenchPerson', '")
+                + paths[i] + "')";
+    }
+    query += " FROM people";
+    if (use_fields) {
+        query += ", protobuf_fields(people.protobuf, 'BenchPerson'";
+        for (int i = 0; i < 5; i ++)
+            query += std::string(", '") + paths[i] + "'";
+        query += ") AS f";
+    }
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.run(query));
+    }
+    state.SetItemsProcessed(state.iterations() * rows);
+    state.SetBytesProcessed(state.iterations() * db.total_bytes());
+}
+
+BENCHMARK_CAPTURE(extract_many, wire_extract, "wire", false)
+    ->RangeMultiplier(8)->Range(1, 64);
+BENCHMARK_CAPTURE(extract_many, wire_fields, "wire", true)
+    ->RangeMultiplier(8)->Range(1, 64);
+BENCHMARK_CAPTURE(extract_many, reflection_extract, "reflection", false)
+    ->RangeMultiplier(8)->Range(1, 64);
+BENCHMARK_CAPTURE(extract_many, reflection_fields, "reflection", true)
+    ->RangeMultiplier(8)->Range(1, 64);
+
+
+/// Reads every phone number, either with protobuf_each or by probing each
+/// index with protobuf_extract
+static void unnest(benchmark::State& state, const char *engine, bool use_each)
+{
+    const int rows = 100;
+    const int phones = static_cast<int>(state.range(0));
+    BenchDatabase db;
+    db.populate(rows, phones);
+    db.exec(std::string("SELECT protobuf_config('extract_engine', '")
+        + engine + "')");
+
+    std::string query;
+    if (use_each) {
+        query = "SELECT each.value FROM people, "
+            "protobuf_each(people.protobuf, 'BenchPerson', "
+            "'$.phones') AS each";
+    } else {
+        query = "WITH RECURSIVE indexes(i) AS (SELECT 0 UNION ALL "
+            "SELECT i + 1 FROM indexes WHERE i + 1 < "
+            + std::to_string(phones) + ") "
+            "SELECT protobuf_extract(protobuf, 'BenchPerson', "
+            "'$.phones[' || i || ']') FROM people, indexes";
+    }
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.run(query));
+    }
+    state.SetItemsProcessed(state.iterations() * rows * phones);
+    state.SetBytesProcessed(state.iterations() * db.total_bytes());
+}
+
+BENCHMARK_CAPTURE(unnest, wire_each, "wire", true)
+    ->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(unnest, wire_extract, "wire", false)
+    ->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(unnest, reflection_each, "reflection", true)
+    ->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(unnest, reflection_extract, "reflection", false)
+    ->RangeMultiplier(8)->Range(1, 512);
+
+
+/// Collects the number of every phone, either with one protobuf_extract_all
+/// call per row or with one protobuf_extract call per phone, which parses the
+/// message again each time once the wire engine cannot be used
+static void extract_all(benchmark::State& state, const char *engine,
+                        bool use_all)
+{
+    const int rows = 100;
+    const int phones = static_cast<int>(state.range(0));
+    BenchDatabase db;
+    db.populate(rows, phones);
+    db.exec(std::string("SELECT protobuf_config('extract_engine', '")
+        + engine + "')");
+
+    std::string query;
+    if (use_all) {
+        query = "SELECT protobuf_extract_all(protobuf, 'BenchPerson', "
+            "'$.phones[*].number') FROM people";
+    } else {
+        query = "WITH RECURSIVE indexes(i) AS (SELECT 0 UNION ALL "
+            "SELECT i + 1 FROM indexes WHERE i + 1 < "
+            + std::to_string(phones) + ") "
+            "SELECT protobuf_extract(protobuf, 'BenchPerson', "
+            "'$.phones[' || i || '].number') FROM people, indexes";
+    }
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.run(query));
+    }
+    state.SetItemsProcessed(state.iterations() * rows * phones);
+    state.SetBytesProcessed(state.iterations() * db.total_bytes());
+}
+
+BENCHMARK_CAPTURE(extract_all, extract_all, "wire", true)
+    ->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(extract_all, wire_extract, "wire", false)
+    ->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(extract_all, reflection_extract, "reflection", false)
+    ->RangeMultiplier(8)->Range(1, 512);
+
+
+/// Converts whole messages to JSON, either straight from the wire format or,
+/// with the reflection engine, by parsing them and calling
+/// util::MessageToJsonString
+static void to_json(benchmark::State& state, const char *engine)
+{
+    const int rows = 100;
+    BenchDatabase db;
+    db.populate(rows, static_cast<int>(state.range(0)));
+    db.exec(std::string("SELECT protobuf_config('extract_engine', '")
+        + engine + "')");
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.run(
+            "SELECT protobuf_to_json(protobuf, 'BenchPerson') FROM people"));
+    }
+    state.SetItemsProcessed(state.iterations() * rows);
+    state.SetBytesProcessed(state.iterations() * db.total_bytes());
+}
+
+BENCHMARK_CAPTURE(to_json, wire, "wire")
+    ->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(to_json, message_to_json_string, "reflection")
+    ->RangeMultiplier(8)->Range(1, 512);
+
+
+/// Filters on one field and reads two others, either through an SQL view of
+/// protobuf_extract calls or through protobuf_view, which can reject rows
+/// before extracting the other columns
+static void view(benchmark::State& state, const char *engine, bool use_view)
+{
+    const int rows = 1000;
+    BenchDatabase db;
+    db.populate(rows, static_cast<int>(state.range(0)));
+    db.exec(std::string("SELECT protobuf_config('extract_engine', '")
+        + engine + "')");
+
+    if (use_view) {
+        db.exec("CREATE VIRTUAL TABLE people_v USING protobuf_view("
+            "people, protobuf, 'BenchPerson', id='$.id', name='$.name', "
+            "phone='$.phones[0].number')");
+    } else {
+        db.exec("CREATE VIEW people_v AS SELECT "
+            "protobuf_extract(protobuf, 'BenchPerson', '$.id') AS id, "
+            "protobuf_extract(protobuf, 'BenchPerson', '$.name') AS name, "
+            "protobuf_extract(protobuf, 'BenchPerson', "
+            "'$.phones[0].number') AS phone FROM people");
+    }
+
+    // Selects one row in a hundred
+    const std::string query = "SELECT name, phone FROM people_v "
+        "WHERE id >= 1337 AND id < 1347";
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.run(query));
+    }
+    state.SetItemsProcessed(state.iterations() * rows);
+    state.SetBytesProcessed(state.iterations() * db.total_bytes());
+}
+
+BENCHMARK_CAPTURE(view, wire_sql_view, "wire", false)
+    ->RangeMultiplier(8)->Range(1, 64);
+BENCHMARK_CAPTURE(view, wire_protobuf_view, "wire", true)
+    ->RangeMultiplier(8)->Range(1, 64);
+BENCHMARK_CAPTURE(view, reflection_sql_view, "reflection", false)
+    ->RangeMultiplier(8)->Range(1, 64);
+BENCHMARK_CAPTURE(view, reflection_protobuf_view, "reflection", true)
+    ->RangeMultiplier(8)->Range(1, 64);
+
+
+/// Sums one field, either with protobuf_extract on each message or from the
+/// column that protobuf_shred keeps for it, which does not touch the messages.
+/// Reading the message column of protobuf_shred reassembles every message from
+/// all of the columns.
+static void shred(benchmark::State& state, const char *query)
+{
+    const int rows = 1000;
+    BenchDatabase db;
+    db.populate(rows, static_cast<int>(state.range(0)));
+    db.exec("CREATE VIRTUAL TABLE people_s USING protobuf_shred("
+        "people, protobuf, 'BenchPerson')");
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.run(query));
+    }
+    state.SetItemsProcessed(state.iterations() * rows);
+    state.SetBytesProcessed(state.iterations() * db.total_bytes());
+}
+
+BENCHMARK_CAPTURE(shred, extract_score,
+    "SELECT sum(protobuf_extract(protobuf, 'BenchPerson', '$.score')) "
+    "FROM people")->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(shred, shred_score,
+    "SELECT sum(score) FROM people_s")->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(shred, shred_message,
+    "SELECT length(protobuf) FROM people_s")->RangeMultiplier(8)->Range(1, 64);
+
+
+/// Finds ten rows by id, either with protobuf_extract on each message or from
+/// the values that protobuf_index keeps, which does not touch the messages
+static void index(benchmark::State& state, const char *query)
+{
+    const int rows = 1000;
+    BenchDatabase db;
+    db.populate(rows, static_cast<int>(state.range(0)));
+    db.exec("CREATE VIRTUAL TABLE id_idx USING protobuf_index("
+        "people, protobuf, 'BenchPerson', '$.id')");
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.run(query));
+    }
+    state.SetItemsProcessed(state.iterations() * rows);
+    state.SetBytesProcessed(state.iterations() * db.total_bytes());
+}
+
+BENCHMARK_CAPTURE(index, extract_id,
+    "SELECT rowid FROM people WHERE protobuf_extract(protobuf, 'BenchPerson', "
+    "'$.id') BETWEEN 1347 AND 1356")->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(index, index_id,
+    "SELECT rowid FROM id_idx WHERE value BETWEEN 1347 AND 1356")
+    ->RangeMultiplier(8)->Range(1, 512);
+
+
+/// Filters on two fields, either with a protobuf_extract call for each or with
+/// protobuf_match, which finds both in one pass and stops as soon as the result
+/// is known. Every row has a work phone, so when that is tested first, both
+/// fields are needed for every row.
+static void match(benchmark::State& state, const char *engine, bool use_match,
+                  bool phone_first)
+{
+    const int rows = 1000;
+    BenchDatabase db;
+    db.populate(rows, static_cast<int>(state.range(0)));
+    db.exec(std::string("SELECT protobuf_config('extract_engine', '")
+        + engine + "')");
+
+    // Selects one row in a hundred
+    const std::string id = "$.id < 1347";
+    const std::string phone = "$.phones[0].type = WORK";
+    const std::string id_sql =
+        "protobuf_extract(protobuf, 'BenchPerson', '$.id') < 1347";
+    const std::string phone_sql =
+        "protobuf_extract(protobuf, 'BenchPerson', '$.phones[0].type') = "
+        + std::to_string(BenchPerson::WORK);
+    const std::string query = "SELECT rowid FROM people WHERE " + (use_match
+        ? "protobuf_match(protobuf, 'BenchPerson', '"
+          + (phone_first ? phone + " AND " + id : id + " AND " + phone) + "')"
+        : phone_first ? phone_sql + " AND " + id_sql
+                      : id_sql + " AND " + phone_sql);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.run(query));
+    }
+    state.SetItemsProcessed(state.iterations() * rows);
+    state.SetBytesProcessed(state.iterations() * db.total_bytes());
+}
+
+BENCHMARK_CAPTURE(match, wire_extract, "wire", false, false)
+    ->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(match, wire_protobuf_match, "wire", true, false)
+    ->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(match, wire_extract_phone_first, "wire", false, true)
+    ->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(match, wire_protobuf_match_phone_first, "wire", true, true)
+    ->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(match, reflection_extract, "reflection", false, false)
+    ->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(match, reflection_protobuf_match, "reflection", true, false)
+    ->RangeMultiplier(8)->Range(1, 512);
+
+
+/// Sums a packed array, either with protobuf_array_sum or by summing the rows
+/// of protobuf_each. The samples are doubles, and the readings are varints of
+/// pseudo-random magnitude, from one to four bytes long.
+static void array_sum(benchmark::State& state, const char *engine,
+                      bool use_array, const char *path)
+{
+    const int rows = 100;
+    const int elements = static_cast<int>(state.range(0));
+    BenchPerson person;
+    uint64_t seed = 1;
+    for (int i = 0; i < elements; i ++) {
+        seed = seed * 6364136223846793005u + 1442695040888963407u;
+        int64_t reading = static_cast<int64_t>(seed >> 42) >> (seed >> 60);
+        person.add_samples(i * 0.5);
+        person.add_readings(i % 2 ? reading : -reading);
+    }
+    BenchDatabase db;
+    db.insert(rows, person);
+    db.exec(std::string("SELECT protobuf_config('extract_engine', '")
+        + engine + "')");
+
+    const std::string query = use_array
+        ? std::string("SELECT protobuf_array_sum(protobuf, 'BenchPerson', '")
+          + path + "') FROM people"
+        : std::string("SELECT (SELECT sum(value) FROM protobuf_each(protobuf, "
+          "'BenchPerson', '") + path + "')) FROM people";
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.run(query));
+    }
+    state.SetItemsProcessed(state.iterations() * rows * elements);
+    state.SetBytesProcessed(state.iterations() * db.total_bytes());
+}
+
+BENCHMARK_CAPTURE(array_sum, wire_array_doubles, "wire", true, "$.samples")
+    ->RangeMultiplier(8)->Range(8, 4096);
+BENCHMARK_CAPTURE(array_sum, wire_each_doubles, "wire", false, "$.samples")
+    ->RangeMultiplier(8)->Range(8, 4096);
+BENCHMARK_CAPTURE(array_sum, wire_array_varints, "wire", true, "$.readings")
+    ->RangeMultiplier(8)->Range(8, 4096);
+BENCHMARK_CAPTURE(array_sum, wire_each_varints, "wire", false, "$.readings")
+    ->RangeMultiplier(8)->Range(8, 4096);
+BENCHMARK_CAPTURE(array_sum, reflection_array_varints, "reflection", true,
+                  "$.readings")
+    ->RangeMultiplier(8)->Range(8, 4096);
+
+
+/// Sets the type of the first phone the way an application would without
+/// protobuf_set: parse the message, change it, and serialize it again
+static void reserialize_phone_type(sqlite3_context *context,
+                                   int argc,
+                                   sqlite3_value **argv)
+{
+    BenchPerson person;
+    person.ParseFromArray(sqlite3_value_blob(argv[0]),
+        sqlite3_value_bytes(argv[0]));
+    person.mutable_phones(0)->set_type(
+        static_cast<BenchPerson::PhoneType>(sqlite3_value_int(argv[1])));
+    const std::string data = person.SerializeAsString();
+    sqlite3_result_blob(context, data.data(), data.size(), SQLITE_TRANSIENT);
+}
+
+
+/// Updates one field in every row, either splicing the new value into the
+/// wire format with protobuf_set or with a full parse and serialize
+static void update(benchmark::State& state, bool use_set)
+{
+    const int rows = 1000;
+    BenchDatabase db;
+    db.populate(rows, static_cast<int>(state.range(0)));
+    sqlite3_create_function(db.handle(), "reserialize_phone_type", 2,
+        SQLITE_UTF8, nullptr, reserialize_phone_type, nullptr, nullptr);
+
+    // Alternates between two values so that every update changes the row
+    int type = BenchPerson::HOME;
+    for (auto _ : state) {
+        if (use_set)
+            db.exec("UPDATE people SET protobuf = protobuf_set(protobuf, "
+                "'BenchPerson', '$.phones[0].type', "
+                + std::to_string(type) + ")");
+        else
+            db.exec("UPDATE people SET protobuf = reserialize_phone_type("
+                "protobuf, " + std::to_string(type) + ")");
+        type = type == BenchPerson::HOME ? BenchPerson::WORK : BenchPerson::HOME;
+    }
+    state.SetItemsProcessed(state.iterations() * rows);
+    state.SetBytesProcessed(state.iterations() * db.total_bytes());
+}
+
+BENCHMARK_CAPTURE(update, protobuf_set, true)
+    ->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(update, reserialize, false)
+    ->RangeMultiplier(8)->Range(1, 512);
+
+
+/// Imports a file of length-delimited messages into a table, either with an
+/// INSERT ... SELECT from protobuf_file or by reading each record and inserting
+/// it with a prepared statement, as an import script would
+static void import_file(benchmark::State& state, bool use_file)
+{
+    const int rows = 10000;
+    char path[] = "/tmp/bench_extract_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        throw std::runtime_error("Could not create a temporary file");
+    close(fd);
+
+    int64_t total_bytes = 0;
+    {
+        BenchPerson person;
+        person.set_name("Kaila Dutton");
+        for (int i = 0; i < static_cast<int>(state.range(0)); i ++) {
+            BenchPerson::PhoneNumber *phone = person.add_phones();
+            phone->set_number("(607) 555-" + std::to_string(1000 + i));
+            phone->set_type(BenchPerson::WORK);
+        }
+        std::ofstream out(path, std::ios::binary);
+        for (int i = 0; i < rows; i ++) {
+            person.set_id(1337 + i);
+            google::protobuf::util::SerializeDelimitedToOstream(person, &out);
+            total_bytes += person.ByteSizeLong();
+        }
+    }
+
+    BenchDatabase db;
+    db.exec("CREATE TABLE imported (protobuf BLOB)");
+    db.exec(std::string("CREATE VIRTUAL TABLE file USING protobuf_file('")
+        + path + "', 'BenchPerson')");
+    sqlite3_stmt *stmt;
+    sqlite3_prepare_v2(db.handle(), "INSERT INTO imported VALUES (?)", -1,
+        &stmt, nullptr);
+
+    for (auto _ : state) {
+        db.exec("DELETE FROM imported");
+        db.exec("BEGIN");
+        if (use_file) {
+            db.exec("INSERT INTO imported SELECT protobuf FROM file");
+        } else {
+            std::ifstream in(path, std::ios::binary);
+            std::stringstream contents;
+            contents << in.rdbuf();
+            const std::string data = contents.str();
+            google::protobuf::io::CodedInputStream input(
+                reinterpret_cast<const uint8_t *>(data.data()),
+                static_cast<int>(data.size()));
+            uint32_t size;
+            const void *record;
+            int remaining;
+            while (input.ReadVarint32(&size)) {
+                input.GetDirectBufferPointer(&record, &remaining);
+                sqlite3_bind_blob(stmt, 1, record, size, SQLITE_TRANSIENT);
+                sqlite3_step(stmt);
+                sqlite3_reset(stmt);
+                input.Skip(size);
+            }
+        }
+        db.exec("COMMIT");
+    }
+    sqlite3_finalize(stmt);
+    std::remove(path);
+    state.SetItemsProcessed(state.iterations() * rows);
+    state.SetBytesProcessed(state.iterations() * total_bytes);
+}
+
+BENCHMARK_CAPTURE(import_file, protobuf_file, true)
+    ->RangeMultiplier(8)->Range(1, 64);
+BENCHMARK_CAPTURE(import_file, insert_each, false)
+    ->RangeMultiplier(8)->Range(1, 64);
+
+
+/// Turns the phone types stored in a table into their names, by joining the
+/// table with protobuf_enum, or with protobuf_enum_name
+static void enum_names(benchmark::State& state, const char *query)
+{
+    const int rows = 10000;
+    BenchDatabase db;
+    db.exec("CREATE TABLE types (type INTEGER)");
+    db.exec("BEGIN");
+    for (int i = 0; i < rows; i ++)
+        db.exec("INSERT INTO types VALUES (" + std::to_string(i % 4) + ")");
+    db.exec("COMMIT");
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.run(query));
+    }
+    state.SetItemsProcessed(state.iterations() * rows);
+}
+
+BENCHMARK_CAPTURE(enum_names, join,
+    "SELECT types.type, e.name FROM types "
+    "LEFT JOIN protobuf_enum('BenchPerson.PhoneType') AS e "
+    "ON e.number = types.type");
+BENCHMARK_CAPTURE(enum_names, protobuf_enum_name,
+    "SELECT type, protobuf_enum_name('BenchPerson.PhoneType', type) "
+    "FROM types");
+
+
+/// Scans messages stored as they are, compressed on their own, or compressed
+/// with a dictionary trained on the table. The db_bytes counter is the size of
+/// the database. The name needs the whole message decompressed, but the first
+/// phone only needs the start of it.
+static void compressed_scan(benchmark::State& state, const char *compression,
+                            const char *path)
+{
+    const int rows = 1000;
+    BenchDatabase db;
+    db.populate(rows, static_cast<int>(state.range(0)));
+    if (std::string(compression) == "dictionary") {
+        db.exec("CREATE TABLE protobuf_dictionaries "
+            "(id INTEGER PRIMARY KEY, dictionary BLOB)");
+        db.exec("INSERT INTO protobuf_dictionaries "
+            "SELECT 1, protobuf_train_dictionary(protobuf) FROM people");
+        db.exec("UPDATE people SET protobuf = protobuf_compress(protobuf, 1)");
+    } else if (std::string(compression) == "zlib") {
+        db.exec("UPDATE people SET protobuf = protobuf_compress(protobuf)");
+    }
+    db.exec("VACUUM");
+
+    const std::string query = std::string(
+        "SELECT protobuf_extract(protobuf, 'BenchPerson', '") + path
+        + "') FROM people";
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.run(query));
+    }
+    state.counters["db_bytes"] = static_cast<double>(
+        db.scalar("PRAGMA page_count") * db.scalar("PRAGMA page_size"));
+    state.SetItemsProcessed(state.iterations() * rows);
+    state.SetBytesProcessed(state.iterations() * db.total_bytes());
+}
+
+BENCHMARK_CAPTURE(compressed_scan, none_name, "none", "$.name")
+    ->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(compressed_scan, zlib_name, "zlib", "$.name")
+    ->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(compressed_scan, dictionary_name, "dictionary", "$.name")
+    ->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(compressed_scan, none_first_phone, "none",
+    "$.phones[0].number")->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(compressed_scan, zlib_first_phone, "zlib",
+    "$.phones[0].number")->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK_CAPTURE(compressed_scan, dictionary_first_phone, "dictionary",
+    "$.phones[0].number")->RangeMultiplier(8)->Range(1, 512);
+
+
+BENCHMARK_MAIN();
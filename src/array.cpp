@@ -0,0 +1,690 @@
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "array.h"
+#include "path.h"
+#include "value.h"
+#include "wire.h"
+
+using google::protobuf::FieldDescriptor;
+using google::protobuf::FileDescriptor;
+using google::protobuf::internal::WireFormatLite;
+using google::protobuf::io::CodedInputStream;
+
+
+// Integer elements are converted into a buffer of this many at a time. The
+// elements of 32-bit types in one buffer can be summed without overflowing.
+static const size_t BATCH = 256;
+
+
+array_totals::array_totals(const FieldDescriptor *field,
+                           array_aggregate aggregate)
+    : aggregate(aggregate),
+      integer(field->cpp_type() != FieldDescriptor::CPPTYPE_DOUBLE
+              && field->cpp_type() != FieldDescriptor::CPPTYPE_FLOAT),
+      count(0), values(0), int_sum(0), overflow(false), real_sum(0),
+      int_min(std::numeric_limits<int64_t>::max()),
+      int_max(std::numeric_limits<int64_t>::min()),
+      real_min(std::numeric_limits<double>::infinity()),
+      real_max(-std::numeric_limits<double>::infinity())
+{
+}
+
+
+void array_totals::add(const field_value& value)
+{
+    count ++;
+    if (value.type == SQLITE_INTEGER) {
+        values ++;
+        if (aggregate == ARRAY_SUM || aggregate == ARRAY_AVG)
+            add_sum(value.i);
+        if (value.i < int_min)
+            int_min = value.i;
+        if (value.i > int_max)
+            int_max = value.i;
+    } else if (value.type == SQLITE_FLOAT) {
+        values ++;
+        real_sum += value.d;
+        if (value.d < real_min)
+            real_min = value.d;
+        if (value.d > real_max)
+            real_max = value.d;
+    }
+}
+
+
+void array_totals::add_sum(int64_t sum)
+{
+    if ((sum > 0 && int_sum > std::numeric_limits<int64_t>::max() - sum)
+        || (sum < 0 && int_sum < std::numeric_limits<int64_t>::min() - sum))
+    {
+        real_sum += static_cast<double>(int_sum);
+        int_sum = sum;
+        overflow = true;
+    } else {
+        int_sum += sum;
+    }
+}
+
+
+bool array_supports_field(const FieldDescriptor *field)
+{
+    switch (field->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32:
+    case FieldDescriptor::CPPTYPE_INT64:
+    case FieldDescriptor::CPPTYPE_UINT32:
+    case FieldDescriptor::CPPTYPE_UINT64:
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+    case FieldDescriptor::CPPTYPE_FLOAT:
+    case FieldDescriptor::CPPTYPE_BOOL:
+    case FieldDescriptor::CPPTYPE_ENUM:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+/// Returns true if the values of a field may need 64 bits, so that sums of
+/// them have to be checked for overflow
+static bool is_wide(const FieldDescriptor *field)
+{
+    return field->cpp_type() == FieldDescriptor::CPPTYPE_INT64
+        || field->cpp_type() == FieldDescriptor::CPPTYPE_UINT64;
+}
+
+
+/// Sums integers that fit in 32 bits, of which there are few enough that the
+/// sum cannot overflow
+static int64_t sum_narrow(const int64_t *elements, size_t n)
+{
+    size_t i = 0;
+    int64_t sum = 0;
+#ifdef __SSE2__
+    __m128i a = _mm_setzero_si128();
+    __m128i b = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) {
+        a = _mm_add_epi64(a, _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(elements + i)));
+        b = _mm_add_epi64(b, _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(elements + i + 2)));
+    }
+    int64_t lanes[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), _mm_add_epi64(a, b));
+    sum = lanes[0] + lanes[1];
+#endif
+    for (; i < n; i ++)
+        sum += elements[i];
+    return sum;
+}
+
+
+/// Sums a batch of 64-bit integers exactly, by adding up their high and low
+/// halves separately. Returns false if the sum does not fit in 64 bits.
+static bool sum_wide(const int64_t *elements, size_t n, int64_t *sum)
+{
+    int64_t high = 0;
+    uint64_t low = 0;
+    for (size_t i = 0; i < n; i ++) {
+        high += elements[i] >> 32;
+        low += static_cast<uint32_t>(elements[i]);
+    }
+    high += static_cast<int64_t>(low >> 32);
+    if (high < INT32_MIN || high > INT32_MAX)
+        return false;
+    *sum = static_cast<int64_t>(
+        (static_cast<uint64_t>(high) << 32) | (low & 0xffffffff));
+    return true;
+}
+
+
+/// Adds a batch of integer elements
+static void add_integers(const int64_t *elements,
+                         size_t n,
+                         bool wide,
+                         array_totals *totals)
+{
+    totals->count += n;
+    totals->values += n;
+    switch (totals->aggregate) {
+    case ARRAY_SUM:
+    case ARRAY_AVG:
+    {
+        int64_t sum;
+        if (!wide) {
+            totals->add_sum(sum_narrow(elements, n));
+        } else if (sum_wide(elements, n, &sum)) {
+            totals->add_sum(sum);
+        } else {
+            // Carry the total over into real_sum where it overflows
+            for (size_t i = 0; i < n; i ++)
+                totals->add_sum(elements[i]);
+        }
+        break;
+    }
+    case ARRAY_MIN:
+    {
+        int64_t min = totals->int_min;
+        for (size_t i = 0; i < n; i ++)
+            min = elements[i] < min ? elements[i] : min;
+        totals->int_min = min;
+        break;
+    }
+    case ARRAY_MAX:
+    {
+        int64_t max = totals->int_max;
+        for (size_t i = 0; i < n; i ++)
+            max = elements[i] > max ? elements[i] : max;
+        totals->int_max = max;
+        break;
+    }
+    case ARRAY_COUNT:
+        break;
+    }
+}
+
+
+static inline double load_real(const uint8_t *p, double)
+{
+    uint64_t bits;
+    CodedInputStream::ReadLittleEndian64FromArray(p, &bits);
+    return WireFormatLite::DecodeDouble(bits);
+}
+
+
+static inline double load_real(const uint8_t *p, float)
+{
+    uint32_t bits;
+    CodedInputStream::ReadLittleEndian32FromArray(p, &bits);
+    return WireFormatLite::DecodeFloat(bits);
+}
+
+
+#ifdef __SSE2__
+/// Loads four elements as two pairs of doubles
+static inline void load_lanes(const uint8_t *p, double, __m128d lanes[2])
+{
+    lanes[0] = _mm_loadu_pd(reinterpret_cast<const double *>(p));
+    lanes[1] = _mm_loadu_pd(reinterpret_cast<const double *>(p + 16));
+}
+
+
+static inline void load_lanes(const uint8_t *p, float, __m128d lanes[2])
+{
+    __m128 floats = _mm_loadu_ps(reinterpret_cast<const float *>(p));
+    lanes[0] = _mm_cvtps_pd(floats);
+    lanes[1] = _mm_cvtps_pd(_mm_movehl_ps(floats, floats));
+}
+
+
+/// Folds a pair of elements into a pair of running totals, leaving out NaN.
+/// Each lane of seen counts down by one for every element that is not NaN.
+template <array_aggregate Aggregate>
+static inline __m128d fold_lanes(__m128d totals, __m128d x, __m128i *seen)
+{
+    __m128d ordered = _mm_cmpord_pd(x, x);
+    *seen = _mm_add_epi64(*seen, _mm_castpd_si128(ordered));
+    if (Aggregate == ARRAY_MIN)
+        return _mm_min_pd(x, totals);
+    if (Aggregate == ARRAY_MAX)
+        return _mm_max_pd(x, totals);
+    return _mm_add_pd(totals, _mm_and_pd(x, ordered));
+}
+#endif
+
+
+/// Adds a run of fixed-width floating-point elements. Sums are added up in
+/// several lanes at once, so the result may differ in the last bits from
+/// adding the elements in order.
+template <typename Real, array_aggregate Aggregate>
+static void reduce_reals(const uint8_t *data, size_t n, array_totals *totals)
+{
+    size_t i = 0;
+    int64_t values = 0;
+    double sum = 0;
+    double min = totals->real_min;
+    double max = totals->real_max;
+
+#ifdef __SSE2__
+    __m128d lanes[2];
+    __m128d start = Aggregate == ARRAY_MIN ? _mm_set1_pd(min)
+        : Aggregate == ARRAY_MAX ? _mm_set1_pd(max) : _mm_setzero_pd();
+    __m128d a = start;
+    __m128d b = start;
+    __m128i seen = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) {
+        load_lanes(data + i * sizeof(Real), Real(), lanes);
+        a = fold_lanes<Aggregate>(a, lanes[0], &seen);
+        b = fold_lanes<Aggregate>(b, lanes[1], &seen);
+    }
+
+    double a_lanes[2], b_lanes[2];
+    int64_t seen_lanes[2];
+    _mm_storeu_pd(a_lanes, a);
+    _mm_storeu_pd(b_lanes, b);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(seen_lanes), seen);
+    values = -(seen_lanes[0] + seen_lanes[1]);
+    for (int lane = 0; lane < 2; lane ++) {
+        if (Aggregate == ARRAY_SUM)
+            sum += a_lanes[lane] + b_lanes[lane];
+        else if (Aggregate == ARRAY_MIN)
+            min = std::fmin(min, std::fmin(a_lanes[lane], b_lanes[lane]));
+        else if (Aggregate == ARRAY_MAX)
+            max = std::fmax(max, std::fmax(a_lanes[lane], b_lanes[lane]));
+    }
+#endif
+
+    for (; i < n; i ++) {
+        double x = load_real(data + i * sizeof(Real), Real());
+        if (std::isnan(x))
+            continue;
+        values ++;
+        sum += x;
+        if (x < min)
+            min = x;
+        if (x > max)
+            max = x;
+    }
+
+    totals->values += values;
+    if (Aggregate == ARRAY_SUM)
+        totals->real_sum += sum;
+    else if (Aggregate == ARRAY_MIN)
+        totals->real_min = min;
+    else if (Aggregate == ARRAY_MAX)
+        totals->real_max = max;
+}
+
+
+/// Adds a run of fixed-width floating-point elements
+template <typename Real>
+static void add_reals(const uint8_t *data, size_t n, array_totals *totals)
+{
+    totals->count += n;
+    switch (totals->aggregate) {
+    case ARRAY_SUM:
+    case ARRAY_AVG:
+        reduce_reals<Real, ARRAY_SUM>(data, n, totals);
+        break;
+    case ARRAY_MIN:
+        reduce_reals<Real, ARRAY_MIN>(data, n, totals);
+        break;
+    case ARRAY_MAX:
+        reduce_reals<Real, ARRAY_MAX>(data, n, totals);
+        break;
+    case ARRAY_COUNT:
+        break;
+    }
+}
+
+
+/// Copies fixed-width integer elements into a buffer as 64-bit integers
+static void widen_fixed(const FieldDescriptor *field,
+                        const uint8_t *data,
+                        size_t n,
+                        uint64_t *out)
+{
+    size_t i = 0;
+    switch (field->type()) {
+    case FieldDescriptor::TYPE_FIXED64:
+    case FieldDescriptor::TYPE_SFIXED64:
+        for (; i < n; i ++)
+            CodedInputStream::ReadLittleEndian64FromArray(data + i * 8,
+                out + i);
+        break;
+    default:
+    {
+        bool is_signed = field->type() == FieldDescriptor::TYPE_SFIXED32;
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 4 <= n; i += 4) {
+            __m128i x = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(data + i * 4));
+            __m128i high = is_signed ? _mm_srai_epi32(x, 31) : zero;
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                _mm_unpacklo_epi32(x, high));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i + 2),
+                _mm_unpackhi_epi32(x, high));
+        }
+#endif
+        for (; i < n; i ++) {
+            uint32_t bits;
+            CodedInputStream::ReadLittleEndian32FromArray(data + i * 4, &bits);
+            out[i] = is_signed
+                ? static_cast<uint64_t>(static_cast<int32_t>(bits)) : bits;
+        }
+        break;
+    }
+    }
+}
+
+
+/// Counts the varints in a packed run from the bytes that end them, without
+/// decoding them. Returns false if the last one is cut off, or if one is
+/// longer than the ten bytes the parser allows.
+static bool count_varints(const uint8_t *data, size_t size, int64_t *count)
+{
+    size_t continued = 0;  // bytes that do not end a varint
+    unsigned run = 0;      // continued bytes since the end of the last varint
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for (; i + 16 <= size; i += 16) {
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i))));
+        if (mask == 0) {
+            run = 0;
+            continue;
+        }
+        continued += __builtin_popcount(mask);
+        if (mask == 0xffff) {
+            run += 16;
+            if (run >= 10)
+                return false;
+            continue;
+        }
+
+        // Look for ten continued bytes in a row, carried over from the last
+        // chunk or within this one
+        if (run + __builtin_ctz(~mask) >= 10)
+            return false;
+        unsigned two = mask & (mask >> 1);
+        unsigned eight = two & (two >> 2);
+        eight &= eight >> 4;
+        if (eight & (two >> 8))
+            return false;
+        run = __builtin_clz(~(mask << 16));
+    }
+#endif
+
+    for (; i < size; i ++) {
+        if (data[i] & 0x80) {
+            continued ++;
+            if (++ run >= 10)
+                return false;
+        } else {
+            run = 0;
+        }
+    }
+
+    if (run > 0)
+        return false;
+    *count = static_cast<int64_t>(size - continued);
+    return true;
+}
+
+
+/// Reads one varint, keeping the low 64 bits of up to ten bytes as the parser
+/// does. Returns NULL if it is cut off or too long.
+static inline const uint8_t *read_varint(const uint8_t *p,
+                                         const uint8_t *end,
+                                         uint64_t *value)
+{
+    uint64_t result = 0;
+    for (int shift = 0; shift < 70 && p < end; shift += 7) {
+        uint8_t byte = *p ++;
+        result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            *value = result;
+            return p;
+        }
+    }
+    return nullptr;
+}
+
+
+#ifdef __SSE2__
+/// Gathers the seven payload bits of each byte of a varint of at most eight
+/// bytes, given that eight bytes can be read from p. Adjacent groups of bits
+/// are joined in pairs, then the pairs in pairs, and so on.
+static inline uint64_t gather_varint(const uint8_t *p, unsigned length)
+{
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    unsigned unused = 64 - 8 * length;
+    word = (word << unused) >> unused;
+    word = (word & UINT64_C(0x007f007f007f007f))
+        | ((word & UINT64_C(0x7f007f007f007f00)) >> 1);
+    word = (word & UINT64_C(0x00003fff00003fff))
+        | ((word & UINT64_C(0x3fff00003fff0000)) >> 2);
+    return (word & UINT64_C(0x000000000fffffff))
+        | ((word & UINT64_C(0x0fffffff00000000)) >> 4);
+}
+
+
+/// Widens sixteen bytes into sixteen 64-bit integers
+static inline void widen_bytes(__m128i bytes, uint64_t *out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i halves[2] = {
+        _mm_unpacklo_epi8(bytes, zero),
+        _mm_unpackhi_epi8(bytes, zero),
+    };
+    for (int h = 0; h < 2; h ++) {
+        __m128i low = _mm_unpacklo_epi16(halves[h], zero);
+        __m128i high = _mm_unpackhi_epi16(halves[h], zero);
+        __m128i *dest = reinterpret_cast<__m128i *>(out + 8 * h);
+        _mm_storeu_si128(dest, _mm_unpacklo_epi32(low, zero));
+        _mm_storeu_si128(dest + 1, _mm_unpackhi_epi32(low, zero));
+        _mm_storeu_si128(dest + 2, _mm_unpacklo_epi32(high, zero));
+        _mm_storeu_si128(dest + 3, _mm_unpackhi_epi32(high, zero));
+    }
+}
+#endif
+
+
+/// Decodes up to max varints from a packed run into out, advancing *p past
+/// them. Sets n to the number decoded, and returns false if one is malformed.
+///
+/// Sixteen bytes are examined at a time. If none of them is continued, they
+/// are sixteen single-byte varints that are widened together. Otherwise the
+/// mask of the bytes that end varints gives the length of each varint that
+/// ends in the chunk, and its bits are gathered without looping over its
+/// bytes or branching on its length.
+static bool decode_varints(const uint8_t **p,
+                           const uint8_t *end,
+                           uint64_t *out,
+                           size_t max,
+                           size_t *n)
+{
+    const uint8_t *q = *p;
+    size_t i = 0;
+    while (i < max && q < end) {
+#ifdef __SSE2__
+        // Every varint that ends in the chunk can be gathered with an 8-byte
+        // load, and fits in the buffer
+        if (end - q >= 24 && max - i >= 16) {
+            __m128i bytes =
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(q));
+            unsigned ends = ~static_cast<unsigned>(_mm_movemask_epi8(bytes))
+                & 0xffff;
+            if (ends == 0xffff) {
+                widen_bytes(bytes, out + i);
+                q += 16;
+                i += 16;
+                continue;
+            }
+
+            unsigned start = 0;
+            while (ends) {
+                unsigned stop = __builtin_ctz(ends);
+                ends &= ends - 1;
+                unsigned length = stop + 1 - start;
+                if (length > 8)
+                    break;
+                out[i ++] = gather_varint(q + start, length);
+                start = stop + 1;
+            }
+            if (start > 0) {
+                q += start;
+                continue;
+            }
+        }
+#endif
+        q = read_varint(q, end, out + i);
+        if (!q)
+            return false;
+        i ++;
+    }
+    *p = q;
+    *n = i;
+    return true;
+}
+
+
+/// Converts the bits of varints, in place, into the integers the parser would
+/// store for the field
+static void convert_varints(const FieldDescriptor *field,
+                            uint64_t *bits,
+                            size_t n)
+{
+    switch (field->type()) {
+    case FieldDescriptor::TYPE_INT32:
+    case FieldDescriptor::TYPE_ENUM:
+        for (size_t i = 0; i < n; i ++)
+            bits[i] = static_cast<uint64_t>(static_cast<int32_t>(bits[i]));
+        break;
+    case FieldDescriptor::TYPE_UINT32:
+        for (size_t i = 0; i < n; i ++)
+            bits[i] = static_cast<uint32_t>(bits[i]);
+        break;
+    case FieldDescriptor::TYPE_SINT32:
+        for (size_t i = 0; i < n; i ++)
+            bits[i] = static_cast<uint64_t>(static_cast<int64_t>(
+                WireFormatLite::ZigZagDecode32(
+                    static_cast<uint32_t>(bits[i]))));
+        break;
+    case FieldDescriptor::TYPE_SINT64:
+        for (size_t i = 0; i < n; i ++)
+            bits[i] = static_cast<uint64_t>(
+                WireFormatLite::ZigZagDecode64(bits[i]));
+        break;
+    case FieldDescriptor::TYPE_BOOL:
+        for (size_t i = 0; i < n; i ++)
+            bits[i] = bits[i] != 0;
+        break;
+    default:
+        break;
+    }
+}
+
+
+bool array_add_packed(const FieldDescriptor *field,
+                      const uint8_t *data,
+                      size_t size,
+                      array_totals *totals)
+{
+    WireFormatLite::WireType wire_type =
+        WireFormatLite::WireTypeForFieldType(
+            static_cast<WireFormatLite::FieldType>(field->type()));
+    uint64_t buffer[BATCH];
+    const int64_t *elements = reinterpret_cast<const int64_t *>(buffer);
+
+    if (wire_type == WireFormatLite::WIRETYPE_VARINT) {
+        // The number of elements is the number of bytes that end a varint
+        if (totals->aggregate == ARRAY_COUNT) {
+            int64_t count;
+            if (!count_varints(data, size, &count))
+                return false;
+            totals->count += count;
+            return true;
+        }
+
+        const uint8_t *end = data + size;
+        while (data < end) {
+            size_t n;
+            if (!decode_varints(&data, end, buffer, BATCH, &n))
+                return false;
+            convert_varints(field, buffer, n);
+            add_integers(elements, n, is_wide(field), totals);
+        }
+        return true;
+    }
+
+    // Fixed-width elements are counted from the length of the run
+    size_t width = wire_type == WireFormatLite::WIRETYPE_FIXED64 ? 8 : 4;
+    if (size % width != 0)
+        return false;
+    size_t n = size / width;
+    if (totals->aggregate == ARRAY_COUNT) {
+        totals->count += n;
+        return true;
+    }
+
+    switch (field->type()) {
+    case FieldDescriptor::TYPE_DOUBLE:
+        add_reals<double>(data, n, totals);
+        break;
+    case FieldDescriptor::TYPE_FLOAT:
+        add_reals<float>(data, n, totals);
+        break;
+    default:
+        for (size_t i = 0; i < n; i += BATCH) {
+            size_t batch = n - i < BATCH ? n - i : BATCH;
+            widen_fixed(field, data + i * width, batch, buffer);
+            add_integers(elements, batch, is_wide(field), totals);
+        }
+        break;
+    }
+    return true;
+}
+
+
+bool array_add_wire(const compiled_path& path,
+                    const uint8_t *data,
+                    size_t size,
+                    array_totals *totals)
+{
+    // There are no elements if a message on the way is not present
+    wire_value container;
+    switch (wire_find_container(path, data, size, &container)) {
+    case WIRE_FOUND:
+        break;
+    case WIRE_NULL:
+        return true;
+    default:
+        return false;
+    }
+
+    // The parser drops undefined values of closed enums, so those have to be
+    // read one at a time
+    const FieldDescriptor *field = path.elements.back().field;
+    bool closed_enum = field->type() == FieldDescriptor::TYPE_ENUM
+        && field->enum_type()->file()->syntax()
+            != FileDescriptor::SYNTAX_PROTO3;
+
+    wire_iterator iterator(field, container.data, container.size);
+    for (;;) {
+        wire_value value;
+        bool run = false;
+        wire_status status = closed_enum
+            ? iterator.next(&value) : iterator.next_run(&value, &run);
+        if (status == WIRE_NULL)
+            return true;
+        if (status != WIRE_FOUND)
+            return false;
+
+        if (run) {
+            if (!array_add_packed(field, value.data, value.size, totals))
+                return false;
+        } else {
+            field_value element;
+            if (!value_from_wire(path, value, &element))
+                return false;
+            totals->add(element);
+        }
+    }
+}
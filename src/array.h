@@ -0,0 +1,84 @@
+#ifndef ARRAY_H
+#define ARRAY_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <google/protobuf/descriptor.h>
+
+struct compiled_path;
+struct field_value;
+
+
+/// The aggregates computed by the protobuf_array_* functions
+enum array_aggregate {
+    ARRAY_COUNT,
+    ARRAY_SUM,
+    ARRAY_MIN,
+    ARRAY_MAX,
+    ARRAY_AVG,
+};
+
+
+/// Running totals over the elements of a repeated numeric field, keeping only
+/// what the aggregate needs.
+///
+/// Integers are summed exactly in int_sum. If that overflows, the total is
+/// carried on in real_sum and overflow is set. NaN elements of floating-point
+/// fields are left out of everything but count, since SQLite stores NaN as
+/// null.
+struct array_totals {
+    array_aggregate aggregate;
+    bool integer;
+
+    /// The number of elements, and the number that are not NaN
+    int64_t count;
+    int64_t values;
+
+    int64_t int_sum;
+    bool overflow;
+    double real_sum;
+
+    int64_t int_min;
+    int64_t int_max;
+    double real_min;
+    double real_max;
+
+    array_totals(const google::protobuf::FieldDescriptor *field,
+                 array_aggregate aggregate);
+
+    /// Adds one element, as converted by value_from_wire or value_from_field
+    void add(const field_value& value);
+
+    /// Adds the sum of some integer elements to int_sum
+    void add_sum(int64_t sum);
+};
+
+
+/// Returns true if the field is a numeric field that the protobuf_array_*
+/// functions can aggregate
+bool array_supports_field(const google::protobuf::FieldDescriptor *field);
+
+
+/// Adds the elements of a packed run of a repeated numeric field, which has
+/// already been checked with array_supports_field. Counting does not decode
+/// the elements. Returns false if the run is malformed.
+///
+/// Undefined values of closed enums are not filtered out here, as the parser
+/// would, so those must be added one element at a time.
+bool array_add_packed(const google::protobuf::FieldDescriptor *field,
+                      const uint8_t *data,
+                      size_t size,
+                      array_totals *totals);
+
+
+/// Adds the elements selected by a path in a serialized message, reading them
+/// directly from the wire format. Returns false if the wire engine cannot give
+/// the definitive answer, in which case totals may hold some of the elements.
+bool array_add_wire(const compiled_path& path,
+                    const uint8_t *data,
+                    size_t size,
+                    array_totals *totals);
+
+
+#endif
@@ -0,0 +1,500 @@
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <new>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "compression.h"
+#include "connection.h"
+
+
+static const uint8_t MAGIC[4] = { 0x00, 'p', 'b', 'z' };
+
+/// Deflate writes at least 2 bits for every 258 bytes, so a zlib stream never
+/// decompresses to more than this many times its own size
+static const size_t MAX_EXPANSION = 1032;
+
+/// The decompression buffer starts at this size and doubles as the message
+/// is inflated into it. One larger than MAX_KEPT_CAPACITY is freed rather
+/// than reused for a message that needs much less.
+static const size_t MIN_CAPACITY = 4096;
+static const size_t MAX_KEPT_CAPACITY = 1 << 20;
+
+
+/// Reads a varint, advancing the offset past it. Returns false if it is
+/// truncated or longer than 64 bits.
+static bool read_varint(const uint8_t *data,
+                        size_t size,
+                        size_t *offset,
+                        uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*offset >= size)
+            return false;
+        uint8_t byte = data[(*offset) ++];
+        *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+
+/// Writes a varint and returns the number of bytes it takes, at most 10
+static size_t write_varint(uint8_t *out, uint64_t value)
+{
+    size_t length = 0;
+    while (value >= 0x80) {
+        out[length ++] = static_cast<uint8_t>(value | 0x80);
+        value >>= 7;
+    }
+    out[length ++] = static_cast<uint8_t>(value);
+    return length;
+}
+
+
+/// Reads the header of a compressed message. Returns false if it is not
+/// framed as one, or the header is malformed.
+static bool read_header(const uint8_t *data,
+                        size_t size,
+                        compressed_header *header)
+{
+    if (!is_compressed(data, size))
+        return false;
+
+    size_t offset = sizeof(MAGIC);
+    uint64_t id, message_size;
+    if (!read_varint(data, size, &offset, &id) || id > INT64_MAX
+        || !read_varint(data, size, &offset, &message_size)
+        || message_size > INT_MAX)
+        return false;
+    header->dictionary_id = static_cast<int64_t>(id);
+    header->message_size = static_cast<size_t>(message_size);
+    header->header_size = offset;
+    return true;
+}
+
+
+bool is_compressed(const uint8_t *data, size_t size)
+{
+    return size >= sizeof(MAGIC) && memcmp(data, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+
+message_compressor::message_compressor()
+    : messages(0), bytes(0), deflater_ready(false), inflater_ready(false),
+      capacity(0), produced(0), finished(false)
+{
+}
+
+
+message_compressor::~message_compressor()
+{
+    if (deflater_ready)
+        deflateEnd(&deflater);
+    if (inflater_ready)
+        inflateEnd(&inflater);
+}
+
+
+bool message_compressor::compress(const uint8_t *data,
+                                  size_t size,
+                                  int64_t dictionary_id,
+                                  const std::string *dictionary,
+                                  uint8_t **out,
+                                  size_t *out_size,
+                                  std::string *error_msg)
+{
+    *out = nullptr;
+    if (size > INT_MAX) {
+        *error_msg = "Message is too large to compress";
+        return false;
+    }
+
+    // The stream is reset rather than recreated, which saves allocating its
+    // window for every message
+    if (!deflater_ready) {
+        memset(&deflater, 0, sizeof(deflater));
+        if (deflateInit(&deflater, Z_BEST_COMPRESSION) != Z_OK) {
+            *error_msg = "Could not start compression";
+            return false;
+        }
+        deflater_ready = true;
+    } else if (deflateReset(&deflater) != Z_OK) {
+        *error_msg = "Could not start compression";
+        return false;
+    }
+    if (dictionary && deflateSetDictionary(&deflater,
+            reinterpret_cast<const Bytef *>(dictionary->data()),
+            static_cast<uInt>(dictionary->size())) != Z_OK) {
+        *error_msg = "Could not use dictionary";
+        return false;
+    }
+
+    uint8_t header[sizeof(MAGIC) + 20];
+    memcpy(header, MAGIC, sizeof(MAGIC));
+    size_t header_size = sizeof(MAGIC);
+    header_size += write_varint(header + header_size,
+        static_cast<uint64_t>(dictionary_id));
+    header_size += write_varint(header + header_size, size);
+
+    size_t bound = header_size + deflateBound(&deflater,
+        static_cast<uLong>(size));
+    uint8_t *buffer = static_cast<uint8_t *>(sqlite3_malloc64(bound));
+    if (!buffer) {
+        *error_msg = "Out of memory";
+        return false;
+    }
+    memcpy(buffer, header, header_size);
+
+    deflater.next_in = const_cast<Bytef *>(data);
+    deflater.avail_in = static_cast<uInt>(size);
+    deflater.next_out = buffer + header_size;
+    deflater.avail_out = static_cast<uInt>(bound - header_size);
+    if (deflate(&deflater, Z_FINISH) != Z_STREAM_END) {
+        sqlite3_free(buffer);
+        *error_msg = "Could not compress message";
+        return false;
+    }
+
+    // Keep the message as it is if compressing it does not pay off
+    size_t total = header_size + deflater.total_out;
+    if (total >= size) {
+        sqlite3_free(buffer);
+        return true;
+    }
+    *out = buffer;
+    *out_size = total;
+    return true;
+}
+
+
+bool message_compressor::decompress(sqlite3 *db,
+                                    const uint8_t *data,
+                                    size_t size,
+                                    size_t want,
+                                    std::string *error_msg)
+{
+    // Start over unless this is the message of the last call
+    if (size != input.size() || memcmp(data, input.data(), size) != 0) {
+        input.clear();
+        if (!read_header(data, size, &header)) {
+            *error_msg = "Malformed compressed message";
+            return false;
+        }
+        if (!inflater_ready) {
+            memset(&inflater, 0, sizeof(inflater));
+            if (inflateInit(&inflater) != Z_OK) {
+                *error_msg = "Could not start decompression";
+                return false;
+            }
+            inflater_ready = true;
+        } else if (inflateReset(&inflater) != Z_OK) {
+            *error_msg = "Could not start decompression";
+            return false;
+        }
+
+        // The size comes from the header, so it is checked against what the
+        // stream could hold before anything is allocated for it
+        size_t stream_size = size - header.header_size;
+        if (header.message_size > static_cast<size_t>(
+                sqlite3_limit(db, SQLITE_LIMIT_LENGTH, -1))) {
+            *error_msg = "Compressed message is too large";
+            return false;
+        }
+        if (header.message_size / MAX_EXPANSION > stream_size) {
+            *error_msg = "Malformed compressed message";
+            return false;
+        }
+
+        produced = 0;
+        if (capacity > MAX_KEPT_CAPACITY
+            && capacity / 4 > header.message_size) {
+            buffer.reset();
+            capacity = 0;
+        }
+        if (!buffer && !grow()) {
+            *error_msg = "Out of memory";
+            return false;
+        }
+        input.assign(reinterpret_cast<const char *>(data), size);
+        inflater.next_in = reinterpret_cast<Bytef *>(&input[0])
+            + header.header_size;
+        inflater.avail_in = static_cast<uInt>(stream_size);
+        finished = false;
+        messages ++;
+    }
+
+    while (!finished && produced < want) {
+        // Once the message is complete, inflate into a spare byte, which
+        // must stay unused, to reach the end of the stream and its checksum
+        uint8_t spare;
+        bool full = produced == header.message_size;
+        if (!full && produced == capacity && !grow()) {
+            input.clear();
+            *error_msg = "Out of memory";
+            return false;
+        }
+        size_t room = full ? 1
+            : std::min(std::min(want, header.message_size), capacity)
+                - produced;
+        inflater.next_out = full ? &spare : buffer.get() + produced;
+        inflater.avail_out = static_cast<uInt>(room);
+
+        int err = inflate(&inflater, Z_NO_FLUSH);
+        size_t written = room - inflater.avail_out;
+        if (full && written) {
+            err = Z_DATA_ERROR;
+        } else {
+            produced += written;
+            bytes += static_cast<int64_t>(written);
+        }
+
+        if (err == Z_NEED_DICT) {
+            if (!set_dictionary(db, error_msg)) {
+                input.clear();
+                return false;
+            }
+        } else if (err == Z_STREAM_END
+                   && produced == header.message_size) {
+            finished = true;
+        } else if (err != Z_OK) {
+            input.clear();
+            *error_msg = "Malformed compressed message";
+            return false;
+        }
+    }
+    return true;
+}
+
+
+bool message_compressor::grow()
+{
+    size_t grown = std::min(header.message_size,
+        std::max(MIN_CAPACITY, capacity * 2));
+    std::unique_ptr<uint8_t[]> larger(new (std::nothrow) uint8_t[grown + 1]);
+    if (!larger)
+        return false;
+    if (produced)
+        memcpy(larger.get(), buffer.get(), produced);
+    buffer.swap(larger);
+    capacity = grown;
+    return true;
+}
+
+
+bool message_compressor::set_dictionary(sqlite3 *db, std::string *error_msg)
+{
+    // The stream asks for the dictionary by its checksum
+    uLong checksum = inflater.adler;
+    int64_t id = header.dictionary_id;
+    if (id == 0) {
+        *error_msg = "Malformed compressed message";
+        return false;
+    }
+
+    auto it = dictionaries.find(id);
+    if (it == dictionaries.end() || it->second.first != checksum) {
+        std::string dictionary;
+        if (!load_dictionary(db, id, &dictionary, error_msg))
+            return false;
+        uLong loaded = adler32(adler32(0, Z_NULL, 0),
+            reinterpret_cast<const Bytef *>(dictionary.data()),
+            static_cast<uInt>(dictionary.size()));
+        if (loaded != checksum) {
+            *error_msg = "Dictionary " + std::to_string(id)
+                + " is not the one the message was compressed with";
+            return false;
+        }
+        it = dictionaries.insert(std::make_pair(id,
+            std::make_pair(loaded, std::string()))).first;
+        it->second.first = loaded;
+        it->second.second.swap(dictionary);
+    }
+
+    const std::string& dictionary = it->second.second;
+    if (inflateSetDictionary(&inflater,
+            reinterpret_cast<const Bytef *>(dictionary.data()),
+            static_cast<uInt>(dictionary.size())) != Z_OK) {
+        *error_msg = "Malformed compressed message";
+        return false;
+    }
+    return true;
+}
+
+
+bool load_dictionary(sqlite3 *db,
+                     int64_t id,
+                     std::string *dictionary,
+                     std::string *error_msg)
+{
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db,
+            "SELECT dictionary FROM " DICTIONARY_TABLE " WHERE id = ?", -1,
+            &stmt, nullptr) != SQLITE_OK) {
+        *error_msg = sqlite3_errmsg(db);
+        return false;
+    }
+    sqlite3_bind_int64(stmt, 1, id);
+
+    int err = sqlite3_step(stmt);
+    bool found = err == SQLITE_ROW
+        && sqlite3_column_type(stmt, 0) != SQLITE_NULL;
+    if (found) {
+        const void *data = sqlite3_column_blob(stmt, 0);
+        dictionary->assign(static_cast<const char *>(data ? data : ""),
+            static_cast<size_t>(sqlite3_column_bytes(stmt, 0)));
+    } else if (err == SQLITE_ROW || err == SQLITE_DONE) {
+        *error_msg = "Dictionary " + std::to_string(id) + " not found";
+    } else {
+        *error_msg = sqlite3_errmsg(db);
+    }
+    sqlite3_finalize(stmt);
+    return found;
+}
+
+
+bool decompress_message(connection *conn,
+                        sqlite3 *db,
+                        const uint8_t **data,
+                        size_t *size,
+                        std::string *error_msg)
+{
+    if (!is_compressed(*data, *size))
+        return true;
+
+    message_compressor& compressor = conn->compressor;
+    if (!compressor.decompress(db, *data, *size, SIZE_MAX, error_msg))
+        return false;
+    *data = compressor.data();
+    *size = compressor.size();
+    return true;
+}
+
+
+bool message_argument(sqlite3_context *context,
+                      connection *conn,
+                      sqlite3_value *value,
+                      const uint8_t **data,
+                      size_t *size)
+{
+    *data = static_cast<const uint8_t *>(sqlite3_value_blob(value));
+    *size = static_cast<size_t>(sqlite3_value_bytes(value));
+
+    std::string error_msg;
+    if (decompress_message(conn, sqlite3_context_db_handle(context), data,
+                           size, &error_msg))
+        return true;
+    sqlite3_result_error(context, error_msg.c_str(), -1);
+    return false;
+}
+
+
+/// Dictionaries are built from runs of RUN bytes, which are counted in a table
+/// indexed by their hash, and copied from samples in segments of SEGMENT bytes
+static const size_t RUN = 6;
+static const size_t SEGMENT = 48;
+static const int TABLE_BITS = 20;
+
+
+static uint32_t run_hash(const uint8_t *data)
+{
+    uint64_t word = 0;
+    memcpy(&word, data, RUN);
+    return static_cast<uint32_t>(
+        (word * 0x9e3779b97f4a7c15ULL) >> (64 - TABLE_BITS));
+}
+
+
+std::string train_dictionary(const std::vector<std::string>& samples,
+                             size_t capacity)
+{
+    // Count the samples that each run appears in. Repeats within a sample are
+    // left out, since deflate finds those without a dictionary.
+    std::vector<uint32_t> frequency(1 << TABLE_BITS, 0);
+    std::vector<uint32_t> last_sample(1 << TABLE_BITS, UINT32_MAX);
+    size_t total = 0;
+    for (size_t s = 0; s < samples.size(); s ++) {
+        const uint8_t *data =
+            reinterpret_cast<const uint8_t *>(samples[s].data());
+        for (size_t i = 0; i + RUN <= samples[s].size(); i ++) {
+            uint32_t hash = run_hash(data + i);
+            if (last_sample[hash] != s) {
+                last_sample[hash] = static_cast<uint32_t>(s);
+                frequency[hash] ++;
+            }
+        }
+        total += samples[s].size();
+    }
+
+    // Split the samples into as many epochs as the dictionary has segments,
+    // and take the segment from each one whose runs are the most common. Once
+    // taken, its runs no longer count, so other segments cover something new.
+    struct segment {
+        uint64_t score;
+        size_t runs;
+        const uint8_t *data;
+        size_t size;
+    };
+    std::vector<segment> taken;
+    size_t epochs = std::max<size_t>(1, capacity / SEGMENT);
+    size_t epoch_size = std::max(SEGMENT, total / epochs);
+
+    size_t s = 0, offset = 0;
+    while (s < samples.size()) {
+        segment best = { 0, 0, nullptr, 0 };
+        size_t budget = epoch_size;
+        while (budget > 0 && s < samples.size()) {
+            const std::string& sample = samples[s];
+            const uint8_t *data =
+                reinterpret_cast<const uint8_t *>(sample.data());
+            size_t end = std::min(sample.size(), offset + budget);
+
+            // Slide a segment over the starting points in this epoch, keeping
+            // the sum of the frequencies of its runs
+            uint64_t score = 0;
+            size_t next_run = offset;
+            for (size_t start = offset;
+                 start < end && start + RUN <= sample.size(); start ++) {
+                if (start > offset)
+                    score -= frequency[run_hash(data + start - 1)];
+                size_t size = std::min(SEGMENT, sample.size() - start);
+                while (next_run + RUN <= start + size) {
+                    score += frequency[run_hash(data + next_run)];
+                    next_run ++;
+                }
+                if (score > best.score)
+                    best = { score, size - RUN + 1, data + start, size };
+            }
+
+            budget -= end - offset;
+            if (end == sample.size()) {
+                s ++;
+                offset = 0;
+            } else {
+                offset = end;
+            }
+        }
+
+        // A segment is only worth having if its runs are shared by other
+        // samples on average
+        if (best.score <= best.runs)
+            continue;
+        taken.push_back(best);
+        for (size_t i = 0; i + RUN <= best.size; i ++)
+            frequency[run_hash(best.data + i)] = 0;
+    }
+
+    std::stable_sort(taken.begin(), taken.end(),
+        [](const segment& a, const segment& b) { return a.score < b.score; });
+    std::string dictionary;
+    for (const segment& segment : taken)
+        dictionary.append(reinterpret_cast<const char *>(segment.data),
+            segment.size);
+    if (dictionary.size() > capacity)
+        dictionary.erase(0, dictionary.size() - capacity);
+    return dictionary;
+}
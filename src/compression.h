@@ -0,0 +1,149 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <zlib.h>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+struct connection;
+
+
+/// The table that dictionaries are looked up in, by id
+#define DICTIONARY_TABLE "protobuf_dictionaries"
+
+/// Dictionaries cannot be longer than the deflate window
+static const size_t MAX_DICTIONARY_SIZE = 32768;
+
+
+/// The start of a compressed message, as written by protobuf_compress:
+///
+///     00 'p' 'b' 'z'  magic, which no serialized message can start with,
+///                     since field number 0 is invalid
+///     varint          id of the dictionary, or 0 for none
+///     varint          size of the message
+///     ...             zlib stream
+struct compressed_header {
+    int64_t dictionary_id;
+    size_t message_size;
+    size_t header_size;
+};
+
+
+/// Returns true if the bytes are framed as a compressed message
+bool is_compressed(const uint8_t *data, size_t size);
+
+
+/// Compresses messages and decompresses them for the readers, keeping the
+/// zlib streams, the output buffer and the dictionaries between calls
+struct message_compressor {
+    /// Compressed messages the readers started to decompress, and the bytes
+    /// decompressed from them, which protobuf_stats reports
+    int64_t messages;
+    int64_t bytes;
+
+    message_compressor();
+    ~message_compressor();
+
+    /// Writes the framed, compressed message into a buffer allocated with
+    /// sqlite3_malloc64. The dictionary may be NULL. Sets out to NULL if
+    /// compression does not make the message smaller, and returns false and
+    /// sets error_msg if it fails.
+    bool compress(const uint8_t *data,
+                  size_t size,
+                  int64_t dictionary_id,
+                  const std::string *dictionary,
+                  uint8_t **out,
+                  size_t *out_size,
+                  std::string *error_msg);
+
+    /// Decompresses a compressed message into the buffer, stopping once at
+    /// least want bytes of it are available, or the whole message. Called
+    /// again with the same bytes, it carries on from where it stopped, so
+    /// calls on the same row share the work. Dictionaries are loaded from
+    /// the database as needed. Returns false and sets error_msg if the
+    /// message is malformed, larger than SQLite allows, or its dictionary
+    /// cannot be found, or if the buffer cannot be allocated.
+    bool decompress(sqlite3 *db,
+                    const uint8_t *data,
+                    size_t size,
+                    size_t want,
+                    std::string *error_msg);
+
+    /// The part of the current message decompressed so far, which stays valid
+    /// until more of it or another message is decompressed
+    const uint8_t *data() const { return buffer.get(); }
+    size_t size() const { return produced; }
+    bool complete() const { return finished; }
+
+private:
+    z_stream deflater;
+    z_stream inflater;
+    bool deflater_ready;
+    bool inflater_ready;
+
+    /// The compressed message being decompressed, kept to recognize it and
+    /// so that the stream can carry on reading it
+    std::string input;
+    compressed_header header;
+    std::unique_ptr<uint8_t[]> buffer;
+    size_t capacity;
+    size_t produced;
+    bool finished;
+
+    /// Dictionaries loaded for decompression, with their checksums, which
+    /// are checked against the one in each stream so that a dictionary that
+    /// has been replaced is loaded again
+    std::map<int64_t, std::pair<uLong, std::string>> dictionaries;
+
+    /// Makes room for more of the message, doubling the buffer up to the
+    /// size of the message. Returns false if it cannot be allocated.
+    bool grow();
+    bool set_dictionary(sqlite3 *db, std::string *error_msg);
+};
+
+
+/// Looks up a dictionary by id. Returns false and sets error_msg if there is
+/// no such dictionary.
+bool load_dictionary(sqlite3 *db,
+                     int64_t id,
+                     std::string *dictionary,
+                     std::string *error_msg);
+
+
+/// Replaces the data and size of a message with those of its decompressed
+/// bytes, if it is compressed. They stay valid until the connection
+/// decompresses another message, so anything kept longer must be copied.
+/// Returns false and sets error_msg if it cannot be decompressed.
+bool decompress_message(connection *conn,
+                        sqlite3 *db,
+                        const uint8_t **data,
+                        size_t *size,
+                        std::string *error_msg);
+
+
+/// The same for a function argument, except that errors are set on the
+/// context
+bool message_argument(sqlite3_context *context,
+                      connection *conn,
+                      sqlite3_value *value,
+                      const uint8_t **data,
+                      size_t *size);
+
+
+/// Builds a dictionary of at most capacity bytes from sample messages, out of
+/// the runs of bytes that the most samples have in common. The most useful
+/// runs are put at the end, where they are cheapest to refer to.
+std::string train_dictionary(const std::vector<std::string>& samples,
+                             size_t capacity);
+
+
+#endif
@@ -0,0 +1,51 @@
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "connection.h"
+
+
+connection::connection()
+    : refcount(1), engine(ENGINE_AUTO), extractor_finds(0)
+{
+}
+
+
+connection *connection::retain()
+{
+    refcount ++;
+    return this;
+}
+
+
+void connection::release(void *p)
+{
+    connection *conn = static_cast<connection *>(p);
+    if (-- conn->refcount == 0)
+        delete conn;
+}
+
+
+connection *connection::get(sqlite3_context *context)
+{
+    return static_cast<connection *>(sqlite3_user_data(context));
+}
+
+
+int create_function(sqlite3 *db, connection *conn, const char *name,
+                    int nargs, int flags,
+                    void (*xFunc)(sqlite3_context *, int, sqlite3_value **))
+{
+    // SQLite calls the destructor even if registration fails
+    return sqlite3_create_function_v2(db, name, nargs, flags, conn->retain(),
+        xFunc, 0, 0, connection::release);
+}
+
+
+int create_aggregate(sqlite3 *db, connection *conn, const char *name,
+                     int nargs, int flags,
+                     void (*xStep)(sqlite3_context *, int, sqlite3_value **),
+                     void (*xFinal)(sqlite3_context *))
+{
+    return sqlite3_create_function_v2(db, name, nargs, flags, conn->retain(),
+        0, xStep, xFinal, connection::release);
+}
@@ -0,0 +1,94 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <string>
+#include <unordered_set>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "compression.h"
+#include "json_writer.h"
+#include "loaded_descriptors.h"
+#include "message_cache.h"
+#include "message_factory.h"
+#include "stats.h"
+
+
+/// The strategies protobuf_extract can use to find a field in a message
+enum extract_engine {
+    /// Walk the wire format, with code generated for the message type if there
+    /// is any, falling back to reflection when necessary
+    ENGINE_AUTO,
+    /// Always parse the whole message and traverse it with reflection
+    ENGINE_REFLECTION,
+    /// The same as ENGINE_AUTO, but without the extractors generated for
+    /// message types in libraries loaded with protobuf_load
+    ENGINE_WIRE,
+};
+
+
+/// State shared by every function and module registered on a database
+/// connection. Each registration holds a reference, which SQLite drops when
+/// the connection is closed.
+struct connection {
+    int refcount;
+    extract_engine engine;
+
+    /// Libraries loaded with protobuf_load
+    std::unordered_set<std::string> libraries;
+
+    /// Message types loaded with protobuf_load_descriptors. This is declared
+    /// before anything that uses the types, so that it is destroyed last.
+    loaded_descriptors descriptors;
+
+    /// Creates the messages parsed on this connection. This is declared before
+    /// anything holding those messages, so that it is destroyed after them.
+    message_factory factory;
+
+    /// Messages recently parsed by protobuf_extract
+    message_cache cache;
+
+    /// Counters reported by protobuf_stats
+    connection_stats stats;
+
+    /// Values that protobuf_extract found with a generated extractor, which
+    /// protobuf_stats always reports
+    int64_t extractor_finds;
+
+    /// Writes the JSON of protobuf_to_json, reusing its buffer between calls
+    json_writer json;
+
+    /// Compresses messages, and decompresses them for every function that
+    /// reads one
+    message_compressor compressor;
+
+    connection();
+
+    /// Adds a reference on behalf of a function or module being registered
+    connection *retain();
+
+    /// Suitable as the destructor argument of sqlite3_create_function_v2 and
+    /// sqlite3_create_module_v2
+    static void release(void *p);
+
+    /// Returns the connection state a function was registered with
+    static connection *get(sqlite3_context *context);
+};
+
+
+/// Registers a function whose user data is a reference to the connection
+int create_function(sqlite3 *db, connection *conn, const char *name,
+                    int nargs, int flags,
+                    void (*xFunc)(sqlite3_context *, int, sqlite3_value **));
+
+
+/// Registers an aggregate function whose user data is a reference to the
+/// connection
+int create_aggregate(sqlite3 *db, connection *conn, const char *name,
+                     int nargs, int flags,
+                     void (*xStep)(sqlite3_context *, int, sqlite3_value **),
+                     void (*xFinal)(sqlite3_context *));
+
+
+#endif
@@ -1,6 +1,7 @@
 #include <sqlite3ext.h>
 SQLITE_EXTENSION_INIT1
 
+#include "connection.h"
 #include "header.h"
 
 
@@ -21,18 +22,39 @@ int sqlite3_sqliteprotobuf_init(sqlite3 *db,
         return SQLITE_ERROR;
     }
     
-    // Run each register_* function and abort if any of them fails
-    int (*register_fns[])(sqlite3 *, char **, const sqlite3_api_routines *) = {
+    // Run each register_* function and abort if any of them fails. Each one
+    // takes its own reference to the per-connection state.
+    int (*register_fns[])(sqlite3 *, char **, const sqlite3_api_routines *,
+                          connection *) = {
+        register_protobuf_array,
+        register_protobuf_compress,
+        register_protobuf_config,
+        register_protobuf_each,
         register_protobuf_enum,
         register_protobuf_extract,
+        register_protobuf_extract_all,
+        register_protobuf_extract_raw,
+        register_protobuf_fields,
+        register_protobuf_file,
+        register_protobuf_index,
         register_protobuf_load,
+        register_protobuf_load_descriptors,
+        register_protobuf_match,
+        register_protobuf_remove,
+        register_protobuf_set,
+        register_protobuf_shred,
+        register_protobuf_stats,
+        register_protobuf_to_json,
+        register_protobuf_view,
     };
     
+    connection *conn = new connection;
     int nfuncs = sizeof(register_fns) / sizeof(register_fns[0]);
     for (int i = 0; i < nfuncs; i ++) {
-        int err = (register_fns[i])(db, pzErrMsg, pApi);
-        if (err != SQLITE_OK) return err;
+        err = (register_fns[i])(db, pzErrMsg, pApi, conn);
+        if (err != SQLITE_OK) break;
     }
 
-    return SQLITE_OK;
+    connection::release(conn);
+    return err;
 }
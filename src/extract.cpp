@@ -0,0 +1,597 @@
+#include <algorithm>
+#include <climits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/message.h>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "connection.h"
+#include "extract.h"
+#include "extractors.h"
+#include "message_cache.h"
+#include "message_factory.h"
+#include "path.h"
+#include "wire.h"
+
+using google::protobuf::Descriptor;
+using google::protobuf::EnumValueDescriptor;
+using google::protobuf::FieldDescriptor;
+using google::protobuf::Message;
+using google::protobuf::Reflection;
+
+
+/// Logs a warning that a value is being returned for an unsigned 64-bit field
+static void warn_unsigned(const FieldDescriptor *field)
+{
+    sqlite3_log(SQLITE_WARNING,
+        "Protobuf field \"%s\" is unsigned, but SQLite does not "
+        "support unsigned types", field->full_name().c_str());
+}
+
+
+/// Sets the result to an enum value, or to its name for the virtual .name child
+static void result_enum(sqlite3_context *context,
+                        const FieldDescriptor *field,
+                        int value,
+                        bool enum_name)
+{
+    if (!enum_name) {
+        sqlite3_result_int(context, value);
+        return;
+    }
+
+    const EnumValueDescriptor *value_descriptor =
+        field->enum_type()->FindValueByNumber(value);
+    if (!value_descriptor) {
+        sqlite3_result_error(context, "Enum value not found", -1);
+        return;
+    }
+    sqlite3_result_text(context,
+        value_descriptor->name().c_str(),
+        value_descriptor->name().length(),
+        SQLITE_TRANSIENT);
+}
+
+
+/// Sets the result to the contents of a string or bytes field
+static void result_string(sqlite3_context *context,
+                          const FieldDescriptor *field,
+                          const char *data,
+                          size_t size)
+{
+    switch(field->type()) {
+    default:
+        // fall through, but log
+        sqlite3_log(SQLITE_WARNING,
+            "Protobuf field \"%s\" is an unexpected string type",
+            field->full_name().c_str());
+    case FieldDescriptor::Type::TYPE_STRING:
+        sqlite3_result_text(context, data, size, SQLITE_TRANSIENT);
+        break;
+    case FieldDescriptor::Type::TYPE_BYTES:
+        sqlite3_result_blob(context, data, size, SQLITE_TRANSIENT);
+        break;
+    }
+}
+
+
+/// Sets the result to a serialized message. It is serialized directly into a
+/// buffer that SQLite takes ownership of, rather than being copied.
+static void result_message(sqlite3_context *context, const Message& message)
+{
+    size_t size = message.ByteSizeLong();
+    if (size == 0) {
+        sqlite3_result_zeroblob(context, 0);
+        return;
+    }
+
+    uint8_t *buffer = static_cast<uint8_t *>(sqlite3_malloc64(size));
+    if (!buffer) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    if (size > INT_MAX
+        || !message.SerializeToArray(buffer, static_cast<int>(size))) {
+        sqlite3_free(buffer);
+        sqlite3_result_error(context, "Could not serialize message", -1);
+        return;
+    }
+    sqlite3_result_blob64(context, buffer, size, sqlite3_free);
+}
+
+
+void result_from_field(sqlite3_context *context,
+                       const Message& message,
+                       const FieldDescriptor *field,
+                       int index,
+                       bool enum_name)
+{
+    const Reflection *reflection = message.GetReflection();
+    bool repeated = field->is_repeated();
+
+    // Translate the field type into a SQLite type and return it
+    switch(field->cpp_type()) {
+        case FieldDescriptor::CppType::CPPTYPE_INT32:
+        {
+            int32_t value = repeated
+                ? reflection->GetRepeatedInt32(message, field, index)
+                : reflection->GetInt32(message, field);
+            sqlite3_result_int(context, value);
+            return;
+        }
+        case FieldDescriptor::CppType::CPPTYPE_INT64:
+        {
+            int64_t value = repeated
+                ? reflection->GetRepeatedInt64(message, field, index)
+                : reflection->GetInt64(message, field);
+            sqlite3_result_int64(context, value);
+            return;
+        }
+        case FieldDescriptor::CppType::CPPTYPE_UINT32:
+        {
+            uint32_t value = repeated
+                ? reflection->GetRepeatedUInt32(message, field, index)
+                : reflection->GetUInt32(message, field);
+            sqlite3_result_int64(context, value);
+            return;
+        }
+        case FieldDescriptor::CppType::CPPTYPE_UINT64:
+        {
+            warn_unsigned(field);
+            uint64_t value = repeated
+                ? reflection->GetRepeatedUInt64(message, field, index)
+                : reflection->GetUInt64(message, field);
+            sqlite3_result_int64(context, static_cast<sqlite3_int64>(value));
+            return;
+        }
+        case FieldDescriptor::CppType::CPPTYPE_DOUBLE:
+        {
+            double value = repeated
+                ? reflection->GetRepeatedDouble(message, field, index)
+                : reflection->GetDouble(message, field);
+            sqlite3_result_double(context, value);
+            return;
+        }
+        case FieldDescriptor::CppType::CPPTYPE_FLOAT:
+        {
+            float value = repeated
+                ? reflection->GetRepeatedFloat(message, field, index)
+                : reflection->GetFloat(message, field);
+            sqlite3_result_double(context, value);
+            return;
+        }
+        case FieldDescriptor::CppType::CPPTYPE_BOOL:
+        {
+            bool value = repeated
+                ? reflection->GetRepeatedBool(message, field, index)
+                : reflection->GetBool(message, field);
+            sqlite3_result_int(context, value ? 1 : 0);
+            return;
+        }
+        case FieldDescriptor::CppType::CPPTYPE_ENUM:
+        {
+            int value = repeated
+                ? reflection->GetRepeatedEnumValue(message, field, index)
+                : reflection->GetEnumValue(message, field);
+            result_enum(context, field, value, enum_name);
+            return;
+        }
+        case FieldDescriptor::CppType::CPPTYPE_STRING:
+        {
+            std::string scratch;
+            const std::string& value = repeated
+                ? reflection->GetRepeatedStringReference(message, field, index,
+                    &scratch)
+                : reflection->GetStringReference(message, field, &scratch);
+            result_string(context, field, value.c_str(), value.length());
+            return;
+        }
+        case FieldDescriptor::CppType::CPPTYPE_MESSAGE:
+            result_message(context, repeated
+                ? reflection->GetRepeatedMessage(message, field, index)
+                : reflection->GetMessage(message, field));
+            return;
+    }
+}
+
+
+void result_from_default(sqlite3_context *context,
+                         const FieldDescriptor *field,
+                         bool enum_name)
+{
+    switch(field->cpp_type()) {
+        case FieldDescriptor::CppType::CPPTYPE_INT32:
+            sqlite3_result_int(context, field->default_value_int32());
+            return;
+        case FieldDescriptor::CppType::CPPTYPE_INT64:
+            sqlite3_result_int64(context, field->default_value_int64());
+            return;
+        case FieldDescriptor::CppType::CPPTYPE_UINT32:
+            sqlite3_result_int64(context, field->default_value_uint32());
+            return;
+        case FieldDescriptor::CppType::CPPTYPE_UINT64:
+            warn_unsigned(field);
+            sqlite3_result_int64(context,
+                static_cast<sqlite3_int64>(field->default_value_uint64()));
+            return;
+        case FieldDescriptor::CppType::CPPTYPE_DOUBLE:
+            sqlite3_result_double(context, field->default_value_double());
+            return;
+        case FieldDescriptor::CppType::CPPTYPE_FLOAT:
+            sqlite3_result_double(context, field->default_value_float());
+            return;
+        case FieldDescriptor::CppType::CPPTYPE_BOOL:
+            sqlite3_result_int(context, field->default_value_bool() ? 1 : 0);
+            return;
+        case FieldDescriptor::CppType::CPPTYPE_ENUM:
+            result_enum(context, field,
+                field->default_value_enum()->number(), enum_name);
+            return;
+        case FieldDescriptor::CppType::CPPTYPE_STRING:
+            result_string(context, field,
+                field->default_value_string().c_str(),
+                field->default_value_string().length());
+            return;
+        case FieldDescriptor::CppType::CPPTYPE_MESSAGE:
+            sqlite3_result_null(context);
+            return;
+    }
+}
+
+
+void result_from_wire(sqlite3_context *context,
+                      const FieldDescriptor *field,
+                      const wire_value& value,
+                      bool enum_name)
+{
+    switch(field->cpp_type()) {
+        case FieldDescriptor::CppType::CPPTYPE_UINT64:
+            warn_unsigned(field);
+            // fall through
+        case FieldDescriptor::CppType::CPPTYPE_INT32:
+        case FieldDescriptor::CppType::CPPTYPE_INT64:
+        case FieldDescriptor::CppType::CPPTYPE_UINT32:
+        case FieldDescriptor::CppType::CPPTYPE_BOOL:
+            sqlite3_result_int64(context, wire_decode_int(field, value.bits));
+            return;
+        case FieldDescriptor::CppType::CPPTYPE_DOUBLE:
+        case FieldDescriptor::CppType::CPPTYPE_FLOAT:
+            sqlite3_result_double(context,
+                wire_decode_double(field, value.bits));
+            return;
+        case FieldDescriptor::CppType::CPPTYPE_ENUM:
+            result_enum(context, field,
+                static_cast<int>(wire_decode_int(field, value.bits)),
+                enum_name);
+            return;
+        case FieldDescriptor::CppType::CPPTYPE_STRING:
+            result_string(context, field,
+                reinterpret_cast<const char *>(value.data), value.size);
+            return;
+        case FieldDescriptor::CppType::CPPTYPE_MESSAGE:
+            // The submessage is returned in its original encoding
+            sqlite3_result_blob(context, value.data, value.size,
+                SQLITE_TRANSIENT);
+            return;
+    }
+}
+
+
+parsed_message::parsed_message()
+    : data(nullptr), size(0), conn(nullptr), arena(nullptr), cache(nullptr),
+      descriptor(nullptr), message(nullptr)
+{
+}
+
+
+parsed_message::parsed_message(const uint8_t *data, size_t size,
+                               connection *conn, message_arena *arena)
+    : data(data), size(size), conn(conn), arena(arena), cache(nullptr),
+      descriptor(nullptr), message(nullptr)
+{
+}
+
+
+parsed_message::parsed_message(const uint8_t *data, size_t size,
+                               connection *conn, message_cache *cache)
+    : data(data), size(size), conn(conn), arena(nullptr), cache(cache),
+      descriptor(nullptr), message(nullptr)
+{
+}
+
+
+const Message *parsed_message::get(const Descriptor *type)
+{
+    if (descriptor == type)
+        return message;
+
+    // Deserialize the message
+    stats_phase phase = conn->stats.enter_phase(PHASE_PARSE);
+    descriptor = type;
+    message = cache
+        ? cache->parse(conn->factory, type, data, size)
+        : conn->factory.parse(*arena, type, data, size);
+    if (!message)
+        conn->stats.count_parse_failure();
+    conn->stats.enter_phase(phase);
+    return message;
+}
+
+
+/// Wraps a negative index around the end of a repeated field. Returns -1 if
+/// the index is out of range.
+static int resolve_index(const Message& message,
+                         const FieldDescriptor *field,
+                         int index)
+{
+    int field_size = message.GetReflection()->FieldSize(message, field);
+    if (index < 0)
+        index += field_size;
+    return index < field_size ? index : -1;
+}
+
+
+const Message *follow_path(const Message *message,
+                           const compiled_path& path,
+                           size_t count)
+{
+    for (size_t i = 0; i < count; i ++) {
+        const FieldDescriptor *field = path.elements[i].field;
+        const Reflection *reflection = message->GetReflection();
+
+        // An optional message field that is not present is null, regardless
+        // of the rest of the path
+        if (field->is_repeated()) {
+            int index = resolve_index(*message, field, path.elements[i].index);
+            if (index < 0)
+                return nullptr;
+            message = &reflection->GetRepeatedMessage(*message, field, index);
+        } else if (reflection->HasField(*message, field)) {
+            message = &reflection->GetMessage(*message, field);
+        } else {
+            return nullptr;
+        }
+    }
+    return message;
+}
+
+
+void extract_path(sqlite3_context *context,
+                  connection *conn,
+                  const compiled_path& path,
+                  parsed_message& parsed)
+{
+    conn->stats.enter_phase(PHASE_WALK);
+
+    // Try to find the field without parsing the whole message, with the code
+    // generated for the message type if there is any
+    if (conn->engine != ENGINE_REFLECTION && path.wire_supported) {
+        const FieldDescriptor *field = path.elements.back().field;
+        wire_value value;
+        wire_status status;
+        if (path.extractor && conn->engine == ENGINE_AUTO) {
+            status = extractor_find(path, parsed.data, parsed.size, &value);
+            if (status != WIRE_FALLBACK)
+                conn->extractor_finds ++;
+        } else {
+            status = wire_find(path, parsed.data, parsed.size, &value);
+        }
+        switch (status) {
+        case WIRE_FOUND:
+            conn->stats.enter_phase(PHASE_RESULT);
+            result_from_wire(context, field, value, path.enum_name);
+            return;
+        case WIRE_DEFAULT:
+            conn->stats.enter_phase(PHASE_RESULT);
+            result_from_default(context, field, path.enum_name);
+            return;
+        case WIRE_NULL:
+            sqlite3_result_null(context);
+            return;
+        case WIRE_FALLBACK:
+            break;
+        }
+    }
+
+    const Message *root = parsed.get(path.descriptor);
+    if (!root) {
+        sqlite3_result_error(context, "Failed to parse message", -1);
+        return;
+    }
+    
+    // Special case: just return the root object. An empty message is still an
+    // empty BLOB rather than null.
+    if (path.elements.empty()) {
+        conn->stats.enter_phase(PHASE_RESULT);
+        if (parsed.size == 0)
+            sqlite3_result_zeroblob(context, 0);
+        else
+            sqlite3_result_blob(context, parsed.data, parsed.size,
+                SQLITE_TRANSIENT);
+        return;
+    }
+    
+    // Now that the message is known to be valid, a submessage can be returned
+    // as the slice of the original bytes it was parsed from, if the wire
+    // engine can find it, rather than serialized again
+    const FieldDescriptor *field = path.elements.back().field;
+    wire_value value;
+    if (conn->engine != ENGINE_REFLECTION && !path.wire_supported
+        && path.wire_after_parse
+        && field->cpp_type() == FieldDescriptor::CppType::CPPTYPE_MESSAGE
+        && wire_find(path, parsed.data, parsed.size, &value) == WIRE_FOUND) {
+        conn->stats.enter_phase(PHASE_RESULT);
+        result_from_wire(context, field, value, path.enum_name);
+        return;
+    }
+
+    // Descend to the message that holds the last field
+    const Message *message = follow_path(root, path,
+        path.elements.size() - 1);
+    if (!message) {
+        sqlite3_result_null(context);
+        return;
+    }
+
+    // Return null if the index is out of range or an optional message field
+    // is not present. Unset non-message fields give their default values.
+    const path_element& last = path.elements.back();
+    int index = last.index;
+    if (last.field->is_repeated()) {
+        index = resolve_index(*message, last.field, index);
+        if (index < 0) {
+            sqlite3_result_null(context);
+            return;
+        }
+    } else if (last.field->cpp_type()
+                   == FieldDescriptor::CppType::CPPTYPE_MESSAGE
+               && !message->GetReflection()->HasField(*message, last.field)) {
+        sqlite3_result_null(context);
+        return;
+    }
+
+    conn->stats.enter_phase(PHASE_RESULT);
+    result_from_field(context, *message, last.field, index, path.enum_name);
+}
+
+
+/// The state of match_path, which is passed down as it recurses
+struct match_walk {
+    const compiled_path& path;
+    bool with_paths;
+    std::vector<path_match> *matches;
+    std::string prefix;
+};
+
+
+static void match_element(match_walk& walk, const Message& message, size_t i);
+
+
+/// Selects the elements of a field as the i-th element of the path says, and
+/// either records them or matches the rest of the path inside them
+static void match_field(match_walk& walk,
+                        const Message& message,
+                        size_t i,
+                        const FieldDescriptor *field)
+{
+    const path_element& element = walk.path.elements[i];
+    const Reflection *reflection = message.GetReflection();
+    bool last = i + 1 == walk.path.elements.size();
+    bool is_message =
+        field->cpp_type() == FieldDescriptor::CppType::CPPTYPE_MESSAGE;
+    if (!last && !is_message)
+        return;
+
+    size_t length = walk.prefix.length();
+    if (walk.with_paths)
+        walk.prefix += "." + field->name();
+
+    // A non-repeated field has just the one value, whatever the index
+    int start = 0;
+    int stop = 0;
+    if (!field->is_repeated()) {
+        if (!is_message || reflection->HasField(message, field))
+            stop = 1;
+    } else {
+        int size = reflection->FieldSize(message, field);
+        start = element.index < 0 ? element.index + size : element.index;
+        if (element.slice) {
+            stop = element.end < 0 ? element.end + size : element.end;
+            start = std::max(start, 0);
+            stop = std::min(stop, size);
+        } else if (start >= 0 && start < size) {
+            stop = start + 1;
+        } else {
+            stop = start;
+        }
+    }
+
+    for (int index = start; index < stop; index ++) {
+        if (walk.with_paths && field->is_repeated())
+            walk.prefix.append("[").append(std::to_string(index)).append("]");
+        if (last) {
+            path_match match = { &message, field,
+                field->is_repeated() ? index : -1, std::string() };
+            if (walk.with_paths)
+                match.path = walk.prefix
+                    + (walk.path.enum_name ? ".name" : "");
+            walk.matches->push_back(match);
+        } else {
+            match_element(walk, field->is_repeated()
+                ? reflection->GetRepeatedMessage(message, field, index)
+                : reflection->GetMessage(message, field), i + 1);
+        }
+        if (walk.with_paths)
+            walk.prefix.resize(length + 1 + field->name().length());
+    }
+    walk.prefix.resize(length);
+}
+
+
+/// Looks for the field of a recursive descent in a message, and then in the
+/// messages inside it that can lead to the field
+static void match_descent(match_walk& walk, const Message& message, size_t i)
+{
+    const path_element& element = walk.path.elements[i];
+    auto step = element.descent.find(message.GetDescriptor());
+    if (step == element.descent.end())
+        return;
+    if (step->second.field)
+        match_field(walk, message, i, step->second.field);
+
+    const Reflection *reflection = message.GetReflection();
+    size_t length = walk.prefix.length();
+    for (const FieldDescriptor *child : step->second.children) {
+        if (walk.with_paths)
+            walk.prefix += "." + child->name();
+        if (!child->is_repeated()) {
+            if (reflection->HasField(message, child))
+                match_descent(walk, reflection->GetMessage(message, child), i);
+        } else {
+            size_t child_length = walk.prefix.length();
+            int size = reflection->FieldSize(message, child);
+            for (int index = 0; index < size; index ++) {
+                if (walk.with_paths)
+                    walk.prefix.append("[").append(std::to_string(index))
+                        .append("]");
+                match_descent(walk,
+                    reflection->GetRepeatedMessage(message, child, index), i);
+                walk.prefix.resize(child_length);
+            }
+        }
+        walk.prefix.resize(length);
+    }
+}
+
+
+/// Matches the path from its i-th element on in a message
+static void match_element(match_walk& walk, const Message& message, size_t i)
+{
+    const path_element& element = walk.path.elements[i];
+    if (element.recursive) {
+        match_descent(walk, message, i);
+        return;
+    }
+
+    // After a recursive descent, the field depends on the type of message
+    const FieldDescriptor *field = element.field ? element.field
+        : find_path_field(message.GetDescriptor(), element.name);
+    if (field)
+        match_field(walk, message, i, field);
+}
+
+
+void match_path(const Message& root,
+                const compiled_path& path,
+                bool with_paths,
+                std::vector<path_match> *matches)
+{
+    if (path.elements.empty())
+        return;
+    match_walk walk = { path, with_paths, matches, "$" };
+    match_element(walk, root, 0);
+}
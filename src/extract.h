@@ -0,0 +1,116 @@
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/message.h>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+struct compiled_path;
+struct connection;
+struct message_arena;
+struct message_cache;
+struct wire_value;
+
+
+/// A serialized message that is parsed on demand, at most once, no matter how
+/// many paths are extracted from it. The data must outlive this object.
+///
+/// The message is parsed either into an arena owned by the caller, which can
+/// be reused for the next message, or into the connection's cache, where the
+/// parse is shared with other calls on the same bytes. A cached message must
+/// not be held across calls that could use the cache again.
+struct parsed_message {
+    const uint8_t *data;
+    size_t size;
+
+    parsed_message();
+    parsed_message(const uint8_t *data, size_t size, connection *conn,
+                   message_arena *arena);
+    parsed_message(const uint8_t *data, size_t size, connection *conn,
+                   message_cache *cache);
+
+    /// Returns the message parsed as the given type, or NULL if it could not
+    /// be parsed
+    const google::protobuf::Message *get(
+        const google::protobuf::Descriptor *type);
+
+private:
+    connection *conn;
+    message_arena *arena;
+    message_cache *cache;
+    const google::protobuf::Descriptor *descriptor;
+    const google::protobuf::Message *message;
+};
+
+
+/// Sets the result of a function to the value selected by a compiled path,
+/// using the wire engine if possible and otherwise the parsed message
+void extract_path(sqlite3_context *context,
+                  connection *conn,
+                  const compiled_path& path,
+                  parsed_message& parsed);
+
+
+/// Follows the first count elements of a path, which must all be message
+/// fields, using reflection. Returns NULL if an index is out of range or a
+/// message on the way is not present.
+const google::protobuf::Message *follow_path(
+    const google::protobuf::Message *message,
+    const compiled_path& path,
+    size_t count);
+
+
+/// A value selected by a path with wildcards: the field of a message that holds
+/// it, and the index of the element if the field is repeated
+struct path_match {
+    const google::protobuf::Message *message;
+    const google::protobuf::FieldDescriptor *field;
+    int index;
+
+    /// The path that selects only this value, such as "$.phones[1].number"
+    std::string path;
+};
+
+
+/// Appends every value selected by a path compiled with SELECTS_MANY, in the
+/// order they appear in the message. A recursive descent looks for the field
+/// in each message before the messages inside it. Non-repeated fields that are
+/// not set are skipped if they are messages, and otherwise give their default
+/// values, as protobuf_extract would. The paths of the matches are only filled
+/// in if asked for.
+void match_path(const google::protobuf::Message& root,
+                const compiled_path& path,
+                bool with_paths,
+                std::vector<path_match> *matches);
+
+
+/// Sets the result to the value of a field of a parsed message. The index is
+/// ignored unless the field is repeated. Messages are returned serialized.
+void result_from_field(sqlite3_context *context,
+                       const google::protobuf::Message& message,
+                       const google::protobuf::FieldDescriptor *field,
+                       int index,
+                       bool enum_name);
+
+
+/// Sets the result to the default value of a non-repeated field that is not
+/// present in the message
+void result_from_default(sqlite3_context *context,
+                         const google::protobuf::FieldDescriptor *field,
+                         bool enum_name);
+
+
+/// Sets the result to a value found by the wire engine
+void result_from_wire(sqlite3_context *context,
+                      const google::protobuf::FieldDescriptor *field,
+                      const wire_value& value,
+                      bool enum_name);
+
+
+#endif
@@ -0,0 +1,85 @@
+#include <atomic>
+#include <climits>
+#include <mutex>
+#include <unordered_map>
+
+#include <dlfcn.h>
+
+#include "extractors.h"
+#include "path.h"
+
+using google::protobuf::Descriptor;
+using google::protobuf::DescriptorPool;
+
+
+static_assert(WIRE_FOUND == 0 && WIRE_DEFAULT == 1 && WIRE_NULL == 2
+              && WIRE_FALLBACK == 3,
+              "The generated extractors return these values");
+
+
+// The extractors of the libraries loaded so far, which any connection can use
+static std::mutex registry_mutex;
+static std::unordered_map<const Descriptor *, sqlite_protobuf_find> registry;
+static std::atomic<bool> any_registered(false);
+
+
+int register_extractors(void *handle)
+{
+    sqlite_protobuf_extractors_fn extractors =
+        reinterpret_cast<sqlite_protobuf_extractors_fn>(
+            dlsym(handle, SQLITE_PROTOBUF_EXTRACTORS_SYMBOL));
+    if (!extractors)
+        return 0;
+    size_t count = 0;
+    const sqlite_protobuf_extractor *list =
+        extractors(SQLITE_PROTOBUF_EXTRACTORS_VERSION, &count);
+    if (!list)
+        return 0;
+
+    // The generated code only knows the type by name, so it is only used for
+    // the type of that name compiled into the process
+    int registered = 0;
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (size_t i = 0; i < count; i ++) {
+        const Descriptor *type = DescriptorPool::generated_pool()
+            ->FindMessageTypeByName(list[i].type_name);
+        if (!type || !list[i].find)
+            continue;
+        registry[type] = list[i].find;
+        registered ++;
+    }
+    if (registered > 0)
+        any_registered.store(true, std::memory_order_release);
+    return registered;
+}
+
+
+sqlite_protobuf_find find_extractor(const Descriptor *type)
+{
+    if (!any_registered.load(std::memory_order_acquire))
+        return nullptr;
+    if (type->file()->pool() != DescriptorPool::generated_pool())
+        return nullptr;
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    auto found = registry.find(type);
+    return found == registry.end() ? nullptr : found->second;
+}
+
+
+wire_status extractor_find(const compiled_path& path,
+                           const uint8_t *data,
+                           size_t size,
+                           wire_value *value)
+{
+    if (size > INT_MAX)
+        return WIRE_FALLBACK;
+    sqlite_protobuf_value found = { 0, nullptr, 0 };
+    int status = path.extractor(data, size, path.steps.data(),
+        path.steps.size(), &found);
+    if (status < WIRE_FOUND || status > WIRE_FALLBACK)
+        return WIRE_FALLBACK;
+    value->bits = found.bits;
+    value->data = found.data;
+    value->size = found.size;
+    return static_cast<wire_status>(status);
+}
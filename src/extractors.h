@@ -0,0 +1,81 @@
+#ifndef EXTRACTORS_H
+#define EXTRACTORS_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <google/protobuf/descriptor.h>
+
+#include "wire.h"
+
+struct compiled_path;
+
+
+// The interface to the extractors that protoc-gen-sqlite_protobuf generates
+// into a library of message types. The generated code repeats these
+// declarations, since it is built without this project's headers, so they
+// must not change without a new version number.
+extern "C" {
+
+/// One element of a path: the field number and, for repeated fields, the index
+/// of the element, which may be negative
+struct sqlite_protobuf_step {
+    int32_t number;
+    int32_t index;
+};
+
+/// The same as wire_value
+struct sqlite_protobuf_value {
+    uint64_t bits;
+    const uint8_t *data;
+    size_t size;
+};
+
+/// Finds the value selected by a path of at least one step in a serialized
+/// message of one type. Returns a wire_status, and gives the same answers as
+/// wire_find, although it may fall back in more cases.
+typedef int (*sqlite_protobuf_find)(const uint8_t *data,
+                                    size_t size,
+                                    const sqlite_protobuf_step *path,
+                                    size_t count,
+                                    sqlite_protobuf_value *value);
+
+/// The extractor of a message type, by its full name
+struct sqlite_protobuf_extractor {
+    const char *type_name;
+    sqlite_protobuf_find find;
+};
+
+/// The function a library exports, which returns its extractors, or NULL if it
+/// does not support the version of the interface
+typedef const sqlite_protobuf_extractor *(*sqlite_protobuf_extractors_fn)(
+    int version, size_t *count);
+
+}
+
+#define SQLITE_PROTOBUF_EXTRACTORS_SYMBOL "sqlite_protobuf_extractors"
+#define SQLITE_PROTOBUF_EXTRACTORS_VERSION 1
+
+
+/// Registers the extractors exported by a library that was just loaded, if it
+/// has any, for every connection. Types are matched by name with those
+/// compiled into the process. Returns the number registered.
+int register_extractors(void *handle);
+
+
+/// Returns the extractor registered for a message type compiled into the
+/// process, or NULL. This takes a lock once any extractors are registered, so
+/// it is called when a path is compiled rather than for every row.
+sqlite_protobuf_find find_extractor(
+    const google::protobuf::Descriptor *type);
+
+
+/// Finds the value selected by a path with the extractor of its message type,
+/// which the path must have
+wire_status extractor_find(const compiled_path& path,
+                           const uint8_t *data,
+                           size_t size,
+                           wire_value *value);
+
+
+#endif
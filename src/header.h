@@ -3,16 +3,36 @@
 
 #include <sqlite3ext.h>
 
+struct connection;
+
 #define DECLARE_(X) \
     extern "C" \
     int register_##X(sqlite3 *db, \
                      char **pzErrMsg, \
-                     const sqlite3_api_routines *pApi)
+                     const sqlite3_api_routines *pApi, \
+                     connection *conn)
 
 
+DECLARE_(protobuf_array);
+DECLARE_(protobuf_compress);
+DECLARE_(protobuf_config);
+DECLARE_(protobuf_each);
 DECLARE_(protobuf_enum);
 DECLARE_(protobuf_extract);
+DECLARE_(protobuf_extract_all);
+DECLARE_(protobuf_extract_raw);
+DECLARE_(protobuf_fields);
+DECLARE_(protobuf_file);
+DECLARE_(protobuf_index);
 DECLARE_(protobuf_load);
+DECLARE_(protobuf_load_descriptors);
+DECLARE_(protobuf_match);
+DECLARE_(protobuf_remove);
+DECLARE_(protobuf_set);
+DECLARE_(protobuf_shred);
+DECLARE_(protobuf_stats);
+DECLARE_(protobuf_to_json);
+DECLARE_(protobuf_view);
 
 
 #endif
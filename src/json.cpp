@@ -0,0 +1,92 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "json.h"
+
+
+void json_append_string(std::string *output, const char *data, size_t size)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    output->push_back('"');
+    const char *run = data;
+    const char *end = data + size;
+    for (const char *p = data; p < end; p ++) {
+        unsigned char c = static_cast<unsigned char>(*p);
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        // Copy the characters that need no escaping in one go
+        output->append(run, p - run);
+        run = p + 1;
+        switch (c) {
+        case '"':  output->append("\\\""); break;
+        case '\\': output->append("\\\\"); break;
+        case '\b': output->append("\\b"); break;
+        case '\f': output->append("\\f"); break;
+        case '\n': output->append("\\n"); break;
+        case '\r': output->append("\\r"); break;
+        case '\t': output->append("\\t"); break;
+        default:
+            output->append("\\u00");
+            output->push_back(hex[c >> 4]);
+            output->push_back(hex[c & 0xf]);
+        }
+    }
+    output->append(run, end - run);
+    output->push_back('"');
+}
+
+
+void json_append_base64(std::string *output, const void *data, size_t size)
+{
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    output->push_back('"');
+    size_t i = 0;
+    for (; i + 3 <= size; i += 3) {
+        unsigned int group = bytes[i] << 16 | bytes[i + 1] << 8 | bytes[i + 2];
+        output->push_back(alphabet[group >> 18]);
+        output->push_back(alphabet[group >> 12 & 0x3f]);
+        output->push_back(alphabet[group >> 6 & 0x3f]);
+        output->push_back(alphabet[group & 0x3f]);
+    }
+    if (i < size) {
+        unsigned int group = bytes[i] << 16
+            | (i + 1 < size ? bytes[i + 1] << 8 : 0);
+        output->push_back(alphabet[group >> 18]);
+        output->push_back(alphabet[group >> 12 & 0x3f]);
+        output->push_back(i + 1 < size ? alphabet[group >> 6 & 0x3f] : '=');
+        output->push_back('=');
+    }
+    output->push_back('"');
+}
+
+
+void json_append_double(std::string *output, double value)
+{
+    if (std::isnan(value)) {
+        output->append("null");
+        return;
+    }
+    if (std::isinf(value)) {
+        output->append(value < 0 ? "-9.0e+999" : "9.0e+999");
+        return;
+    }
+
+    // Use the fewest digits that give back the same value
+    char buffer[32];
+    for (int precision = 15; precision <= 17; precision ++) {
+        snprintf(buffer, sizeof(buffer), "%.*g", precision, value);
+        if (precision == 17 || strtod(buffer, nullptr) == value)
+            break;
+    }
+    output->append(buffer);
+    if (!strpbrk(buffer, ".e"))
+        output->append(".0");
+}
@@ -0,0 +1,24 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <cstddef>
+#include <string>
+
+
+/// Appends a JSON string literal with the contents of some UTF-8 text
+void json_append_string(std::string *output, const char *data, size_t size);
+
+
+/// Appends bytes as a JSON string literal in base64, the encoding the Protobuf
+/// JSON mapping uses for bytes fields
+void json_append_base64(std::string *output, const void *data, size_t size);
+
+
+/// Appends a JSON number that converts back to the same double. It always has
+/// a decimal point or exponent, so SQLite reads it back as a real number.
+/// Infinities are written as out of range numbers, as SQLite does, and NaN as
+/// null.
+void json_append_double(std::string *output, double value);
+
+
+#endif
@@ -0,0 +1,690 @@
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <set>
+#include <string>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/stubs/strutil.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include "json.h"
+#include "json_writer.h"
+#include "wire.h"
+
+using google::protobuf::Descriptor;
+using google::protobuf::EnumDescriptor;
+using google::protobuf::EnumValueDescriptor;
+using google::protobuf::FieldDescriptor;
+using google::protobuf::FileDescriptor;
+using google::protobuf::OneofDescriptor;
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::internal::WireFormatLite;
+
+
+/// Messages nested deeper than this are left to the parser, which has its own
+/// recursion limit
+static const size_t MAX_DEPTH = 100;
+
+
+json_options::json_options()
+    : always_print_primitive_fields(false)
+    , always_print_enums_as_ints(false)
+    , preserve_proto_field_names(false)
+{
+}
+
+
+bool json_options::parse(const std::string& names)
+{
+    size_t start = 0;
+    while (start <= names.length()) {
+        size_t end = names.find(',', start);
+        if (end == std::string::npos)
+            end = names.length();
+
+        size_t first = names.find_first_not_of(" \t", start);
+        size_t last = names.find_last_not_of(" \t", end - 1);
+        std::string name;
+        if (first < end && last != std::string::npos && last >= first)
+            name = names.substr(first, last - first + 1);
+
+        if (name == "always_print_primitive_fields")
+            always_print_primitive_fields = true;
+        else if (name == "always_print_enums_as_ints")
+            always_print_enums_as_ints = true;
+        else if (name == "preserve_proto_field_names")
+            preserve_proto_field_names = true;
+        else if (!name.empty())
+            return false;
+        start = end + 1;
+    }
+    return true;
+}
+
+
+/// Returns true if messages of this type, and of every type inside them, can
+/// be written from the wire format. Well-known types have JSON forms of their
+/// own, groups are not length-delimited, extensions are written by their full
+/// names, and a missing required field makes the parse fail.
+static bool can_stream(const Descriptor *type,
+                       std::set<const Descriptor *> *visited)
+{
+    if (!visited->insert(type).second)
+        return true;
+    if (type->file()->package() == "google.protobuf"
+            || type->extension_range_count() > 0)
+        return false;
+
+    for (int i = 0; i < type->field_count(); i ++) {
+        const FieldDescriptor *field = type->field(i);
+        if (field->is_required()
+                || field->type() == FieldDescriptor::TYPE_GROUP)
+            return false;
+        const EnumDescriptor *enum_type = field->enum_type();
+        if (enum_type && enum_type->full_name() == "google.protobuf.NullValue")
+            return false;
+        const Descriptor *message_type = field->message_type();
+        if (message_type && !can_stream(message_type, visited))
+            return false;
+    }
+    return true;
+}
+
+
+/// Returns true if a proto3 field without presence holds its default value,
+/// and so is not written
+static bool is_zero(const FieldDescriptor *field, const wire_value& value)
+{
+    switch (field->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_STRING:
+        return value.size == 0;
+    case FieldDescriptor::CPPTYPE_FLOAT:
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+        // Negative zero is written, as it is not the default
+        return value.bits == 0;
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+        return false;
+    default:
+        return value.bits == 0;
+    }
+}
+
+
+const json_writer::type_plan& json_writer::plan(const Descriptor *type)
+{
+    std::unique_ptr<type_plan>& entry = plans[type];
+    if (entry)
+        return *entry;
+    entry.reset(new type_plan);
+    type_plan& plan = *entry;
+
+    std::set<const Descriptor *> visited;
+    plan.streamable = can_stream(type, &visited);
+    plan.oneofs = type->oneof_decl_count();
+
+    std::vector<const FieldDescriptor *> fields;
+    for (int i = 0; i < type->field_count(); i ++)
+        fields.push_back(type->field(i));
+    std::sort(fields.begin(), fields.end(),
+        [](const FieldDescriptor *a, const FieldDescriptor *b) {
+            return a->number() < b->number();
+        });
+
+    int max_number = 0;
+    for (const FieldDescriptor *field : fields) {
+        field_plan field_plan;
+        field_plan.field = field;
+        json_append_string(&field_plan.json_key, field->json_name().data(),
+            field->json_name().length());
+        field_plan.json_key.push_back(':');
+        json_append_string(&field_plan.proto_key, field->name().data(),
+            field->name().length());
+        field_plan.proto_key.push_back(':');
+
+        field_plan.wire_type = WireFormatLite::WireTypeForFieldType(
+            static_cast<WireFormatLite::FieldType>(field->type()));
+        field_plan.packable = field->is_packable();
+        field_plan.closed_enum = field->enum_type()
+            && field->enum_type()->file()->syntax()
+                != FileDescriptor::SYNTAX_PROTO3;
+        field_plan.implicit_presence = !field->is_repeated()
+            && !field->has_presence();
+        field_plan.print_default = field->is_repeated()
+            || (!field->message_type() && !field->containing_oneof());
+
+        const OneofDescriptor *oneof = field->real_containing_oneof();
+        field_plan.oneof = oneof ? oneof->index() : -1;
+
+        plan.fields.push_back(field_plan);
+        max_number = std::max(max_number, field->number());
+    }
+
+    // Most messages number their fields densely enough for a lookup table
+    if (max_number <= 1024) {
+        plan.slots.assign(max_number + 1, 0);
+        for (size_t i = 0; i < plan.fields.size(); i ++) {
+            int number = plan.fields[i].field->number();
+            plan.slots[number] = static_cast<int>(i) + 1;
+        }
+    }
+    return plan;
+}
+
+
+int json_writer::find_slot(const type_plan& type, int number) const
+{
+    if (!type.slots.empty()) {
+        if (number < static_cast<int>(type.slots.size()))
+            return type.slots[number] - 1;
+        return -1;
+    }
+
+    auto it = std::lower_bound(type.fields.begin(), type.fields.end(), number,
+        [](const field_plan& field, int number) {
+            return field.field->number() < number;
+        });
+    if (it == type.fields.end() || it->field->number() != number)
+        return -1;
+    return static_cast<int>(it - type.fields.begin());
+}
+
+
+bool json_writer::write(const Descriptor *type,
+                        const uint8_t *data,
+                        size_t size,
+                        const json_options& options)
+{
+    this->options = options;
+    output.clear();
+
+    const type_plan& root = plan(type);
+    if (!root.streamable || size > INT_MAX)
+        return false;
+    return write_message(root, data, size, 0);
+}
+
+
+/// Writes a message in two passes. The first finds the values of each field,
+/// which may be spread across the message, and the second writes them.
+bool json_writer::write_message(const type_plan& type,
+                                const uint8_t *data,
+                                size_t size,
+                                size_t depth)
+{
+    if (depth >= MAX_DEPTH)
+        return false;
+    if (levels.size() <= depth)
+        levels.resize(depth + 1);
+    level& scratch = levels[depth];
+    scratch.found.clear();
+    scratch.oneof_cases.assign(type.oneofs, 0);
+
+    CodedInputStream input(data, static_cast<int>(size));
+    bool sorted = true;
+    while (uint32_t tag = input.ReadTag()) {
+        int slot = find_slot(type, WireFormatLite::GetTagFieldNumber(tag));
+        if (slot < 0) {
+            if (!wire_skip_field(input, tag))
+                return false;
+            continue;
+        }
+
+        const field_plan& field = type.fields[slot];
+        WireFormatLite::WireType tag_type = WireFormatLite::GetTagWireType(tag);
+        occurrence found = { slot, false, wire_value() };
+        if (tag_type == field.wire_type) {
+            if (!wire_read_value(input, data, tag_type, &found.value))
+                return false;
+            if (field.closed_enum
+                    && !wire_accepts_value(field.field, found.value.bits))
+                continue;
+        } else if (field.packable
+                   && tag_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+            if (!wire_read_value(input, data, tag_type, &found.value))
+                return false;
+            found.packed = true;
+        } else {
+            // The parser keeps a value of the wrong wire type as an unknown
+            // field
+            if (!wire_skip_field(input, tag))
+                return false;
+            continue;
+        }
+
+        if (field.oneof >= 0)
+            scratch.oneof_cases[field.oneof] = field.field->number();
+        if (!scratch.found.empty() && scratch.found.back().slot > slot)
+            sorted = false;
+        scratch.found.push_back(found);
+    }
+    if (!input.ConsumedEntireMessage()
+            || input.CurrentPosition() != static_cast<int>(size))
+        return false;
+
+    // Serializers write fields in order, so this is rarely needed
+    if (!sorted)
+        std::stable_sort(scratch.found.begin(), scratch.found.end(),
+            [](const occurrence& a, const occurrence& b) {
+                return a.slot < b.slot;
+            });
+
+    output.push_back('{');
+    bool first = true;
+    size_t i = 0;
+    if (options.always_print_primitive_fields) {
+        for (size_t slot = 0; slot < type.fields.size(); slot ++) {
+            size_t begin = i;
+            while (i < scratch.found.size()
+                    && scratch.found[i].slot == static_cast<int>(slot))
+                i ++;
+            if (!write_field(type, slot, begin, i, depth, &first))
+                return false;
+        }
+    } else {
+        while (i < scratch.found.size()) {
+            size_t begin = i;
+            int slot = scratch.found[i].slot;
+            while (i < scratch.found.size() && scratch.found[i].slot == slot)
+                i ++;
+            if (!write_field(type, slot, begin, i, depth, &first))
+                return false;
+        }
+    }
+    output.push_back('}');
+    return true;
+}
+
+
+/// Writes a field from the values found for it, from begin to end in the
+/// scratch space of the message. Nothing is written if the field is not
+/// present and its default is not to be written.
+bool json_writer::write_field(const type_plan& type,
+                              size_t slot,
+                              size_t begin,
+                              size_t end,
+                              size_t depth,
+                              bool *first)
+{
+    const field_plan& field = type.fields[slot];
+    bool print_default = options.always_print_primitive_fields
+        && field.print_default;
+
+    // The key is written first, and taken back if there turns out to be no
+    // value
+    size_t mark = output.length();
+    if (!*first)
+        output.push_back(',');
+    output.append(options.preserve_proto_field_names
+        ? field.proto_key : field.json_key);
+
+    bool empty = false;
+    if (field.field->is_map()) {
+        if (!write_map(field, begin, end, depth, &empty))
+            return false;
+    } else if (field.field->is_repeated()) {
+        if (!write_repeated(field, begin, end, depth, &empty))
+            return false;
+    } else {
+        // The parser keeps the last value, unless another member of the oneof
+        // came after it
+        const level& scratch = levels[depth];
+        const occurrence *last =
+            begin < end ? &scratch.found[end - 1] : nullptr;
+        if (last && field.oneof >= 0
+                && scratch.oneof_cases[field.oneof] != field.field->number())
+            last = nullptr;
+
+        // Several occurrences of a message are merged into one
+        if (last && field.field->message_type() && end - begin > 1)
+            return false;
+        if (last && field.implicit_presence
+                && is_zero(field.field, last->value))
+            last = nullptr;
+
+        if (last) {
+            if (!write_value(field.field, last->value, depth))
+                return false;
+        } else if (print_default) {
+            write_default(field.field);
+        } else {
+            empty = true;
+            print_default = false;
+        }
+    }
+
+    if (empty && !print_default) {
+        output.resize(mark);
+        return true;
+    }
+    *first = false;
+    return true;
+}
+
+
+bool json_writer::write_repeated(const field_plan& field,
+                                 size_t begin,
+                                 size_t end,
+                                 size_t depth,
+                                 bool *empty)
+{
+    output.push_back('[');
+    size_t count = 0;
+    for (size_t i = begin; i < end; i ++) {
+        const occurrence& found = levels[depth].found[i];
+        if (!found.packed) {
+            if (count ++)
+                output.push_back(',');
+            if (!write_value(field.field, found.value, depth))
+                return false;
+            continue;
+        }
+
+        CodedInputStream elements(found.value.data,
+            static_cast<int>(found.value.size));
+        while (elements.BytesUntilLimit() > 0) {
+            wire_value value = wire_value();
+            if (!wire_read_value(elements, found.value.data, field.wire_type,
+                                 &value))
+                return false;
+            if (field.closed_enum
+                    && !wire_accepts_value(field.field, value.bits))
+                continue;
+            if (count ++)
+                output.push_back(',');
+            if (!write_value(field.field, value, depth))
+                return false;
+        }
+    }
+    output.push_back(']');
+    *empty = count == 0;
+    return true;
+}
+
+
+/// Writes a map from its entries, each of which is a message with the key in
+/// field 1 and the value in field 2. When a key is repeated, the last entry
+/// wins.
+bool json_writer::write_map(const field_plan& field,
+                            size_t begin,
+                            size_t end,
+                            size_t depth,
+                            bool *empty)
+{
+    const Descriptor *entry_type = field.field->message_type();
+    const FieldDescriptor *key_field = entry_type->map_key();
+    const FieldDescriptor *value_field = entry_type->map_value();
+    WireFormatLite::WireType key_type = WireFormatLite::WireTypeForFieldType(
+        static_cast<WireFormatLite::FieldType>(key_field->type()));
+    WireFormatLite::WireType value_type = WireFormatLite::WireTypeForFieldType(
+        static_cast<WireFormatLite::FieldType>(value_field->type()));
+
+    std::vector<map_entry>& entries = levels[depth].entries;
+    entries.clear();
+    for (size_t i = begin; i < end; i ++) {
+        const wire_value& found = levels[depth].found[i].value;
+
+        map_entry entry = { wire_value(), wire_value(), false };
+        entry.key.data = reinterpret_cast<const uint8_t *>("");
+        entry.value.data = entry.key.data;
+        int values = 0;
+
+        CodedInputStream input(found.data, static_cast<int>(found.size));
+        while (uint32_t tag = input.ReadTag()) {
+            int number = WireFormatLite::GetTagFieldNumber(tag);
+            WireFormatLite::WireType tag_type =
+                WireFormatLite::GetTagWireType(tag);
+            if (number == 1 && tag_type == key_type) {
+                if (!wire_read_value(input, found.data, tag_type, &entry.key))
+                    return false;
+            } else if (number == 2 && tag_type == value_type) {
+                if (!wire_read_value(input, found.data, tag_type, &entry.value))
+                    return false;
+                entry.has_value = true;
+                values ++;
+            } else if (!wire_skip_field(input, tag)) {
+                return false;
+            }
+        }
+        if (!input.ConsumedEntireMessage()
+                || input.CurrentPosition() != static_cast<int>(found.size))
+            return false;
+        if (values > 1 && value_field->message_type())
+            return false;
+        if (!wire_accepts_string(key_field, entry.key))
+            return false;
+
+        // An entry with an undefined value of a closed enum is kept as an
+        // unknown field
+        if (entry.has_value
+                && !wire_accepts_value(value_field, entry.value.bits))
+            continue;
+        entries.push_back(entry);
+    }
+
+    // Sorting the entries by key puts the one that wins last among its equals
+    FieldDescriptor::CppType key_cpp_type = key_field->cpp_type();
+    auto less = [&](const map_entry& a, const map_entry& b) {
+        if (key_cpp_type == FieldDescriptor::CPPTYPE_STRING) {
+            int order = memcmp(a.key.data, b.key.data,
+                std::min(a.key.size, b.key.size));
+            return order < 0 || (order == 0 && a.key.size < b.key.size);
+        }
+        if (key_cpp_type == FieldDescriptor::CPPTYPE_BOOL)
+            return a.key.bits == 0 && b.key.bits != 0;
+        if (key_cpp_type == FieldDescriptor::CPPTYPE_UINT64)
+            return a.key.bits < b.key.bits;
+        return wire_decode_int(key_field, a.key.bits)
+            < wire_decode_int(key_field, b.key.bits);
+    };
+    std::stable_sort(entries.begin(), entries.end(), less);
+
+    output.push_back('{');
+    size_t count = 0;
+    for (size_t i = 0; i < entries.size(); i ++) {
+        const map_entry& entry = entries[i];
+        if (i + 1 < entries.size() && !less(entry, entries[i + 1]))
+            continue;
+
+        if (count ++)
+            output.push_back(',');
+        write_map_key(key_field, entry.key);
+        output.push_back(':');
+        if (entry.has_value) {
+            if (!write_value(value_field, entry.value, depth))
+                return false;
+        } else if (value_field->message_type()) {
+            if (!write_message(plan(value_field->message_type()),
+                               entry.value.data, 0, depth + 1))
+                return false;
+        } else {
+            write_default(value_field);
+        }
+    }
+    output.push_back('}');
+    *empty = count == 0;
+    return true;
+}
+
+
+/// Writes the key of a map entry, which is always a JSON string
+void json_writer::write_map_key(const FieldDescriptor *field,
+                                const wire_value& key)
+{
+    char buffer[google::protobuf::kFastToBufferSize];
+    switch (field->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_STRING:
+        json_append_string(&output, reinterpret_cast<const char *>(key.data),
+            key.size);
+        return;
+    case FieldDescriptor::CPPTYPE_BOOL:
+        output.append(key.bits ? "\"true\"" : "\"false\"");
+        return;
+    case FieldDescriptor::CPPTYPE_UINT64:
+        output.push_back('"');
+        output.append(buffer, google::protobuf::FastUInt64ToBufferLeft(
+            key.bits, buffer) - buffer);
+        output.push_back('"');
+        return;
+    default:
+        output.push_back('"');
+        output.append(buffer, google::protobuf::FastInt64ToBufferLeft(
+            wire_decode_int(field, key.bits), buffer) - buffer);
+        output.push_back('"');
+        return;
+    }
+}
+
+
+bool json_writer::write_value(const FieldDescriptor *field,
+                              const wire_value& value,
+                              size_t depth)
+{
+    char buffer[google::protobuf::kFastToBufferSize];
+    switch (field->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32:
+    case FieldDescriptor::CPPTYPE_UINT32:
+        output.append(buffer, google::protobuf::FastInt64ToBufferLeft(
+            wire_decode_int(field, value.bits), buffer) - buffer);
+        return true;
+    case FieldDescriptor::CPPTYPE_INT64:
+        // 64-bit integers are quoted, as JSON parsers may not keep every digit
+        output.push_back('"');
+        output.append(buffer, google::protobuf::FastInt64ToBufferLeft(
+            wire_decode_int(field, value.bits), buffer) - buffer);
+        output.push_back('"');
+        return true;
+    case FieldDescriptor::CPPTYPE_UINT64:
+        output.push_back('"');
+        output.append(buffer, google::protobuf::FastUInt64ToBufferLeft(
+            value.bits, buffer) - buffer);
+        output.push_back('"');
+        return true;
+    case FieldDescriptor::CPPTYPE_BOOL:
+        output.append(value.bits ? "true" : "false");
+        return true;
+    case FieldDescriptor::CPPTYPE_FLOAT:
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+        write_real(wire_decode_double(field, value.bits),
+            field->cpp_type() == FieldDescriptor::CPPTYPE_FLOAT);
+        return true;
+    case FieldDescriptor::CPPTYPE_ENUM:
+        write_enum(field->enum_type(), static_cast<int32_t>(value.bits));
+        return true;
+    case FieldDescriptor::CPPTYPE_STRING:
+        if (field->type() == FieldDescriptor::TYPE_BYTES) {
+            json_append_base64(&output, value.data, value.size);
+            return true;
+        }
+        if (!wire_accepts_string(field, value))
+            return false;
+        json_append_string(&output, reinterpret_cast<const char *>(value.data),
+            value.size);
+        return true;
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+        return write_message(plan(field->message_type()), value.data,
+            value.size, depth + 1);
+    }
+    return false;
+}
+
+
+/// Writes the default value of a field that is not present
+void json_writer::write_default(const FieldDescriptor *field)
+{
+    if (field->is_map()) {
+        output.append("{}");
+        return;
+    }
+    if (field->is_repeated()) {
+        output.append("[]");
+        return;
+    }
+
+    char buffer[google::protobuf::kFastToBufferSize];
+    switch (field->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32:
+        output.append(buffer, google::protobuf::FastInt64ToBufferLeft(
+            field->default_value_int32(), buffer) - buffer);
+        break;
+    case FieldDescriptor::CPPTYPE_UINT32:
+        output.append(buffer, google::protobuf::FastUInt64ToBufferLeft(
+            field->default_value_uint32(), buffer) - buffer);
+        break;
+    case FieldDescriptor::CPPTYPE_INT64:
+        output.push_back('"');
+        output.append(buffer, google::protobuf::FastInt64ToBufferLeft(
+            field->default_value_int64(), buffer) - buffer);
+        output.push_back('"');
+        break;
+    case FieldDescriptor::CPPTYPE_UINT64:
+        output.push_back('"');
+        output.append(buffer, google::protobuf::FastUInt64ToBufferLeft(
+            field->default_value_uint64(), buffer) - buffer);
+        output.push_back('"');
+        break;
+    case FieldDescriptor::CPPTYPE_BOOL:
+        output.append(field->default_value_bool() ? "true" : "false");
+        break;
+    case FieldDescriptor::CPPTYPE_FLOAT:
+        write_real(field->default_value_float(), true);
+        break;
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+        write_real(field->default_value_double(), false);
+        break;
+    case FieldDescriptor::CPPTYPE_ENUM:
+        write_enum(field->enum_type(), field->default_value_enum()->number());
+        break;
+    case FieldDescriptor::CPPTYPE_STRING:
+        if (field->type() == FieldDescriptor::TYPE_BYTES)
+            json_append_base64(&output, field->default_value_string().data(),
+                field->default_value_string().length());
+        else
+            json_append_string(&output, field->default_value_string().data(),
+                field->default_value_string().length());
+        break;
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+        output.append("null");
+        break;
+    }
+}
+
+
+/// Writes a real number the way the JSON mapping does: floats with as few
+/// digits as still give the same float, and infinities and NaN as strings
+void json_writer::write_real(double value, bool is_float)
+{
+    if (std::isnan(value)) {
+        output.append("\"NaN\"");
+    } else if (std::isinf(value)) {
+        output.append(value > 0 ? "\"Infinity\"" : "\"-Infinity\"");
+    } else if (is_float) {
+        char buffer[google::protobuf::kFloatToBufferSize];
+        output.append(google::protobuf::FloatToBuffer(
+            static_cast<float>(value), buffer));
+    } else {
+        char buffer[google::protobuf::kDoubleToBufferSize];
+        output.append(google::protobuf::DoubleToBuffer(value, buffer));
+    }
+}
+
+
+/// Writes an enum value by name, or by number if that is asked for or if the
+/// value is not defined, as in an open enum
+void json_writer::write_enum(const EnumDescriptor *type, int number)
+{
+    if (!options.always_print_enums_as_ints) {
+        const EnumValueDescriptor *value = type->FindValueByNumber(number);
+        if (value) {
+            json_append_string(&output, value->name().data(),
+                value->name().length());
+            return;
+        }
+    }
+
+    char buffer[google::protobuf::kFastToBufferSize];
+    output.append(buffer,
+        google::protobuf::FastInt32ToBufferLeft(number, buffer) - buffer);
+}
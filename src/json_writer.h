@@ -0,0 +1,156 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include "wire.h"
+
+
+/// The options of protobuf_to_json, which have the same meaning as those of
+/// util::JsonPrintOptions
+struct json_options {
+    bool always_print_primitive_fields;
+    bool always_print_enums_as_ints;
+    bool preserve_proto_field_names;
+
+    json_options();
+
+    /// Sets the options named in a comma-separated list. Returns false if a
+    /// name is not recognized.
+    bool parse(const std::string& names);
+};
+
+
+/// Writes serialized messages as JSON, in the Protobuf JSON mapping that
+/// util::MessageToJsonString uses, reading the values straight from the wire
+/// format instead of parsing the message first. Each connection has one, so
+/// its output buffer and its plan for each message type are reused.
+///
+/// Fields are written in the order of their numbers, and the entries of a map
+/// in the order of their keys.
+struct json_writer {
+    /// The JSON written for the last message
+    std::string output;
+
+    /// Writes the message into output, replacing what was there. Returns false
+    /// if the message needs a full parse instead: if it is malformed, or uses
+    /// a feature that is not emulated here, such as well-known types with
+    /// their own JSON form or message fields that are merged from several
+    /// occurrences.
+    bool write(const google::protobuf::Descriptor *type,
+               const uint8_t *data,
+               size_t size,
+               const json_options& options);
+
+private:
+    /// How to write a field, worked out once per message type
+    struct field_plan {
+        const google::protobuf::FieldDescriptor *field;
+
+        /// The key, quoted and followed by a colon, with the JSON name and
+        /// with the name from the .proto file
+        std::string json_key;
+        std::string proto_key;
+
+        google::protobuf::internal::WireFormatLite::WireType wire_type;
+        bool packable;
+        bool closed_enum;
+
+        /// True if a proto3 field without presence, which is not written if
+        /// it has its default value
+        bool implicit_presence;
+
+        /// True if always_print_primitive_fields writes the field when it is
+        /// not present
+        bool print_default;
+
+        /// The index of the containing oneof, or -1
+        int oneof;
+    };
+
+    struct type_plan {
+        /// False if a message of this type, or one inside it, has to be
+        /// written from a full parse
+        bool streamable;
+
+        /// The fields in order of their numbers, and the index in fields of
+        /// each field number, plus one, if the numbers are small enough
+        std::vector<field_plan> fields;
+        std::vector<int> slots;
+
+        int oneofs;
+    };
+
+    /// A value of a field found in a message, or a packed run of values
+    struct occurrence {
+        int slot;
+        bool packed;
+        wire_value value;
+    };
+
+    /// A key and value of a map
+    struct map_entry {
+        wire_value key;
+        wire_value value;
+        bool has_value;
+    };
+
+    /// Scratch space for the message being written at each depth
+    struct level {
+        std::vector<occurrence> found;
+        std::vector<int> oneof_cases;
+        std::vector<map_entry> entries;
+    };
+
+    const type_plan& plan(const google::protobuf::Descriptor *type);
+    int find_slot(const type_plan& type, int number) const;
+
+    bool write_message(const type_plan& type,
+                       const uint8_t *data,
+                       size_t size,
+                       size_t depth);
+    bool write_field(const type_plan& type,
+                     size_t slot,
+                     size_t begin,
+                     size_t end,
+                     size_t depth,
+                     bool *first);
+    bool write_repeated(const field_plan& field,
+                        size_t begin,
+                        size_t end,
+                        size_t depth,
+                        bool *empty);
+    bool write_map(const field_plan& field,
+                   size_t begin,
+                   size_t end,
+                   size_t depth,
+                   bool *empty);
+    void write_map_key(const google::protobuf::FieldDescriptor *field,
+                       const wire_value& key);
+    bool write_value(const google::protobuf::FieldDescriptor *field,
+                     const wire_value& value,
+                     size_t depth);
+    void write_default(const google::protobuf::FieldDescriptor *field);
+    void write_real(double value, bool is_float);
+    void write_enum(const google::protobuf::EnumDescriptor *type, int number);
+
+    json_options options;
+    std::unordered_map<const google::protobuf::Descriptor *,
+                       std::unique_ptr<type_plan>> plans;
+
+    // A deque, so that the scratch space of a message stays put while the
+    // messages inside it are written
+    std::deque<level> levels;
+};
+
+
+#endif
@@ -0,0 +1,180 @@
+#include <atomic>
+#include <climits>
+#include <vector>
+
+#include <google/protobuf/descriptor.pb.h>
+
+#include "loaded_descriptors.h"
+
+using google::protobuf::Descriptor;
+using google::protobuf::DescriptorPool;
+using google::protobuf::EnumDescriptor;
+using google::protobuf::FileDescriptorProto;
+using google::protobuf::FileDescriptorSet;
+
+
+// Bumped each time a library is loaded into the process
+static std::atomic<uint64_t> generated_generation(0);
+
+// The most names a connection caches before starting over, which bounds the
+// memory held for names that were looked up and not found
+static const size_t MAX_CACHED_TYPES = 4096;
+
+
+loaded_descriptors::database::database()
+    : generated(*DescriptorPool::generated_pool())
+{
+}
+
+
+bool loaded_descriptors::database::FindFileByName(
+    const std::string& filename,
+    FileDescriptorProto *output)
+{
+    return loaded.FindFileByName(filename, output)
+        || generated.FindFileByName(filename, output);
+}
+
+
+bool loaded_descriptors::database::FindFileContainingSymbol(
+    const std::string& symbol_name,
+    FileDescriptorProto *output)
+{
+    // Types compiled into the process are looked up in their own pool, so
+    // that they are not built a second time here
+    return loaded.FindFileContainingSymbol(symbol_name, output);
+}
+
+
+bool loaded_descriptors::database::FindFileContainingExtension(
+    const std::string& containing_type,
+    int field_number,
+    FileDescriptorProto *output)
+{
+    return loaded.FindFileContainingExtension(containing_type, field_number,
+        output);
+}
+
+
+loaded_descriptors::loaded_descriptors()
+    : pool(&db), generation(generated_generation.load()), file_loads(0)
+{
+}
+
+
+void loaded_descriptors::generated_types_changed()
+{
+    generated_generation.fetch_add(1);
+}
+
+
+int loaded_descriptors::add_file_set(const void *data,
+                                     size_t size,
+                                     std::string *error_msg)
+{
+    std::string set(static_cast<const char *>(data ? data : ""), size);
+    if (sets.count(set))
+        return 0;
+
+    FileDescriptorSet file_set;
+    if (size > INT_MAX || !file_set.ParseFromString(set)) {
+        *error_msg = "Could not parse FileDescriptorSet";
+        return -1;
+    }
+
+    // Check every file before adding any of them
+    std::vector<std::pair<std::string, std::string>> added;
+    for (const FileDescriptorProto& file : file_set.file()) {
+        std::string contents = file.SerializeAsString();
+        auto existing = files.find(file.name());
+        if (existing == files.end()) {
+            added.emplace_back(file.name(), contents);
+        } else if (existing->second != contents) {
+            *error_msg = "File \"" + file.name()
+                + "\" was already loaded with different contents";
+            return -1;
+        }
+    }
+
+    size_t loaded = 0;
+    for (auto& file : added) {
+        if (!db.loaded.AddCopy(file.second.data(),
+                               static_cast<int>(file.second.size()))) {
+            *error_msg = "Could not load file \"" + file.first + "\"";
+            break;
+        }
+        files.insert(file);
+        loaded ++;
+    }
+
+    // A loaded type may hide one that was found before, or be one that was
+    // not, even if a later file in the set could not be loaded
+    if (loaded) {
+        message_types.clear();
+        enum_types.clear();
+        file_loads ++;
+    }
+    if (loaded < added.size())
+        return -1;
+
+    sets.insert(set);
+    return static_cast<int>(added.size());
+}
+
+
+bool loaded_descriptors::is_loaded(const std::string& name)
+{
+    std::string filename;
+    return db.loaded.FindNameOfFileContainingSymbol(name, &filename);
+}
+
+
+void loaded_descriptors::check_caches()
+{
+    uint64_t current = generated_generation.load(std::memory_order_acquire);
+    if (current != generation
+            || message_types.size() + enum_types.size() >= MAX_CACHED_TYPES) {
+        message_types.clear();
+        enum_types.clear();
+        generation = current;
+    }
+}
+
+
+uint64_t loaded_descriptors::version() const
+{
+    // Both counts only go up, so their sum changes when either does
+    return generated_generation.load(std::memory_order_acquire) + file_loads;
+}
+
+
+const Descriptor *loaded_descriptors::find_message_type(
+    const std::string& name)
+{
+    check_caches();
+    auto cached = message_types.find(name);
+    if (cached != message_types.end())
+        return cached->second;
+
+    const Descriptor *type = is_loaded(name)
+        ? pool.FindMessageTypeByName(name)
+        : DescriptorPool::generated_pool()->FindMessageTypeByName(name);
+    message_types.emplace(name, type);
+    return type;
+}
+
+
+const EnumDescriptor *loaded_descriptors::find_enum_type(
+    const std::string& name)
+{
+    check_caches();
+    auto cached = enum_types.find(name);
+    if (cached != enum_types.end())
+        return cached->second;
+
+    const EnumDescriptor *type = is_loaded(name)
+        ? pool.FindEnumTypeByName(name)
+        : DescriptorPool::generated_pool()->FindEnumTypeByName(name);
+    enum_types.emplace(name, type);
+    return type;
+}
@@ -0,0 +1,97 @@
+#ifndef LOADED_DESCRIPTORS_H
+#define LOADED_DESCRIPTORS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor_database.h>
+
+
+/// Message types loaded from serialized FileDescriptorSets, such as one kept in
+/// a table, for use on a single connection. Loading a file only indexes the
+/// names it defines; its descriptors are built the first time one of its types
+/// is looked up.
+///
+/// Types compiled into the process, such as those in a library loaded with
+/// protobuf_load, are found too. Loaded types take precedence.
+///
+/// Each type is looked up in a pool once, after which it is found in a cache of
+/// its own, since the pools take a lock shared by every connection. A
+/// connection is only used by one thread at a time, so the cache needs none.
+struct loaded_descriptors {
+    loaded_descriptors();
+
+    /// Makes every connection forget the types it could not find, after a
+    /// library may have added types to the process
+    static void generated_types_changed();
+
+    /// Adds the files in a serialized FileDescriptorSet. Files that were
+    /// loaded before with the same contents are skipped. Returns the number of
+    /// files added, or -1 and sets error_msg if the set cannot be parsed or a
+    /// file conflicts with one loaded before.
+    int add_file_set(const void *data, size_t size, std::string *error_msg);
+
+    /// Returns the message type with the given full name, or NULL
+    const google::protobuf::Descriptor *find_message_type(
+        const std::string& name);
+
+    /// Returns the enum type with the given full name, or NULL
+    const google::protobuf::EnumDescriptor *find_enum_type(
+        const std::string& name);
+
+    /// Returns a number that changes whenever a name may find a different
+    /// type than before, so that callers can keep what they found until then
+    uint64_t version() const;
+
+private:
+    /// The files that were loaded, and the files compiled into the process,
+    /// which loaded files can import
+    struct database : google::protobuf::DescriptorDatabase {
+        google::protobuf::EncodedDescriptorDatabase loaded;
+        google::protobuf::DescriptorPoolDatabase generated;
+
+        database();
+        bool FindFileByName(const std::string& filename,
+            google::protobuf::FileDescriptorProto *output) override;
+        bool FindFileContainingSymbol(const std::string& symbol_name,
+            google::protobuf::FileDescriptorProto *output) override;
+        bool FindFileContainingExtension(const std::string& containing_type,
+            int field_number,
+            google::protobuf::FileDescriptorProto *output) override;
+    };
+
+    /// Returns true if a loaded file defines the symbol. The pool is only
+    /// asked about these, since it remembers the names it failed to find.
+    bool is_loaded(const std::string& name);
+
+    /// Empties the caches if generated_types_changed was called since they
+    /// were last emptied, or if they hold too many names
+    void check_caches();
+
+    database db;
+    google::protobuf::DescriptorPool pool;
+
+    // The serialized contents of each loaded file, by name, and every set
+    // that was loaded, so that loading the same set again is cheap
+    std::unordered_map<std::string, std::string> files;
+    std::unordered_set<std::string> sets;
+
+    // The result of each lookup, including the names that were not found, and
+    // the generation of the types compiled into the process they were made in
+    std::unordered_map<std::string, const google::protobuf::Descriptor *>
+        message_types;
+    std::unordered_map<std::string, const google::protobuf::EnumDescriptor *>
+        enum_types;
+    uint64_t generation;
+
+    // The number of times files were added
+    uint64_t file_loads;
+};
+
+
+#endif
@@ -0,0 +1,670 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "connection.h"
+#include "extract.h"
+#include "match.h"
+
+using google::protobuf::EnumValueDescriptor;
+using google::protobuf::FieldDescriptor;
+using google::protobuf::Message;
+
+
+/// Compares the contents of a sqlite3_value against a std::string without
+/// copying the value
+static bool value_equals(sqlite3_value *value, const std::string& str)
+{
+    const char *text = reinterpret_cast<const char *>(
+        sqlite3_value_text(value));
+    size_t length = static_cast<size_t>(sqlite3_value_bytes(value));
+    return text && length == str.length()
+        && memcmp(text, str.data(), length) == 0;
+}
+
+
+bool compiled_filter::matches(sqlite3_value *type_arg,
+                              sqlite3_value *filter_arg) const
+{
+    return value_equals(filter_arg, filter)
+        && value_equals(type_arg, type_name);
+}
+
+
+void compiled_filter::destroy(void *p)
+{
+    delete static_cast<compiled_filter *>(p);
+}
+
+
+namespace {
+
+/// A token of the filter language
+struct token {
+    enum token_type {
+        END,
+        PATH,
+        NUMBER,
+        STRING,
+        WORD,
+        SYMBOL,
+    };
+
+    token_type type;
+    std::string text;
+};
+
+
+/// A recursive descent parser for filters:
+///
+///     expr      := and (OR and)*
+///     and       := unary (AND unary)*
+///     unary     := NOT unary | '(' expr ')' | predicate
+///     predicate := path (op literal | '^=' string | [NOT] IN '(' literal, ...
+///                  ')' | IS [NOT] NULL)
+///
+/// Keywords are not case sensitive.
+struct filter_parser {
+    connection *conn;
+    const std::string& text;
+    compiled_filter *filter;
+    std::string *error_msg;
+
+    size_t pos;
+    token current;
+
+    filter_parser(connection *conn, const std::string& text,
+                  compiled_filter *filter, std::string *error_msg)
+        : conn(conn), text(text), filter(filter), error_msg(error_msg),
+          pos(0)
+    {
+    }
+
+    bool fail(const char *message)
+    {
+        *error_msg = message;
+        return false;
+    }
+
+    /// Reads the next token into current
+    bool advance()
+    {
+        while (pos < text.length() && isspace((unsigned char)text[pos]))
+            pos ++;
+        current.text.clear();
+        if (pos == text.length()) {
+            current.type = token::END;
+            return true;
+        }
+
+        size_t start = pos;
+        char c = text[pos];
+        char next = pos + 1 < text.length() ? text[pos + 1] : '\0';
+        if (c == '$') {
+            pos ++;
+            while (pos < text.length()
+                   && (isalnum((unsigned char)text[pos])
+                       || strchr("_.[]-#", text[pos])))
+                pos ++;
+            current.type = token::PATH;
+        } else if (isdigit((unsigned char)c)
+                   || ((c == '-' || c == '+' || c == '.')
+                       && (isdigit((unsigned char)next) || next == '.'))) {
+            pos ++;
+            while (pos < text.length()
+                   && (isalnum((unsigned char)text[pos]) || text[pos] == '.'
+                       || ((text[pos] == '-' || text[pos] == '+')
+                           && (text[pos - 1] == 'e' || text[pos - 1] == 'E'))))
+                pos ++;
+            current.type = token::NUMBER;
+        } else if (c == '\'' || c == '"') {
+            // A quote inside a string is written twice
+            for (pos ++; ; pos ++) {
+                if (pos == text.length())
+                    return fail("Unterminated string in filter");
+                if (text[pos] != c) {
+                    current.text.push_back(text[pos]);
+                } else if (pos + 1 < text.length() && text[pos + 1] == c) {
+                    current.text.push_back(c);
+                    pos ++;
+                } else {
+                    break;
+                }
+            }
+            pos ++;
+            current.type = token::STRING;
+            return true;
+        } else if (isalpha((unsigned char)c) || c == '_') {
+            while (pos < text.length()
+                   && (isalnum((unsigned char)text[pos]) || text[pos] == '_'))
+                pos ++;
+            current.type = token::WORD;
+        } else {
+            static const char *symbols[] = {
+                "==", "!=", "<>", "<=", ">=", "^=",
+                "=", "<", ">", "(", ")", ",",
+            };
+            current.type = token::END;
+            for (const char *symbol : symbols) {
+                size_t length = strlen(symbol);
+                if (text.compare(pos, length, symbol) == 0) {
+                    pos += length;
+                    current.type = token::SYMBOL;
+                    break;
+                }
+            }
+            if (current.type != token::SYMBOL)
+                return fail("Invalid filter");
+        }
+
+        if (current.text.empty())
+            current.text = text.substr(start, pos - start);
+        return true;
+    }
+
+    bool is_keyword(const char *keyword) const
+    {
+        return current.type == token::WORD
+            && sqlite3_stricmp(current.text.c_str(), keyword) == 0;
+    }
+
+    bool is_symbol(const char *symbol) const
+    {
+        return current.type == token::SYMBOL && current.text == symbol;
+    }
+
+    size_t add_node(const match_node& node)
+    {
+        filter->nodes.push_back(node);
+        return filter->nodes.size() - 1;
+    }
+
+    size_t add_not(size_t operand)
+    {
+        match_node node = match_node();
+        node.kind = match_node::NOT;
+        node.children.push_back(operand);
+        return add_node(node);
+    }
+
+    /// Parses operands separated by a keyword, which is AND or OR
+    bool parse_list(match_node::node_kind kind, size_t *result)
+    {
+        match_node node = match_node();
+        node.kind = kind;
+        const char *keyword = kind == match_node::OR ? "OR" : "AND";
+        for (;;) {
+            size_t operand;
+            if (!(kind == match_node::OR ? parse_list(match_node::AND, &operand)
+                                         : parse_unary(&operand)))
+                return false;
+            node.children.push_back(operand);
+            if (!is_keyword(keyword))
+                break;
+            if (!advance())
+                return false;
+        }
+
+        *result = node.children.size() == 1
+            ? node.children[0] : add_node(node);
+        return true;
+    }
+
+    bool parse_unary(size_t *result)
+    {
+        if (is_keyword("NOT")) {
+            size_t operand;
+            if (!advance() || !parse_unary(&operand))
+                return false;
+            *result = add_not(operand);
+            return true;
+        }
+
+        if (is_symbol("(")) {
+            if (!advance() || !parse_list(match_node::OR, result))
+                return false;
+            if (!is_symbol(")"))
+                return fail("Invalid filter");
+            return advance();
+        }
+
+        return parse_predicate(result);
+    }
+
+    /// Compiles a path, or finds it among the paths already compiled
+    bool add_path(const std::string& path, size_t *index)
+    {
+        for (size_t i = 0; i < filter->paths.size(); i ++) {
+            if (filter->paths[i]->path == path) {
+                *index = i;
+                return true;
+            }
+        }
+
+        // The root message itself cannot be compared
+        if (path == "$")
+            return fail("Invalid path");
+        compiled_path *compiled = new_compiled_path(conn, filter->type_name,
+            path, error_msg);
+        if (!compiled)
+            return false;
+        filter->paths.emplace_back(compiled);
+        *index = filter->paths.size() - 1;
+        return true;
+    }
+
+    bool parse_predicate(size_t *result)
+    {
+        if (current.type != token::PATH)
+            return fail("Invalid filter");
+        match_node node = match_node();
+        if (!add_path(current.text, &node.path) || !advance())
+            return false;
+
+        bool negate = false;
+        static const struct {
+            const char *symbol;
+            int op;
+        } operators[] = {
+            { "=", SQLITE_INDEX_CONSTRAINT_EQ },
+            { "==", SQLITE_INDEX_CONSTRAINT_EQ },
+            { "!=", SQLITE_INDEX_CONSTRAINT_NE },
+            { "<>", SQLITE_INDEX_CONSTRAINT_NE },
+            { "<", SQLITE_INDEX_CONSTRAINT_LT },
+            { "<=", SQLITE_INDEX_CONSTRAINT_LE },
+            { ">", SQLITE_INDEX_CONSTRAINT_GT },
+            { ">=", SQLITE_INDEX_CONSTRAINT_GE },
+        };
+        node.kind = match_node::IS_NULL;
+        for (const auto& op : operators) {
+            if (is_symbol(op.symbol)) {
+                node.kind = match_node::COMPARE;
+                node.op = op.op;
+            }
+        }
+
+        if (node.kind == match_node::COMPARE || is_symbol("^=")) {
+            if (is_symbol("^="))
+                node.kind = match_node::PREFIX;
+            node.literals.resize(1);
+            if (!advance() || !parse_literal(node.path, &node.literals[0]))
+                return false;
+            if (node.kind == match_node::PREFIX
+                && node.literals[0].type != SQLITE_TEXT)
+                return fail("Expected a string after ^=");
+        } else if (is_keyword("IS")) {
+            if (!advance())
+                return false;
+            if (is_keyword("NOT")) {
+                negate = true;
+                if (!advance())
+                    return false;
+            }
+            if (!is_keyword("NULL"))
+                return fail("Invalid filter");
+            if (!advance())
+                return false;
+        } else {
+            if (is_keyword("NOT")) {
+                negate = true;
+                if (!advance())
+                    return false;
+            }
+            if (!is_keyword("IN"))
+                return fail("Invalid filter");
+            node.kind = match_node::IN;
+            if (!advance())
+                return false;
+            if (!is_symbol("("))
+                return fail("Invalid filter");
+            do {
+                node.literals.resize(node.literals.size() + 1);
+                if (!advance()
+                    || !parse_literal(node.path, &node.literals.back()))
+                    return false;
+            } while (is_symbol(","));
+            if (!is_symbol(")"))
+                return fail("Invalid filter");
+            if (!advance())
+                return false;
+        }
+
+        *result = add_node(node);
+        if (negate)
+            *result = add_not(*result);
+        return true;
+    }
+
+    /// Parses a number, a string, TRUE or FALSE, or the name of a value of the
+    /// enum that the path selects
+    bool parse_literal(size_t path, match_literal *literal)
+    {
+        literal->type = SQLITE_NULL;
+        if (current.type == token::NUMBER) {
+            const char *start = current.text.c_str();
+            char *end;
+            errno = 0;
+            bool real = current.text.find_first_of(".eE") != std::string::npos;
+            if (!real) {
+                literal->type = SQLITE_INTEGER;
+                literal->i = strtoll(start, &end, 10);
+                real = errno == ERANGE;
+            }
+            if (real) {
+                literal->type = SQLITE_FLOAT;
+                literal->d = strtod(start, &end);
+            }
+            if (*end != '\0')
+                return fail("Invalid number in filter");
+        } else if (current.type == token::STRING) {
+            literal->type = SQLITE_TEXT;
+            literal->text = current.text;
+        } else if (is_keyword("TRUE") || is_keyword("FALSE")) {
+            literal->type = SQLITE_INTEGER;
+            literal->i = is_keyword("TRUE") ? 1 : 0;
+        } else if (current.type == token::WORD) {
+            const compiled_path& compiled = *filter->paths[path];
+            const FieldDescriptor *field = compiled.elements.back().field;
+            if (field->cpp_type() != FieldDescriptor::CppType::CPPTYPE_ENUM)
+                return fail("Invalid filter");
+            const EnumValueDescriptor *value =
+                field->enum_type()->FindValueByName(current.text);
+            if (!value)
+                return fail("Enum value not found");
+            if (compiled.enum_name) {
+                literal->type = SQLITE_TEXT;
+                literal->text = value->name();
+            } else {
+                literal->type = SQLITE_INTEGER;
+                literal->i = value->number();
+            }
+        } else {
+            return fail("Invalid filter");
+        }
+        return advance();
+    }
+};
+
+}  // namespace
+
+
+compiled_filter *new_compiled_filter(connection *conn,
+                                     const std::string& type_name,
+                                     const std::string& filter,
+                                     std::string *error_msg)
+{
+    std::unique_ptr<compiled_filter> compiled(new compiled_filter);
+    compiled->type_name = type_name;
+    compiled->filter = filter;
+
+    // Report an unknown type before anything wrong with the filter
+    if (!conn->descriptors.find_message_type(type_name)) {
+        *error_msg = "Could not find message descriptor";
+        return nullptr;
+    }
+
+    filter_parser parser(conn, filter, compiled.get(), error_msg);
+    if (!parser.advance()
+        || !parser.parse_list(match_node::OR, &compiled->root))
+        return nullptr;
+    if (parser.current.type != token::END) {
+        *error_msg = "Invalid filter";
+        return nullptr;
+    }
+
+    std::vector<const compiled_path *> paths;
+    compiled->wire_supported = true;
+    for (const std::unique_ptr<compiled_path>& path : compiled->paths) {
+        paths.push_back(path.get());
+        compiled->wire_supported =
+            compiled->wire_supported && path->wire_supported;
+    }
+    compiled->scan.reset(new wire_scan(paths));
+    compiled->values.resize(paths.size());
+    compiled->known.resize(paths.size());
+    compiled->scratch.resize(paths.size());
+    return compiled.release();
+}
+
+
+/// Compares a value with a literal. Numbers sort before strings, and a string
+/// compares bytewise with both text and blobs.
+static int compare(const field_value& value, const match_literal& literal)
+{
+    bool number = value.type == SQLITE_INTEGER || value.type == SQLITE_FLOAT;
+    if (literal.type == SQLITE_TEXT) {
+        if (number)
+            return -1;
+        size_t size = literal.text.size();
+        int c = memcmp(value.data, literal.text.data(),
+            value.size < size ? value.size : size);
+        return c != 0 ? c : value.size < size ? -1 : value.size > size ? 1 : 0;
+    }
+
+    if (!number)
+        return 1;
+    if (value.type == SQLITE_INTEGER && literal.type == SQLITE_INTEGER)
+        return value.i < literal.i ? -1 : value.i > literal.i ? 1 : 0;
+    if (value.type == SQLITE_INTEGER)
+        return compare_int_double(value.i, literal.d);
+    if (literal.type == SQLITE_INTEGER)
+        return -compare_int_double(literal.i, value.d);
+    return value.d < literal.d ? -1 : value.d > literal.d ? 1 : 0;
+}
+
+
+/// Tests a value against a predicate, which is never pending
+static match_result test(const match_node& node, const field_value& value)
+{
+    if (node.kind == match_node::IS_NULL)
+        return value.type == SQLITE_NULL ? MATCH_TRUE : MATCH_FALSE;
+    if (value.type == SQLITE_NULL)
+        return MATCH_UNKNOWN;
+
+    switch (node.kind) {
+    case match_node::COMPARE:
+    {
+        int c = compare(value, node.literals[0]);
+        bool matched = false;
+        switch (node.op) {
+        case SQLITE_INDEX_CONSTRAINT_EQ: matched = c == 0; break;
+        case SQLITE_INDEX_CONSTRAINT_NE: matched = c != 0; break;
+        case SQLITE_INDEX_CONSTRAINT_LT: matched = c < 0; break;
+        case SQLITE_INDEX_CONSTRAINT_LE: matched = c <= 0; break;
+        case SQLITE_INDEX_CONSTRAINT_GT: matched = c > 0; break;
+        case SQLITE_INDEX_CONSTRAINT_GE: matched = c >= 0; break;
+        }
+        return matched ? MATCH_TRUE : MATCH_FALSE;
+    }
+    case match_node::IN:
+        for (const match_literal& literal : node.literals)
+            if (compare(value, literal) == 0)
+                return MATCH_TRUE;
+        return MATCH_FALSE;
+    case match_node::PREFIX:
+    {
+        const std::string& prefix = node.literals[0].text;
+        return (value.type == SQLITE_TEXT || value.type == SQLITE_BLOB)
+            && value.size >= prefix.size()
+            && memcmp(value.data, prefix.data(), prefix.size()) == 0
+            ? MATCH_TRUE : MATCH_FALSE;
+    }
+    default:
+        return MATCH_FALSE;
+    }
+}
+
+
+namespace {
+
+/// Evaluates a filter on one message. The values of the paths come either
+/// from the wire scan, as far as it has got, or from the parsed message.
+struct filter_evaluator {
+    compiled_filter& filter;
+    const Message *root;
+
+    /// Set if the wire engine cannot decide on a value that is needed
+    bool needs_parse;
+
+    /// Set if a value cannot be converted
+    bool failed;
+
+    filter_evaluator(compiled_filter& filter, const Message *root)
+        : filter(filter), root(root), needs_parse(false), failed(false)
+    {
+    }
+
+    /// Finds the value of a path with the wire engine. Returns false if it is
+    /// not known yet.
+    bool wire_value_of(size_t i, field_value *value)
+    {
+        const wire_scan& scan = *filter.scan;
+        if (!scan.decided(i))
+            return false;
+        const compiled_path& path = *filter.paths[i];
+        switch (scan.status(i)) {
+        case WIRE_FOUND:
+            if (value_from_wire(path, scan.value(i), value))
+                return true;
+            break;
+        case WIRE_DEFAULT:
+            if (value_from_default(path, value))
+                return true;
+            break;
+        case WIRE_NULL:
+            value->type = SQLITE_NULL;
+            return true;
+        case WIRE_FALLBACK:
+            break;
+        }
+        needs_parse = true;
+        return false;
+    }
+
+    /// Finds the value of a path in the parsed message
+    bool message_value_of(size_t i, field_value *value)
+    {
+        const compiled_path& path = *filter.paths[i];
+        value->type = SQLITE_NULL;
+        const Message *message = follow_path(root, path,
+            path.elements.size() - 1);
+        if (!message)
+            return true;
+
+        const path_element& last = path.elements.back();
+        int index = last.index;
+        if (last.field->is_repeated()) {
+            int size = message->GetReflection()->FieldSize(*message,
+                last.field);
+            if (index < 0)
+                index += size;
+            if (index < 0 || index >= size)
+                return true;
+        } else if (last.field->cpp_type()
+                       == FieldDescriptor::CppType::CPPTYPE_MESSAGE
+                   && !message->GetReflection()->HasField(*message,
+                                                          last.field)) {
+            return true;
+        }
+
+        if (value_from_field(*message, last.field, index, path.enum_name,
+                             &filter.scratch[i], value))
+            return true;
+        failed = true;
+        return false;
+    }
+
+    match_result evaluate(size_t n)
+    {
+        const match_node& node = filter.nodes[n];
+        switch (node.kind) {
+        case match_node::AND:
+        case match_node::OR:
+        {
+            // Stop at the first operand that decides the result
+            match_result decisive = node.kind == match_node::AND
+                ? MATCH_FALSE : MATCH_TRUE;
+            match_result result = decisive == MATCH_FALSE
+                ? MATCH_TRUE : MATCH_FALSE;
+            for (size_t child : node.children) {
+                match_result r = evaluate(child);
+                if (r == decisive || failed)
+                    return r;
+                if (r == MATCH_PENDING
+                    || (r == MATCH_UNKNOWN && result != MATCH_PENDING))
+                    result = r;
+            }
+            return result;
+        }
+        case match_node::NOT:
+        {
+            match_result r = evaluate(node.children[0]);
+            return r == MATCH_TRUE ? MATCH_FALSE
+                : r == MATCH_FALSE ? MATCH_TRUE : r;
+        }
+        default:
+            break;
+        }
+
+        // Each path is only looked up once per message
+        size_t i = node.path;
+        if (!filter.known[i]) {
+            bool found = root ? message_value_of(i, &filter.values[i])
+                              : wire_value_of(i, &filter.values[i]);
+            if (!found)
+                return root ? MATCH_UNKNOWN : MATCH_PENDING;
+            filter.known[i] = true;
+        }
+        return test(node, filter.values[i]);
+    }
+};
+
+}  // namespace
+
+
+bool evaluate_filter(connection *conn,
+                     compiled_filter& filter,
+                     parsed_message& parsed,
+                     match_result *result,
+                     std::string *error_msg)
+{
+    conn->stats.enter_phase(PHASE_WALK);
+    std::fill(filter.known.begin(), filter.known.end(), false);
+
+    // Scan the message one submessage at a time, until the fields that have
+    // been found so far decide the result
+    if (conn->engine != ENGINE_REFLECTION && filter.wire_supported) {
+        filter_evaluator evaluator(filter, nullptr);
+        filter.scan->start(parsed.data, parsed.size);
+        while (!evaluator.needs_parse && filter.scan->step()) {
+            *result = evaluator.evaluate(filter.root);
+            if (*result != MATCH_PENDING)
+                return true;
+        }
+    }
+
+    const Message *root = parsed.get(filter.paths[0]->descriptor);
+    if (!root) {
+        *error_msg = "Failed to parse message";
+        return false;
+    }
+
+    conn->stats.enter_phase(PHASE_WALK);
+    std::fill(filter.known.begin(), filter.known.end(), false);
+    filter_evaluator evaluator(filter, root);
+    *result = evaluator.evaluate(filter.root);
+    if (evaluator.failed) {
+        *error_msg = "Enum value not found";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,115 @@
+#ifndef MATCH_H
+#define MATCH_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "path.h"
+#include "value.h"
+#include "wire.h"
+
+struct connection;
+struct parsed_message;
+
+
+/// The truth value of a filter, or of part of it. A comparison with null is
+/// unknown, as in SQL. While the wire engine is still scanning, a part of the
+/// filter that depends on a field that has not been reached is pending.
+enum match_result {
+    MATCH_FALSE,
+    MATCH_TRUE,
+    MATCH_UNKNOWN,
+    MATCH_PENDING,
+};
+
+
+/// A literal in a filter, in the form SQLite would compare it
+struct match_literal {
+    int type;
+    sqlite3_int64 i;
+    double d;
+    std::string text;
+};
+
+
+/// One node of the expression tree of a filter
+struct match_node {
+    enum node_kind {
+        AND,
+        OR,
+        NOT,
+        COMPARE,
+        IN,
+        PREFIX,
+        IS_NULL,
+    };
+
+    node_kind kind;
+
+    /// The operands of AND, OR, and NOT
+    std::vector<size_t> children;
+
+    /// For predicates, the path they test, and for comparisons, one of the
+    /// SQLITE_INDEX_CONSTRAINT_* operators
+    size_t path;
+    int op;
+    std::vector<match_literal> literals;
+};
+
+
+/// A filter such as "$.name ^= 'A' AND $.phones[0].type = HOME" compiled
+/// against a message type. This is built once per statement.
+struct compiled_filter {
+    std::string type_name;
+    std::string filter;
+
+    /// The distinct paths the filter tests
+    std::vector<std::unique_ptr<compiled_path>> paths;
+
+    /// The expression tree, in which operands come before the operators
+    /// that use them
+    std::vector<match_node> nodes;
+    size_t root;
+
+    /// True if the wire engine can evaluate every path
+    bool wire_supported;
+
+    /// Finds the values of all the paths in one pass over a message
+    std::unique_ptr<wire_scan> scan;
+
+    /// The values of the paths in the current message, once they are known
+    std::vector<field_value> values;
+    std::vector<bool> known;
+    std::vector<std::string> scratch;
+
+    /// Returns true if this was compiled from the given type name and filter
+    bool matches(sqlite3_value *type_arg, sqlite3_value *filter_arg) const;
+
+    /// Suitable as the destructor argument of sqlite3_set_auxdata
+    static void destroy(void *p);
+};
+
+
+/// Parses a filter and compiles its paths against a message type. Returns
+/// NULL and sets error_msg if it is malformed or does not fit the type.
+compiled_filter *new_compiled_filter(connection *conn,
+                                     const std::string& type_name,
+                                     const std::string& filter,
+                                     std::string *error_msg);
+
+
+/// Evaluates a filter on a message, using the wire engine if possible and
+/// otherwise the parsed message. Returns false and sets error_msg if the
+/// message cannot be parsed.
+bool evaluate_filter(connection *conn,
+                     compiled_filter& filter,
+                     parsed_message& parsed,
+                     match_result *result,
+                     std::string *error_msg);
+
+
+#endif
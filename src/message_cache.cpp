@@ -0,0 +1,85 @@
+#include <cstring>
+
+#include "message_cache.h"
+
+using google::protobuf::Descriptor;
+using google::protobuf::Message;
+
+
+/// A cheap hash that rejects most mismatches before comparing every byte. It
+/// mixes the length with at most 16 words sampled evenly across the message.
+static uint64_t sample_hash(const uint8_t *data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ULL ^ size;
+    if (size < sizeof(uint64_t)) {
+        for (size_t i = 0; i < size; i ++)
+            hash = (hash ^ data[i]) * 1099511628211ULL;
+        return hash;
+    }
+
+    size_t stride = size / 16 > sizeof(uint64_t) ? size / 16 : sizeof(uint64_t);
+    for (size_t offset = 0; offset + sizeof(uint64_t) <= size;
+         offset += stride) {
+        uint64_t word;
+        memcpy(&word, data + offset, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ULL;
+    }
+
+    // Always include the tail, where the last fields of a row tend to differ
+    uint64_t word;
+    memcpy(&word, data + size - sizeof(word), sizeof(word));
+    return (hash ^ word) * 1099511628211ULL;
+}
+
+
+message_cache::message_cache()
+    : hits(0), misses(0), clock(0)
+{
+    clear();
+}
+
+
+const Message *message_cache::parse(message_factory& factory,
+                                    const Descriptor *type,
+                                    const uint8_t *data,
+                                    size_t size)
+{
+    uint64_t hash = sample_hash(data, size);
+
+    // Look for the same type and bytes, remembering the least recently used
+    // entry in case it needs to be replaced
+    entry *victim = &entries[0];
+    for (entry& e : entries) {
+        if (e.descriptor == type && e.hash == hash && e.data.size() == size
+            && (size == 0 || memcmp(e.data.data(), data, size) == 0)) {
+            hits ++;
+            e.last_used = ++ clock;
+            return e.message;
+        }
+        if (e.last_used < victim->last_used)
+            victim = &e;
+    }
+
+    misses ++;
+    victim->descriptor = type;
+    victim->data.assign(reinterpret_cast<const char *>(data), size);
+    victim->hash = hash;
+    victim->last_used = ++ clock;
+
+    // Failures are cached too, so that a bad message is only parsed once
+    victim->message = factory.parse(victim->arena, type,
+        reinterpret_cast<const uint8_t *>(victim->data.data()), size);
+    return victim->message;
+}
+
+
+void message_cache::clear()
+{
+    for (entry& e : entries) {
+        e.descriptor = nullptr;
+        e.data.clear();
+        e.hash = 0;
+        e.last_used = 0;
+        e.message = nullptr;
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef MESSAGE_CACHE_H
+#define MESSAGE_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <google/protobuf/message.h>
+
+#include "message_factory.h"
+
+
+/// The most recently parsed messages, so that several protobuf_extract calls
+/// on the same row only parse the message once. Entries are keyed by the type
+/// and a copy of the serialized bytes, since SQLite reuses the buffers that
+/// hold column values from one row to the next.
+struct message_cache {
+    /// The number of messages that are kept
+    static const int SIZE = 4;
+
+    /// Calls that found the message already parsed, or had to parse it
+    int64_t hits;
+    int64_t misses;
+
+    message_cache();
+
+    /// Returns the message parsed as the given type, or NULL if it could not
+    /// be parsed. The message remains valid until the next call.
+    const google::protobuf::Message *parse(
+        message_factory& factory,
+        const google::protobuf::Descriptor *type,
+        const uint8_t *data,
+        size_t size);
+
+    /// Discards every entry
+    void clear();
+
+private:
+    struct entry {
+        const google::protobuf::Descriptor *descriptor;
+        std::string data;
+        uint64_t hash;
+        uint64_t last_used;
+        const google::protobuf::Message *message;
+        message_arena arena;
+    };
+
+    entry entries[SIZE];
+    uint64_t clock;
+};
+
+
+#endif
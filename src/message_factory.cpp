@@ -0,0 +1,83 @@
+#include <climits>
+
+#include "message_factory.h"
+
+using google::protobuf::Arena;
+using google::protobuf::ArenaOptions;
+using google::protobuf::Descriptor;
+using google::protobuf::Message;
+
+
+// The size of the first block of a new arena, and the largest size it grows
+// to. Messages bigger than that need more blocks each time they are parsed.
+#define INITIAL_BLOCK_SIZE 4096
+#define MAX_BLOCK_SIZE (1 << 20)
+
+
+message_arena::message_arena()
+    : block_size(0)
+{
+}
+
+
+Arena *message_arena::reset()
+{
+    // If the last message needed more than the first block, replace it with
+    // one that is large enough
+    size_t allocated = arena ? arena->SpaceAllocated() : 0;
+    size_t size = block_size ? block_size : INITIAL_BLOCK_SIZE;
+    while (size < allocated && size < MAX_BLOCK_SIZE)
+        size *= 2;
+
+    if (arena && size == block_size) {
+        arena->Reset();
+        return arena.get();
+    }
+
+    arena.reset();
+    block.reset(new char[size]);
+    block_size = size;
+
+    ArenaOptions options;
+    options.initial_block = block.get();
+    options.initial_block_size = block_size;
+    arena.reset(new Arena(options));
+    return arena.get();
+}
+
+
+size_t message_arena::footprint() const
+{
+    return arena ? arena->SpaceAllocated() : 0;
+}
+
+
+message_factory::message_factory()
+    : arena_high_water(0)
+{
+}
+
+
+const Message *message_factory::prototype(const Descriptor *type)
+{
+    const Message *& prototype = prototypes[type];
+    if (!prototype)
+        prototype = factory.GetPrototype(type);
+    return prototype;
+}
+
+
+const Message *message_factory::parse(message_arena& arena,
+                                      const Descriptor *type,
+                                      const uint8_t *data,
+                                      size_t size)
+{
+    Message *message = prototype(type)->New(arena.reset());
+    bool parsed = size <= INT_MAX
+        && message->ParseFromArray(data, static_cast<int>(size));
+
+    int64_t footprint = static_cast<int64_t>(arena.footprint());
+    if (footprint > arena_high_water)
+        arena_high_water = footprint;
+    return parsed ? message : nullptr;
+}
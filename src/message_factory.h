@@ -0,0 +1,60 @@
+#ifndef MESSAGE_FACTORY_H
+#define MESSAGE_FACTORY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+#include <google/protobuf/arena.h>
+#include <google/protobuf/dynamic_message.h>
+
+
+/// An arena that holds one parsed message at a time. Its first block grows to
+/// fit the largest message parsed so far and is reused for each message after
+/// that, so parsing messages of a steady size does not allocate.
+struct message_arena {
+    message_arena();
+
+    /// Destroys the message parsed previously, if any, and returns the arena
+    /// to parse the next one into
+    google::protobuf::Arena *reset();
+
+    /// Returns the number of bytes the arena has allocated
+    size_t footprint() const;
+
+private:
+    std::unique_ptr<char[]> block;
+    size_t block_size;
+    std::unique_ptr<google::protobuf::Arena> arena;
+};
+
+
+/// Creates and parses messages of any type. Each connection has one, so the
+/// layout of each dynamic message type is only computed once.
+struct message_factory {
+    /// The largest footprint of an arena after parsing a message
+    int64_t arena_high_water;
+
+    message_factory();
+
+    /// Returns the prototype of the message type
+    const google::protobuf::Message *prototype(
+        const google::protobuf::Descriptor *type);
+
+    /// Parses a message into the arena, replacing the one it held before.
+    /// Returns NULL if the message could not be parsed.
+    const google::protobuf::Message *parse(
+        message_arena& arena,
+        const google::protobuf::Descriptor *type,
+        const uint8_t *data,
+        size_t size);
+
+private:
+    google::protobuf::DynamicMessageFactory factory;
+    std::unordered_map<const google::protobuf::Descriptor *,
+                       const google::protobuf::Message *> prototypes;
+};
+
+
+#endif
@@ -0,0 +1,572 @@
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "connection.h"
+#include "path.h"
+#include "utilities.h"
+#include "wire.h"
+
+using google::protobuf::Descriptor;
+using google::protobuf::FieldDescriptor;
+
+
+/// Compares the contents of a sqlite3_value against a std::string without
+/// copying the value
+static bool value_equals(sqlite3_value *value, const std::string& str)
+{
+    const char *text = reinterpret_cast<const char *>(
+        sqlite3_value_text(value));
+    size_t length = static_cast<size_t>(sqlite3_value_bytes(value));
+    return text && length == str.length()
+        && memcmp(text, str.data(), length) == 0;
+}
+
+
+bool compiled_path::matches(sqlite3_value *type_arg,
+                            sqlite3_value *path_arg) const
+{
+    return value_equals(path_arg, path) && value_equals(type_arg, type_name);
+}
+
+
+void compiled_path::destroy(void *p)
+{
+    delete static_cast<compiled_path *>(p);
+}
+
+
+/// Parses an optionally negative decimal index, advancing pos past it
+static bool parse_index(const std::string& path, size_t& pos, int *index)
+{
+    bool negative = false;
+    if (pos < path.length() && path[pos] == '-') {
+        negative = true;
+        pos ++;
+    }
+
+    size_t start = pos;
+    long long value = 0;
+    while (pos < path.length() && path[pos] >= '0' && path[pos] <= '9') {
+        value = value * 10 + (path[pos] - '0');
+        if (value > INT_MAX) return false;
+        pos ++;
+    }
+    if (pos == start) return false;
+
+    *index = static_cast<int>(negative ? -value : value);
+    return true;
+}
+
+
+/// Parses a field number written as "#N" in place of a field name
+static bool parse_field_number(const std::string& name, int *number)
+{
+    size_t pos = 1;  // skip #
+    int value;
+    if (name.length() < 2 || name[0] != '#'
+        || !(name[1] >= '0' && name[1] <= '9')
+        || !parse_index(name, pos, &value) || pos != name.length()
+        || value < 1 || value > FieldDescriptor::kMaxNumber)
+        return false;
+    *number = value;
+    return true;
+}
+
+
+const FieldDescriptor *find_path_field(const Descriptor *type,
+                                       const std::string& name)
+{
+    int number;
+    if (parse_field_number(name, &number))
+        return type->FindFieldByNumber(number);
+    return type->FindFieldByName(name);
+}
+
+
+/// Parses the brackets after a field name in a path that selects many values:
+/// an index, [*], or a slice [start:end] in which either bound can be left out
+static bool parse_selector(const std::string& path,
+                           size_t& pos,
+                           path_element *element)
+{
+    pos ++;  // skip [
+    element->index = 0;
+    element->end = INT_MAX;
+    if (pos < path.length() && path[pos] == '*') {
+        pos ++;
+        element->slice = true;
+    } else {
+        bool has_start = pos < path.length() && path[pos] != ':';
+        if (has_start && !parse_index(path, pos, &element->index))
+            return false;
+        if (pos < path.length() && path[pos] == ':') {
+            pos ++;
+            element->slice = true;
+            if (pos < path.length() && path[pos] != ']'
+                && !parse_index(path, pos, &element->end))
+                return false;
+        } else if (!has_start) {
+            return false;
+        }
+    }
+    if (pos >= path.length() || path[pos] != ']')
+        return false;
+    pos ++;
+    return true;
+}
+
+
+/// Works out how a recursive descent for the named field proceeds from each
+/// type of message it can reach. Message fields are only followed if they can
+/// lead to the field. Returns the fields found.
+static std::vector<const FieldDescriptor *> plan_descent(
+    const std::vector<const Descriptor *>& types,
+    const std::string& name,
+    std::map<const Descriptor *, path_descent> *descent)
+{
+    // Find every type that is reachable, including the starting ones
+    std::vector<const Descriptor *> reachable;
+    std::set<const Descriptor *> seen;
+    for (const Descriptor *type : types)
+        if (seen.insert(type).second)
+            reachable.push_back(type);
+    for (size_t i = 0; i < reachable.size(); i ++) {
+        for (int j = 0; j < reachable[i]->field_count(); j ++) {
+            const Descriptor *child = reachable[i]->field(j)->message_type();
+            if (child && seen.insert(child).second)
+                reachable.push_back(child);
+        }
+    }
+
+    // Keep the types that have the field or lead to one that does
+    std::set<const Descriptor *> useful;
+    for (bool changed = true; changed; ) {
+        changed = false;
+        for (const Descriptor *type : reachable) {
+            if (useful.count(type))
+                continue;
+            bool leads = find_path_field(type, name) != nullptr;
+            for (int j = 0; !leads && j < type->field_count(); j ++)
+                leads = useful.count(type->field(j)->message_type()) > 0;
+            if (leads) {
+                useful.insert(type);
+                changed = true;
+            }
+        }
+    }
+
+    std::vector<const FieldDescriptor *> found;
+    for (const Descriptor *type : useful) {
+        path_descent& step = (*descent)[type];
+        step.field = find_path_field(type, name);
+        if (step.field)
+            found.push_back(step.field);
+        for (int j = 0; j < type->field_count(); j ++)
+            if (useful.count(type->field(j)->message_type()))
+                step.children.push_back(type->field(j));
+    }
+    return found;
+}
+
+
+/// Compiles a path that may use wildcards. After a recursive descent, the
+/// messages reached can be of several types, so each element is checked
+/// against all of them and only has to fit one.
+static bool compile_path_many(const Descriptor *descriptor,
+                              const std::string& path,
+                              compiled_path *compiled,
+                              std::string *error_msg)
+{
+    std::vector<const Descriptor *> types = { descriptor };
+    std::vector<const FieldDescriptor *> fields;
+    bool ends_open = false;
+    size_t pos = 1;  // skip $
+    while (pos < path.length()) {
+        // Each element has the form .field_name or ..field_name, optionally
+        // followed by an index, [*], or a slice
+        if (path[pos] != '.') {
+            *error_msg = "Invalid path";
+            return false;
+        }
+        path_element element {};
+        element.recursive = pos + 1 < path.length() && path[pos + 1] == '.';
+        pos += element.recursive ? 2 : 1;
+        size_t name_start = pos;
+        while (pos < path.length() && path[pos] != '.' && path[pos] != '[')
+            pos ++;
+        if (pos == name_start) {
+            *error_msg = "Invalid path";
+            return false;
+        }
+        element.name = path.substr(name_start, pos - name_start);
+
+        bool has_index = false;
+        if (pos < path.length() && path[pos] == '[') {
+            if (!parse_selector(path, pos, &element)) {
+                *error_msg = "Invalid path";
+                return false;
+            }
+            has_index = true;
+        }
+
+        // Find the field in each type of message that can be reached
+        fields.clear();
+        if (element.recursive) {
+            fields = plan_descent(types, element.name, &element.descent);
+        } else {
+            for (const Descriptor *type : types) {
+                const FieldDescriptor *field =
+                    find_path_field(type, element.name);
+                if (field)
+                    fields.push_back(field);
+            }
+        }
+        if (fields.empty()) {
+            *error_msg = "Invalid field name";
+            return false;
+        }
+        if (!element.recursive && types.size() == 1)
+            element.field = fields[0];
+
+        // Without an index, a repeated field selects all of its elements,
+        // which is only allowed at the end of the path; elsewhere, [*] has
+        // to be asked for
+        ends_open = false;
+        for (const FieldDescriptor *field : fields)
+            ends_open = ends_open || (field->is_repeated() && !has_index);
+        if (ends_open) {
+            element.slice = true;
+            element.end = INT_MAX;
+        }
+        compiled->wildcards = compiled->wildcards || element.slice
+            || element.recursive;
+        compiled->elements.push_back(element);
+
+        // The rest of the path descends into the messages found
+        const std::string rest = path.substr(pos);
+        if (rest == "")
+            break;
+        types.clear();
+        bool all_enums = true;
+        for (const FieldDescriptor *field : fields) {
+            if (field->message_type()
+                && std::find(types.begin(), types.end(),
+                             field->message_type()) == types.end())
+                types.push_back(field->message_type());
+            all_enums = all_enums && field->enum_type();
+        }
+        if (!types.empty()) {
+            if (ends_open) {
+                *error_msg = "Expected index into repeated field";
+                return false;
+            }
+            continue;
+        }
+
+        // For enum fields, handle the special suffix paths .name and .number
+        if (all_enums && (rest == ".name" || rest == ".number")) {
+            compiled->enum_name = rest == ".name";
+            break;
+        }
+        *error_msg = "Path traverses non-message elements";
+        return false;
+    }
+
+    compiled->all_elements = ends_open && !compiled->wildcards;
+    return true;
+}
+
+
+bool compile_path(const Descriptor *descriptor,
+                  const std::string& path,
+                  compiled_path *compiled,
+                  std::string *error_msg,
+                  path_selects selects)
+{
+    compiled->descriptor = descriptor;
+    compiled->elements.clear();
+    compiled->enum_name = false;
+    compiled->all_elements = false;
+    compiled->wildcards = false;
+    compiled->wire_supported = false;
+    compiled->wire_after_parse = false;
+    compiled->extractor = nullptr;
+    compiled->steps.clear();
+    compiled->type_calls = nullptr;
+    compiled->path_calls = nullptr;
+
+    // Check that the path begins with $, representing the root of the tree
+    if (path.length() == 0 || path[0] != '$') {
+        *error_msg = "Invalid path";
+        return false;
+    }
+    if (selects == SELECTS_MANY)
+        return compile_path_many(descriptor, path, compiled, error_msg);
+
+    size_t pos = 1;  // skip $
+    bool ends_open = false;
+    while (pos < path.length()) {
+        // Each element has the form .field_name or .field_name[index]
+        if (path[pos] != '.') {
+            *error_msg = "Invalid path";
+            return false;
+        }
+        size_t name_start = ++ pos;
+        while (pos < path.length() && path[pos] != '.' && path[pos] != '[')
+            pos ++;
+        if (pos == name_start) {
+            *error_msg = "Invalid path";
+            return false;
+        }
+        const std::string field_name =
+            path.substr(name_start, pos - name_start);
+
+        bool has_index = false;
+        int index = 0;
+        if (pos < path.length() && path[pos] == '[') {
+            pos ++;
+            if (!parse_index(path, pos, &index)
+                || pos >= path.length() || path[pos] != ']')
+            {
+                *error_msg = "Invalid path";
+                return false;
+            }
+            pos ++;
+            has_index = true;
+        }
+
+        // Get the descriptor for this field by its name or number
+        const FieldDescriptor *field =
+            find_path_field(descriptor, field_name);
+        if (!field) {
+            *error_msg = "Invalid field name";
+            return false;
+        }
+
+        // Only the last element may select every element of a repeated field
+        ends_open = field->is_repeated() && !has_index;
+        if (ends_open && selects == SELECTS_ONE) {
+            *error_msg = "Expected index into repeated field";
+            return false;
+        }
+
+        path_element element {};
+        element.field = field;
+        element.index = index;
+        compiled->elements.push_back(element);
+
+        // If the field is a submessage, the rest of the path descends into it
+        if (field->cpp_type() == FieldDescriptor::CppType::CPPTYPE_MESSAGE) {
+            if (ends_open && pos < path.length()) {
+                *error_msg = "Expected index into repeated field";
+                return false;
+            }
+            descriptor = field->message_type();
+            continue;
+        }
+
+        // For enum fields, handle the special suffix paths .name and .number
+        const std::string rest = path.substr(pos);
+        if (field->cpp_type() == FieldDescriptor::CppType::CPPTYPE_ENUM) {
+            if (rest == "" || rest == ".number") {
+                break;
+            } else if (rest == ".name") {
+                compiled->enum_name = true;
+                break;
+            }
+        } else if (rest == "") {
+            break;
+        }
+
+        // This error message should match for enums and non-enums
+        *error_msg = "Path traverses non-message elements";
+        return false;
+    }
+
+    if (selects == SELECTS_ALL && !ends_open) {
+        *error_msg = "Path does not select a repeated field";
+        return false;
+    }
+    compiled->all_elements = ends_open;
+    return true;
+}
+
+
+compiled_path *new_compiled_path(connection *conn,
+                                 const std::string& type_name,
+                                 const std::string& path,
+                                 std::string *error_msg,
+                                 path_selects selects)
+{
+    std::unique_ptr<compiled_path> compiled(new compiled_path);
+    compiled->type_name = type_name;
+    compiled->path = path;
+
+    // Check that the path begins with $ before looking up the message type
+    if (compiled->path.length() == 0 || compiled->path[0] != '$') {
+        *error_msg = "Invalid path";
+        return nullptr;
+    }
+
+    // Find the message type among those loaded on this connection
+    const Descriptor *descriptor =
+        conn->descriptors.find_message_type(compiled->type_name);
+    if (!descriptor) {
+        *error_msg = "Could not find message descriptor";
+        return nullptr;
+    }
+
+    if (!compile_path(descriptor, compiled->path, compiled.get(), error_msg,
+                      selects))
+        return nullptr;
+    if (!compiled->wildcards) {
+        compiled->wire_supported = wire_supports_path(*compiled);
+        compiled->wire_after_parse = wire_can_follow_path(*compiled);
+    }
+    if (compiled->wire_supported)
+        compiled->extractor = find_extractor(descriptor);
+    if (compiled->extractor) {
+        for (const path_element& element : compiled->elements)
+            compiled->steps.push_back({ element.field->number(),
+                                        element.index });
+    }
+    return compiled.release();
+}
+
+
+compiled_path *new_compiled_path(connection *conn,
+                                 sqlite3_value *type_arg,
+                                 sqlite3_value *path_arg,
+                                 std::string *error_msg,
+                                 path_selects selects)
+{
+    return new_compiled_path(conn, string_from_sqlite3_value(type_arg),
+        string_from_sqlite3_value(path_arg), error_msg, selects);
+}
+
+
+const compiled_path *get_compiled_path(sqlite3_context *context,
+                                       sqlite3_value **argv,
+                                       int type_arg,
+                                       int path_arg,
+                                       std::unique_ptr<compiled_path>& fallback,
+                                       path_selects selects)
+{
+    connection *conn = connection::get(context);
+
+    // Reuse the compiled path from a previous row if the arguments match
+    compiled_path *cached = static_cast<compiled_path *>(
+        sqlite3_get_auxdata(context, path_arg));
+    if (cached && cached->matches(argv[type_arg], argv[path_arg]))
+        return cached;
+
+    std::string error_msg;
+    compiled_path *compiled =
+        new_compiled_path(conn, argv[type_arg], argv[path_arg], &error_msg,
+            selects);
+    if (!compiled) {
+        sqlite3_result_error(context, error_msg.c_str(), -1);
+        return nullptr;
+    }
+
+    // Hand the compiled path to SQLite, which is free to discard it at once
+    sqlite3_set_auxdata(context, path_arg, compiled, compiled_path::destroy);
+    if (sqlite3_get_auxdata(context, path_arg) == compiled)
+        return compiled;
+
+    // If it was discarded, compile a copy that we own for the current call
+    fallback.reset(
+        new_compiled_path(conn, argv[type_arg], argv[path_arg], &error_msg,
+            selects));
+    if (!fallback)
+        sqlite3_result_error(context, error_msg.c_str(), -1);
+    return fallback.get();
+}
+
+
+bool raw_path::matches(sqlite3_value *path_arg, sqlite3_value *hint_arg) const
+{
+    if (!value_equals(path_arg, path))
+        return false;
+    return hint_arg ? value_equals(hint_arg, hint) : hint.empty();
+}
+
+
+void raw_path::destroy(void *p)
+{
+    delete static_cast<raw_path *>(p);
+}
+
+
+bool compile_raw_path(const std::string& path,
+                      const std::string& hint,
+                      raw_path *compiled,
+                      std::string *error_msg)
+{
+    compiled->path = path;
+    compiled->hint = hint;
+    compiled->steps.clear();
+    compiled->has_hint = false;
+
+    // Groups cannot be followed without knowing where they end
+    if (!hint.empty()) {
+        for (int type = 1; type <= FieldDescriptor::MAX_TYPE; type ++) {
+            if (type != FieldDescriptor::TYPE_GROUP
+                && hint == FieldDescriptor::TypeName(
+                    static_cast<FieldDescriptor::Type>(type))) {
+                compiled->has_hint = true;
+                compiled->hint_type = static_cast<FieldDescriptor::Type>(type);
+            }
+        }
+        if (!compiled->has_hint) {
+            *error_msg = "Invalid wire hint";
+            return false;
+        }
+    }
+
+    if (path.length() == 0 || path[0] != '$') {
+        *error_msg = "Invalid path";
+        return false;
+    }
+
+    size_t pos = 1;  // skip $
+    while (pos < path.length()) {
+        // Each element has the form .#number or .#number[index]
+        if (path[pos] != '.') {
+            *error_msg = "Invalid path";
+            return false;
+        }
+        size_t name_start = ++ pos;
+        while (pos < path.length() && path[pos] != '.' && path[pos] != '[')
+            pos ++;
+        raw_step step = { 0, false, 0 };
+        if (!parse_field_number(path.substr(name_start, pos - name_start),
+                                &step.number)) {
+            *error_msg = "Invalid field number";
+            return false;
+        }
+
+        if (pos < path.length() && path[pos] == '[') {
+            pos ++;
+            if (!parse_index(path, pos, &step.index)
+                || pos >= path.length() || path[pos] != ']')
+            {
+                *error_msg = "Invalid path";
+                return false;
+            }
+            pos ++;
+            step.has_index = true;
+        }
+        compiled->steps.push_back(step);
+    }
+    return true;
+}
@@ -0,0 +1,199 @@
+#ifndef PATH_H
+#define PATH_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "extractors.h"
+
+struct connection;
+
+/// Whether a path selects a single value, or ends with a repeated field that
+/// has no index, such as "$.phones", which selects all of its elements.
+/// SELECTS_MANY also allows the wildcards [*], [start:end], and ..field
+/// anywhere in the path.
+enum path_selects {
+    SELECTS_ONE,
+    SELECTS_ALL,
+    SELECTS_ONE_OR_ALL,
+    SELECTS_MANY,
+};
+
+
+/// What a recursive descent does on reaching a message of some type: the
+/// field it is looking for, if the type has one, and the message fields that
+/// can lead to more of them
+struct path_descent {
+    const google::protobuf::FieldDescriptor *field;
+    std::vector<const google::protobuf::FieldDescriptor *> children;
+};
+
+
+/// One step of a compiled path: the field to select and, for repeated fields,
+/// the index of the element (possibly negative, counting from the end)
+struct path_element {
+    const google::protobuf::FieldDescriptor *field;
+    int index;
+
+    /// The rest is only used by paths with wildcards. A slice selects the
+    /// elements from index up to, but not including, end, which may also be
+    /// negative. [*] is the slice of every element.
+    bool slice;
+    int end;
+
+    /// The name of the field, which is NULL above if the messages reached
+    /// can be of several types
+    std::string name;
+
+    /// For ..name, the descent through each message type that can lead to
+    /// the field
+    bool recursive;
+    std::map<const google::protobuf::Descriptor *, path_descent> descent;
+};
+
+
+/// A path such as "$.phones[0].number" resolved against a message type. This
+/// is built once per statement so that each row only has to walk the fields.
+struct compiled_path {
+    std::string type_name;
+    std::string path;
+    const google::protobuf::Descriptor *descriptor;
+    std::vector<path_element> elements;
+
+    /// True if the path ends with the virtual .name child of an enum field
+    bool enum_name;
+
+    /// True if the path ends with a repeated field that has no index. The
+    /// index of the last element is then meaningless.
+    bool all_elements;
+
+    /// True if the path uses [*], [start:end], or ..field, and so must be
+    /// evaluated with match_path
+    bool wildcards;
+
+    /// True if the path can be evaluated directly on the wire format
+    bool wire_supported;
+
+    /// True if the wire format can be used to find the value once a full parse
+    /// has shown that the message is valid
+    bool wire_after_parse;
+
+    /// The extractor generated for the message type, if a library loaded with
+    /// protobuf_load has one and the wire engine supports the path, and the
+    /// steps of the path to pass to it
+    sqlite_protobuf_find extractor;
+    std::vector<sqlite_protobuf_step> steps;
+
+    /// The counters of calls on this type and path in connection_stats, once
+    /// they have been looked up
+    mutable int64_t *type_calls;
+    mutable int64_t *path_calls;
+
+    /// Returns true if this was compiled from the given type name and path
+    bool matches(sqlite3_value *type_arg, sqlite3_value *path_arg) const;
+
+    /// Suitable as the destructor argument of sqlite3_set_auxdata
+    static void destroy(void *p);
+};
+
+
+/// Finds a field of a message type by the name used for it in a path, which
+/// may also be its number written as "#N". Returns NULL if there is none.
+const google::protobuf::FieldDescriptor *find_path_field(
+    const google::protobuf::Descriptor *type,
+    const std::string& name);
+
+
+/// Resolves the path against the message descriptor. Returns false and sets
+/// error_msg if the path is malformed or does not fit the message type.
+///
+/// By default the path must select a single value; selects says whether it
+/// may or must select all of the elements of a repeated field instead.
+bool compile_path(const google::protobuf::Descriptor *descriptor,
+                  const std::string& path,
+                  compiled_path *compiled,
+                  std::string *error_msg,
+                  path_selects selects = SELECTS_ONE);
+
+
+/// Looks up the message type by name among the types available to the
+/// connection and compiles the path against it. Returns NULL and sets
+/// error_msg on failure.
+compiled_path *new_compiled_path(connection *conn,
+                                 const std::string& type_name,
+                                 const std::string& path,
+                                 std::string *error_msg,
+                                 path_selects selects = SELECTS_ONE);
+
+
+/// Same as above, taking the type name and path from function arguments
+compiled_path *new_compiled_path(connection *conn,
+                                 sqlite3_value *type_arg,
+                                 sqlite3_value *path_arg,
+                                 std::string *error_msg,
+                                 path_selects selects = SELECTS_ONE);
+
+
+/// Returns the compiled path for the type name and path arguments of a
+/// function, reusing the one attached to the statement if possible. The path
+/// argument's auxiliary data is used as the cache. If SQLite declines to keep
+/// the compiled path, it is owned by fallback instead.
+///
+/// On failure, sets an error on the context and returns NULL.
+const compiled_path *get_compiled_path(sqlite3_context *context,
+                                       sqlite3_value **argv,
+                                       int type_arg,
+                                       int path_arg,
+                                       std::unique_ptr<compiled_path>& fallback,
+                                       path_selects selects = SELECTS_ONE);
+
+
+/// One step of a path of field numbers: the number, and the index of the
+/// occurrence to select if there is one (possibly negative, counting from the
+/// end)
+struct raw_step {
+    int number;
+    bool has_index;
+    int index;
+};
+
+
+/// A path of field numbers such as "$.#2[0].#1", which protobuf_extract_raw
+/// follows through the wire format without a message type, along with the
+/// wire hint that says how to read the value at the end
+struct raw_path {
+    std::string path;
+    std::string hint;
+    std::vector<raw_step> steps;
+
+    /// The field type named by the hint, if one was given
+    bool has_hint;
+    google::protobuf::FieldDescriptor::Type hint_type;
+
+    /// Returns true if this was compiled from the given path and hint, which
+    /// may be NULL
+    bool matches(sqlite3_value *path_arg, sqlite3_value *hint_arg) const;
+
+    /// Suitable as the destructor argument of sqlite3_set_auxdata
+    static void destroy(void *p);
+};
+
+
+/// Parses a path of field numbers and a wire hint, which is the name of a
+/// field type such as "sint64" or "string", or empty. Returns false and sets
+/// error_msg if either is malformed.
+bool compile_raw_path(const std::string& path,
+                      const std::string& hint,
+                      raw_path *compiled,
+                      std::string *error_msg);
+
+
+#endif
@@ -0,0 +1,220 @@
+#include <memory>
+#include <string>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "array.h"
+#include "compression.h"
+#include "connection.h"
+#include "extract.h"
+#include "header.h"
+#include "path.h"
+#include "stats.h"
+#include "value.h"
+
+using google::protobuf::FieldDescriptor;
+using google::protobuf::Message;
+
+
+/// Adds the elements selected by a path, reading packed runs straight from the
+/// wire format if possible and otherwise from the parsed message. Returns
+/// false and sets an error on the context if the message cannot be parsed.
+static bool aggregate_path(sqlite3_context *context,
+                           connection *conn,
+                           const compiled_path& path,
+                           parsed_message& parsed,
+                           array_totals *totals)
+{
+    conn->stats.enter_phase(PHASE_WALK);
+
+    if (conn->engine != ENGINE_REFLECTION && path.wire_supported) {
+        array_totals wire_totals = *totals;
+        if (array_add_wire(path, parsed.data, parsed.size, &wire_totals)) {
+            *totals = wire_totals;
+            return true;
+        }
+    }
+
+    const Message *root = parsed.get(path.descriptor);
+    if (!root) {
+        sqlite3_result_error(context, "Failed to parse message", -1);
+        return false;
+    }
+
+    // There are no elements if a message on the way is not present
+    const Message *message = follow_path(root, path,
+        path.elements.size() - 1);
+    if (!message)
+        return true;
+
+    const FieldDescriptor *field = path.elements.back().field;
+    int size = message->GetReflection()->FieldSize(*message, field);
+    for (int i = 0; i < size; i ++) {
+        field_value value;
+        value_from_field(*message, field, i, false, nullptr, &value);
+        totals->add(value);
+    }
+    return true;
+}
+
+
+/// Sets the result to an aggregate of the elements. Like the SQL aggregate
+/// functions, all but count give null if there are no elements.
+static void result_from_totals(sqlite3_context *context,
+                               const array_totals& totals)
+{
+    if (totals.aggregate == ARRAY_COUNT) {
+        sqlite3_result_int64(context, totals.count);
+        return;
+    }
+    if (totals.values == 0) {
+        sqlite3_result_null(context);
+        return;
+    }
+
+    switch (totals.aggregate) {
+    case ARRAY_SUM:
+        if (!totals.integer)
+            sqlite3_result_double(context, totals.real_sum);
+        else if (totals.overflow)
+            sqlite3_result_error(context, "integer overflow", -1);
+        else
+            sqlite3_result_int64(context, totals.int_sum);
+        break;
+    case ARRAY_AVG:
+        sqlite3_result_double(context,
+            (totals.real_sum + static_cast<double>(totals.int_sum))
+                / static_cast<double>(totals.values));
+        break;
+    case ARRAY_MIN:
+        if (totals.integer)
+            sqlite3_result_int64(context, totals.int_min);
+        else
+            sqlite3_result_double(context, totals.real_min);
+        break;
+    case ARRAY_MAX:
+        if (totals.integer)
+            sqlite3_result_int64(context, totals.int_max);
+        else
+            sqlite3_result_double(context, totals.real_max);
+        break;
+    case ARRAY_COUNT:
+        break;
+    }
+}
+
+
+/// Aggregates the elements of a repeated numeric field
+///
+///     SELECT protobuf_array_sum(data, "Sensor", "$.samples");
+///
+/// Packed runs of elements are read directly from the wire format. Counting
+/// them does not decode them, and the other aggregates decode them in bulk.
+///
+/// @returns the number of elements for count, and otherwise their sum,
+///          minimum, maximum, or average, or NULL if there are none
+static void protobuf_array(sqlite3_context *context,
+                           sqlite3_value **argv,
+                           array_aggregate aggregate,
+                           stats_function function)
+{
+    connection *conn = connection::get(context);
+    stats_call call(conn->stats, function);
+
+    // Resolve the type name and path, which is only done once per statement
+    std::unique_ptr<compiled_path> fallback;
+    const compiled_path *path = get_compiled_path(context, argv, 1, 2,
+        fallback, SELECTS_ALL);
+    if (!path)
+        return;
+    const FieldDescriptor *field = path->elements.back().field;
+    if (path->enum_name || !array_supports_field(field)) {
+        sqlite3_result_error(context, "Path does not select a numeric field",
+            -1);
+        return;
+    }
+
+    // There is nothing to aggregate in a missing message
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    conn->stats.count_path(*path);
+    conn->stats.count_bytes(static_cast<size_t>(sqlite3_value_bytes(argv[0])));
+
+    const uint8_t *data;
+    size_t size;
+    if (!message_argument(context, conn, argv[0], &data, &size))
+        return;
+    parsed_message parsed(data, size, conn, &conn->cache);
+    array_totals totals(field, aggregate);
+    if (!aggregate_path(context, conn, *path, parsed, &totals))
+        return;
+
+    conn->stats.enter_phase(PHASE_RESULT);
+    result_from_totals(context, totals);
+}
+
+
+static void protobuf_array_avg(sqlite3_context *context,
+                               int argc,
+                               sqlite3_value **argv)
+{
+    protobuf_array(context, argv, ARRAY_AVG, FUNCTION_ARRAY_AVG);
+}
+
+
+static void protobuf_array_count(sqlite3_context *context,
+                                 int argc,
+                                 sqlite3_value **argv)
+{
+    protobuf_array(context, argv, ARRAY_COUNT, FUNCTION_ARRAY_COUNT);
+}
+
+
+static void protobuf_array_max(sqlite3_context *context,
+                               int argc,
+                               sqlite3_value **argv)
+{
+    protobuf_array(context, argv, ARRAY_MAX, FUNCTION_ARRAY_MAX);
+}
+
+
+static void protobuf_array_min(sqlite3_context *context,
+                               int argc,
+                               sqlite3_value **argv)
+{
+    protobuf_array(context, argv, ARRAY_MIN, FUNCTION_ARRAY_MIN);
+}
+
+
+static void protobuf_array_sum(sqlite3_context *context,
+                               int argc,
+                               sqlite3_value **argv)
+{
+    protobuf_array(context, argv, ARRAY_SUM, FUNCTION_ARRAY_SUM);
+}
+
+
+DECLARE_(protobuf_array)
+{
+    int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+    int err = create_function(db, conn, "protobuf_array_avg", 3, flags,
+        protobuf_array_avg);
+    if (err != SQLITE_OK) return err;
+    err = create_function(db, conn, "protobuf_array_count", 3, flags,
+        protobuf_array_count);
+    if (err != SQLITE_OK) return err;
+    err = create_function(db, conn, "protobuf_array_max", 3, flags,
+        protobuf_array_max);
+    if (err != SQLITE_OK) return err;
+    err = create_function(db, conn, "protobuf_array_min", 3, flags,
+        protobuf_array_min);
+    if (err != SQLITE_OK) return err;
+    return create_function(db, conn, "protobuf_array_sum", 3, flags,
+        protobuf_array_sum);
+}
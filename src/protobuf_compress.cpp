@@ -0,0 +1,270 @@
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "compression.h"
+#include "connection.h"
+#include "header.h"
+#include "stats.h"
+
+
+/// The dictionaries that protobuf_train_dictionary builds by default
+static const size_t DEFAULT_DICTIONARY_SIZE = 16384;
+
+/// The samples protobuf_train_dictionary keeps, in bytes. Beyond this, each
+/// new message replaces a random sample.
+static const size_t MAX_SAMPLE_BYTES = 8 * 1024 * 1024;
+
+
+/// A dictionary loaded by protobuf_compress, which is kept for the rest of the
+/// statement
+struct statement_dictionary {
+    int64_t id;
+    std::string data;
+
+    static void destroy(void *p) {
+        delete static_cast<statement_dictionary *>(p);
+    }
+};
+
+
+/// Returns the dictionary with the id in the given argument, reusing the one
+/// attached to the statement if possible. On failure, sets an error on the
+/// context and returns NULL.
+static const std::string *get_dictionary(
+    sqlite3_context *context,
+    sqlite3_value **argv,
+    int id_arg,
+    std::unique_ptr<statement_dictionary>& fallback)
+{
+    int64_t id = sqlite3_value_int64(argv[id_arg]);
+    statement_dictionary *cached = static_cast<statement_dictionary *>(
+        sqlite3_get_auxdata(context, id_arg));
+    if (cached && cached->id == id)
+        return &cached->data;
+
+    std::unique_ptr<statement_dictionary> loaded(new statement_dictionary);
+    loaded->id = id;
+    std::string error_msg;
+    if (!load_dictionary(sqlite3_context_db_handle(context), id,
+                         &loaded->data, &error_msg)) {
+        sqlite3_result_error(context, error_msg.c_str(), -1);
+        return nullptr;
+    }
+
+    // Hand the dictionary to SQLite, which is free to discard it at once
+    statement_dictionary *kept = loaded.release();
+    sqlite3_set_auxdata(context, id_arg, kept, statement_dictionary::destroy);
+    if (sqlite3_get_auxdata(context, id_arg) == kept)
+        return &kept->data;
+
+    // If it was discarded, load a copy that we own for the current call
+    fallback.reset(new statement_dictionary);
+    fallback->id = id;
+    load_dictionary(sqlite3_context_db_handle(context), id, &fallback->data,
+        &error_msg);
+    return &fallback->data;
+}
+
+
+/// Compress a message, optionally with a dictionary from the
+/// protobuf_dictionaries table
+///
+///     SELECT protobuf_compress(data, 1);
+///
+/// @returns a BLOB that every function reading a message decompresses as
+///          needed, or the message itself if compressing it would not make
+///          it smaller
+static void protobuf_compress(sqlite3_context *context,
+                              int argc,
+                              sqlite3_value **argv)
+{
+    connection *conn = connection::get(context);
+    stats_call call(conn->stats, FUNCTION_COMPRESS);
+
+    std::unique_ptr<statement_dictionary> fallback;
+    int64_t dictionary_id = 0;
+    const std::string *dictionary = nullptr;
+    if (argc > 1 && sqlite3_value_type(argv[1]) != SQLITE_NULL) {
+        dictionary_id = sqlite3_value_int64(argv[1]);
+        if (sqlite3_value_type(argv[1]) != SQLITE_INTEGER
+            || dictionary_id <= 0) {
+            sqlite3_result_error(context, "Invalid dictionary id", -1);
+            return;
+        }
+        dictionary = get_dictionary(context, argv, 1, fallback);
+        if (!dictionary)
+            return;
+    }
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    const uint8_t *data =
+        static_cast<const uint8_t *>(sqlite3_value_blob(argv[0]));
+    size_t size = static_cast<size_t>(sqlite3_value_bytes(argv[0]));
+    conn->stats.count_bytes(size);
+
+    // An empty message, or one that is compressed already, is kept as it is
+    if (size == 0 || is_compressed(data, size)) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+
+    uint8_t *compressed;
+    size_t compressed_size;
+    std::string error_msg;
+    if (!conn->compressor.compress(data, size, dictionary_id, dictionary,
+                                   &compressed, &compressed_size,
+                                   &error_msg)) {
+        sqlite3_result_error(context, error_msg.c_str(), -1);
+        return;
+    }
+    if (!compressed) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+    sqlite3_result_blob64(context, compressed, compressed_size, sqlite3_free);
+}
+
+
+/// Decompress a message compressed by protobuf_compress
+///
+///     SELECT protobuf_decompress(data);
+///
+/// @returns the serialized message; a message that is not compressed is
+///          returned as it is
+static void protobuf_decompress(sqlite3_context *context,
+                                int argc,
+                                sqlite3_value **argv)
+{
+    connection *conn = connection::get(context);
+    stats_call call(conn->stats, FUNCTION_DECOMPRESS);
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    conn->stats.count_bytes(static_cast<size_t>(sqlite3_value_bytes(argv[0])));
+
+    const uint8_t *data;
+    size_t size;
+    if (!message_argument(context, conn, argv[0], &data, &size))
+        return;
+    if (size == 0)
+        sqlite3_result_zeroblob(context, 0);
+    else
+        sqlite3_result_blob64(context, data, size, SQLITE_TRANSIENT);
+}
+
+
+/// The messages protobuf_train_dictionary has sampled so far
+struct training {
+    size_t capacity;
+    std::vector<std::string> samples;
+    size_t sample_bytes;
+    int64_t seen;
+    uint64_t random;
+};
+
+
+static void protobuf_train_dictionary_step(sqlite3_context *context,
+                                           int argc,
+                                           sqlite3_value **argv)
+{
+    training **state = static_cast<training **>(
+        sqlite3_aggregate_context(context, sizeof(training *)));
+    if (!state) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    if (!*state) {
+        size_t capacity = DEFAULT_DICTIONARY_SIZE;
+        if (argc > 1) {
+            sqlite3_int64 requested = sqlite3_value_int64(argv[1]);
+            if (requested <= 0
+                || requested > static_cast<sqlite3_int64>(MAX_DICTIONARY_SIZE)) {
+                sqlite3_result_error(context,
+                    "Dictionary size must be between 1 and 32768", -1);
+                return;
+            }
+            capacity = static_cast<size_t>(requested);
+        }
+        *state = new training { capacity, {}, 0, 0, 0x2545f4914f6cdd1dULL };
+    }
+    training *t = *state;
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+        return;
+
+    // Messages that are compressed already are sampled as they were
+    connection *conn = connection::get(context);
+    const uint8_t *data;
+    size_t size;
+    if (!message_argument(context, conn, argv[0], &data, &size))
+        return;
+    std::string sample(reinterpret_cast<const char *>(data), size);
+
+    // Keep every message until there are enough, then a uniform sample of
+    // them, picked with a fixed seed so that training is repeatable
+    t->seen ++;
+    if (t->sample_bytes + size <= MAX_SAMPLE_BYTES) {
+        t->sample_bytes += size;
+        t->samples.push_back(std::move(sample));
+        return;
+    }
+    t->random ^= t->random << 13;
+    t->random ^= t->random >> 7;
+    t->random ^= t->random << 17;
+    uint64_t slot = t->random % static_cast<uint64_t>(t->seen);
+    if (slot < t->samples.size()) {
+        t->sample_bytes += size - t->samples[slot].size();
+        t->samples[slot].swap(sample);
+    }
+}
+
+
+static void protobuf_train_dictionary_final(sqlite3_context *context)
+{
+    training **state = static_cast<training **>(
+        sqlite3_aggregate_context(context, 0));
+    if (!state || !*state) {
+        sqlite3_result_null(context);
+        return;
+    }
+    std::unique_ptr<training> t(*state);
+    *state = nullptr;
+
+    std::string dictionary = train_dictionary(t->samples, t->capacity);
+    if (dictionary.empty())
+        sqlite3_result_null(context);
+    else
+        sqlite3_result_blob64(context, dictionary.data(), dictionary.size(),
+            SQLITE_TRANSIENT);
+}
+
+
+DECLARE_(protobuf_compress)
+{
+    int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+    int err = create_function(db, conn, "protobuf_compress", 1, flags,
+        protobuf_compress);
+    if (err != SQLITE_OK) return err;
+    err = create_function(db, conn, "protobuf_compress", 2, flags,
+        protobuf_compress);
+    if (err != SQLITE_OK) return err;
+    err = create_function(db, conn, "protobuf_decompress", 1, flags,
+        protobuf_decompress);
+    if (err != SQLITE_OK) return err;
+    err = create_aggregate(db, conn, "protobuf_train_dictionary", 1,
+        SQLITE_UTF8, protobuf_train_dictionary_step,
+        protobuf_train_dictionary_final);
+    if (err != SQLITE_OK) return err;
+    return create_aggregate(db, conn, "protobuf_train_dictionary", 2,
+        SQLITE_UTF8, protobuf_train_dictionary_step,
+        protobuf_train_dictionary_final);
+}
@@ -0,0 +1,93 @@
+#include <string>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "connection.h"
+#include "header.h"
+#include "stats.h"
+#include "utilities.h"
+
+
+/// Names for the values of the extract_engine setting
+static const char *engine_names[] = {
+    "auto",        // ENGINE_AUTO
+    "reflection",  // ENGINE_REFLECTION
+    "wire",        // ENGINE_WIRE
+};
+
+
+/// Names for the values of the stats setting
+static const char *stats_names[] = {
+    "off",       // STATS_OFF
+    "counters",  // STATS_COUNTERS
+    "timing",    // STATS_TIMING
+};
+
+
+/// Returns the index of a value's name, or -1 if it is not one of the names
+static int find_name(const char **names, int nnames, const std::string& value)
+{
+    for (int i = 0; i < nnames; i ++) {
+        if (value == names[i]) return i;
+    }
+    return -1;
+}
+
+
+/// Gets or sets a setting of the extension for the current connection. Returns
+/// the value of the setting, after any change.
+///
+///     SELECT protobuf_config("extract_engine", "reflection");
+///
+static void protobuf_config(sqlite3_context *context,
+                            int argc,
+                            sqlite3_value **argv)
+{
+    connection *conn = connection::get(context);
+    const std::string name = string_from_sqlite3_value(argv[0]);
+
+    if (name == "extract_engine") {
+        if (argc > 1) {
+            int i = find_name(engine_names,
+                sizeof(engine_names) / sizeof(engine_names[0]),
+                string_from_sqlite3_value(argv[1]));
+            if (i < 0) {
+                sqlite3_result_error(context, "Unknown extract_engine", -1);
+                return;
+            }
+            conn->engine = static_cast<extract_engine>(i);
+        }
+        sqlite3_result_text(context, engine_names[conn->engine], -1,
+            SQLITE_STATIC);
+        return;
+    }
+
+    if (name == "stats") {
+        if (argc > 1) {
+            int i = find_name(stats_names,
+                sizeof(stats_names) / sizeof(stats_names[0]),
+                string_from_sqlite3_value(argv[1]));
+            if (i < 0) {
+                sqlite3_result_error(context, "Unknown stats level", -1);
+                return;
+            }
+            conn->stats.level = static_cast<stats_level>(i);
+        }
+        sqlite3_result_text(context, stats_names[conn->stats.level], -1,
+            SQLITE_STATIC);
+        return;
+    }
+
+    sqlite3_result_error(context, "Unknown setting", -1);
+}
+
+
+DECLARE_(protobuf_config)
+{
+    int err = create_function(db, conn, "protobuf_config", 1, SQLITE_UTF8,
+        protobuf_config);
+    if (err != SQLITE_OK) return err;
+    return create_function(db, conn, "protobuf_config", 2, SQLITE_UTF8,
+        protobuf_config);
+}
@@ -0,0 +1,554 @@
+#include <climits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "compression.h"
+#include "connection.h"
+#include "extract.h"
+#include "header.h"
+#include "message_factory.h"
+#include "path.h"
+#include "stats.h"
+#include "wire.h"
+
+using google::protobuf::FieldDescriptor;
+using google::protobuf::Message;
+
+
+// The column indexes, corresponding to the order of the columns in the CREATE
+// TABLE statement in xConnect
+enum {
+    COLUMN_KEY,
+    COLUMN_VALUE,
+    COLUMN_TYPE,
+    COLUMN_PATH,
+    COLUMN_MESSAGE,
+    COLUMN_TYPE_NAME,
+    COLUMN_ROOT,
+};
+
+// The indexing strategies used by MODULE_FUNC(xBestIndex) and MODULE_FUNC(xFilter)
+enum {
+    LOOKUP_ALL,
+    LOOKUP_BY_KEY,
+};
+
+
+#define MODULE_FUNC(func) protobuf_each ## _ ## func
+
+
+// each_vtab is a subclass of sqlite3_vtab which remembers the connection
+// state the module was registered with
+typedef struct each_vtab each_vtab;
+struct each_vtab {
+    sqlite3_vtab base;
+    sqlite3 *db;
+    connection *conn;
+};
+
+
+// each_cursor is a subclass of sqlite3_vtab_cursor which walks the elements
+// of a repeated field. Elements are read one at a time from the wire format
+// if possible; otherwise the message is parsed into the cursor's arena and
+// the elements are read with reflection. A path with wildcards is matched
+// against the parsed message all at once.
+typedef struct each_cursor each_cursor;
+struct each_cursor {
+    sqlite3_vtab_cursor base;
+    std::string data;
+    std::unique_ptr<compiled_path> path;
+    parsed_message parsed;
+    message_arena arena;
+
+    // The path of an element, split around the index
+    std::string path_prefix;
+    std::string path_suffix;
+    std::string type;
+
+    // Set while reading from the wire format
+    std::unique_ptr<wire_iterator> iterator;
+    wire_value value;
+
+    // Set once reading with reflection
+    const Message *container;
+    sqlite3_int64 count;
+
+    // Set if the path has wildcards
+    std::vector<path_match> matches;
+
+    sqlite3_int64 index;
+    sqlite3_int64 stopIndex;
+    bool eof;
+};
+
+
+/// Connect to the eponymous virtual table
+static int MODULE_FUNC(xConnect) (
+    sqlite3 *db,
+    void *pAux,
+    int argc, const char * const *argv,
+    sqlite3_vtab **ppVtab,
+    char **pzErr
+) {
+    int err = sqlite3_declare_vtab(db,
+        "CREATE TABLE tbl("
+        "    key INTEGER,"
+        "    value,"
+        "    type TEXT,"
+        "    path TEXT,"
+        "    message BLOB HIDDEN,"
+        "    type_name TEXT HIDDEN,"
+        "    root TEXT HIDDEN"
+        ")");
+    if (err != SQLITE_OK) return err;
+
+    each_vtab *vtab = new each_vtab();
+    vtab->db = db;
+    vtab->conn = static_cast<connection *>(pAux);
+    *ppVtab = &vtab->base;
+    return SQLITE_OK;
+}
+
+
+/// Undoes xConnect
+static int MODULE_FUNC(xDisconnect) (sqlite3_vtab *pVtab)
+{
+    delete reinterpret_cast<each_vtab *>(pVtab);
+    return SQLITE_OK;
+}
+
+
+/// Constructor each_cursor objects
+static int MODULE_FUNC(xOpen) (sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor)
+{
+    each_cursor *cursor = new each_cursor();
+    cursor->eof = true;
+    *ppCursor = &cursor->base;
+    return SQLITE_OK;
+}
+
+/// Destructor each_cursor objects
+static int MODULE_FUNC(xClose) (sqlite3_vtab_cursor *cur)
+{
+    delete reinterpret_cast<each_cursor *>(cur);
+    return SQLITE_OK;
+}
+
+
+/// Reports an error from a cursor method
+static int set_error(each_cursor *cursor, const char *message)
+{
+    sqlite3_vtab *vtab = cursor->base.pVtab;
+    sqlite3_free(vtab->zErrMsg);
+    vtab->zErrMsg = sqlite3_mprintf("%s", message);
+    return SQLITE_ERROR;
+}
+
+
+/// Stops reading from the wire format and parses the message instead. The
+/// elements already read are the same either way, so the scan carries on
+/// from the current index.
+static int use_reflection(each_cursor *cursor)
+{
+    cursor->iterator.reset();
+    const Message *root = cursor->parsed.get(cursor->path->descriptor);
+    if (!root)
+        return set_error(cursor, "Failed to parse message");
+
+    const compiled_path& path = *cursor->path;
+    cursor->container = follow_path(root, path, path.elements.size() - 1);
+    cursor->count = !cursor->container ? 0 : cursor->container
+        ->GetReflection()->FieldSize(*cursor->container,
+                                     path.elements.back().field);
+    return SQLITE_OK;
+}
+
+
+/// Reads the element at the current index, which must be one past the last
+/// element read, and sets eof if there is no such element
+static int read_element(each_cursor *cursor)
+{
+    if (cursor->index >= cursor->stopIndex) {
+        cursor->eof = true;
+        return SQLITE_OK;
+    }
+
+    if (cursor->iterator) {
+        switch (cursor->iterator->next(&cursor->value)) {
+        case WIRE_FOUND:
+            return SQLITE_OK;
+        case WIRE_FALLBACK:
+            break;
+        default:
+            cursor->eof = true;
+            return SQLITE_OK;
+        }
+
+        int err = use_reflection(cursor);
+        if (err != SQLITE_OK) return err;
+    }
+
+    cursor->eof = cursor->index >= cursor->count;
+    return SQLITE_OK;
+}
+
+
+/// Advance to the next element
+static int MODULE_FUNC(xNext) (sqlite3_vtab_cursor *cur)
+{
+    each_cursor *cursor = (each_cursor *)cur;
+    connection *conn = ((each_vtab *)cur->pVtab)->conn;
+    stats_call call(conn->stats, FUNCTION_EACH, PHASE_WALK);
+    cursor->index += 1;
+    return read_element(cursor);
+}
+
+
+/// Returns the current index
+static int MODULE_FUNC(xRowid) (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
+{
+    each_cursor *cursor = (each_cursor *)cur;
+    *pRowid = cursor->index;
+    return SQLITE_OK;
+}
+
+
+/// Returns true once every element has been returned
+static int MODULE_FUNC(xEof) (sqlite3_vtab_cursor *cur)
+{
+    each_cursor *cursor = (each_cursor *)cur;
+    return cursor->eof;
+}
+
+
+/// Returns the name to report in the type column for the elements of a field.
+/// Messages and enums use the full type name, which can be passed back to the
+/// other functions.
+static std::string element_type(const FieldDescriptor *field)
+{
+    if (field->message_type())
+        return field->message_type()->full_name();
+    if (field->enum_type())
+        return field->enum_type()->full_name();
+    return field->type_name();
+}
+
+
+/// Return the fields in a given cell of the table
+static int MODULE_FUNC(xColumn) (
+    sqlite3_vtab_cursor *cur,
+    sqlite3_context *ctx,
+    int i
+) {
+    each_cursor *cursor = (each_cursor *)cur;
+    connection *conn = ((each_vtab *)cur->pVtab)->conn;
+    stats_call call(conn->stats, FUNCTION_EACH, PHASE_RESULT, false);
+    const compiled_path& path = *cursor->path;
+    const FieldDescriptor *field = path.elements.back().field;
+    const path_match *match = path.wildcards
+        ? &cursor->matches[static_cast<size_t>(cursor->index)] : nullptr;
+
+    switch (i) {
+    case COLUMN_KEY:
+        sqlite3_result_int64(ctx, cursor->index);
+        break;
+    case COLUMN_VALUE:
+        if (cursor->iterator)
+            result_from_wire(ctx, field, cursor->value, path.enum_name);
+        else if (match)
+            result_from_field(ctx, *match->message, match->field,
+                match->index, path.enum_name);
+        else
+            result_from_field(ctx, *cursor->container, field,
+                static_cast<int>(cursor->index), path.enum_name);
+        break;
+    case COLUMN_TYPE:
+        if (match) {
+            std::string type = element_type(match->field);
+            sqlite3_result_text(ctx, type.c_str(), type.length(),
+                SQLITE_TRANSIENT);
+            break;
+        }
+        sqlite3_result_text(ctx, cursor->type.c_str(), cursor->type.length(),
+            SQLITE_TRANSIENT);
+        break;
+    case COLUMN_PATH:
+    {
+        if (match) {
+            sqlite3_result_text(ctx, match->path.c_str(),
+                match->path.length(), SQLITE_TRANSIENT);
+            break;
+        }
+        std::string element_path = cursor->path_prefix + "["
+            + std::to_string(cursor->index) + "]" + cursor->path_suffix;
+        sqlite3_result_text(ctx, element_path.c_str(), element_path.length(),
+            SQLITE_TRANSIENT);
+        break;
+    }
+    case COLUMN_MESSAGE:
+        sqlite3_result_blob(ctx, cursor->data.data(), cursor->data.length(),
+            SQLITE_TRANSIENT);
+        break;
+    case COLUMN_TYPE_NAME:
+        sqlite3_result_text(ctx, path.type_name.c_str(),
+            path.type_name.length(), SQLITE_TRANSIENT);
+        break;
+    case COLUMN_ROOT:
+        sqlite3_result_text(ctx, path.path.c_str(), path.path.length(),
+            SQLITE_TRANSIENT);
+        break;
+    }
+    return SQLITE_OK;
+}
+
+
+/// Requires the message, type name, and path of the repeated field. A
+/// constraint on the key is used to stop after that element.
+static int MODULE_FUNC(xBestIndex) (
+    sqlite3_vtab *tab,
+    sqlite3_index_info *pIdxInfo
+)
+{
+    int messageEqConstraintIdx = -1;
+    int typeEqConstraintIdx = -1;
+    int rootEqConstraintIdx = -1;
+    int keyEqConstraintIdx = -1;
+
+    const auto *constraint = pIdxInfo->aConstraint;
+    for(int i = 0; i < pIdxInfo->nConstraint; i ++, constraint ++) {
+        if (!constraint->usable) continue;
+        if (constraint->op != SQLITE_INDEX_CONSTRAINT_EQ) continue;
+        switch (constraint->iColumn) {
+        case COLUMN_MESSAGE:
+            messageEqConstraintIdx = i;
+            break;
+        case COLUMN_TYPE_NAME:
+            typeEqConstraintIdx = i;
+            break;
+        case COLUMN_ROOT:
+            rootEqConstraintIdx = i;
+            break;
+        case COLUMN_KEY:
+            keyEqConstraintIdx = i;
+            break;
+        }
+    }
+
+    // Without the message, its type, and the path, there is nothing to return
+    if (messageEqConstraintIdx == -1 || typeEqConstraintIdx == -1
+        || rootEqConstraintIdx == -1) {
+        return SQLITE_CONSTRAINT;
+    }
+
+    // Pass the arguments to xFilter:
+    //     argv[0] = message
+    //     argv[1] = type name
+    //     argv[2] = path
+    //     argv[3] = key, if constrained
+    int argIdx = 1;
+    for (int constraintIdx : { messageEqConstraintIdx, typeEqConstraintIdx,
+                               rootEqConstraintIdx }) {
+        pIdxInfo->aConstraintUsage[constraintIdx].argvIndex = argIdx ++;
+        pIdxInfo->aConstraintUsage[constraintIdx].omit = 1;
+    }
+
+    // The key is converted to an integer to decide where to stop, so SQLite
+    // still checks the constraint itself in case the conversion was lossy
+    if (keyEqConstraintIdx >= 0) {
+        pIdxInfo->aConstraintUsage[keyEqConstraintIdx].argvIndex = argIdx ++;
+        pIdxInfo->idxNum = LOOKUP_BY_KEY;
+        pIdxInfo->estimatedCost = 5;
+        pIdxInfo->estimatedRows = 1;
+        pIdxInfo->idxFlags |= SQLITE_INDEX_SCAN_UNIQUE;
+    } else {
+        pIdxInfo->idxNum = LOOKUP_ALL;
+        pIdxInfo->estimatedCost = 100;
+        pIdxInfo->estimatedRows = 10;
+    }
+
+    // Elements are returned in order
+    if (pIdxInfo->nOrderBy == 1 && pIdxInfo->aOrderBy[0].iColumn == COLUMN_KEY
+        && !pIdxInfo->aOrderBy[0].desc) {
+        pIdxInfo->orderByConsumed = 1;
+    }
+
+    return SQLITE_OK;
+}
+
+
+/// Copy the message, compile the path, and position the cursor at the first
+/// element to return
+static int MODULE_FUNC(xFilter) (
+    sqlite3_vtab_cursor *pVtabCursor,
+    int idxNum, const char *idxStr,
+    int argc, sqlite3_value **argv
+){
+    each_cursor *cursor = (each_cursor *)pVtabCursor;
+    connection *conn = ((each_vtab *)pVtabCursor->pVtab)->conn;
+    stats_call call(conn->stats, FUNCTION_EACH);
+    cursor->eof = true;
+
+    // Reuse the compiled path from the previous call if it has not changed
+    if (!cursor->path || !cursor->path->matches(argv[1], argv[2])) {
+        std::string error_msg;
+        cursor->path.reset(
+            new_compiled_path(conn, argv[1], argv[2], &error_msg,
+                SELECTS_MANY));
+        if (!cursor->path)
+            return set_error(cursor, error_msg.c_str());
+        if (!cursor->path->wildcards && !cursor->path->all_elements) {
+            cursor->path.reset();
+            return set_error(cursor, "Path does not select a repeated field");
+        }
+
+        // Rebuild the path of an element from the field names. Each match of
+        // a path with wildcards has its own path and type.
+        cursor->path_prefix = "$";
+        for (const path_element& element : cursor->path->elements) {
+            if (cursor->path->wildcards)
+                break;
+            cursor->path_prefix += "." + element.field->name();
+            if (&element != &cursor->path->elements.back()
+                && element.field->is_repeated())
+                cursor->path_prefix +=
+                    "[" + std::to_string(element.index) + "]";
+        }
+        cursor->path_suffix = cursor->path->enum_name ? ".name" : "";
+        if (!cursor->path->wildcards)
+            cursor->type = element_type(cursor->path->elements.back().field);
+    }
+
+    // The argument is only valid during this call, so keep a copy, which is
+    // decompressed if need be
+    const uint8_t *data =
+        static_cast<const uint8_t *>(sqlite3_value_blob(argv[0]));
+    size_t size = static_cast<size_t>(sqlite3_value_bytes(argv[0]));
+    std::string error_msg;
+    if (!decompress_message(conn, ((each_vtab *)pVtabCursor->pVtab)->db,
+            &data, &size, &error_msg)) {
+        sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+        pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf("%s", error_msg.c_str());
+        return SQLITE_ERROR;
+    }
+    cursor->data.assign(data ? reinterpret_cast<const char *>(data) : "",
+        size);
+    cursor->parsed = parsed_message(
+        reinterpret_cast<const uint8_t *>(cursor->data.data()),
+        cursor->data.length(), conn, &cursor->arena);
+    conn->stats.count_path(*cursor->path);
+    conn->stats.count_bytes(
+        static_cast<size_t>(sqlite3_value_bytes(argv[0])));
+    conn->stats.enter_phase(PHASE_WALK);
+    cursor->iterator.reset();
+    cursor->container = nullptr;
+    cursor->count = 0;
+    cursor->matches.clear();
+
+    // Decide which elements to return
+    sqlite3_int64 key = 0;
+    cursor->stopIndex = LLONG_MAX;
+    if (idxNum == LOOKUP_BY_KEY) {
+        if (sqlite3_value_type(argv[3]) == SQLITE_NULL)
+            return SQLITE_OK;
+        key = sqlite3_value_int64(argv[3]);
+        if (key < 0)
+            return SQLITE_OK;
+        cursor->stopIndex = key + 1;
+    }
+
+    // Wildcards are matched in one go, and the matches are returned in order
+    const compiled_path& path = *cursor->path;
+    if (path.wildcards) {
+        const Message *root = cursor->parsed.get(path.descriptor);
+        if (!root)
+            return set_error(cursor, "Failed to parse message");
+        match_path(*root, path, true, &cursor->matches);
+        cursor->count = static_cast<sqlite3_int64>(cursor->matches.size());
+        cursor->eof = false;
+        cursor->index = key;
+        return read_element(cursor);
+    }
+
+    // Find the message holding the repeated field without parsing everything.
+    // If the message type needs a full parse to show that the message is
+    // valid, the elements can still be read from the original bytes
+    // afterwards.
+    bool use_wire = conn->engine != ENGINE_REFLECTION && path.wire_after_parse;
+    if (use_wire && !path.wire_supported
+        && !cursor->parsed.get(path.descriptor))
+        return set_error(cursor, "Failed to parse message");
+    wire_value container;
+    if (use_wire) {
+        switch (wire_find_container(path,
+                    reinterpret_cast<const uint8_t *>(cursor->data.data()),
+                    cursor->data.length(), &container)) {
+        case WIRE_FOUND:
+            cursor->iterator.reset(new wire_iterator(
+                path.elements.back().field, container.data, container.size));
+            break;
+        case WIRE_FALLBACK:
+            use_wire = false;
+            break;
+        default:
+            // The message holding the field is not present
+            return SQLITE_OK;
+        }
+    }
+    if (!use_wire) {
+        int err = use_reflection(cursor);
+        if (err != SQLITE_OK) return err;
+    }
+
+    // Elements are read in order on the wire, but can be jumped to with
+    // reflection
+    cursor->eof = false;
+    if (cursor->iterator) {
+        cursor->index = 0;
+        int err = read_element(cursor);
+        while (err == SQLITE_OK && !cursor->eof && cursor->index < key) {
+            cursor->index += 1;
+            err = read_element(cursor);
+        }
+        return err;
+    }
+    cursor->index = key;
+    return read_element(cursor);
+}
+
+
+static sqlite3_module module = {
+  0,                         /* iVersion */
+  0,                         /* xCreate */
+  MODULE_FUNC(xConnect),     /* xConnect - required */
+  MODULE_FUNC(xBestIndex),   /* xBestIndex - required */
+  MODULE_FUNC(xDisconnect),  /* xDisconnect - required */
+  0,                         /* xDestroy */
+  MODULE_FUNC(xOpen),        /* xOpen - open a cursor - required */
+  MODULE_FUNC(xClose),       /* xClose - close a cursor - required */
+  MODULE_FUNC(xFilter),      /* xFilter - configure scan constraints - required */
+  MODULE_FUNC(xNext),        /* xNext - advance a cursor - required */
+  MODULE_FUNC(xEof),         /* xEof - check for end of scan - required */
+  MODULE_FUNC(xColumn),      /* xColumn - read data - required */
+  MODULE_FUNC(xRowid),       /* xRowid - read data - required */
+  0,                         /* xUpdate */
+  0,                         /* xBegin */
+  0,                         /* xSync */
+  0,                         /* xCommit */
+  0,                         /* xRollback */
+  0,                         /* xFindMethod */
+  0,                         /* xRename */
+};
+
+
+DECLARE_(protobuf_each)
+{
+    return sqlite3_create_module_v2(db, "protobuf_each", &module,
+        conn->retain(), connection::release);
+}
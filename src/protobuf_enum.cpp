@@ -1,3 +1,10 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include <strings.h>
 #include <stdio.h>
 
@@ -8,10 +15,10 @@
 #include <sqlite3ext.h>
 SQLITE_EXTENSION_INIT3
 
+#include "connection.h"
 #include "header.h"
 #include "utilities.h"
 
-using google::protobuf::DescriptorPool;
 using google::protobuf::EnumDescriptor;
 using google::protobuf::EnumValueDescriptor;
 
@@ -24,26 +31,61 @@ enum {
     COLUMN_ENUM,
 };
 
-// The indexing strategies used by MODULE_FUNC(xBestIndex) and MODULE_FUNC(xFilter)
+// The indexing strategies used by MODULE_FUNC(xBestIndex) and MODULE_FUNC(xFilter),
+// which are combined in idxNum. Without any, every value is returned in the
+// order they are declared.
 enum {
-    LOOKUP_ALL,
-    LOOKUP_BY_NUMBER,
-    LOOKUP_BY_NAME,
+    LOOKUP_BY_NAME = 1,
+    LOOKUP_BY_NUMBER = 2,
+    LOOKUP_NUMBER_IN = 4,
+    LOOKUP_LOWER_GE = 8,
+    LOOKUP_LOWER_GT = 16,
+    LOOKUP_UPPER_LE = 32,
+    LOOKUP_UPPER_LT = 64,
+    /// Return the values in order of their numbers, and with ORDER_DESC, in
+    /// the reverse order
+    ORDER_NUMBER = 128,
+    ORDER_DESC = 256,
 };
 
+// The number of values assumed for an enum type that cannot be looked up while
+// planning a query
+static const double ASSUMED_VALUE_COUNT = 16;
+
+// sqlite3_vtab_in and sqlite3_vtab_rhs_value were added in SQLite 3.38.0
+#if SQLITE_VERSION_NUMBER >= 3038000
+#define HAVE_VTAB_IN 1
+#else
+#define HAVE_VTAB_IN 0
+#endif
+
 
 #define MODULE_FUNC(func) protobuf_enum ## _ ## func
 
 
-// enum_cursor is a subclass of sqlite3_vtab_cursor which holds metadata that
-// allows us to iterate over the EnumDescriptor
+// enum_vtab is a subclass of sqlite3_vtab which remembers the connection
+// state, whose loaded descriptors are searched for the enum type
+typedef struct enum_vtab enum_vtab;
+struct enum_vtab {
+    sqlite3_vtab base;
+    connection *conn;
+};
+
+
+// enum_cursor is a subclass of sqlite3_vtab_cursor which holds the values of
+// the EnumDescriptor that match the constraints. The same cursor is filtered
+// again for every row of the outer loop of a join, so it keeps the last enum
+// type it looked up, and the values of that type sorted by number, until the
+// version of the connection's descriptors changes.
 typedef struct enum_cursor enum_cursor;
 struct enum_cursor {
     sqlite3_vtab_cursor base;
+    std::string enum_name;
+    uint64_t version;
     const EnumDescriptor *descriptor;
-    sqlite3_int64 index;
-    sqlite3_int64 stopIndex;
-    bool isInvalid;
+    std::vector<const EnumValueDescriptor *> by_number;
+    std::vector<const EnumValueDescriptor *> rows;
+    size_t position;
 };
 
 
@@ -63,9 +105,11 @@ static int MODULE_FUNC(xConnect) (
         ")");
     if (err != SQLITE_OK) return err;
 
-    *ppVtab = (sqlite3_vtab *)sqlite3_malloc(sizeof(**ppVtab));
-    if (!*ppVtab) return SQLITE_NOMEM;
-    bzero(*ppVtab, sizeof(**ppVtab));
+    enum_vtab *vtab = (enum_vtab *)sqlite3_malloc(sizeof(*vtab));
+    if (!vtab) return SQLITE_NOMEM;
+    bzero(vtab, sizeof(*vtab));
+    vtab->conn = static_cast<connection *>(pAux);
+    *ppVtab = &vtab->base;
 
     return SQLITE_OK;
 }
@@ -82,10 +126,7 @@ static int MODULE_FUNC(xDisconnect) (sqlite3_vtab *pVtab)
 /// Constructor enum_cursor objects
 static int MODULE_FUNC(xOpen) (sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor)
 {
-    enum_cursor *cursor = (enum_cursor *)sqlite3_malloc(sizeof(*cursor));
-    if (!cursor)
-        return SQLITE_NOMEM;
-    bzero(cursor, sizeof(*cursor));
+    enum_cursor *cursor = new enum_cursor();
     *ppCursor = &cursor->base;
     return SQLITE_OK;
 }
@@ -93,24 +134,24 @@ static int MODULE_FUNC(xOpen) (sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor)
 /// Destructor enum_cursor objects
 static int MODULE_FUNC(xClose) (sqlite3_vtab_cursor *cur)
 {
-    sqlite3_free(cur);
+    delete (enum_cursor *)cur;
     return SQLITE_OK;
 }
 
-/// Advance the index to the next enum value
+/// Advance to the next matching enum value
 static int MODULE_FUNC(xNext) (sqlite3_vtab_cursor *cur)
 {
     enum_cursor *cursor = (enum_cursor *)cur;
-    cursor->index += 1;
+    cursor->position += 1;
     return SQLITE_OK;
 }
 
 
-/// Returns the current index
+/// Returns the index of the current value in the enum type
 static int MODULE_FUNC(xRowid) (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
 {
     enum_cursor *cursor = (enum_cursor *)cur;
-    *pRowid = cursor->index;
+    *pRowid = cursor->rows[cursor->position]->index();
     return SQLITE_OK;
 }
 
@@ -119,8 +160,7 @@ static int MODULE_FUNC(xRowid) (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
 static int MODULE_FUNC(xEof) (sqlite3_vtab_cursor *cur)
 {
     enum_cursor *cursor = (enum_cursor *)cur;
-    return !cursor->descriptor || cursor->isInvalid ||
-        cursor->index >= cursor->stopIndex;
+    return cursor->position >= cursor->rows.size();
 }
 
 
@@ -131,14 +171,13 @@ static int MODULE_FUNC(xColumn) (
     int i
 ) {
     enum_cursor *cursor = (enum_cursor *)cur;
+    const EnumValueDescriptor *value = cursor->rows[cursor->position];
     switch (i) {
     case COLUMN_NUMBER:
-        sqlite3_result_int(ctx,
-            cursor->descriptor->value(cursor->index)->number());
+        sqlite3_result_int(ctx, value->number());
         break;
     case COLUMN_NAME:
-        sqlite3_result_text(ctx, 
-            cursor->descriptor->value(cursor->index)->name().c_str(), -1, 0);
+        sqlite3_result_text(ctx, value->name().c_str(), -1, 0);
         break;
     case COLUMN_ENUM:
         sqlite3_result_text(ctx,
@@ -149,15 +188,44 @@ static int MODULE_FUNC(xColumn) (
 }
 
 
-/// 
+/// Returns the number of values of the enum type that a query is constrained
+/// to, if it is known while planning
+static double count_values(enum_vtab *vtab,
+                           sqlite3_index_info *pIdxInfo,
+                           int enumEqConstraintIdx)
+{
+#if HAVE_VTAB_IN
+    sqlite3_value *value = nullptr;
+    if (sqlite3_libversion_number() >= 3038000
+        && sqlite3_vtab_rhs_value(pIdxInfo, enumEqConstraintIdx, &value)
+               == SQLITE_OK
+        && value && sqlite3_value_type(value) == SQLITE_TEXT) {
+        const EnumDescriptor *descriptor = vtab->conn->descriptors
+            .find_enum_type(string_from_sqlite3_value(value));
+        if (descriptor)
+            return descriptor->value_count();
+    }
+#endif
+    return ASSUMED_VALUE_COUNT;
+}
+
+
+/// Chooses how to find the values that match the constraints. Every value is
+/// returned by default, in the order they are declared. A constraint on the
+/// name finds at most one value, while constraints on the number are looked up
+/// in the values sorted by number, which also gives them in the order that an
+/// ORDER BY number asks for.
 static int MODULE_FUNC(xBestIndex) (
     sqlite3_vtab *tab,
     sqlite3_index_info *pIdxInfo
 )
 {
-    // Loop over the constraints to find useful ones -- namely, ones that pin
-    // a column to a specific value
+    // Loop over the constraints to find useful ones: ones that pin a column
+    // to a specific value, or the number to a set or range of values
     int numberEqConstraintIdx = -1;
+    int numberInConstraintIdx = -1;
+    int lowerConstraintIdx = -1;
+    int upperConstraintIdx = -1;
     int nameEqConstraintIdx = -1;
     int enumEqConstraintIdx = -1;
     
@@ -167,6 +235,15 @@ static int MODULE_FUNC(xBestIndex) (
         if (constraint->op == SQLITE_INDEX_CONSTRAINT_EQ) {
             switch(constraint->iColumn) {
             case COLUMN_NUMBER:
+#if HAVE_VTAB_IN
+                // An IN constraint is an equality constraint that can be
+                // given all of its values at once
+                if (sqlite3_libversion_number() >= 3038000
+                    && sqlite3_vtab_in(pIdxInfo, i, -1)) {
+                    numberInConstraintIdx = i;
+                    break;
+                }
+#endif
                 numberEqConstraintIdx = i;
                 break;
             case COLUMN_NAME:
@@ -176,6 +253,17 @@ static int MODULE_FUNC(xBestIndex) (
                 enumEqConstraintIdx = i;
                 break;
             }
+        } else if (constraint->iColumn == COLUMN_NUMBER) {
+            switch (constraint->op) {
+            case SQLITE_INDEX_CONSTRAINT_GT:
+            case SQLITE_INDEX_CONSTRAINT_GE:
+                lowerConstraintIdx = i;
+                break;
+            case SQLITE_INDEX_CONSTRAINT_LT:
+            case SQLITE_INDEX_CONSTRAINT_LE:
+                upperConstraintIdx = i;
+                break;
+            }
         }
     }
     
@@ -184,44 +272,80 @@ static int MODULE_FUNC(xBestIndex) (
         return SQLITE_CONSTRAINT;
     }
     
-    // If we have a constraint on the name, we can only return zero or one
-    // matching rows. We can't say the same for a constraint on the number,
-    // in case aliases are allowed. This allows SQLite to be more efficient.
+    // Decide on the indexing strategy to use, and estimate how many rows it
+    // gives. A constraint on the name can only match zero or one rows. We
+    // can't say the same for a constraint on the number, in case aliases are
+    // allowed, but they are rare.
+    double values = count_values((enum_vtab *)tab, pIdxInfo,
+        enumEqConstraintIdx);
+    double rows = values;
+    pIdxInfo->idxNum = 0;
     if (nameEqConstraintIdx >= 0) {
+        pIdxInfo->idxNum = LOOKUP_BY_NAME;
         pIdxInfo->idxFlags |= SQLITE_INDEX_SCAN_UNIQUE;
-    }
-    
-    // Decide on the indexing strategy to use. Also, tell SQLite the cost of
-    // different combinations of constraints, to help it compare multiple query
-    // plans.
-    if (numberEqConstraintIdx >= 0 && nameEqConstraintIdx < 0) {
+        rows = 1;
+    } else if (numberEqConstraintIdx >= 0) {
         pIdxInfo->idxNum = LOOKUP_BY_NUMBER;
-        pIdxInfo->estimatedCost = 1;
-    } else if (nameEqConstraintIdx >= 0) {
-        pIdxInfo->idxNum = LOOKUP_BY_NAME;
-        pIdxInfo->estimatedCost = 5;
+        rows = 1;
     } else {
-        pIdxInfo->idxNum = LOOKUP_ALL;
-        pIdxInfo->estimatedCost = 100;
+        if (numberInConstraintIdx >= 0) {
+            pIdxInfo->idxNum |= LOOKUP_NUMBER_IN;
+            rows = std::min(values, 4.0);
+        }
+        if (lowerConstraintIdx >= 0) {
+            pIdxInfo->idxNum |=
+                pIdxInfo->aConstraint[lowerConstraintIdx].op
+                    == SQLITE_INDEX_CONSTRAINT_GT
+                ? LOOKUP_LOWER_GT : LOOKUP_LOWER_GE;
+            rows /= 4;
+        }
+        if (upperConstraintIdx >= 0) {
+            pIdxInfo->idxNum |=
+                pIdxInfo->aConstraint[upperConstraintIdx].op
+                    == SQLITE_INDEX_CONSTRAINT_LT
+                ? LOOKUP_UPPER_LT : LOOKUP_UPPER_LE;
+            rows /= 4;
+        }
+    }
+    rows = std::max(rows, 1.0);
+    pIdxInfo->estimatedRows = static_cast<sqlite3_int64>(rows);
+    pIdxInfo->estimatedCost = rows + (pIdxInfo->idxNum ? 1 : 0);
+
+    // Values are looked up by number in sorted order, so the results can be
+    // given in the order SQLite asks for without sorting them afterwards
+    if (pIdxInfo->nOrderBy == 1
+        && pIdxInfo->aOrderBy[0].iColumn == COLUMN_NUMBER) {
+        pIdxInfo->idxNum |= ORDER_NUMBER;
+        if (pIdxInfo->aOrderBy[0].desc)
+            pIdxInfo->idxNum |= ORDER_DESC;
+        pIdxInfo->orderByConsumed = 1;
     }
     
     // Copy the values of our constraints (i.e., the right-hand sides of the
-    // equality assertions) into the arguments that will be passed to MODULE_FUNC(xFilter).
+    // comparisons) into the arguments that will be passed to MODULE_FUNC(xFilter).
     //     argv[0] = enum type name
-    //     argv[1] = number or name to lookup
+    //     then the name, the number, or the set of numbers to look up
+    //     then the lower and upper bounds of the number
     int argIdx = 1;
     pIdxInfo->aConstraintUsage[enumEqConstraintIdx].argvIndex = argIdx ++;
-    switch (pIdxInfo->idxNum) {
-    case LOOKUP_BY_NUMBER:
-        pIdxInfo->aConstraintUsage[numberEqConstraintIdx].argvIndex = argIdx ++;
-        break;
-    case LOOKUP_BY_NAME:
+    if (pIdxInfo->idxNum & LOOKUP_BY_NAME)
         pIdxInfo->aConstraintUsage[nameEqConstraintIdx].argvIndex = argIdx ++;
-        break;
+    if (pIdxInfo->idxNum & LOOKUP_BY_NUMBER)
+        pIdxInfo->aConstraintUsage[numberEqConstraintIdx].argvIndex = argIdx ++;
+    if (pIdxInfo->idxNum & LOOKUP_NUMBER_IN) {
+        pIdxInfo->aConstraintUsage[numberInConstraintIdx].argvIndex = argIdx ++;
+#if HAVE_VTAB_IN
+        sqlite3_vtab_in(pIdxInfo, numberInConstraintIdx, 1);
+#endif
     }
+    if (pIdxInfo->idxNum & (LOOKUP_LOWER_GE | LOOKUP_LOWER_GT))
+        pIdxInfo->aConstraintUsage[lowerConstraintIdx].argvIndex = argIdx ++;
+    if (pIdxInfo->idxNum & (LOOKUP_UPPER_LE | LOOKUP_UPPER_LT))
+        pIdxInfo->aConstraintUsage[upperConstraintIdx].argvIndex = argIdx ++;
 
     // For some constraints, SQLite does not need to double check that our
-    // output matches the constraints.
+    // output matches the constraints. Numbers are compared as SQLite would
+    // compare them, but only when they are numeric, so they are checked again.
     for (int constraintIdx : { enumEqConstraintIdx, nameEqConstraintIdx }) {
         if (constraintIdx >= 0) {
             pIdxInfo->aConstraintUsage[constraintIdx].omit = 1;
@@ -232,66 +356,180 @@ static int MODULE_FUNC(xBestIndex) (
 }
 
 
+/// Narrows the range [*low, *high] of enum numbers to those that can satisfy a
+/// comparison with the value, if it is numeric. Otherwise, the range is left
+/// as it is, and SQLite rejects the values that do not match.
+static void narrow_range(int op, sqlite3_value *value,
+                         double *low, double *high)
+{
+    int type = sqlite3_value_numeric_type(value);
+    if (type != SQLITE_INTEGER && type != SQLITE_FLOAT)
+        return;
+    double bound = sqlite3_value_double(value);
+    switch (op) {
+    case LOOKUP_LOWER_GE:
+        *low = std::max(*low, std::ceil(bound));
+        break;
+    case LOOKUP_LOWER_GT:
+        *low = std::max(*low, std::floor(bound) + 1);
+        break;
+    case LOOKUP_UPPER_LE:
+        *high = std::min(*high, std::floor(bound));
+        break;
+    case LOOKUP_UPPER_LT:
+        *high = std::min(*high, std::ceil(bound) - 1);
+        break;
+    }
+}
+
+
+/// Orders values by number, and aliases in the order they are declared
+static bool number_less(const EnumValueDescriptor *a,
+                        const EnumValueDescriptor *b)
+{
+    return a->number() < b->number()
+        || (a->number() == b->number() && a->index() < b->index());
+}
+
+
+/// Appends the values whose numbers are in the range [low, high], in order
+static void append_range(enum_cursor *cursor, double low, double high)
+{
+    auto begin = std::lower_bound(cursor->by_number.begin(),
+        cursor->by_number.end(), low,
+        [](const EnumValueDescriptor *value, double number) {
+            return value->number() < number;
+        });
+    auto end = std::upper_bound(begin, cursor->by_number.end(), high,
+        [](double number, const EnumValueDescriptor *value) {
+            return number < value->number();
+        });
+    cursor->rows.insert(cursor->rows.end(), begin, end);
+}
+
+
 /// Initialize the enum_cursor with information about the enum type, and
-/// position it at the start of the relevant results.
+/// find the values that match the constraints
 static int MODULE_FUNC(xFilter) (
     sqlite3_vtab_cursor *pVtabCursor, 
     int idxNum, const char *idxStr,
     int argc, sqlite3_value **argv
 ){
     enum_cursor *cursor = (enum_cursor *)pVtabCursor;
+    connection *conn = ((enum_vtab *)pVtabCursor->pVtab)->conn;
+    cursor->rows.clear();
+    cursor->position = 0;
     
-    // Find the descriptor for this enum type
-    std::string enum_name = string_from_sqlite3_value(argv[0]);
-    cursor->descriptor =
-        DescriptorPool::generated_pool()->FindEnumTypeByName(enum_name);
+    // Find the descriptor for this enum type, unless it is the same type as
+    // the last time the cursor was filtered and no types have been loaded since
+    const char *enum_name = reinterpret_cast<const char *>(
+        sqlite3_value_text(argv[0]));
+    size_t enum_name_length = static_cast<size_t>(sqlite3_value_bytes(argv[0]));
+    uint64_t version = conn->descriptors.version();
+    if (!cursor->descriptor || !enum_name || version != cursor->version
+        || enum_name_length != cursor->enum_name.length()
+        || memcmp(enum_name, cursor->enum_name.data(), enum_name_length) != 0)
+    {
+        cursor->version = version;
+        cursor->enum_name = string_from_sqlite3_value(argv[0]);
+        cursor->descriptor = conn->descriptors.find_enum_type(
+            cursor->enum_name);
+        cursor->by_number.clear();
+    }
     if (!cursor->descriptor) {
-        // TODO: Better way to report this error message?
-        sqlite3_log(SQLITE_WARNING, "Could not find enum type \"%s\"",
-            enum_name.c_str());
+        sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+        pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf(
+            "Could not find enum type \"%s\"", cursor->enum_name.c_str());
         return SQLITE_ERROR;
     }
+    const EnumDescriptor *descriptor = cursor->descriptor;
     
-    // Set the cursor to iterate over the whole set of enum values, but this
-    // may be overridden by a specific strategy.
-    cursor->index = 0;
-    cursor->stopIndex = cursor->descriptor->value_count();
-    
-    // If there's no particular index strategy, we don't need to do anything
-    // further.
-    if (idxNum == LOOKUP_ALL)
+    // A name finds at most one value
+    int arg = 1;
+    if (idxNum & LOOKUP_BY_NAME) {
+        const EnumValueDescriptor *value = descriptor->FindValueByName(
+            string_from_sqlite3_value(argv[arg ++]));
+        if (value)
+            cursor->rows.push_back(value);
         return SQLITE_OK;
+    }
     
-    // Otherwise, find the value by our constraint argument
-    const EnumValueDescriptor *value_desc;
-    switch (idxNum) {
-    case LOOKUP_BY_NUMBER:
-        value_desc = cursor->descriptor->FindValueByNumber(
-            sqlite3_value_int(argv[1]));
-        break;
-    case LOOKUP_BY_NAME:
-        value_desc = cursor->descriptor->FindValueByName(
-            string_from_sqlite3_value(argv[1]));
-        break;
+    // Without any constraint on the number, every value is returned, in the
+    // order they are declared unless they are to be sorted
+    if (idxNum == 0) {
+        for (int i = 0; i < descriptor->value_count(); i ++)
+            cursor->rows.push_back(descriptor->value(i));
+        return SQLITE_OK;
     }
     
-    if (!value_desc) {
-        cursor->isInvalid = 1;
+    // Without aliases, an integer finds at most one value, which is the usual
+    // case when a table of numbers is joined with the enum type
+    if (idxNum == LOOKUP_BY_NUMBER && !descriptor->options().allow_alias()
+        && sqlite3_value_type(argv[arg]) == SQLITE_INTEGER) {
+        sqlite3_int64 number = sqlite3_value_int64(argv[arg]);
+        const EnumValueDescriptor *value = nullptr;
+        if (number >= INT32_MIN && number <= INT32_MAX)
+            value = descriptor->FindValueByNumber(static_cast<int>(number));
+        if (value)
+            cursor->rows.push_back(value);
         return SQLITE_OK;
     }
+
+    // Sort the values by number, once for each enum type
+    if (cursor->by_number.empty()) {
+        for (int i = 0; i < descriptor->value_count(); i ++)
+            cursor->by_number.push_back(descriptor->value(i));
+        std::sort(cursor->by_number.begin(), cursor->by_number.end(),
+            number_less);
+    }
     
-    // Set the starting index to the index of the result
-    cursor->index = value_desc->index();
+    double low = -HUGE_VAL;
+    double high = HUGE_VAL;
+    if (idxNum & LOOKUP_BY_NUMBER) {
+        sqlite3_value *value = argv[arg ++];
+        narrow_range(LOOKUP_LOWER_GE, value, &low, &high);
+        narrow_range(LOOKUP_UPPER_LE, value, &low, &high);
+    }
+    sqlite3_value *in_list = nullptr;
+    if (idxNum & LOOKUP_NUMBER_IN)
+        in_list = argv[arg ++];
+    for (int op : { LOOKUP_LOWER_GE, LOOKUP_LOWER_GT,
+                    LOOKUP_UPPER_LE, LOOKUP_UPPER_LT }) {
+        if (idxNum & op)
+            narrow_range(op, argv[arg ++], &low, &high);
+    }
     
-    if (idxNum == LOOKUP_BY_NUMBER && 
-        cursor->descriptor->options().allow_alias()) {
-        // In this case, we cannot set an upper bound, because we need there
-        // may be additional values with the same number.
-    } else {
-        // Set the upper bound to the next entry
-        cursor->stopIndex = cursor->index + 1;
+    if (in_list) {
+#if HAVE_VTAB_IN
+        // Look up each distinct number in the list that is within range, in
+        // order
+        std::vector<double> numbers;
+        sqlite3_value *value;
+        int err;
+        for (err = sqlite3_vtab_in_first(in_list, &value);
+             err == SQLITE_OK && value;
+             err = sqlite3_vtab_in_next(in_list, &value)) {
+            double number = low;
+            double number_high = high;
+            narrow_range(LOOKUP_LOWER_GE, value, &number, &number_high);
+            narrow_range(LOOKUP_UPPER_LE, value, &number, &number_high);
+            if (number == number_high)
+                numbers.push_back(number);
+        }
+        if (err != SQLITE_OK && err != SQLITE_DONE)
+            return err;
+        std::sort(numbers.begin(), numbers.end());
+        numbers.erase(std::unique(numbers.begin(), numbers.end()),
+            numbers.end());
+        for (double number : numbers)
+            append_range(cursor, number, number);
+#endif
+    } else if (low <= high) {
+        append_range(cursor, low, high);
     }
     
+    if (idxNum & ORDER_DESC)
+        std::reverse(cursor->rows.begin(), cursor->rows.end());
     return SQLITE_OK;
 }
 
@@ -320,7 +558,128 @@ static sqlite3_module module = {
 };
 
 
+/// The names of the values of an enum type, by number. Numbers that are close
+/// together, as they usually are, are looked up in a table.
+struct enum_names {
+    std::string enum_name;
+    uint64_t version;
+    const EnumDescriptor *descriptor;
+    int first_number;
+    std::vector<const EnumValueDescriptor *> table;
+
+    /// Returns the first value declared with the number, or NULL
+    const EnumValueDescriptor *find(sqlite3_int64 number) const {
+        if (number >= first_number
+            && number - first_number < (sqlite3_int64)table.size())
+            return table[number - first_number];
+        if (number < INT32_MIN || number > INT32_MAX)
+            return nullptr;
+        return descriptor->FindValueByNumber(static_cast<int>(number));
+    }
+
+    static void destroy(void *p) {
+        delete static_cast<enum_names *>(p);
+    }
+};
+
+
+/// Looks up the enum type and builds the table of its values, unless there
+/// are far more numbers in between them than there are values
+static enum_names *new_enum_names(connection *conn,
+                                  const std::string& enum_name)
+{
+    const EnumDescriptor *descriptor =
+        conn->descriptors.find_enum_type(enum_name);
+    if (!descriptor)
+        return nullptr;
+    std::unique_ptr<enum_names> names(new enum_names());
+    names->enum_name = enum_name;
+    names->version = conn->descriptors.version();
+    names->descriptor = descriptor;
+    names->first_number = 0;
+
+    int64_t low = descriptor->value(0)->number();
+    int64_t high = low;
+    for (int i = 1; i < descriptor->value_count(); i ++) {
+        low = std::min<int64_t>(low, descriptor->value(i)->number());
+        high = std::max<int64_t>(high, descriptor->value(i)->number());
+    }
+    if (high - low < 4 * (int64_t)descriptor->value_count() + 16) {
+        names->first_number = static_cast<int>(low);
+        names->table.resize(high - low + 1);
+        for (int i = descriptor->value_count() - 1; i >= 0; i --) {
+            const EnumValueDescriptor *value = descriptor->value(i);
+            names->table[value->number() - low] = value;
+        }
+    }
+    return names.release();
+}
+
+
+/// Return the name of an enum value, or null if no value has the number
+///
+///     SELECT protobuf_enum_name("Person.PhoneType", 2);
+///
+/// @returns the name of the first value declared with the number
+static void protobuf_enum_name(sqlite3_context *context,
+                               int argc,
+                               sqlite3_value **argv)
+{
+    connection *conn = connection::get(context);
+
+    // Reuse the enum type from a previous row if the name matches, and no
+    // types have been loaded since
+    const char *enum_name = reinterpret_cast<const char *>(
+        sqlite3_value_text(argv[0]));
+    size_t enum_name_length = static_cast<size_t>(sqlite3_value_bytes(argv[0]));
+    if (!enum_name) {
+        sqlite3_result_null(context);
+        return;
+    }
+    enum_names *names = static_cast<enum_names *>(
+        sqlite3_get_auxdata(context, 0));
+    std::unique_ptr<enum_names> fallback;
+    if (!names || names->version != conn->descriptors.version()
+        || enum_name_length != names->enum_name.length()
+        || memcmp(enum_name, names->enum_name.data(), enum_name_length) != 0)
+    {
+        fallback.reset(new_enum_names(conn,
+            std::string(enum_name, enum_name_length)));
+        if (!fallback) {
+            sqlite3_result_error(context, "Could not find enum type", -1);
+            return;
+        }
+        names = fallback.release();
+        sqlite3_set_auxdata(context, 0, names, enum_names::destroy);
+        if (sqlite3_get_auxdata(context, 0) != names) {
+            fallback.reset(new_enum_names(conn,
+                std::string(enum_name, enum_name_length)));
+            names = fallback.get();
+        }
+    }
+
+    // Numbers stored as text or real are compared as SQLite would compare them
+    // with an INTEGER column
+    if (sqlite3_value_numeric_type(argv[1]) != SQLITE_INTEGER) {
+        sqlite3_result_null(context);
+        return;
+    }
+    const EnumValueDescriptor *value =
+        names->find(sqlite3_value_int64(argv[1]));
+    if (!value) {
+        sqlite3_result_null(context);
+        return;
+    }
+    sqlite3_result_text(context, value->name().c_str(),
+        value->name().length(), SQLITE_STATIC);
+}
+
+
 DECLARE_(protobuf_enum)
 {
-    return sqlite3_create_module(db, "protobuf_enum", &module, 0);
+    int err = sqlite3_create_module_v2(db, "protobuf_enum", &module,
+        conn->retain(), connection::release);
+    if (err != SQLITE_OK) return err;
+    return create_function(db, conn, "protobuf_enum_name", 2,
+        SQLITE_UTF8 | SQLITE_DETERMINISTIC, protobuf_enum_name);
 }
@@ -0,0 +1,216 @@
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include <google/protobuf/stubs/common.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "compression.h"
+#include "connection.h"
+#include "extract.h"
+#include "header.h"
+#include "path.h"
+#include "stats.h"
+#include "value.h"
+#include "wire.h"
+
+using google::protobuf::FieldDescriptor;
+using google::protobuf::Message;
+using google::protobuf::internal::WireFormatLite;
+
+
+/// The encodings protobuf_extract_all can return the values in
+enum extract_format {
+    FORMAT_JSON,
+    FORMAT_PACKED,
+};
+
+
+/// Appends a value in little-endian byte order
+template <typename T>
+static void append_fixed(std::string *output, T value)
+{
+    uint8_t bytes[sizeof(T)];
+    for (size_t i = 0; i < sizeof(T); i ++)
+        bytes[i] = static_cast<uint8_t>(value >> (8 * i));
+    output->append(reinterpret_cast<const char *>(bytes), sizeof(T));
+}
+
+
+/// Appends a value in the encoding of a repeated field with the same type.
+/// Numbers go into the payload of a single packed run, and everything else is
+/// appended to the output as a length-delimited element of field 1.
+static void append_packed(std::string *output,
+                          std::string *run,
+                          const FieldDescriptor *field,
+                          const field_value& value)
+{
+    if (value.type == SQLITE_TEXT || value.type == SQLITE_BLOB) {
+        wire_append_varint(output, WireFormatLite::MakeTag(1,
+            WireFormatLite::WIRETYPE_LENGTH_DELIMITED));
+        wire_append_varint(output, value.size);
+        output->append(static_cast<const char *>(value.data), value.size);
+        return;
+    }
+
+    switch (field->type()) {
+    case FieldDescriptor::TYPE_SINT32:
+        wire_append_varint(run, WireFormatLite::ZigZagEncode32(
+            static_cast<int32_t>(value.i)));
+        break;
+    case FieldDescriptor::TYPE_SINT64:
+        wire_append_varint(run, WireFormatLite::ZigZagEncode64(value.i));
+        break;
+    case FieldDescriptor::TYPE_FIXED32:
+    case FieldDescriptor::TYPE_SFIXED32:
+        append_fixed(run, static_cast<uint32_t>(value.i));
+        break;
+    case FieldDescriptor::TYPE_FIXED64:
+    case FieldDescriptor::TYPE_SFIXED64:
+        append_fixed(run, static_cast<uint64_t>(value.i));
+        break;
+    case FieldDescriptor::TYPE_FLOAT:
+        append_fixed(run, WireFormatLite::EncodeFloat(
+            static_cast<float>(value.d)));
+        break;
+    case FieldDescriptor::TYPE_DOUBLE:
+        append_fixed(run, WireFormatLite::EncodeDouble(value.d));
+        break;
+    default:
+        // The other numeric types are varints, and negative 32-bit values are
+        // sign-extended to 64 bits
+        wire_append_varint(run, static_cast<uint64_t>(value.i));
+        break;
+    }
+}
+
+
+/// Returns every value selected by a path, which may use the wildcards [*] and
+/// [start:end] and the recursive descent ..field
+///
+///     SELECT protobuf_extract_all(data, "Person", "$.phones[*].number");
+///     SELECT protobuf_extract_all(data, "Person", "$..number", "packed");
+///
+/// The message is parsed once, however many values there are. The format is
+/// "json" for a JSON array, or "packed" for a message in which field 1 is a
+/// repeated field of the same type as the values.
+///
+/// @returns the values as a JSON array or a Protobuf-encoded BLOB, or NULL if
+///          the message is NULL
+static void protobuf_extract_all(sqlite3_context *context,
+                                 int argc,
+                                 sqlite3_value **argv)
+{
+    connection *conn = connection::get(context);
+    stats_call call(conn->stats, FUNCTION_EXTRACT_ALL);
+
+    extract_format format = FORMAT_JSON;
+    if (argc > 3) {
+        const char *name = reinterpret_cast<const char *>(
+            sqlite3_value_text(argv[3]));
+        if (name && strcmp(name, "packed") == 0) {
+            format = FORMAT_PACKED;
+        } else if (!name || strcmp(name, "json") != 0) {
+            sqlite3_result_error(context, "Unknown format", -1);
+            return;
+        }
+    }
+
+    // Resolve the type name and path, which is only done once per statement
+    std::unique_ptr<compiled_path> fallback;
+    const compiled_path *path = get_compiled_path(context, argv, 1, 2,
+        fallback, SELECTS_MANY);
+    if (!path)
+        return;
+    if (path->elements.empty()) {
+        sqlite3_result_error(context, "Path does not select a field", -1);
+        return;
+    }
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    conn->stats.count_path(*path);
+    conn->stats.count_bytes(static_cast<size_t>(sqlite3_value_bytes(argv[0])));
+
+    // Other calls on the same row can share the parsed message
+    const uint8_t *data;
+    size_t size;
+    if (!message_argument(context, conn, argv[0], &data, &size))
+        return;
+    parsed_message parsed(data, size, conn, &conn->cache);
+    const Message *root = parsed.get(path->descriptor);
+    if (!root) {
+        sqlite3_result_error(context, "Failed to parse message", -1);
+        return;
+    }
+
+    conn->stats.enter_phase(PHASE_WALK);
+    std::vector<path_match> matches;
+    match_path(*root, *path, false, &matches);
+
+    conn->stats.enter_phase(PHASE_RESULT);
+    std::string output;
+    std::string run;
+    std::string scratch;
+    if (format == FORMAT_JSON)
+        output.push_back('[');
+    for (const path_match& match : matches) {
+        field_value value;
+        if (!value_from_field(*match.message, match.field, match.index,
+                              path->enum_name, &scratch, &value)) {
+            sqlite3_result_error(context, path->enum_name
+                ? "Enum value not found" : "Could not serialize message", -1);
+            return;
+        }
+
+        if (format == FORMAT_JSON) {
+            if (&match != &matches.front())
+                output.push_back(',');
+            json_append_value(&output, match.field, value);
+            continue;
+        }
+
+        // A recursive descent can find fields of different types
+        if (match.field->type() != matches.front().field->type()) {
+            sqlite3_result_error(context,
+                "Packed values must all have the same type", -1);
+            return;
+        }
+        append_packed(&output, &run, match.field, value);
+    }
+
+    if (format == FORMAT_JSON) {
+        output.push_back(']');
+        sqlite3_result_text64(context, output.data(), output.length(),
+            SQLITE_TRANSIENT, SQLITE_UTF8);
+        sqlite3_result_subtype(context, 'J');
+        return;
+    }
+    if (!run.empty()) {
+        wire_append_varint(&output, WireFormatLite::MakeTag(1,
+            WireFormatLite::WIRETYPE_LENGTH_DELIMITED));
+        wire_append_varint(&output, run.length());
+        output.append(run);
+    }
+    sqlite3_result_blob64(context, output.data(), output.length(),
+        SQLITE_TRANSIENT);
+}
+
+
+DECLARE_(protobuf_extract_all)
+{
+    int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+    int err = create_function(db, conn, "protobuf_extract_all", 3, flags,
+        protobuf_extract_all);
+    if (err != SQLITE_OK) return err;
+    return create_function(db, conn, "protobuf_extract_all", 4, flags,
+        protobuf_extract_all);
+}
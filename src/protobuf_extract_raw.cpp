@@ -0,0 +1,154 @@
+#include <memory>
+#include <string>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "compression.h"
+#include "connection.h"
+#include "header.h"
+#include "path.h"
+#include "stats.h"
+#include "utilities.h"
+#include "wire.h"
+
+using google::protobuf::FieldDescriptor;
+using google::protobuf::internal::WireFormatLite;
+
+
+/// Returns the raw path for the path and hint arguments, reusing the one
+/// attached to the statement if possible. On failure, sets an error on the
+/// context and returns NULL.
+static const raw_path *get_raw_path(sqlite3_context *context,
+                                    int argc,
+                                    sqlite3_value **argv,
+                                    std::unique_ptr<raw_path>& fallback)
+{
+    sqlite3_value *hint_arg = argc > 2
+        && sqlite3_value_type(argv[2]) != SQLITE_NULL ? argv[2] : nullptr;
+    raw_path *cached = static_cast<raw_path *>(
+        sqlite3_get_auxdata(context, 1));
+    if (cached && cached->matches(argv[1], hint_arg))
+        return cached;
+
+    const std::string path = string_from_sqlite3_value(argv[1]);
+    const std::string hint = hint_arg ? string_from_sqlite3_value(hint_arg)
+        : "";
+    std::string error_msg;
+    std::unique_ptr<raw_path> compiled(new raw_path);
+    if (!compile_raw_path(path, hint, compiled.get(), &error_msg)) {
+        sqlite3_result_error(context, error_msg.c_str(), -1);
+        return nullptr;
+    }
+
+    // Hand the path to SQLite, which is free to discard it at once
+    raw_path *kept = compiled.release();
+    sqlite3_set_auxdata(context, 1, kept, raw_path::destroy);
+    if (sqlite3_get_auxdata(context, 1) == kept)
+        return kept;
+
+    // If it was discarded, compile a copy that we own for the current call
+    fallback.reset(new raw_path);
+    compile_raw_path(path, hint, fallback.get(), &error_msg);
+    return fallback.get();
+}
+
+
+/// Sets the result to a value found without a message type. Without a hint,
+/// numbers are returned as integers and anything length-delimited as a BLOB.
+static void result_from_raw(sqlite3_context *context,
+                            const raw_path& path,
+                            const wire_value& value,
+                            WireFormatLite::WireType wire_type)
+{
+    if (wire_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+        if (path.has_hint && path.hint_type == FieldDescriptor::TYPE_STRING)
+            sqlite3_result_text(context,
+                reinterpret_cast<const char *>(value.data),
+                static_cast<int>(value.size), SQLITE_TRANSIENT);
+        else if (value.size == 0)
+            sqlite3_result_zeroblob(context, 0);
+        else
+            sqlite3_result_blob(context, value.data,
+                static_cast<int>(value.size), SQLITE_TRANSIENT);
+        return;
+    }
+    if (!path.has_hint) {
+        sqlite3_result_int64(context, static_cast<int64_t>(value.bits));
+        return;
+    }
+    switch (path.hint_type) {
+    case FieldDescriptor::TYPE_DOUBLE:
+    case FieldDescriptor::TYPE_FLOAT:
+        sqlite3_result_double(context,
+            wire_decode_double(path.hint_type, value.bits));
+        break;
+    default:
+        sqlite3_result_int64(context,
+            wire_decode_int(path.hint_type, value.bits));
+        break;
+    }
+}
+
+
+/// Return the value at a path of field numbers, without a message type
+///
+///     SELECT protobuf_extract_raw(data, "$.#2[0].#1", "string");
+///
+/// @returns an INTEGER, REAL, TEXT or BLOB, depending on the wire type and the
+///          hint, or null if the field is not present
+static void protobuf_extract_raw(sqlite3_context *context,
+                                 int argc,
+                                 sqlite3_value **argv)
+{
+    connection *conn = connection::get(context);
+    stats_call call(conn->stats, FUNCTION_EXTRACT_RAW);
+
+    std::unique_ptr<raw_path> fallback;
+    const raw_path *path = get_raw_path(context, argc, argv, fallback);
+    if (!path)
+        return;
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    conn->stats.count_bytes(static_cast<size_t>(sqlite3_value_bytes(argv[0])));
+
+    const uint8_t *data;
+    size_t size;
+    if (!message_argument(context, conn, argv[0], &data, &size))
+        return;
+
+    conn->stats.enter_phase(PHASE_WALK);
+    wire_value value;
+    WireFormatLite::WireType wire_type;
+    std::string merged;
+    switch (wire_find_raw(*path, data, size, &value, &wire_type, &merged)) {
+    case WIRE_FOUND:
+        conn->stats.enter_phase(PHASE_RESULT);
+        result_from_raw(context, *path, value, wire_type);
+        break;
+    case WIRE_FALLBACK:
+        conn->stats.count_parse_failure();
+        sqlite3_result_error(context, "Failed to parse message", -1);
+        break;
+    default:
+        sqlite3_result_null(context);
+        break;
+    }
+}
+
+
+DECLARE_(protobuf_extract_raw)
+{
+    int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+    int err = create_function(db, conn, "protobuf_extract_raw", 2, flags,
+        protobuf_extract_raw);
+    if (err != SQLITE_OK) return err;
+    return create_function(db, conn, "protobuf_extract_raw", 3, flags,
+        protobuf_extract_raw);
+}
@@ -0,0 +1,317 @@
+#include <memory>
+#include <string>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "compression.h"
+#include "connection.h"
+#include "extract.h"
+#include "header.h"
+#include "message_factory.h"
+#include "path.h"
+#include "stats.h"
+#include "utilities.h"
+
+
+// The maximum number of paths that can be extracted by one call
+#define MAX_FIELDS 16
+
+// The column indexes, corresponding to the order of the columns in the CREATE
+// TABLE statement in xConnect. There is one value column and one hidden path
+// column for each field.
+enum {
+    COLUMN_VALUE = 0,
+    COLUMN_MESSAGE = MAX_FIELDS,
+    COLUMN_TYPE_NAME,
+    COLUMN_PATH,
+};
+
+
+#define MODULE_FUNC(func) protobuf_fields ## _ ## func
+
+
+// fields_vtab is a subclass of sqlite3_vtab which remembers the connection
+// state the module was registered with
+typedef struct fields_vtab fields_vtab;
+struct fields_vtab {
+    sqlite3_vtab base;
+    sqlite3 *db;
+    connection *conn;
+};
+
+
+// fields_cursor is a subclass of sqlite3_vtab_cursor which holds a copy of the
+// message and the compiled paths. The paths and the arena the message is
+// parsed into are kept between calls to xFilter, so a join only compiles the
+// paths once and reuses the memory for each row.
+typedef struct fields_cursor fields_cursor;
+struct fields_cursor {
+    sqlite3_vtab_cursor base;
+    std::string data;
+    std::string type_name;
+    parsed_message parsed;
+    message_arena arena;
+    std::unique_ptr<compiled_path> paths[MAX_FIELDS];
+    bool eof;
+};
+
+
+/// Connect to the eponymous virtual table
+static int MODULE_FUNC(xConnect) (
+    sqlite3 *db,
+    void *pAux,
+    int argc, const char * const *argv,
+    sqlite3_vtab **ppVtab,
+    char **pzErr
+) {
+    std::string schema = "CREATE TABLE tbl(";
+    for (int i = 0; i < MAX_FIELDS; i ++) {
+        schema += "value" + std::to_string(i + 1) + ", ";
+    }
+    schema += "message BLOB HIDDEN, type_name TEXT HIDDEN";
+    for (int i = 0; i < MAX_FIELDS; i ++) {
+        schema += ", path" + std::to_string(i + 1) + " TEXT HIDDEN";
+    }
+    schema += ")";
+
+    int err = sqlite3_declare_vtab(db, schema.c_str());
+    if (err != SQLITE_OK) return err;
+
+    fields_vtab *vtab = new fields_vtab();
+    vtab->db = db;
+    vtab->conn = static_cast<connection *>(pAux);
+    *ppVtab = &vtab->base;
+    return SQLITE_OK;
+}
+
+
+/// Undoes xConnect
+static int MODULE_FUNC(xDisconnect) (sqlite3_vtab *pVtab)
+{
+    delete reinterpret_cast<fields_vtab *>(pVtab);
+    return SQLITE_OK;
+}
+
+
+/// Constructor fields_cursor objects
+static int MODULE_FUNC(xOpen) (sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor)
+{
+    fields_cursor *cursor = new fields_cursor();
+    cursor->eof = true;
+    *ppCursor = &cursor->base;
+    return SQLITE_OK;
+}
+
+/// Destructor fields_cursor objects
+static int MODULE_FUNC(xClose) (sqlite3_vtab_cursor *cur)
+{
+    delete reinterpret_cast<fields_cursor *>(cur);
+    return SQLITE_OK;
+}
+
+/// There is only one row, so advancing always reaches the end
+static int MODULE_FUNC(xNext) (sqlite3_vtab_cursor *cur)
+{
+    fields_cursor *cursor = (fields_cursor *)cur;
+    cursor->eof = true;
+    return SQLITE_OK;
+}
+
+
+/// The single row always has rowid 0
+static int MODULE_FUNC(xRowid) (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
+{
+    *pRowid = 0;
+    return SQLITE_OK;
+}
+
+
+/// Returns true once the row has been consumed
+static int MODULE_FUNC(xEof) (sqlite3_vtab_cursor *cur)
+{
+    fields_cursor *cursor = (fields_cursor *)cur;
+    return cursor->eof;
+}
+
+
+/// Return the fields in a given cell of the table. Values are only extracted
+/// for the columns that the query actually reads.
+static int MODULE_FUNC(xColumn) (
+    sqlite3_vtab_cursor *cur,
+    sqlite3_context *ctx,
+    int i
+) {
+    fields_cursor *cursor = (fields_cursor *)cur;
+    fields_vtab *vtab = (fields_vtab *)cur->pVtab;
+    stats_call call(vtab->conn->stats, FUNCTION_FIELDS, PHASE_RESULT, false);
+
+    if (i < COLUMN_MESSAGE) {
+        const compiled_path *path = cursor->paths[i - COLUMN_VALUE].get();
+        if (path) {
+            vtab->conn->stats.count_path(*path);
+            extract_path(ctx, vtab->conn, *path, cursor->parsed);
+        } else {
+            sqlite3_result_null(ctx);
+        }
+    } else if (i == COLUMN_MESSAGE) {
+        sqlite3_result_blob(ctx, cursor->data.data(), cursor->data.length(),
+            SQLITE_TRANSIENT);
+    } else if (i == COLUMN_TYPE_NAME) {
+        sqlite3_result_text(ctx, cursor->type_name.c_str(),
+            cursor->type_name.length(), SQLITE_TRANSIENT);
+    } else {
+        const compiled_path *path = cursor->paths[i - COLUMN_PATH].get();
+        if (path)
+            sqlite3_result_text(ctx, path->path.c_str(),
+                path->path.length(), SQLITE_TRANSIENT);
+    }
+    return SQLITE_OK;
+}
+
+
+/// Requires the message and type name, and accepts any subset of the paths.
+/// idxNum is a bitmask of the path columns that are constrained.
+static int MODULE_FUNC(xBestIndex) (
+    sqlite3_vtab *tab,
+    sqlite3_index_info *pIdxInfo
+)
+{
+    int messageEqConstraintIdx = -1;
+    int typeEqConstraintIdx = -1;
+    int pathEqConstraintIdx[MAX_FIELDS];
+    for (int i = 0; i < MAX_FIELDS; i ++) {
+        pathEqConstraintIdx[i] = -1;
+    }
+
+    const auto *constraint = pIdxInfo->aConstraint;
+    for(int i = 0; i < pIdxInfo->nConstraint; i ++, constraint ++) {
+        if (!constraint->usable) continue;
+        if (constraint->op != SQLITE_INDEX_CONSTRAINT_EQ) continue;
+        if (constraint->iColumn == COLUMN_MESSAGE) {
+            messageEqConstraintIdx = i;
+        } else if (constraint->iColumn == COLUMN_TYPE_NAME) {
+            typeEqConstraintIdx = i;
+        } else if (constraint->iColumn >= COLUMN_PATH) {
+            pathEqConstraintIdx[constraint->iColumn - COLUMN_PATH] = i;
+        }
+    }
+
+    // Without the message and its type, there is nothing to return
+    if (messageEqConstraintIdx == -1 || typeEqConstraintIdx == -1) {
+        return SQLITE_CONSTRAINT;
+    }
+
+    // Pass the arguments to xFilter in column order:
+    //     argv[0] = message
+    //     argv[1] = type name
+    //     argv[2...] = each path that was provided
+    int argIdx = 1;
+    pIdxInfo->aConstraintUsage[messageEqConstraintIdx].argvIndex = argIdx ++;
+    pIdxInfo->aConstraintUsage[messageEqConstraintIdx].omit = 1;
+    pIdxInfo->aConstraintUsage[typeEqConstraintIdx].argvIndex = argIdx ++;
+    pIdxInfo->aConstraintUsage[typeEqConstraintIdx].omit = 1;
+
+    pIdxInfo->idxNum = 0;
+    for (int i = 0; i < MAX_FIELDS; i ++) {
+        if (pathEqConstraintIdx[i] < 0) continue;
+        pIdxInfo->idxNum |= 1 << i;
+        pIdxInfo->aConstraintUsage[pathEqConstraintIdx[i]].argvIndex =
+            argIdx ++;
+        pIdxInfo->aConstraintUsage[pathEqConstraintIdx[i]].omit = 1;
+    }
+
+    // There is exactly one row
+    pIdxInfo->estimatedCost = 1;
+    pIdxInfo->estimatedRows = 1;
+    pIdxInfo->idxFlags |= SQLITE_INDEX_SCAN_UNIQUE;
+    return SQLITE_OK;
+}
+
+
+/// Copy the message and compile the paths, reusing the paths compiled for a
+/// previous call if they have not changed.
+static int MODULE_FUNC(xFilter) (
+    sqlite3_vtab_cursor *pVtabCursor,
+    int idxNum, const char *idxStr,
+    int argc, sqlite3_value **argv
+){
+    fields_cursor *cursor = (fields_cursor *)pVtabCursor;
+    fields_vtab *vtab = (fields_vtab *)pVtabCursor->pVtab;
+    stats_call call(vtab->conn->stats, FUNCTION_FIELDS);
+
+    int argIdx = 2;
+    for (int i = 0; i < MAX_FIELDS; i ++) {
+        if (!(idxNum & (1 << i))) {
+            cursor->paths[i].reset();
+            continue;
+        }
+
+        sqlite3_value *path_arg = argv[argIdx ++];
+        if (cursor->paths[i] && cursor->paths[i]->matches(argv[1], path_arg))
+            continue;
+
+        std::string error_msg;
+        cursor->paths[i].reset(
+            new_compiled_path(vtab->conn, argv[1], path_arg, &error_msg));
+        if (!cursor->paths[i]) {
+            sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+            pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf("%s",
+                error_msg.c_str());
+            return SQLITE_ERROR;
+        }
+    }
+
+    // The argument is only valid during this call, so keep a copy, which is
+    // decompressed if need be
+    const uint8_t *data =
+        static_cast<const uint8_t *>(sqlite3_value_blob(argv[0]));
+    size_t size = static_cast<size_t>(sqlite3_value_bytes(argv[0]));
+    std::string error_msg;
+    if (!decompress_message(vtab->conn, vtab->db, &data, &size, &error_msg)) {
+        sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+        pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf("%s", error_msg.c_str());
+        return SQLITE_ERROR;
+    }
+    cursor->data.assign(data ? reinterpret_cast<const char *>(data) : "",
+        size);
+    cursor->type_name = string_from_sqlite3_value(argv[1]);
+    cursor->parsed = parsed_message(
+        reinterpret_cast<const uint8_t *>(cursor->data.data()),
+        cursor->data.length(), vtab->conn, &cursor->arena);
+    vtab->conn->stats.count_bytes(
+        static_cast<size_t>(sqlite3_value_bytes(argv[0])));
+    cursor->eof = false;
+    return SQLITE_OK;
+}
+
+
+static sqlite3_module module = {
+  0,                         /* iVersion */
+  0,                         /* xCreate */
+  MODULE_FUNC(xConnect),     /* xConnect - required */
+  MODULE_FUNC(xBestIndex),   /* xBestIndex - required */
+  MODULE_FUNC(xDisconnect),  /* xDisconnect - required */
+  0,                         /* xDestroy */
+  MODULE_FUNC(xOpen),        /* xOpen - open a cursor - required */
+  MODULE_FUNC(xClose),       /* xClose - close a cursor - required */
+  MODULE_FUNC(xFilter),      /* xFilter - configure scan constraints - required */
+  MODULE_FUNC(xNext),        /* xNext - advance a cursor - required */
+  MODULE_FUNC(xEof),         /* xEof - check for end of scan - required */
+  MODULE_FUNC(xColumn),      /* xColumn - read data - required */
+  MODULE_FUNC(xRowid),       /* xRowid - read data - required */
+  0,                         /* xUpdate */
+  0,                         /* xBegin */
+  0,                         /* xSync */
+  0,                         /* xCommit */
+  0,                         /* xRollback */
+  0,                         /* xFindMethod */
+  0,                         /* xRename */
+};
+
+
+DECLARE_(protobuf_fields)
+{
+    return sqlite3_create_module_v2(db, "protobuf_fields", &module,
+        conn->retain(), connection::release);
+}
@@ -0,0 +1,432 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "connection.h"
+#include "header.h"
+#include "recordio.h"
+#include "stats.h"
+#include "utilities.h"
+
+
+// The constraints on the rowid used by MODULE_FUNC(xBestIndex) and
+// MODULE_FUNC(xFilter), as bits of idxNum. The arguments are passed in this
+// order.
+enum {
+    LOOKUP_BY_ROWID = 1,
+    ROWID_GT = 2,
+    ROWID_GE = 4,
+    ROWID_LT = 8,
+    ROWID_LE = 16,
+};
+
+// The guessed size of a record, used to estimate the number of rows before the
+// file is indexed
+#define ESTIMATED_RECORD_SIZE 100
+
+
+#define MODULE_FUNC(func) protobuf_file ## _ ## func
+
+
+// file_vtab is a subclass of sqlite3_vtab which holds the open file. The file
+// is indexed when the first cursor is opened.
+typedef struct file_vtab file_vtab;
+struct file_vtab {
+    sqlite3_vtab base;
+    connection *conn;
+    std::string path;
+    std::unique_ptr<record_file> file;
+};
+
+
+// file_cursor is a subclass of sqlite3_vtab_cursor which steps through the
+// records from one offset up to, but not including, another. The current
+// record points into the cursor's buffer.
+typedef struct file_cursor file_cursor;
+struct file_cursor {
+    sqlite3_vtab_cursor base;
+    uint64_t offset;
+    uint64_t next;
+    uint64_t end;
+    record_buffer buffer;
+    const uint8_t *record;
+    size_t record_size;
+    bool eof;
+};
+
+
+/// Shared by xCreate and xConnect. The arguments are the path to the file and
+/// the type of the messages in it:
+///
+///     CREATE VIRTUAL TABLE people USING protobuf_file(
+///         '/data/people.pb', 'Person');
+static int file_connect(
+    sqlite3 *db,
+    void *pAux,
+    int argc, const char * const *argv,
+    sqlite3_vtab **ppVtab,
+    char **pzErr
+) {
+    // The first three arguments are the module, database, and table names
+    if (argc != 5) {
+        *pzErr = sqlite3_mprintf("protobuf_file requires a file path and a "
+            "message type");
+        return SQLITE_ERROR;
+    }
+
+    std::unique_ptr<file_vtab> vtab(new file_vtab());
+    vtab->conn = static_cast<connection *>(pAux);
+    vtab->path = dequote(argv[3]);
+
+    std::string type_name = dequote(argv[4]);
+    if (!vtab->conn->descriptors.find_message_type(type_name)) {
+        *pzErr = sqlite3_mprintf("Could not find message descriptor: %s",
+            type_name.c_str());
+        return SQLITE_ERROR;
+    }
+
+    std::string error_msg;
+    vtab->file.reset(new record_file());
+    if (!vtab->file->open(vtab->path, &error_msg)) {
+        *pzErr = sqlite3_mprintf("%s", error_msg.c_str());
+        return SQLITE_ERROR;
+    }
+
+    int err = sqlite3_declare_vtab(db, "CREATE TABLE tbl(protobuf BLOB)");
+    if (err != SQLITE_OK) {
+        *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+        return err;
+    }
+
+    // The table reads any file it is given, so a database that is not trusted
+    // must not be able to use it from its own triggers and views
+    sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
+    *ppVtab = &vtab.release()->base;
+    return SQLITE_OK;
+}
+
+
+/// Create a new table over a file
+static int MODULE_FUNC(xCreate) (
+    sqlite3 *db,
+    void *pAux,
+    int argc, const char * const *argv,
+    sqlite3_vtab **ppVtab,
+    char **pzErr
+) {
+    return file_connect(db, pAux, argc, argv, ppVtab, pzErr);
+}
+
+
+/// Connect to an existing table
+static int MODULE_FUNC(xConnect) (
+    sqlite3 *db,
+    void *pAux,
+    int argc, const char * const *argv,
+    sqlite3_vtab **ppVtab,
+    char **pzErr
+) {
+    return file_connect(db, pAux, argc, argv, ppVtab, pzErr);
+}
+
+
+/// Undoes xConnect, closing the file
+static int MODULE_FUNC(xDisconnect) (sqlite3_vtab *pVtab)
+{
+    delete reinterpret_cast<file_vtab *>(pVtab);
+    return SQLITE_OK;
+}
+
+
+/// Constructor file_cursor objects. The first cursor indexes the file.
+static int MODULE_FUNC(xOpen) (sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor)
+{
+    file_vtab *vtab = (file_vtab *)p;
+    std::string error_msg;
+    if (!vtab->file->build_index(&error_msg)) {
+        sqlite3_free(vtab->base.zErrMsg);
+        vtab->base.zErrMsg = sqlite3_mprintf("%s: %s", vtab->path.c_str(),
+            error_msg.c_str());
+        return SQLITE_CORRUPT;
+    }
+
+    file_cursor *cursor = new file_cursor();
+    cursor->eof = true;
+    *ppCursor = &cursor->base;
+    return SQLITE_OK;
+}
+
+
+/// Destructor file_cursor objects
+static int MODULE_FUNC(xClose) (sqlite3_vtab_cursor *cur)
+{
+    delete (file_cursor *)cur;
+    return SQLITE_OK;
+}
+
+
+/// Advance to the next record
+static int MODULE_FUNC(xNext) (sqlite3_vtab_cursor *cur)
+{
+    file_cursor *cursor = (file_cursor *)cur;
+    file_vtab *vtab = (file_vtab *)cur->pVtab;
+    stats_call call(vtab->conn->stats, FUNCTION_FILE, PHASE_WALK);
+
+    cursor->offset = cursor->next;
+    std::string error_msg;
+    if (cursor->offset >= cursor->end
+            || !vtab->file->read(cursor->offset, &cursor->buffer,
+                                 &cursor->record, &cursor->record_size,
+                                 &cursor->next, &error_msg)) {
+        cursor->eof = true;
+        if (error_msg.empty())
+            return SQLITE_OK;
+        sqlite3_free(vtab->base.zErrMsg);
+        vtab->base.zErrMsg = sqlite3_mprintf("%s", error_msg.c_str());
+        return SQLITE_IOERR;
+    }
+    vtab->conn->stats.count_bytes(cursor->record_size);
+    return SQLITE_OK;
+}
+
+
+/// Returns the offset of the record in the file
+static int MODULE_FUNC(xRowid) (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
+{
+    file_cursor *cursor = (file_cursor *)cur;
+    *pRowid = static_cast<sqlite_int64>(cursor->offset);
+    return SQLITE_OK;
+}
+
+
+/// Returns true once every record has been returned
+static int MODULE_FUNC(xEof) (sqlite3_vtab_cursor *cur)
+{
+    file_cursor *cursor = (file_cursor *)cur;
+    return cursor->eof;
+}
+
+
+/// Returns the record. It is copied, since the cursor's buffer is reused for
+/// the records after it.
+static int MODULE_FUNC(xColumn) (
+    sqlite3_vtab_cursor *cur,
+    sqlite3_context *ctx,
+    int i
+) {
+    file_cursor *cursor = (file_cursor *)cur;
+    sqlite3_result_blob64(ctx, cursor->record, cursor->record_size,
+        SQLITE_TRANSIENT);
+    return SQLITE_OK;
+}
+
+
+/// Looks up a record by rowid, or limits the scan to a range of rowids. Rows
+/// come out in the order of their rowids, so ORDER BY rowid costs nothing.
+static int MODULE_FUNC(xBestIndex) (
+    sqlite3_vtab *tab,
+    sqlite3_index_info *pIdxInfo
+)
+{
+    file_vtab *vtab = (file_vtab *)tab;
+
+    // Find the first usable constraint of each kind on the rowid
+    int constraints[5] = { -1, -1, -1, -1, -1 };
+    const auto *constraint = pIdxInfo->aConstraint;
+    for (int i = 0; i < pIdxInfo->nConstraint; i ++, constraint ++) {
+        if (!constraint->usable || constraint->iColumn >= 0)
+            continue;
+        int kind;
+        switch (constraint->op) {
+        case SQLITE_INDEX_CONSTRAINT_EQ: kind = 0; break;
+        case SQLITE_INDEX_CONSTRAINT_GT: kind = 1; break;
+        case SQLITE_INDEX_CONSTRAINT_GE: kind = 2; break;
+        case SQLITE_INDEX_CONSTRAINT_LT: kind = 3; break;
+        case SQLITE_INDEX_CONSTRAINT_LE: kind = 4; break;
+        default: continue;
+        }
+        if (constraints[kind] < 0)
+            constraints[kind] = i;
+    }
+
+    // Use a lookup by rowid on its own, and otherwise at most one bound on
+    // each side
+    if (constraints[0] >= 0) {
+        constraints[1] = constraints[2] = constraints[3] = constraints[4] = -1;
+    } else {
+        if (constraints[1] >= 0) constraints[2] = -1;
+        if (constraints[3] >= 0) constraints[4] = -1;
+    }
+
+    // SQLite checks the constraints again, since rowids that are not integers
+    // are only narrowed down here
+    int argIdx = 1;
+    pIdxInfo->idxNum = 0;
+    for (int kind = 0; kind < 5; kind ++) {
+        if (constraints[kind] < 0) continue;
+        pIdxInfo->aConstraintUsage[constraints[kind]].argvIndex = argIdx ++;
+        pIdxInfo->aConstraintUsage[constraints[kind]].omit = 0;
+        pIdxInfo->idxNum |= 1 << kind;
+    }
+
+    double rows = vtab->file->indexed
+        ? static_cast<double>(vtab->file->records)
+        : static_cast<double>(vtab->file->size / ESTIMATED_RECORD_SIZE + 1);
+    if (pIdxInfo->idxNum & LOOKUP_BY_ROWID) {
+        pIdxInfo->estimatedCost = 10;
+        pIdxInfo->estimatedRows = 1;
+        pIdxInfo->idxFlags |= SQLITE_INDEX_SCAN_UNIQUE;
+    } else {
+        if (pIdxInfo->idxNum & (ROWID_GT | ROWID_GE)) rows /= 2;
+        if (pIdxInfo->idxNum & (ROWID_LT | ROWID_LE)) rows /= 2;
+        pIdxInfo->estimatedCost = rows;
+        pIdxInfo->estimatedRows = static_cast<sqlite3_int64>(rows);
+    }
+
+    if (pIdxInfo->nOrderBy == 1 && pIdxInfo->aOrderBy[0].iColumn < 0
+            && !pIdxInfo->aOrderBy[0].desc)
+        pIdxInfo->orderByConsumed = 1;
+    return SQLITE_OK;
+}
+
+
+/// Converts a bound on the rowid into an inclusive bound on the offset,
+/// clamped to the file. Returns false if no offset can satisfy it. Bounds that
+/// are not numbers are not narrowed down, and left for SQLite to check.
+static bool offset_bound(sqlite3_value *value,
+                         bool lower,
+                         bool inclusive,
+                         uint64_t size,
+                         uint64_t *bound)
+{
+    int type = sqlite3_value_numeric_type(value);
+    if (type == SQLITE_NULL)
+        return false;
+    if (type != SQLITE_INTEGER && type != SQLITE_FLOAT) {
+        *bound = lower ? 0 : size;
+        return true;
+    }
+
+    if (type == SQLITE_INTEGER) {
+        sqlite3_int64 i = sqlite3_value_int64(value);
+        if (lower) {
+            if (!inclusive && i == INT64_MAX)
+                return false;
+            i = std::max<sqlite3_int64>(inclusive ? i : i + 1, 0);
+            if (static_cast<uint64_t>(i) > size)
+                return false;
+            *bound = static_cast<uint64_t>(i);
+        } else {
+            if (!inclusive && i == INT64_MIN)
+                return false;
+            i = inclusive ? i : i - 1;
+            if (i < 0)
+                return false;
+            *bound = std::min(static_cast<uint64_t>(i), size);
+        }
+        return true;
+    }
+
+    double d = sqlite3_value_double(value);
+    if (std::isnan(d))
+        return false;
+    if (lower) {
+        d = inclusive ? std::ceil(d) : std::floor(d) + 1;
+        if (d > static_cast<double>(size))
+            return false;
+        *bound = d < 0 ? 0 : static_cast<uint64_t>(d);
+    } else {
+        d = inclusive ? std::floor(d) : std::ceil(d) - 1;
+        if (d < 0)
+            return false;
+        *bound = d > static_cast<double>(size)
+            ? size : static_cast<uint64_t>(d);
+    }
+    return true;
+}
+
+
+/// Start stepping through the records in the range that xBestIndex chose
+static int MODULE_FUNC(xFilter) (
+    sqlite3_vtab_cursor *pVtabCursor,
+    int idxNum, const char *idxStr,
+    int argc, sqlite3_value **argv
+){
+    file_cursor *cursor = (file_cursor *)pVtabCursor;
+    file_vtab *vtab = (file_vtab *)pVtabCursor->pVtab;
+    const record_file& file = *vtab->file;
+
+    cursor->next = 0;
+    cursor->end = file.size;
+    cursor->eof = false;
+
+    int argIdx = 0;
+    if (idxNum & LOOKUP_BY_ROWID) {
+        // The rowid must be the offset of a record, which is found by stepping
+        // from the nearest entry of the index
+        uint64_t offset;
+        if (!offset_bound(argv[argIdx ++], true, true, file.size, &offset)
+                || file.seek(offset, &cursor->buffer) != offset) {
+            cursor->eof = true;
+            return SQLITE_OK;
+        }
+        cursor->next = offset;
+        cursor->end = offset + 1;
+    }
+
+    uint64_t bound;
+    if (idxNum & (ROWID_GT | ROWID_GE)) {
+        if (!offset_bound(argv[argIdx ++], true, idxNum & ROWID_GE,
+                          file.size, &bound)) {
+            cursor->eof = true;
+            return SQLITE_OK;
+        }
+        cursor->next = file.seek(bound, &cursor->buffer);
+    }
+    if (idxNum & (ROWID_LT | ROWID_LE)) {
+        if (!offset_bound(argv[argIdx ++], false, idxNum & ROWID_LE,
+                          file.size, &bound)) {
+            cursor->eof = true;
+            return SQLITE_OK;
+        }
+        cursor->end = bound + 1;
+    }
+
+    return MODULE_FUNC(xNext)(pVtabCursor);
+}
+
+
+static sqlite3_module module = {
+  0,                         /* iVersion */
+  MODULE_FUNC(xCreate),      /* xCreate */
+  MODULE_FUNC(xConnect),     /* xConnect - required */
+  MODULE_FUNC(xBestIndex),   /* xBestIndex - required */
+  MODULE_FUNC(xDisconnect),  /* xDisconnect - required */
+  MODULE_FUNC(xDisconnect),  /* xDestroy */
+  MODULE_FUNC(xOpen),        /* xOpen - open a cursor - required */
+  MODULE_FUNC(xClose),       /* xClose - close a cursor - required */
+  MODULE_FUNC(xFilter),      /* xFilter - configure scan constraints - required */
+  MODULE_FUNC(xNext),        /* xNext - advance a cursor - required */
+  MODULE_FUNC(xEof),         /* xEof - check for end of scan - required */
+  MODULE_FUNC(xColumn),      /* xColumn - read data - required */
+  MODULE_FUNC(xRowid),       /* xRowid - read data - required */
+  0,                         /* xUpdate */
+  0,                         /* xBegin */
+  0,                         /* xSync */
+  0,                         /* xCommit */
+  0,                         /* xRollback */
+  0,                         /* xFindMethod */
+  0,                         /* xRename */
+};
+
+
+DECLARE_(protobuf_file)
+{
+    return sqlite3_create_module_v2(db, "protobuf_file", &module,
+        conn->retain(), connection::release);
+}
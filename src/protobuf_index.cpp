@@ -0,0 +1,751 @@
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "compression.h"
+#include "connection.h"
+#include "extract.h"
+#include "header.h"
+#include "message_factory.h"
+#include "path.h"
+#include "shadow.h"
+#include "stats.h"
+#include "utilities.h"
+#include "value.h"
+
+using google::protobuf::FieldDescriptor;
+using google::protobuf::Message;
+
+
+// The estimated number of rows in the index, which is not known
+#define ESTIMATED_ROWS 1000000
+
+
+#define MODULE_FUNC(func) protobuf_index ## _ ## func
+
+
+// The constraints that xBestIndex passes to xFilter, one character each in
+// idxStr, in the order of the arguments
+enum {
+    INDEX_EQ = 'e',
+    INDEX_GT = 'g',
+    INDEX_GE = 'G',
+    INDEX_LT = 'l',
+    INDEX_LE = 'L',
+    INDEX_MATCH = 'm',
+    INDEX_ROWID = 'r',
+};
+
+
+// index_vtab is a subclass of sqlite3_vtab which holds the path that selects
+// the indexed values. The values are kept in the table <name>_data, ordered by
+// value and then by the rowid of the row they came from.
+typedef struct index_vtab index_vtab;
+struct index_vtab {
+    sqlite3_vtab base;
+    sqlite3 *db;
+    connection *conn;
+    std::string schema;
+    std::string name;
+    std::string table;
+    std::string column;
+    std::unique_ptr<compiled_path> path;
+
+    // Statements that write the index, prepared when first needed
+    sqlite3_stmt *insert;
+    sqlite3_stmt *remove;
+
+    // Each message being indexed is parsed into the arena
+    message_arena arena;
+    std::vector<path_match> matches;
+    std::string scratch;
+};
+
+
+// index_cursor is a subclass of sqlite3_vtab_cursor which steps through the
+// values of the index that satisfy the constraints, without reading the
+// underlying table
+typedef struct index_cursor index_cursor;
+struct index_cursor {
+    sqlite3_vtab_cursor base;
+    sqlite3_stmt *stmt;
+    std::string sql;
+
+    // MATCH patterns that the range in the query does not settle, which each
+    // value is checked against
+    std::vector<std::string> patterns;
+    bool eof;
+};
+
+
+/// Returns the declared type of the indexed values, which is also the
+/// affinity of the values in the index, so that it compares them with other
+/// values as SQLite compares the column
+static const char *value_type(const compiled_path& path)
+{
+    const FieldDescriptor *field = path.elements.back().field;
+    switch (field->cpp_type()) {
+    case FieldDescriptor::CppType::CPPTYPE_INT32:
+    case FieldDescriptor::CppType::CPPTYPE_INT64:
+    case FieldDescriptor::CppType::CPPTYPE_UINT32:
+    case FieldDescriptor::CppType::CPPTYPE_UINT64:
+    case FieldDescriptor::CppType::CPPTYPE_BOOL:
+        return "INTEGER";
+    case FieldDescriptor::CppType::CPPTYPE_DOUBLE:
+    case FieldDescriptor::CppType::CPPTYPE_FLOAT:
+        return "REAL";
+    case FieldDescriptor::CppType::CPPTYPE_ENUM:
+        return path.enum_name ? "TEXT" : "INTEGER";
+    case FieldDescriptor::CppType::CPPTYPE_STRING:
+        return field->type() == FieldDescriptor::Type::TYPE_BYTES
+            ? "BLOB" : "TEXT";
+    case FieldDescriptor::CppType::CPPTYPE_MESSAGE:
+        return "BLOB";
+    }
+    return "";
+}
+
+
+/// Shared by xCreate and xConnect. The arguments are the table and column
+/// holding the messages, the message type, and the path of the values to
+/// index, which may select any number of them:
+///
+///     CREATE VIRTUAL TABLE phone_idx USING protobuf_index(
+///         people, protobuf, 'Person', '$.phones[*].number');
+static int index_connect(
+    sqlite3 *db,
+    void *pAux,
+    int argc, const char * const *argv,
+    sqlite3_vtab **ppVtab,
+    char **pzErr
+) {
+    // The first three arguments are the module, database, and table names
+    if (argc != 7) {
+        *pzErr = sqlite3_mprintf("protobuf_index requires a table, a column, "
+            "a message type, and a path");
+        return SQLITE_ERROR;
+    }
+
+    std::unique_ptr<index_vtab> vtab(new index_vtab());
+    vtab->db = db;
+    vtab->conn = static_cast<connection *>(pAux);
+    vtab->schema = argv[1];
+    vtab->name = argv[2];
+    vtab->table = dequote(argv[3]);
+    vtab->column = dequote(argv[4]);
+    vtab->insert = nullptr;
+    vtab->remove = nullptr;
+
+    std::string type_name = dequote(argv[5]);
+    std::string path = dequote(argv[6]);
+    std::string error_msg;
+    vtab->path.reset(new_compiled_path(vtab->conn, type_name, path,
+        &error_msg, SELECTS_MANY));
+    if (!vtab->path) {
+        *pzErr = sqlite3_mprintf("%s: %s", error_msg.c_str(), path.c_str());
+        return SQLITE_ERROR;
+    }
+    if (vtab->path->elements.empty()) {
+        *pzErr = sqlite3_mprintf("Path does not select a field: %s",
+            path.c_str());
+        return SQLITE_ERROR;
+    }
+
+    // As in FTS5, a hidden column with the name of the table is the left
+    // operand of MATCH, and is written to index a message
+    char *schema = sqlite3_mprintf("CREATE TABLE tbl(value %s, \"%w\" HIDDEN)",
+        value_type(*vtab->path), vtab->name.c_str());
+    if (!schema)
+        return SQLITE_NOMEM;
+    int err = sqlite3_declare_vtab(db, schema);
+    sqlite3_free(schema);
+    if (err != SQLITE_OK) {
+        *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+        return err;
+    }
+
+    *ppVtab = &vtab.release()->base;
+    return SQLITE_OK;
+}
+
+
+/// Adds the values that the path selects in a message to the index. A
+/// compressed message is decompressed first. A null message has no values, and
+/// neither does one that cannot be read, since the index must not stop it from
+/// being written to the underlying table; parse failures show up in
+/// protobuf_stats.
+static int index_message(index_vtab *vtab,
+                         sqlite3_int64 rowid,
+                         sqlite3_value *value,
+                         char **pzErr)
+{
+    if (sqlite3_value_type(value) == SQLITE_NULL)
+        return SQLITE_OK;
+
+    const uint8_t *data = static_cast<const uint8_t *>(sqlite3_value_blob(value));
+    size_t size = static_cast<size_t>(sqlite3_value_bytes(value));
+    vtab->conn->stats.count_bytes(size);
+    vtab->conn->stats.count_path(*vtab->path);
+    std::string error_msg;
+    if (!decompress_message(vtab->conn, vtab->db, &data, &size, &error_msg))
+        return SQLITE_OK;
+
+    parsed_message parsed(data, size, vtab->conn, &vtab->arena);
+    const Message *message = parsed.get(vtab->path->descriptor);
+    if (!message)
+        return SQLITE_OK;
+
+    stats_phase phase = vtab->conn->stats.enter_phase(PHASE_WALK);
+    vtab->matches.clear();
+    match_path(*message, *vtab->path, false, &vtab->matches);
+    vtab->conn->stats.enter_phase(phase);
+
+    if (!vtab->insert) {
+        int err = prepare(vtab->db, &vtab->insert,
+            "INSERT OR IGNORE INTO \"%w\".\"%w_data\" (value, id) "
+            "VALUES (?, ?)", vtab->schema.c_str(), vtab->name.c_str());
+        if (err != SQLITE_OK) {
+            *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(vtab->db));
+            return err;
+        }
+    }
+
+    // A value that appears more than once in a message is indexed once. Nulls
+    // are not indexed, and neither are enum values without names.
+    for (const path_match& match : vtab->matches) {
+        field_value found;
+        if (!value_from_field(*match.message, match.field, match.index,
+                              vtab->path->enum_name, &vtab->scratch, &found))
+            continue;
+
+        sqlite3_stmt *stmt = vtab->insert;
+        switch (found.type) {
+        case SQLITE_INTEGER:
+            sqlite3_bind_int64(stmt, 1, found.i);
+            break;
+        case SQLITE_FLOAT:
+            sqlite3_bind_double(stmt, 1, found.d);
+            break;
+        case SQLITE_TEXT:
+            sqlite3_bind_text64(stmt, 1, static_cast<const char *>(found.data),
+                found.size, SQLITE_STATIC, SQLITE_UTF8);
+            break;
+        case SQLITE_BLOB:
+            sqlite3_bind_blob64(stmt, 1, found.size ? found.data : "",
+                found.size, SQLITE_STATIC);
+            break;
+        default:
+            continue;
+        }
+        sqlite3_bind_int64(stmt, 2, rowid);
+        int err = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (err != SQLITE_DONE) {
+            *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(vtab->db));
+            return err;
+        }
+    }
+    return SQLITE_OK;
+}
+
+
+/// Removes the values of a row from the index
+static int remove_message(index_vtab *vtab, sqlite3_int64 rowid)
+{
+    if (!vtab->remove) {
+        int err = prepare(vtab->db, &vtab->remove,
+            "DELETE FROM \"%w\".\"%w_data\" WHERE id = ?",
+            vtab->schema.c_str(), vtab->name.c_str());
+        if (err != SQLITE_OK) return err;
+    }
+    sqlite3_bind_int64(vtab->remove, 1, rowid);
+    int err = sqlite3_step(vtab->remove);
+    sqlite3_reset(vtab->remove);
+    return err == SQLITE_DONE ? SQLITE_OK : err;
+}
+
+
+/// Indexes a message the underlying table already holds, for create_shadow
+static int index_existing(void *vtab,
+                          sqlite3_int64 rowid,
+                          sqlite3_value *value,
+                          char **pzErr)
+{
+    return index_message(static_cast<index_vtab *>(vtab), rowid, value, pzErr);
+}
+
+
+/// Finalizes the statements that write the index
+static void finalize_statements(index_vtab *vtab)
+{
+    sqlite3_finalize(vtab->insert);
+    sqlite3_finalize(vtab->remove);
+    vtab->insert = vtab->remove = nullptr;
+}
+
+
+/// Create the index and the triggers that keep it up to date with the
+/// underlying table, and index the messages it already holds
+static int MODULE_FUNC(xCreate) (
+    sqlite3 *db,
+    void *pAux,
+    int argc, const char * const *argv,
+    sqlite3_vtab **ppVtab,
+    char **pzErr
+) {
+    int err = index_connect(db, pAux, argc, argv, ppVtab, pzErr);
+    if (err != SQLITE_OK) return err;
+    std::unique_ptr<index_vtab> vtab(reinterpret_cast<index_vtab *>(*ppVtab));
+    *ppVtab = nullptr;
+    const char *schema = vtab->schema.c_str();
+    const char *name = vtab->name.c_str();
+    const char *table = vtab->table.c_str();
+    const char *column = vtab->column.c_str();
+
+    err = exec_sql(db, pzErr, "CREATE TABLE \"%w\".\"%w_data\" "
+        "(value %s, id INTEGER, PRIMARY KEY (value, id)) WITHOUT ROWID",
+        schema, name, value_type(*vtab->path));
+    if (err != SQLITE_OK) return err;
+    err = exec_sql(db, pzErr, "CREATE INDEX \"%w\".\"%w_ids\" "
+        "ON \"%w_data\" (id)", schema, name, name);
+    if (err != SQLITE_OK) return err;
+
+    shadow_source source = { schema, name, table, column, name };
+    err = create_shadow(db, source, index_existing, vtab.get(), pzErr);
+    if (err != SQLITE_OK) {
+        finalize_statements(vtab.get());
+        return err;
+    }
+
+    *ppVtab = &vtab.release()->base;
+    return SQLITE_OK;
+}
+
+
+/// Connect to an existing index
+static int MODULE_FUNC(xConnect) (
+    sqlite3 *db,
+    void *pAux,
+    int argc, const char * const *argv,
+    sqlite3_vtab **ppVtab,
+    char **pzErr
+) {
+    return index_connect(db, pAux, argc, argv, ppVtab, pzErr);
+}
+
+
+/// Undoes xConnect
+static int MODULE_FUNC(xDisconnect) (sqlite3_vtab *pVtab)
+{
+    index_vtab *vtab = reinterpret_cast<index_vtab *>(pVtab);
+    finalize_statements(vtab);
+    delete vtab;
+    return SQLITE_OK;
+}
+
+
+/// Drops the index and the triggers along with the table
+static int MODULE_FUNC(xDestroy) (sqlite3_vtab *pVtab)
+{
+    index_vtab *vtab = reinterpret_cast<index_vtab *>(pVtab);
+    finalize_statements(vtab);
+    const char *schema = vtab->schema.c_str();
+    const char *name = vtab->name.c_str();
+
+    char *error_msg = nullptr;
+    int err = drop_shadow_triggers(vtab->db, schema, name, &error_msg);
+    if (err == SQLITE_OK)
+        err = exec_sql(vtab->db, &error_msg,
+            "DROP TABLE IF EXISTS \"%w\".\"%w_data\"", schema, name);
+    if (err != SQLITE_OK) {
+        sqlite3_free(vtab->base.zErrMsg);
+        vtab->base.zErrMsg = error_msg;
+        return err;
+    }
+
+    delete vtab;
+    return SQLITE_OK;
+}
+
+
+/// Constructor for index_cursor objects
+static int MODULE_FUNC(xOpen) (sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor)
+{
+    index_cursor *cursor = new index_cursor();
+    cursor->stmt = nullptr;
+    cursor->eof = true;
+    *ppCursor = &cursor->base;
+    return SQLITE_OK;
+}
+
+
+/// Destructor for index_cursor objects
+static int MODULE_FUNC(xClose) (sqlite3_vtab_cursor *cur)
+{
+    index_cursor *cursor = (index_cursor *)cur;
+    sqlite3_finalize(cursor->stmt);
+    delete cursor;
+    return SQLITE_OK;
+}
+
+
+/// Returns true if text matches a MATCH pattern, in which * stands for any
+/// run of characters and everything else for itself
+static bool match_pattern(const char *pattern, size_t pattern_size,
+                          const char *text, size_t text_size)
+{
+    size_t p = 0, t = 0;
+    size_t star = std::string::npos, resume = 0;
+    while (t < text_size) {
+        if (p < pattern_size && pattern[p] == '*') {
+            star = p ++;
+            resume = t;
+        } else if (p < pattern_size && pattern[p] == text[t]) {
+            p ++;
+            t ++;
+        } else if (star != std::string::npos) {
+            p = star + 1;
+            t = ++ resume;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern_size && pattern[p] == '*')
+        p ++;
+    return p == pattern_size;
+}
+
+
+/// Advance to the next value that matches every MATCH pattern
+static int MODULE_FUNC(xNext) (sqlite3_vtab_cursor *cur)
+{
+    index_cursor *cursor = (index_cursor *)cur;
+    index_vtab *vtab = (index_vtab *)cur->pVtab;
+    stats_call call(vtab->conn->stats, FUNCTION_INDEX, PHASE_WALK);
+
+    for (;;) {
+        int err = sqlite3_step(cursor->stmt);
+        if (err == SQLITE_DONE) {
+            cursor->eof = true;
+            return SQLITE_OK;
+        } else if (err != SQLITE_ROW) {
+            return database_error(&vtab->base, vtab->db, err);
+        }
+
+        // Only text matches a pattern
+        if (cursor->patterns.empty())
+            return SQLITE_OK;
+        if (sqlite3_column_type(cursor->stmt, 0) != SQLITE_TEXT)
+            continue;
+        const char *text = reinterpret_cast<const char *>(
+            sqlite3_column_text(cursor->stmt, 0));
+        size_t size = static_cast<size_t>(sqlite3_column_bytes(cursor->stmt, 0));
+        bool matched = true;
+        for (const std::string& pattern : cursor->patterns)
+            matched = matched && match_pattern(pattern.data(),
+                pattern.length(), text, size);
+        if (matched)
+            return SQLITE_OK;
+    }
+}
+
+
+/// Returns the rowid of the row in the underlying table that holds the value
+static int MODULE_FUNC(xRowid) (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
+{
+    index_cursor *cursor = (index_cursor *)cur;
+    *pRowid = sqlite3_column_int64(cursor->stmt, 1);
+    return SQLITE_OK;
+}
+
+
+/// Returns true once every value has been returned
+static int MODULE_FUNC(xEof) (sqlite3_vtab_cursor *cur)
+{
+    index_cursor *cursor = (index_cursor *)cur;
+    return cursor->eof;
+}
+
+
+/// Returns the value. The hidden column is only there to be written to and
+/// matched against, and is always null.
+static int MODULE_FUNC(xColumn) (
+    sqlite3_vtab_cursor *cur,
+    sqlite3_context *ctx,
+    int i
+) {
+    index_cursor *cursor = (index_cursor *)cur;
+    index_vtab *vtab = (index_vtab *)cur->pVtab;
+    stats_call call(vtab->conn->stats, FUNCTION_INDEX, PHASE_RESULT, false);
+
+    if (i == 0)
+        sqlite3_result_value(ctx, sqlite3_column_value(cursor->stmt, 0));
+    else
+        sqlite3_result_null(ctx);
+    return SQLITE_OK;
+}
+
+
+/// Looks up values by equality, range, or MATCH, and rows by rowid. The
+/// constraints that are used are listed in idxStr, one character each. SQLite
+/// does not check them again, since the index compares values just as it
+/// would.
+static int MODULE_FUNC(xBestIndex) (
+    sqlite3_vtab *tab,
+    sqlite3_index_info *pIdxInfo
+)
+{
+    index_vtab *vtab = (index_vtab *)tab;
+    bool text = strcmp(value_type(*vtab->path), "TEXT") == 0;
+    std::string constraints;
+    int argIdx = 1;
+    double estimatedRows = ESTIMATED_ROWS;
+
+    const auto *constraint = pIdxInfo->aConstraint;
+    for (int i = 0; i < pIdxInfo->nConstraint; i ++, constraint ++) {
+        if (!constraint->usable) continue;
+
+        // Guess how many values each kind of constraint leaves
+        char kind;
+        double selectivity;
+        if (constraint->iColumn < 0) {
+            if (constraint->op != SQLITE_INDEX_CONSTRAINT_EQ)
+                continue;
+            kind = INDEX_ROWID;
+            selectivity = 1.0 / ESTIMATED_ROWS;
+        } else if (constraint->op == SQLITE_INDEX_CONSTRAINT_MATCH) {
+            // MATCH is not a function that SQLite could fall back on, so the
+            // index takes it on either column, as long as the values are text
+            if (!text) continue;
+            kind = INDEX_MATCH;
+            selectivity = 0.01;
+        } else if (constraint->iColumn != 0) {
+            continue;
+        } else {
+            switch (constraint->op) {
+            case SQLITE_INDEX_CONSTRAINT_EQ: kind = INDEX_EQ; break;
+            case SQLITE_INDEX_CONSTRAINT_GT: kind = INDEX_GT; break;
+            case SQLITE_INDEX_CONSTRAINT_GE: kind = INDEX_GE; break;
+            case SQLITE_INDEX_CONSTRAINT_LT: kind = INDEX_LT; break;
+            case SQLITE_INDEX_CONSTRAINT_LE: kind = INDEX_LE; break;
+            default: continue;
+            }
+            selectivity = kind == INDEX_EQ ? 0.0001 : 0.25;
+
+            // The index compares values byte by byte, so other collations
+            // are left to SQLite
+            const char *collation = sqlite3_vtab_collation(pIdxInfo, i);
+            if (collation && sqlite3_stricmp(collation, "BINARY") != 0)
+                continue;
+        }
+
+        pIdxInfo->aConstraintUsage[i].argvIndex = argIdx ++;
+        pIdxInfo->aConstraintUsage[i].omit = 1;
+        estimatedRows *= selectivity;
+        constraints.push_back(kind);
+    }
+
+    // Values come out in order, and the rowids of each value in order
+    if (pIdxInfo->nOrderBy == 1 && pIdxInfo->aOrderBy[0].iColumn == 0
+        && !pIdxInfo->aOrderBy[0].desc)
+        pIdxInfo->orderByConsumed = 1;
+
+    if (estimatedRows < 1)
+        estimatedRows = 1;
+    pIdxInfo->estimatedRows = static_cast<sqlite3_int64>(estimatedRows);
+    pIdxInfo->estimatedCost = 10 + estimatedRows;
+    pIdxInfo->idxStr = sqlite3_mprintf("%s", constraints.c_str());
+    if (!pIdxInfo->idxStr)
+        return SQLITE_NOMEM;
+    pIdxInfo->needToFreeIdxStr = 1;
+    return SQLITE_OK;
+}
+
+
+/// Returns the smallest text greater than every text that starts with a
+/// prefix, or an empty string if there is none
+static std::string prefix_end(std::string prefix)
+{
+    while (!prefix.empty()
+           && static_cast<unsigned char>(prefix.back()) == 0xff)
+        prefix.pop_back();
+    if (!prefix.empty())
+        prefix.back() = static_cast<char>(
+            static_cast<unsigned char>(prefix.back()) + 1);
+    return prefix;
+}
+
+
+/// Start reading the values that satisfy the constraints. A MATCH pattern is
+/// turned into the range of values that start with the text before its first
+/// *, and the values in that range are checked against the rest of it; a
+/// pattern that starts with * reads every value.
+static int MODULE_FUNC(xFilter) (
+    sqlite3_vtab_cursor *pVtabCursor,
+    int idxNum, const char *idxStr,
+    int argc, sqlite3_value **argv
+){
+    index_cursor *cursor = (index_cursor *)pVtabCursor;
+    index_vtab *vtab = (index_vtab *)pVtabCursor->pVtab;
+
+    // The text bound for each argument of a MATCH, or the argument itself
+    struct bound {
+        sqlite3_value *value;
+        std::string text;
+    };
+    std::vector<bound> bounds;
+    std::string where;
+    cursor->patterns.clear();
+    for (int i = 0; idxStr && idxStr[i]; i ++) {
+        const char *condition = nullptr;
+        switch (idxStr[i]) {
+        case INDEX_EQ: condition = "value = ?"; break;
+        case INDEX_GT: condition = "value > ?"; break;
+        case INDEX_GE: condition = "value >= ?"; break;
+        case INDEX_LT: condition = "value < ?"; break;
+        case INDEX_LE: condition = "value <= ?"; break;
+        case INDEX_ROWID: condition = "id = ?"; break;
+        }
+        if (condition) {
+            where += std::string(where.empty() ? " WHERE " : " AND ")
+                + condition;
+            bounds.push_back({ argv[i], "" });
+            continue;
+        }
+
+        if (sqlite3_value_type(argv[i]) == SQLITE_NULL) {
+            where += where.empty() ? " WHERE 0" : " AND 0";
+            continue;
+        }
+        std::string pattern(
+            reinterpret_cast<const char *>(sqlite3_value_text(argv[i])),
+            static_cast<size_t>(sqlite3_value_bytes(argv[i])));
+        size_t star = pattern.find('*');
+        if (star == std::string::npos) {
+            where += where.empty() ? " WHERE value = ?" : " AND value = ?";
+            bounds.push_back({ nullptr, pattern });
+            continue;
+        }
+        std::string prefix = pattern.substr(0, star);
+        if (!prefix.empty()) {
+            where += where.empty() ? " WHERE value >= ?" : " AND value >= ?";
+            bounds.push_back({ nullptr, prefix });
+            std::string end = prefix_end(prefix);
+            if (!end.empty()) {
+                where += " AND value < ?";
+                bounds.push_back({ nullptr, end });
+            }
+        }
+        if (pattern != prefix + "*")
+            cursor->patterns.push_back(pattern);
+    }
+
+    // The query depends on the patterns as well as the plan, so the
+    // statement is only reused if it is the same. The order is spelled out,
+    // since SQLite may otherwise read the smaller index of rowids.
+    char *sql = sqlite3_mprintf("SELECT value, id FROM \"%w\".\"%w_data\"%s "
+        "ORDER BY value, id", vtab->schema.c_str(), vtab->name.c_str(),
+        where.c_str());
+    if (!sql)
+        return SQLITE_NOMEM;
+    if (cursor->stmt && cursor->sql == sql) {
+        sqlite3_reset(cursor->stmt);
+    } else {
+        sqlite3_finalize(cursor->stmt);
+        cursor->stmt = nullptr;
+        cursor->sql = sql;
+        int err = sqlite3_prepare_v2(vtab->db, sql, -1, &cursor->stmt,
+            nullptr);
+        if (err != SQLITE_OK) {
+            sqlite3_free(sql);
+            return database_error(&vtab->base, vtab->db, err);
+        }
+    }
+    sqlite3_free(sql);
+
+    for (size_t i = 0; i < bounds.size(); i ++) {
+        int err = bounds[i].value
+            ? sqlite3_bind_value(cursor->stmt, static_cast<int>(i + 1),
+                bounds[i].value)
+            : sqlite3_bind_text64(cursor->stmt, static_cast<int>(i + 1),
+                bounds[i].text.data(), bounds[i].text.length(),
+                SQLITE_TRANSIENT, SQLITE_UTF8);
+        if (err != SQLITE_OK) return err;
+    }
+
+    cursor->eof = false;
+    return MODULE_FUNC(xNext)(pVtabCursor);
+}
+
+
+/// Indexes a message written to the hidden column, which is what the triggers
+/// on the underlying table do. Values written to the value column are ignored.
+static int MODULE_FUNC(xUpdate) (
+    sqlite3_vtab *tab,
+    int argc, sqlite3_value **argv,
+    sqlite_int64 *pRowid
+) {
+    index_vtab *vtab = (index_vtab *)tab;
+    stats_call call(vtab->conn->stats, FUNCTION_INDEX);
+
+    int err;
+    if (sqlite3_value_type(argv[0]) != SQLITE_NULL) {
+        err = remove_message(vtab, sqlite3_value_int64(argv[0]));
+        if (err != SQLITE_OK) return database_error(&vtab->base, vtab->db, err);
+        if (argc == 1) return SQLITE_OK;
+    }
+
+    if (sqlite3_value_type(argv[1]) != SQLITE_INTEGER) {
+        sqlite3_free(vtab->base.zErrMsg);
+        vtab->base.zErrMsg = sqlite3_mprintf("protobuf_index requires the "
+            "rowid of the row in the underlying table");
+        return SQLITE_ERROR;
+    }
+    *pRowid = sqlite3_value_int64(argv[1]);
+
+    char *error_msg = nullptr;
+    err = index_message(vtab, *pRowid, argv[3], &error_msg);
+    if (err != SQLITE_OK) {
+        sqlite3_free(vtab->base.zErrMsg);
+        vtab->base.zErrMsg = error_msg;
+    }
+    return err;
+}
+
+
+static sqlite3_module module = {
+  0,                         /* iVersion */
+  MODULE_FUNC(xCreate),      /* xCreate */
+  MODULE_FUNC(xConnect),     /* xConnect - required */
+  MODULE_FUNC(xBestIndex),   /* xBestIndex - required */
+  MODULE_FUNC(xDisconnect),  /* xDisconnect - required */
+  MODULE_FUNC(xDestroy),     /* xDestroy */
+  MODULE_FUNC(xOpen),        /* xOpen - open a cursor - required */
+  MODULE_FUNC(xClose),       /* xClose - close a cursor - required */
+  MODULE_FUNC(xFilter),      /* xFilter - configure scan constraints - required */
+  MODULE_FUNC(xNext),        /* xNext - advance a cursor - required */
+  MODULE_FUNC(xEof),         /* xEof - check for end of scan - required */
+  MODULE_FUNC(xColumn),      /* xColumn - read data - required */
+  MODULE_FUNC(xRowid),       /* xRowid - read data - required */
+  MODULE_FUNC(xUpdate),      /* xUpdate */
+  0,                         /* xBegin */
+  0,                         /* xSync */
+  0,                         /* xCommit */
+  0,                         /* xRollback */
+  0,                         /* xFindMethod */
+  0,                         /* xRename */
+};
+
+
+DECLARE_(protobuf_index)
+{
+    return sqlite3_create_module_v2(db, "protobuf_index", &module,
+        conn->retain(), connection::release);
+}
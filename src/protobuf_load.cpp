@@ -5,6 +5,8 @@
 #include <sqlite3ext.h>
 SQLITE_EXTENSION_INIT3
 
+#include "connection.h"
+#include "extractors.h"
 #include "header.h"
 #include "utilities.h"
 
@@ -32,8 +34,14 @@ static void protobuf_load(sqlite3_context *context,
         return;
     }
     
-    // Load the library
+    // Load the library, unless it was already loaded on this connection
+    connection *conn = connection::get(context);
     const std::string path = string_from_sqlite3_value(argv[0]);
+    if (conn->libraries.count(path)) {
+        sqlite3_result_null(context);
+        return;
+    }
+
     void *handle = dlopen(path.c_str(), RTLD_LAZY | RTLD_GLOBAL);
     if (!handle) {
         auto error_msg = std::string("Could not load library: ") + dlerror();
@@ -41,12 +49,15 @@ static void protobuf_load(sqlite3_context *context,
         return;
     }
 
+    conn->libraries.insert(path);
+    loaded_descriptors::generated_types_changed();
+    register_extractors(handle);
     sqlite3_result_null(context);
 }
 
 
 DECLARE_(protobuf_load)
 {
-    return sqlite3_create_function(db, "protobuf_load", 1, SQLITE_UTF8, 0,
-        protobuf_load, 0, 0);
+    return create_function(db, conn, "protobuf_load", 1, SQLITE_UTF8,
+        protobuf_load);
 }
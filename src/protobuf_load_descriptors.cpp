@@ -0,0 +1,37 @@
+#include <string>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "connection.h"
+#include "header.h"
+
+
+/// Loads the message types in a serialized FileDescriptorSet for use on this
+/// connection. Returns the number of files that were not already loaded, or
+/// throws an error on failure.
+///
+///     SELECT protobuf_load_descriptors(readfile("addressbook.pb"));
+///
+static void protobuf_load_descriptors(sqlite3_context *context,
+                                      int argc,
+                                      sqlite3_value **argv)
+{
+    connection *conn = connection::get(context);
+    std::string error_msg;
+    int added = conn->descriptors.add_file_set(sqlite3_value_blob(argv[0]),
+        static_cast<size_t>(sqlite3_value_bytes(argv[0])), &error_msg);
+    if (added < 0) {
+        sqlite3_result_error(context, error_msg.c_str(), -1);
+        return;
+    }
+
+    sqlite3_result_int(context, added);
+}
+
+
+DECLARE_(protobuf_load_descriptors)
+{
+    return create_function(db, conn, "protobuf_load_descriptors", 1,
+        SQLITE_UTF8, protobuf_load_descriptors);
+}
@@ -0,0 +1,111 @@
+#include <memory>
+#include <string>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "compression.h"
+#include "connection.h"
+#include "extract.h"
+#include "header.h"
+#include "match.h"
+#include "stats.h"
+#include "utilities.h"
+
+
+/// Returns the compiled filter for the type name and filter arguments,
+/// reusing the one attached to the statement if possible. If SQLite declines
+/// to keep it, it is owned by fallback instead.
+///
+/// On failure, sets an error on the context and returns NULL.
+static compiled_filter *get_compiled_filter(
+    sqlite3_context *context,
+    sqlite3_value **argv,
+    std::unique_ptr<compiled_filter>& fallback)
+{
+    connection *conn = connection::get(context);
+
+    compiled_filter *cached = static_cast<compiled_filter *>(
+        sqlite3_get_auxdata(context, 2));
+    if (cached && cached->matches(argv[1], argv[2]))
+        return cached;
+
+    std::string error_msg;
+    const std::string type_name = string_from_sqlite3_value(argv[1]);
+    const std::string filter = string_from_sqlite3_value(argv[2]);
+    compiled_filter *compiled =
+        new_compiled_filter(conn, type_name, filter, &error_msg);
+    if (!compiled) {
+        sqlite3_result_error(context, error_msg.c_str(), -1);
+        return nullptr;
+    }
+
+    sqlite3_set_auxdata(context, 2, compiled, compiled_filter::destroy);
+    if (sqlite3_get_auxdata(context, 2) == compiled)
+        return compiled;
+
+    fallback.reset(new_compiled_filter(conn, type_name, filter, &error_msg));
+    if (!fallback)
+        sqlite3_result_error(context, error_msg.c_str(), -1);
+    return fallback.get();
+}
+
+
+/// Tests a message against a filter over its fields
+///
+///     SELECT * FROM people
+///      WHERE protobuf_match(protobuf, "Person",
+///                           "$.name ^= 'A' AND $.phones[0].type = HOME");
+///
+/// The filter is compiled once per statement, and the fields it tests are
+/// found in a single pass over the message, which stops as soon as the result
+/// is known.
+///
+/// @returns 1 if the message matches, 0 if it does not, or NULL if the result
+///          depends on a comparison with NULL
+static void protobuf_match(sqlite3_context *context,
+                           int argc,
+                           sqlite3_value **argv)
+{
+    connection *conn = connection::get(context);
+    stats_call call(conn->stats, FUNCTION_MATCH);
+
+    std::unique_ptr<compiled_filter> fallback;
+    compiled_filter *filter = get_compiled_filter(context, argv, fallback);
+    if (!filter)
+        return;
+
+    // Nothing is known about a missing message
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    for (const std::unique_ptr<compiled_path>& path : filter->paths)
+        conn->stats.count_path(*path);
+    conn->stats.count_bytes(static_cast<size_t>(sqlite3_value_bytes(argv[0])));
+
+    const uint8_t *data;
+    size_t size;
+    if (!message_argument(context, conn, argv[0], &data, &size))
+        return;
+    parsed_message parsed(data, size, conn, &conn->cache);
+    match_result result;
+    std::string error_msg;
+    if (!evaluate_filter(conn, *filter, parsed, &result, &error_msg)) {
+        sqlite3_result_error(context, error_msg.c_str(), -1);
+        return;
+    }
+
+    conn->stats.enter_phase(PHASE_RESULT);
+    if (result == MATCH_UNKNOWN)
+        sqlite3_result_null(context);
+    else
+        sqlite3_result_int(context, result == MATCH_TRUE ? 1 : 0);
+}
+
+
+DECLARE_(protobuf_match)
+{
+    return create_function(db, conn, "protobuf_match", 3,
+        SQLITE_UTF8 | SQLITE_DETERMINISTIC, protobuf_match);
+}
@@ -0,0 +1,74 @@
+#include <memory>
+#include <string>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "compression.h"
+#include "connection.h"
+#include "header.h"
+#include "path.h"
+#include "stats.h"
+#include "wire.h"
+
+
+/// Returns a copy of the message with the value selected by the path removed
+///
+///     UPDATE people SET protobuf = protobuf_remove(protobuf, "Person",
+///                                                  "$.phones[-1]");
+///
+/// If the path ends with a repeated field without an index, all of its
+/// elements are removed. If nothing is selected, the message is returned
+/// unchanged.
+///
+/// @returns a Protobuf-encoded BLOB
+static void protobuf_remove(sqlite3_context *context,
+                            int argc,
+                            sqlite3_value **argv)
+{
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+        return;
+    connection *conn = connection::get(context);
+    stats_call call(conn->stats, FUNCTION_REMOVE);
+
+    // Resolve the type name and path, which is only done once per statement
+    std::unique_ptr<compiled_path> fallback;
+    const compiled_path *path = get_compiled_path(context, argv, 1, 2,
+        fallback, SELECTS_ONE_OR_ALL);
+    if (!path)
+        return;
+    if (!path->wire_after_parse) {
+        sqlite3_result_error(context, "Path cannot be edited", -1);
+        return;
+    }
+
+    conn->stats.count_path(*path);
+    conn->stats.count_bytes(static_cast<size_t>(sqlite3_value_bytes(argv[0])));
+    const uint8_t *data;
+    size_t size;
+    if (!message_argument(context, conn, argv[0], &data, &size))
+        return;
+    conn->stats.enter_phase(PHASE_WALK);
+    std::string output;
+    switch (wire_edit(*path, data, size, nullptr, &output)) {
+    case EDIT_DONE:
+        conn->stats.enter_phase(PHASE_RESULT);
+        sqlite3_result_blob64(context, output.data(), output.size(),
+            SQLITE_TRANSIENT);
+        break;
+    case EDIT_NOT_FOUND:
+        sqlite3_result_value(context, argv[0]);
+        break;
+    case EDIT_MALFORMED:
+        conn->stats.count_parse_failure();
+        sqlite3_result_error(context, "Failed to parse message", -1);
+        break;
+    }
+}
+
+
+DECLARE_(protobuf_remove)
+{
+    return create_function(db, conn, "protobuf_remove", 3,
+        SQLITE_UTF8 | SQLITE_DETERMINISTIC, protobuf_remove);
+}
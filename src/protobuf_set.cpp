@@ -0,0 +1,287 @@
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/stubs/common.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "compression.h"
+#include "connection.h"
+#include "header.h"
+#include "path.h"
+#include "stats.h"
+#include "wire.h"
+
+using google::protobuf::EnumValueDescriptor;
+using google::protobuf::FieldDescriptor;
+using google::protobuf::FileDescriptor;
+using google::protobuf::internal::WireFormatLite;
+
+
+/// Appends a value in little-endian byte order
+template <typename T>
+static void append_fixed(std::string *output, T value)
+{
+    uint8_t bytes[sizeof(T)];
+    for (size_t i = 0; i < sizeof(T); i ++)
+        bytes[i] = static_cast<uint8_t>(value >> (8 * i));
+    output->append(reinterpret_cast<const char *>(bytes), sizeof(T));
+}
+
+
+/// Gets an integer argument, which may also be a real number or text that
+/// converts to an integer without loss
+static bool integer_value(sqlite3_value *value, int64_t min, int64_t max,
+                          int64_t *result)
+{
+    switch (sqlite3_value_numeric_type(value)) {
+    case SQLITE_INTEGER:
+        *result = sqlite3_value_int64(value);
+        break;
+    case SQLITE_FLOAT:
+    {
+        double real = sqlite3_value_double(value);
+        if (real != std::floor(real) || real < -9223372036854775808.0
+            || real >= 9223372036854775808.0)
+            return false;
+        *result = static_cast<int64_t>(real);
+        break;
+    }
+    default:
+        return false;
+    }
+    return *result >= min && *result <= max;
+}
+
+
+/// Encodes a SQL value as a single element of the field selected by the path,
+/// without the tag
+static bool encode_element(const compiled_path& path,
+                           sqlite3_value *value,
+                           std::string *element,
+                           std::string *error_msg)
+{
+    const FieldDescriptor *field = path.elements.back().field;
+    int64_t integer;
+    *error_msg = "Value does not match the field type";
+
+    switch (field->type()) {
+    case FieldDescriptor::TYPE_INT32:
+    case FieldDescriptor::TYPE_INT64:
+    case FieldDescriptor::TYPE_UINT64:
+    case FieldDescriptor::TYPE_UINT32:
+    case FieldDescriptor::TYPE_SINT32:
+    case FieldDescriptor::TYPE_SINT64:
+    case FieldDescriptor::TYPE_FIXED32:
+    case FieldDescriptor::TYPE_SFIXED32:
+    case FieldDescriptor::TYPE_FIXED64:
+    case FieldDescriptor::TYPE_SFIXED64:
+    case FieldDescriptor::TYPE_BOOL:
+    {
+        // 64-bit unsigned values are read back as signed, so accept either
+        int64_t min = INT64_MIN, max = INT64_MAX;
+        switch (field->type()) {
+        case FieldDescriptor::TYPE_INT32:
+        case FieldDescriptor::TYPE_SINT32:
+        case FieldDescriptor::TYPE_SFIXED32:
+            min = INT32_MIN;
+            max = INT32_MAX;
+            break;
+        case FieldDescriptor::TYPE_UINT32:
+        case FieldDescriptor::TYPE_FIXED32:
+            min = 0;
+            max = UINT32_MAX;
+            break;
+        default:
+            break;
+        }
+        if (!integer_value(value, min, max, &integer))
+            return false;
+
+        switch (field->type()) {
+        case FieldDescriptor::TYPE_SINT32:
+            wire_append_varint(element, WireFormatLite::ZigZagEncode32(
+                static_cast<int32_t>(integer)));
+            break;
+        case FieldDescriptor::TYPE_SINT64:
+            wire_append_varint(element,
+                WireFormatLite::ZigZagEncode64(integer));
+            break;
+        case FieldDescriptor::TYPE_FIXED32:
+        case FieldDescriptor::TYPE_SFIXED32:
+            append_fixed(element, static_cast<uint32_t>(integer));
+            break;
+        case FieldDescriptor::TYPE_FIXED64:
+        case FieldDescriptor::TYPE_SFIXED64:
+            append_fixed(element, static_cast<uint64_t>(integer));
+            break;
+        case FieldDescriptor::TYPE_BOOL:
+            wire_append_varint(element, integer != 0);
+            break;
+        default:
+            wire_append_varint(element, static_cast<uint64_t>(integer));
+            break;
+        }
+        return true;
+    }
+
+    case FieldDescriptor::TYPE_ENUM:
+    {
+        const EnumValueDescriptor *enum_value = nullptr;
+        if (path.enum_name) {
+            if (sqlite3_value_type(value) != SQLITE_TEXT)
+                return false;
+            enum_value = field->enum_type()->FindValueByName(
+                reinterpret_cast<const char *>(sqlite3_value_text(value)));
+        } else {
+            if (!integer_value(value, INT32_MIN, INT32_MAX, &integer))
+                return false;
+            enum_value = field->enum_type()->FindValueByNumber(
+                static_cast<int>(integer));
+
+            // Open enums can hold numbers that are not defined
+            if (!enum_value && field->enum_type()->file()->syntax()
+                               == FileDescriptor::SYNTAX_PROTO3) {
+                wire_append_varint(element, static_cast<uint64_t>(integer));
+                return true;
+            }
+        }
+        if (!enum_value) {
+            *error_msg = "Enum value not found";
+            return false;
+        }
+        wire_append_varint(element,
+            static_cast<uint64_t>(static_cast<int64_t>(enum_value->number())));
+        return true;
+    }
+
+    case FieldDescriptor::TYPE_FLOAT:
+    case FieldDescriptor::TYPE_DOUBLE:
+    {
+        int type = sqlite3_value_numeric_type(value);
+        if (type != SQLITE_INTEGER && type != SQLITE_FLOAT)
+            return false;
+        double real = sqlite3_value_double(value);
+        if (field->type() == FieldDescriptor::TYPE_FLOAT) {
+            float narrow = static_cast<float>(real);
+            uint32_t bits;
+            memcpy(&bits, &narrow, sizeof(bits));
+            append_fixed(element, bits);
+        } else {
+            uint64_t bits;
+            memcpy(&bits, &real, sizeof(bits));
+            append_fixed(element, bits);
+        }
+        return true;
+    }
+
+    case FieldDescriptor::TYPE_STRING:
+    case FieldDescriptor::TYPE_BYTES:
+    case FieldDescriptor::TYPE_MESSAGE:
+    {
+        // Submessages are given in their serialized form, and are not checked
+        int type = sqlite3_value_type(value);
+        if (type != SQLITE_TEXT && type != SQLITE_BLOB)
+            return false;
+        if (field->type() == FieldDescriptor::TYPE_MESSAGE
+            && type != SQLITE_BLOB)
+            return false;
+
+        const char *data = static_cast<const char *>(
+            sqlite3_value_blob(value));
+        int size = sqlite3_value_bytes(value);
+        if (field->type() == FieldDescriptor::TYPE_STRING
+            && field->file()->syntax() == FileDescriptor::SYNTAX_PROTO3
+            && !google::protobuf::internal::IsStructurallyValidUTF8(data,
+                                                                     size)) {
+            *error_msg = "String is not valid UTF-8";
+            return false;
+        }
+        wire_append_varint(element, static_cast<uint64_t>(size));
+        element->append(data ? data : "", static_cast<size_t>(size));
+        return true;
+    }
+
+    default:
+        return false;
+    }
+}
+
+
+/// Returns a copy of the message with the value selected by the path replaced
+///
+///     UPDATE people SET protobuf = protobuf_set(protobuf, "Person",
+///                                               "$.phones[0].number", ?);
+///
+/// Messages along the path are created if they are not present. If an index
+/// is out of range, the message is returned unchanged.
+///
+/// @returns a Protobuf-encoded BLOB
+static void protobuf_set(sqlite3_context *context,
+                         int argc,
+                         sqlite3_value **argv)
+{
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+        return;
+    connection *conn = connection::get(context);
+    stats_call call(conn->stats, FUNCTION_SET);
+
+    // Resolve the type name and path, which is only done once per statement
+    std::unique_ptr<compiled_path> fallback;
+    const compiled_path *path = get_compiled_path(context, argv, 1, 2,
+        fallback);
+    if (!path)
+        return;
+    if (!path->wire_after_parse) {
+        sqlite3_result_error(context, "Path cannot be edited", -1);
+        return;
+    }
+
+    // Setting a field to NULL removes it
+    std::string element;
+    std::string error_msg;
+    if (sqlite3_value_type(argv[3]) != SQLITE_NULL
+        && !encode_element(*path, argv[3], &element, &error_msg)) {
+        sqlite3_result_error(context, error_msg.c_str(), -1);
+        return;
+    }
+
+    conn->stats.count_path(*path);
+    conn->stats.count_bytes(static_cast<size_t>(sqlite3_value_bytes(argv[0])));
+    const uint8_t *data;
+    size_t size;
+    if (!message_argument(context, conn, argv[0], &data, &size))
+        return;
+    conn->stats.enter_phase(PHASE_WALK);
+    std::string output;
+    switch (wire_edit(*path, data, size,
+                      sqlite3_value_type(argv[3]) == SQLITE_NULL
+                          ? nullptr : &element,
+                      &output)) {
+    case EDIT_DONE:
+        conn->stats.enter_phase(PHASE_RESULT);
+        sqlite3_result_blob64(context, output.data(), output.size(),
+            SQLITE_TRANSIENT);
+        break;
+    case EDIT_NOT_FOUND:
+        sqlite3_result_value(context, argv[0]);
+        break;
+    case EDIT_MALFORMED:
+        conn->stats.count_parse_failure();
+        sqlite3_result_error(context, "Failed to parse message", -1);
+        break;
+    }
+}
+
+
+DECLARE_(protobuf_set)
+{
+    return create_function(db, conn, "protobuf_set", 4,
+        SQLITE_UTF8 | SQLITE_DETERMINISTIC, protobuf_set);
+}
@@ -0,0 +1,1304 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "compression.h"
+#include "connection.h"
+#include "extract.h"
+#include "header.h"
+#include "message_factory.h"
+#include "shadow.h"
+#include "stats.h"
+#include "utilities.h"
+#include "value.h"
+
+using google::protobuf::Descriptor;
+using google::protobuf::FieldDescriptor;
+using google::protobuf::Message;
+using google::protobuf::Reflection;
+
+
+// The indexing strategies used by MODULE_FUNC(xBestIndex) and MODULE_FUNC(xFilter)
+enum {
+    LOOKUP_ALL,
+    LOOKUP_BY_ROWID,
+};
+
+// The estimated number of rows in the table, which is not known
+#define ESTIMATED_ROWS 1000000
+
+
+#define MODULE_FUNC(func) protobuf_shred ## _ ## func
+
+
+// A field on the way from the message to one or more columns. Its repetition
+// level is the number of repeated fields on the way, counting itself, and its
+// definition level the number of fields on the way that may be absent.
+struct shred_node {
+    const FieldDescriptor *field;
+    int repetition;
+    int definition;
+
+    // The column of a leaf, or -1 for a message whose fields are below it
+    int column;
+    std::vector<shred_node> children;
+};
+
+
+// A column holds every value of one leaf field, with the levels of the fields
+// on the way to it. Its values are stored in the table <name>_c<n>, which has
+// one row for each message if there is no repeated field on the way, and
+// otherwise one for each value, including the repeated fields that are empty.
+struct shred_column {
+    std::string name;
+
+    // The path the column holds, as protobuf_extract_all would take it
+    std::string path;
+
+    // The fields from the message to the leaf, with their levels
+    std::vector<const FieldDescriptor *> fields;
+    std::vector<int> repetitions;
+    std::vector<int> definitions;
+
+    // Statements that write the column's table, prepared when first needed
+    sqlite3_stmt *insert;
+    sqlite3_stmt *remove;
+
+    int max_repetition() const { return repetitions.back(); }
+    int max_definition() const { return definitions.back(); }
+    const FieldDescriptor *leaf() const { return fields.back(); }
+};
+
+
+// shred_vtab is a subclass of sqlite3_vtab which holds the tree of fields and
+// the columns at its leaves. The columns are followed by the hidden message
+// column, which is reassembled from all of them.
+typedef struct shred_vtab shred_vtab;
+struct shred_vtab {
+    sqlite3_vtab base;
+    sqlite3 *db;
+    connection *conn;
+    std::string schema;
+    std::string name;
+    std::string table;
+    std::string column;
+    const Descriptor *type;
+    shred_node root;
+    std::vector<shred_column> columns;
+
+    // Set if the fields of the message type no longer match the columns, in
+    // which case the table can only be dropped
+    bool stale;
+
+    // Each message being shredded is parsed into the arena
+    message_arena arena;
+    std::string scratch;
+    std::vector<int> sequence;
+};
+
+
+// One value of a column, copied out of the column's table
+struct shred_entry {
+    int repetition;
+    int definition;
+    int type;
+    sqlite3_int64 i;
+    double d;
+    std::string bytes;
+};
+
+
+// Reads the table of one column in order of rowid, in step with the others.
+// The statement is kept on the first value of the next row.
+struct shred_reader {
+    int column;
+    sqlite3_stmt *stmt;
+    bool done;
+
+    // The values of the current row. Entries past the count are kept so
+    // that their buffers are reused.
+    std::vector<shred_entry> entries;
+    size_t count;
+};
+
+
+// shred_cursor is a subclass of sqlite3_vtab_cursor which reads the tables of
+// the columns that the query uses, and nothing else.
+typedef struct shred_cursor shred_cursor;
+struct shred_cursor {
+    sqlite3_vtab_cursor base;
+    int readersIdxNum;
+    std::string readersIdxStr;
+    std::vector<shred_reader> readers;
+
+    // The reader of each column, or -1 if the column is not read
+    std::vector<int> reader_of;
+    sqlite3_int64 rowid;
+    bool eof;
+
+    // The message that is reassembled when the message column is read
+    std::unique_ptr<Message> message;
+    std::vector<int> indexes;
+    std::string serialized;
+};
+
+
+/// Returns true if a field counts towards the definition level, because it
+/// may be absent: it is repeated, or it is optional and tracks presence
+static bool may_be_absent(const FieldDescriptor *field)
+{
+    return field->is_repeated()
+        || (field->has_presence() && !field->is_required());
+}
+
+
+/// Returns true if a message field is stored whole, serialized, rather than
+/// split into its fields. This is the case if its type has no fields, or if
+/// its type is already on the way to it, since a recursive type would
+/// otherwise have no end of columns.
+static bool is_message_leaf(const Descriptor *root,
+                            const std::vector<const FieldDescriptor *>& fields)
+{
+    const Descriptor *type = fields.back()->message_type();
+    if (type->field_count() == 0 || type == root)
+        return true;
+    for (size_t i = 0; i + 1 < fields.size(); i ++)
+        if (fields[i]->message_type() == type)
+            return true;
+    return false;
+}
+
+
+/// Returns the declared type of a column, which SQLite uses to decide how to
+/// compare it with other values
+static const char *column_type(const shred_column& column)
+{
+    // The values of a column with a repeated field are returned as JSON
+    if (column.max_repetition() > 0)
+        return "TEXT";
+
+    const FieldDescriptor *field = column.leaf();
+    switch (field->cpp_type()) {
+    case FieldDescriptor::CppType::CPPTYPE_INT32:
+    case FieldDescriptor::CppType::CPPTYPE_INT64:
+    case FieldDescriptor::CppType::CPPTYPE_UINT32:
+    case FieldDescriptor::CppType::CPPTYPE_UINT64:
+    case FieldDescriptor::CppType::CPPTYPE_BOOL:
+    case FieldDescriptor::CppType::CPPTYPE_ENUM:
+        return "INTEGER";
+    case FieldDescriptor::CppType::CPPTYPE_DOUBLE:
+    case FieldDescriptor::CppType::CPPTYPE_FLOAT:
+        return "REAL";
+    case FieldDescriptor::CppType::CPPTYPE_STRING:
+        return field->type() == FieldDescriptor::Type::TYPE_BYTES
+            ? "BLOB" : "TEXT";
+    case FieldDescriptor::CppType::CPPTYPE_MESSAGE:
+        return "BLOB";
+    }
+    return "";
+}
+
+
+/// Adds the fields of a message type to a node of the tree, and a column for
+/// each leaf below it. The column is named after the fields on the way to
+/// it, joined with underscores, with a number added if the name is taken.
+static void add_fields(shred_vtab *vtab,
+                       shred_node *node,
+                       const Descriptor *type,
+                       shred_column *path)
+{
+    for (int i = 0; i < type->field_count(); i ++) {
+        shred_node child;
+        child.field = type->field(i);
+        child.repetition = node->repetition
+            + (child.field->is_repeated() ? 1 : 0);
+        child.definition = node->definition
+            + (may_be_absent(child.field) ? 1 : 0);
+        child.column = -1;
+
+        std::string path_text = path->path;
+        path->path += "." + child.field->name();
+        if (child.field->is_repeated())
+            path->path += "[*]";
+        path->fields.push_back(child.field);
+        path->repetitions.push_back(child.repetition);
+        path->definitions.push_back(child.definition);
+
+        if (child.field->cpp_type() == FieldDescriptor::CppType::CPPTYPE_MESSAGE
+            && !is_message_leaf(vtab->type, path->fields)) {
+            add_fields(vtab, &child, child.field->message_type(), path);
+        } else {
+            std::string base;
+            for (const FieldDescriptor *field : path->fields)
+                base += (base.empty() ? "" : "_") + field->name();
+
+            shred_column column = *path;
+            column.name = base;
+            for (int n = 2; ; n ++) {
+                bool taken = sqlite3_stricmp(column.name.c_str(),
+                    vtab->column.c_str()) == 0;
+                for (const shred_column& other : vtab->columns)
+                    taken = taken || sqlite3_stricmp(column.name.c_str(),
+                        other.name.c_str()) == 0;
+                if (!taken) break;
+                column.name = base + "_" + std::to_string(n);
+            }
+            child.column = static_cast<int>(vtab->columns.size());
+            vtab->columns.push_back(column);
+        }
+
+        path->path = path_text;
+        path->fields.pop_back();
+        path->repetitions.pop_back();
+        path->definitions.pop_back();
+        node->children.push_back(child);
+    }
+}
+
+
+/// Compares the columns with those the table was created with. If they
+/// differ, the columns are replaced by the ones the table was created with,
+/// so that it can still be dropped, and the table is marked as stale.
+static int check_columns(shred_vtab *vtab, char **pzErr)
+{
+    char *sql = sqlite3_mprintf(
+        "SELECT name, path FROM \"%w\".\"%w_columns\" ORDER BY id",
+        vtab->schema.c_str(), vtab->name.c_str());
+    if (!sql)
+        return SQLITE_NOMEM;
+    sqlite3_stmt *stmt;
+    int err = sqlite3_prepare_v2(vtab->db, sql, -1, &stmt, nullptr);
+    sqlite3_free(sql);
+    if (err != SQLITE_OK) {
+        *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(vtab->db));
+        return err;
+    }
+
+    std::vector<shred_column> stored;
+    while ((err = sqlite3_step(stmt)) == SQLITE_ROW) {
+        shred_column column;
+        column.name = reinterpret_cast<const char *>(
+            sqlite3_column_text(stmt, 0));
+        column.path = reinterpret_cast<const char *>(
+            sqlite3_column_text(stmt, 1));
+        column.insert = column.remove = nullptr;
+        stored.push_back(column);
+    }
+    sqlite3_finalize(stmt);
+    if (err != SQLITE_DONE) {
+        *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(vtab->db));
+        return err;
+    }
+
+    bool same = stored.size() == vtab->columns.size();
+    for (size_t i = 0; same && i < stored.size(); i ++)
+        same = stored[i].name == vtab->columns[i].name
+            && stored[i].path == vtab->columns[i].path;
+    if (!same) {
+        vtab->columns.swap(stored);
+        vtab->root.children.clear();
+        vtab->stale = true;
+    }
+    return SQLITE_OK;
+}
+
+
+/// Shared by xCreate and xConnect. The arguments are the table and column
+/// holding the messages, and the message type:
+///
+///     CREATE VIRTUAL TABLE people_cols USING protobuf_shred(
+///         people, protobuf, 'Person');
+static int shred_connect(
+    sqlite3 *db,
+    void *pAux,
+    int argc, const char * const *argv,
+    sqlite3_vtab **ppVtab,
+    char **pzErr,
+    bool create
+) {
+    // The first three arguments are the module, database, and table names
+    if (argc != 6) {
+        *pzErr = sqlite3_mprintf("protobuf_shred requires a table, a column, "
+            "and a message type");
+        return SQLITE_ERROR;
+    }
+
+    std::unique_ptr<shred_vtab> vtab(new shred_vtab());
+    vtab->db = db;
+    vtab->conn = static_cast<connection *>(pAux);
+    vtab->schema = argv[1];
+    vtab->name = argv[2];
+    vtab->table = dequote(argv[3]);
+    vtab->column = dequote(argv[4]);
+    vtab->stale = false;
+
+    std::string type_name = dequote(argv[5]);
+    vtab->type = vtab->conn->descriptors.find_message_type(type_name);
+    if (!vtab->type) {
+        *pzErr = sqlite3_mprintf("Could not find message descriptor: %s",
+            type_name.c_str());
+        return SQLITE_ERROR;
+    }
+
+    vtab->root.field = nullptr;
+    vtab->root.repetition = 0;
+    vtab->root.definition = 0;
+    vtab->root.column = -1;
+    shred_column path;
+    path.path = "$";
+    path.insert = path.remove = nullptr;
+    add_fields(vtab.get(), &vtab->root, vtab->type, &path);
+    if (vtab->columns.empty()) {
+        *pzErr = sqlite3_mprintf("%s has no fields to shred",
+            type_name.c_str());
+        return SQLITE_ERROR;
+    }
+
+    if (!create) {
+        int err = check_columns(vtab.get(), pzErr);
+        if (err != SQLITE_OK) return err;
+    }
+
+    std::string schema = "CREATE TABLE tbl(";
+    for (const shred_column& column : vtab->columns) {
+        char *definition = sqlite3_mprintf("\"%w\" %s, ", column.name.c_str(),
+            vtab->stale ? "" : column_type(column));
+        schema += definition;
+        sqlite3_free(definition);
+    }
+
+    // The message itself is a hidden column with the same name as in the
+    // underlying table
+    char *definition = sqlite3_mprintf("\"%w\" HIDDEN)", vtab->column.c_str());
+    schema += definition;
+    sqlite3_free(definition);
+
+    int err = sqlite3_declare_vtab(db, schema.c_str());
+    if (err != SQLITE_OK) {
+        *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+        return err;
+    }
+
+    vtab->sequence.resize(vtab->columns.size());
+    *ppVtab = &vtab.release()->base;
+    return SQLITE_OK;
+}
+
+
+/// Sets the error message of a table whose columns no longer match the
+/// message type
+static int stale_error(shred_vtab *vtab)
+{
+    sqlite3_free(vtab->base.zErrMsg);
+    vtab->base.zErrMsg = sqlite3_mprintf("The fields of %s have changed since "
+        "%s was created", vtab->type->full_name().c_str(),
+        vtab->name.c_str());
+    return SQLITE_ERROR;
+}
+
+
+/// The state of shredding one message into the tables of the columns
+struct shred_writer {
+    shred_vtab *vtab;
+    sqlite3_int64 rowid;
+    int err;
+};
+
+
+/// Writes one value of a column. The value is taken from a field of a message
+/// if one is given, and is otherwise null.
+static void write_value(shred_writer& writer,
+                        int c,
+                        int repetition,
+                        int definition,
+                        const Message *message,
+                        int index)
+{
+    shred_vtab *vtab = writer.vtab;
+    shred_column& column = vtab->columns[c];
+    bool repeated = column.max_repetition() > 0;
+    if (!column.insert) {
+        writer.err = repeated
+            ? prepare(vtab->db, &column.insert,
+                "INSERT INTO \"%w\".\"%w_c%d\" (id, seq, r, d, value) "
+                "VALUES (?, ?, ?, ?, ?)",
+                vtab->schema.c_str(), vtab->name.c_str(), c)
+            : prepare(vtab->db, &column.insert,
+                "INSERT INTO \"%w\".\"%w_c%d\" (id, d, value) "
+                "VALUES (?, ?, ?)",
+                vtab->schema.c_str(), vtab->name.c_str(), c);
+        if (writer.err != SQLITE_OK) return;
+    }
+
+    sqlite3_stmt *stmt = column.insert;
+    int arg = 1;
+    sqlite3_bind_int64(stmt, arg ++, writer.rowid);
+    if (repeated) {
+        sqlite3_bind_int(stmt, arg ++, vtab->sequence[c] ++);
+        sqlite3_bind_int(stmt, arg ++, repetition);
+    }
+    sqlite3_bind_int(stmt, arg ++, definition);
+
+    field_value value;
+    value.type = SQLITE_NULL;
+    if (message && !value_from_field(*message, column.leaf(), index, false,
+                                     &vtab->scratch, &value))
+        value.type = SQLITE_NULL;
+    switch (value.type) {
+    case SQLITE_INTEGER:
+        sqlite3_bind_int64(stmt, arg, value.i);
+        break;
+    case SQLITE_FLOAT:
+        sqlite3_bind_double(stmt, arg, value.d);
+        break;
+    case SQLITE_TEXT:
+        sqlite3_bind_text64(stmt, arg, static_cast<const char *>(value.data),
+            value.size, SQLITE_STATIC, SQLITE_UTF8);
+        break;
+    case SQLITE_BLOB:
+        sqlite3_bind_blob64(stmt, arg, value.size ? value.data : "",
+            value.size, SQLITE_STATIC);
+        break;
+    default:
+        sqlite3_bind_null(stmt, arg);
+        break;
+    }
+
+    writer.err = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if (writer.err == SQLITE_DONE)
+        writer.err = SQLITE_OK;
+}
+
+
+/// Writes a null value to every column below a field that is absent. The
+/// levels say how much of the path to it is present.
+static void write_nulls(shred_writer& writer,
+                        const shred_node& node,
+                        int repetition,
+                        int definition)
+{
+    if (node.column >= 0) {
+        write_value(writer, node.column, repetition, definition, nullptr, 0);
+        return;
+    }
+    for (const shred_node& child : node.children) {
+        write_nulls(writer, child, repetition, definition);
+        if (writer.err != SQLITE_OK) return;
+    }
+}
+
+
+static void dissect(shred_writer& writer,
+                    const shred_node& node,
+                    const Message& message,
+                    int repetition,
+                    int definition);
+
+
+/// Writes the values below one field of a message, or one element of it
+static void visit(shred_writer& writer,
+                  const shred_node& node,
+                  const Message& message,
+                  int index,
+                  int repetition)
+{
+    if (node.column >= 0) {
+        write_value(writer, node.column, repetition, node.definition,
+            &message, index);
+        return;
+    }
+    const Reflection *reflection = message.GetReflection();
+    const Message& child = node.field->is_repeated()
+        ? reflection->GetRepeatedMessage(message, node.field, index)
+        : reflection->GetMessage(message, node.field);
+    dissect(writer, node, child, repetition, node.definition);
+}
+
+
+/// Writes the values of every field below a node of the tree. The first value
+/// written to each column has the given repetition level, which says which
+/// repeated field the values start a new element of; the next elements of a
+/// repeated field have its own level.
+static void dissect(shred_writer& writer,
+                    const shred_node& node,
+                    const Message& message,
+                    int repetition,
+                    int definition)
+{
+    const Reflection *reflection = message.GetReflection();
+    for (const shred_node& child : node.children) {
+        if (child.field->is_repeated()) {
+            int count = reflection->FieldSize(message, child.field);
+            if (count == 0)
+                write_nulls(writer, child, repetition, definition);
+            for (int i = 0; i < count && writer.err == SQLITE_OK; i ++)
+                visit(writer, child, message, i,
+                    i == 0 ? repetition : child.repetition);
+        } else if (!may_be_absent(child.field)
+                   || reflection->HasField(message, child.field)) {
+            visit(writer, child, message, -1, repetition);
+        } else {
+            write_nulls(writer, child, repetition, definition);
+        }
+        if (writer.err != SQLITE_OK) return;
+    }
+}
+
+
+/// Shreds a message into the tables of the columns. A compressed message is
+/// decompressed first. A null message is left out, and so is one that cannot
+/// be read, since the copy must not stop it from being written to the
+/// underlying table; parse failures show up in protobuf_stats.
+static int shred_message(shred_vtab *vtab,
+                         sqlite3_int64 rowid,
+                         sqlite3_value *value,
+                         char **pzErr)
+{
+    if (sqlite3_value_type(value) == SQLITE_NULL)
+        return SQLITE_OK;
+
+    const uint8_t *data = static_cast<const uint8_t *>(sqlite3_value_blob(value));
+    size_t size = static_cast<size_t>(sqlite3_value_bytes(value));
+    vtab->conn->stats.count_bytes(size);
+    std::string error_msg;
+    if (!decompress_message(vtab->conn, vtab->db, &data, &size, &error_msg))
+        return SQLITE_OK;
+
+    parsed_message parsed(data, size, vtab->conn, &vtab->arena);
+    const Message *message = parsed.get(vtab->type);
+    if (!message)
+        return SQLITE_OK;
+
+    stats_phase phase = vtab->conn->stats.enter_phase(PHASE_WALK);
+    shred_writer writer { vtab, rowid, SQLITE_OK };
+    std::fill(vtab->sequence.begin(), vtab->sequence.end(), 0);
+    dissect(writer, vtab->root, *message, 0, 0);
+    vtab->conn->stats.enter_phase(phase);
+    if (writer.err != SQLITE_OK)
+        *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(vtab->db));
+    return writer.err;
+}
+
+
+/// Removes the values of a message from the tables of the columns
+static int remove_message(shred_vtab *vtab, sqlite3_int64 rowid)
+{
+    for (size_t c = 0; c < vtab->columns.size(); c ++) {
+        shred_column& column = vtab->columns[c];
+        if (!column.remove) {
+            int err = prepare(vtab->db, &column.remove,
+                "DELETE FROM \"%w\".\"%w_c%d\" WHERE id = ?",
+                vtab->schema.c_str(), vtab->name.c_str(), static_cast<int>(c));
+            if (err != SQLITE_OK) return err;
+        }
+        sqlite3_bind_int64(column.remove, 1, rowid);
+        int err = sqlite3_step(column.remove);
+        sqlite3_reset(column.remove);
+        if (err != SQLITE_DONE) return err;
+    }
+    return SQLITE_OK;
+}
+
+
+/// Shreds a message the underlying table already holds, for create_shadow
+static int shred_existing(void *vtab,
+                          sqlite3_int64 rowid,
+                          sqlite3_value *value,
+                          char **pzErr)
+{
+    return shred_message(static_cast<shred_vtab *>(vtab), rowid, value, pzErr);
+}
+
+
+/// Finalizes the statements that write the tables of the columns
+static void finalize_statements(shred_vtab *vtab)
+{
+    for (shred_column& column : vtab->columns) {
+        sqlite3_finalize(column.insert);
+        sqlite3_finalize(column.remove);
+        column.insert = column.remove = nullptr;
+    }
+}
+
+
+/// Create the tables of the columns and the triggers that keep them up to
+/// date with the underlying table, and shred the messages it already holds
+static int MODULE_FUNC(xCreate) (
+    sqlite3 *db,
+    void *pAux,
+    int argc, const char * const *argv,
+    sqlite3_vtab **ppVtab,
+    char **pzErr
+) {
+    int err = shred_connect(db, pAux, argc, argv, ppVtab, pzErr, true);
+    if (err != SQLITE_OK) return err;
+    std::unique_ptr<shred_vtab> vtab(reinterpret_cast<shred_vtab *>(*ppVtab));
+    *ppVtab = nullptr;
+    const char *schema = vtab->schema.c_str();
+    const char *name = vtab->name.c_str();
+    const char *table = vtab->table.c_str();
+    const char *column = vtab->column.c_str();
+
+    err = exec_sql(db, pzErr, "CREATE TABLE \"%w\".\"%w_columns\" "
+        "(id INTEGER PRIMARY KEY, name TEXT, path TEXT)", schema, name);
+    for (size_t c = 0; c < vtab->columns.size() && err == SQLITE_OK; c ++) {
+        const shred_column& col = vtab->columns[c];
+        err = exec_sql(db, pzErr, "INSERT INTO \"%w\".\"%w_columns\" "
+            "VALUES (%d, %Q, %Q)", schema, name, static_cast<int>(c),
+            col.name.c_str(), col.path.c_str());
+        if (err != SQLITE_OK) break;
+        if (col.max_repetition() > 0)
+            err = exec_sql(db, pzErr, "CREATE TABLE \"%w\".\"%w_c%d\" "
+                "(id INTEGER, seq INTEGER, r INTEGER, d INTEGER, value, "
+                "PRIMARY KEY (id, seq)) WITHOUT ROWID",
+                schema, name, static_cast<int>(c));
+        else
+            err = exec_sql(db, pzErr, "CREATE TABLE \"%w\".\"%w_c%d\" "
+                "(id INTEGER PRIMARY KEY, d INTEGER, value)",
+                schema, name, static_cast<int>(c));
+    }
+    if (err != SQLITE_OK) return err;
+
+    shadow_source source = { schema, name, table, column, column };
+    err = create_shadow(db, source, shred_existing, vtab.get(), pzErr);
+    if (err != SQLITE_OK) {
+        finalize_statements(vtab.get());
+        return err;
+    }
+
+    *ppVtab = &vtab.release()->base;
+    return SQLITE_OK;
+}
+
+
+/// Connect to an existing table
+static int MODULE_FUNC(xConnect) (
+    sqlite3 *db,
+    void *pAux,
+    int argc, const char * const *argv,
+    sqlite3_vtab **ppVtab,
+    char **pzErr
+) {
+    return shred_connect(db, pAux, argc, argv, ppVtab, pzErr, false);
+}
+
+
+/// Undoes xConnect
+static int MODULE_FUNC(xDisconnect) (sqlite3_vtab *pVtab)
+{
+    shred_vtab *vtab = reinterpret_cast<shred_vtab *>(pVtab);
+    finalize_statements(vtab);
+    delete vtab;
+    return SQLITE_OK;
+}
+
+
+/// Drops the tables of the columns and the triggers along with the table
+static int MODULE_FUNC(xDestroy) (sqlite3_vtab *pVtab)
+{
+    shred_vtab *vtab = reinterpret_cast<shred_vtab *>(pVtab);
+    finalize_statements(vtab);
+    const char *schema = vtab->schema.c_str();
+    const char *name = vtab->name.c_str();
+
+    char *error_msg = nullptr;
+    int err = drop_shadow_triggers(vtab->db, schema, name, &error_msg);
+    for (size_t c = 0; c < vtab->columns.size() && err == SQLITE_OK; c ++)
+        err = exec_sql(vtab->db, &error_msg,
+            "DROP TABLE IF EXISTS \"%w\".\"%w_c%d\"", schema, name,
+            static_cast<int>(c));
+    if (err == SQLITE_OK)
+        err = exec_sql(vtab->db, &error_msg,
+            "DROP TABLE IF EXISTS \"%w\".\"%w_columns\"", schema, name);
+    if (err != SQLITE_OK) {
+        sqlite3_free(vtab->base.zErrMsg);
+        vtab->base.zErrMsg = error_msg;
+        return err;
+    }
+
+    delete vtab;
+    return SQLITE_OK;
+}
+
+
+/// Constructor for shred_cursor objects
+static int MODULE_FUNC(xOpen) (sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor)
+{
+    shred_cursor *cursor = new shred_cursor();
+    cursor->readersIdxNum = -1;
+    cursor->rowid = 0;
+    cursor->eof = true;
+    *ppCursor = &cursor->base;
+    return SQLITE_OK;
+}
+
+
+/// Finalizes the statements of the readers
+static void clear_readers(shred_cursor *cursor)
+{
+    for (shred_reader& reader : cursor->readers)
+        sqlite3_finalize(reader.stmt);
+    cursor->readers.clear();
+    cursor->reader_of.clear();
+    cursor->readersIdxNum = -1;
+}
+
+
+/// Destructor for shred_cursor objects
+static int MODULE_FUNC(xClose) (sqlite3_vtab_cursor *cur)
+{
+    shred_cursor *cursor = (shred_cursor *)cur;
+    clear_readers(cursor);
+    delete cursor;
+    return SQLITE_OK;
+}
+
+
+/// Copies the values of the row with the given rowid out of the table of a
+/// column, skipping any that come before it
+static int read_entries(shred_vtab *vtab,
+                        shred_reader& reader,
+                        sqlite3_int64 rowid)
+{
+    reader.count = 0;
+    while (!reader.done) {
+        sqlite3_int64 id = sqlite3_column_int64(reader.stmt, 0);
+        if (id > rowid)
+            break;
+        if (id == rowid) {
+            if (reader.count == reader.entries.size())
+                reader.entries.emplace_back();
+            shred_entry& entry = reader.entries[reader.count ++];
+            entry.repetition = sqlite3_column_int(reader.stmt, 1);
+            entry.definition = sqlite3_column_int(reader.stmt, 2);
+            entry.type = sqlite3_column_type(reader.stmt, 3);
+            switch (entry.type) {
+            case SQLITE_INTEGER:
+                entry.i = sqlite3_column_int64(reader.stmt, 3);
+                break;
+            case SQLITE_FLOAT:
+                entry.d = sqlite3_column_double(reader.stmt, 3);
+                break;
+            case SQLITE_TEXT:
+            case SQLITE_BLOB:
+            {
+                const char *data = static_cast<const char *>(
+                    sqlite3_column_blob(reader.stmt, 3));
+                entry.bytes.assign(data ? data : "",
+                    static_cast<size_t>(sqlite3_column_bytes(reader.stmt, 3)));
+                break;
+            }
+            }
+        }
+
+        int err = sqlite3_step(reader.stmt);
+        if (err == SQLITE_DONE)
+            reader.done = true;
+        else if (err != SQLITE_ROW)
+            return database_error(&vtab->base, vtab->db, err);
+    }
+    return SQLITE_OK;
+}
+
+
+/// Advance to the next row. The first reader decides which row that is, and
+/// the others are brought up to it.
+static int MODULE_FUNC(xNext) (sqlite3_vtab_cursor *cur)
+{
+    shred_cursor *cursor = (shred_cursor *)cur;
+    shred_vtab *vtab = (shred_vtab *)cur->pVtab;
+    stats_call call(vtab->conn->stats, FUNCTION_SHRED, PHASE_WALK);
+
+    if (cursor->readers[0].done) {
+        cursor->eof = true;
+        return SQLITE_OK;
+    }
+    cursor->rowid = sqlite3_column_int64(cursor->readers[0].stmt, 0);
+    for (shred_reader& reader : cursor->readers) {
+        int err = read_entries(vtab, reader, cursor->rowid);
+        if (err != SQLITE_OK) return err;
+    }
+    return SQLITE_OK;
+}
+
+
+/// Returns the rowid of the row in the underlying table
+static int MODULE_FUNC(xRowid) (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
+{
+    shred_cursor *cursor = (shred_cursor *)cur;
+    *pRowid = cursor->rowid;
+    return SQLITE_OK;
+}
+
+
+/// Returns true once every row has been returned
+static int MODULE_FUNC(xEof) (sqlite3_vtab_cursor *cur)
+{
+    shred_cursor *cursor = (shred_cursor *)cur;
+    return cursor->eof;
+}
+
+
+/// Converts a value of a column to a field value
+static field_value entry_value(const shred_entry& entry)
+{
+    field_value value;
+    value.type = entry.type;
+    value.i = entry.i;
+    value.d = entry.d;
+    value.data = entry.bytes.data();
+    value.size = entry.bytes.length();
+    return value;
+}
+
+
+/// Returns true if a value stands for a leaf field that is absent from a
+/// message that is itself present, and so has the field's default value
+static bool is_default(const shred_column& column, const shred_entry& entry)
+{
+    const FieldDescriptor *leaf = column.leaf();
+    return entry.definition == column.max_definition() - 1
+        && may_be_absent(leaf) && !leaf->is_repeated()
+        && leaf->cpp_type() != FieldDescriptor::CppType::CPPTYPE_MESSAGE;
+}
+
+
+/// Sets the result to the value of a column, which is what protobuf_extract
+/// would return for its path, or protobuf_extract_all for a path with a
+/// repeated field
+static void result_from_column(sqlite3_context *ctx,
+                               const shred_column& column,
+                               const shred_reader& reader)
+{
+    if (column.max_repetition() == 0) {
+        if (reader.count == 0) {
+            sqlite3_result_null(ctx);
+            return;
+        }
+        const shred_entry& entry = reader.entries[0];
+        if (is_default(column, entry)) {
+            result_from_default(ctx, column.leaf(), false);
+            return;
+        }
+        if (entry.definition < column.max_definition()) {
+            sqlite3_result_null(ctx);
+            return;
+        }
+        switch (entry.type) {
+        case SQLITE_INTEGER:
+            sqlite3_result_int64(ctx, entry.i);
+            break;
+        case SQLITE_FLOAT:
+            sqlite3_result_double(ctx, entry.d);
+            break;
+        case SQLITE_TEXT:
+            sqlite3_result_text64(ctx, entry.bytes.data(),
+                entry.bytes.length(), SQLITE_TRANSIENT, SQLITE_UTF8);
+            break;
+        case SQLITE_BLOB:
+            sqlite3_result_blob64(ctx, entry.bytes.data(),
+                entry.bytes.length(), SQLITE_TRANSIENT);
+            break;
+        default:
+            sqlite3_result_null(ctx);
+            break;
+        }
+        return;
+    }
+
+    std::string output = "[";
+    for (size_t i = 0; i < reader.count; i ++) {
+        const shred_entry& entry = reader.entries[i];
+        field_value value;
+        if (entry.definition == column.max_definition())
+            value = entry_value(entry);
+        else if (!is_default(column, entry)
+                 || !value_from_default(column.leaf(), false, &value))
+            continue;
+        if (output.length() > 1)
+            output.push_back(',');
+        json_append_value(&output, column.leaf(), value);
+    }
+    output.push_back(']');
+    sqlite3_result_text64(ctx, output.data(), output.length(),
+        SQLITE_TRANSIENT, SQLITE_UTF8);
+    sqlite3_result_subtype(ctx, 'J');
+}
+
+
+/// Sets a leaf field of a reassembled message to a value, or adds the value
+/// to it if it is repeated
+static void set_leaf(Message *message,
+                     const FieldDescriptor *field,
+                     const shred_entry& entry)
+{
+    const Reflection *reflection = message->GetReflection();
+    bool repeated = field->is_repeated();
+    sqlite3_int64 i = entry.type == SQLITE_FLOAT
+        ? static_cast<sqlite3_int64>(entry.d) : entry.i;
+    double d = entry.type == SQLITE_INTEGER
+        ? static_cast<double>(entry.i) : entry.d;
+
+    // SQLite stores NaN as null
+    if (entry.type == SQLITE_NULL) {
+        if (field->cpp_type() != FieldDescriptor::CppType::CPPTYPE_DOUBLE
+            && field->cpp_type() != FieldDescriptor::CppType::CPPTYPE_FLOAT)
+            return;
+        d = NAN;
+    }
+
+    switch (field->cpp_type()) {
+    case FieldDescriptor::CppType::CPPTYPE_INT32:
+        if (repeated)
+            reflection->AddInt32(message, field, static_cast<int32_t>(i));
+        else
+            reflection->SetInt32(message, field, static_cast<int32_t>(i));
+        break;
+    case FieldDescriptor::CppType::CPPTYPE_INT64:
+        if (repeated)
+            reflection->AddInt64(message, field, i);
+        else
+            reflection->SetInt64(message, field, i);
+        break;
+    case FieldDescriptor::CppType::CPPTYPE_UINT32:
+        if (repeated)
+            reflection->AddUInt32(message, field, static_cast<uint32_t>(i));
+        else
+            reflection->SetUInt32(message, field, static_cast<uint32_t>(i));
+        break;
+    case FieldDescriptor::CppType::CPPTYPE_UINT64:
+        if (repeated)
+            reflection->AddUInt64(message, field, static_cast<uint64_t>(i));
+        else
+            reflection->SetUInt64(message, field, static_cast<uint64_t>(i));
+        break;
+    case FieldDescriptor::CppType::CPPTYPE_BOOL:
+        if (repeated)
+            reflection->AddBool(message, field, i != 0);
+        else
+            reflection->SetBool(message, field, i != 0);
+        break;
+    case FieldDescriptor::CppType::CPPTYPE_ENUM:
+        if (repeated)
+            reflection->AddEnumValue(message, field, static_cast<int>(i));
+        else
+            reflection->SetEnumValue(message, field, static_cast<int>(i));
+        break;
+    case FieldDescriptor::CppType::CPPTYPE_DOUBLE:
+        if (repeated)
+            reflection->AddDouble(message, field, d);
+        else
+            reflection->SetDouble(message, field, d);
+        break;
+    case FieldDescriptor::CppType::CPPTYPE_FLOAT:
+        if (repeated)
+            reflection->AddFloat(message, field, static_cast<float>(d));
+        else
+            reflection->SetFloat(message, field, static_cast<float>(d));
+        break;
+    case FieldDescriptor::CppType::CPPTYPE_STRING:
+        if (repeated)
+            reflection->AddString(message, field, entry.bytes);
+        else
+            reflection->SetString(message, field, entry.bytes);
+        break;
+    case FieldDescriptor::CppType::CPPTYPE_MESSAGE:
+        (repeated
+            ? reflection->AddMessage(message, field)
+            : reflection->MutableMessage(message, field))
+                ->ParsePartialFromString(entry.bytes);
+        break;
+    }
+}
+
+
+/// Puts the values of a column back into a reassembled message. Each value
+/// says how many of the fields on the way to the leaf are present, and at
+/// which repeated field it starts a new element. The elements are counted so
+/// that each column finds the messages that the columns before it created.
+static void assemble_column(shred_cursor *cursor,
+                            const shred_column& column,
+                            const shred_reader& reader)
+{
+    size_t depth = column.fields.size();
+    std::vector<int>& indexes = cursor->indexes;
+    indexes.assign(depth, 0);
+
+    for (size_t e = 0; e < reader.count; e ++) {
+        const shred_entry& entry = reader.entries[e];
+        if (entry.repetition > 0) {
+            for (size_t k = 0; k < depth; k ++) {
+                if (!column.fields[k]->is_repeated()
+                    || column.repetitions[k] != entry.repetition)
+                    continue;
+                indexes[k] ++;
+                std::fill(indexes.begin() + k + 1, indexes.end(), 0);
+                break;
+            }
+        }
+
+        Message *message = cursor->message.get();
+        for (size_t k = 0; k < depth; k ++) {
+            const FieldDescriptor *field = column.fields[k];
+            if (column.definitions[k] > entry.definition)
+                break;
+            if (k + 1 == depth) {
+                set_leaf(message, field, entry);
+                break;
+            }
+
+            const Reflection *reflection = message->GetReflection();
+            if (!field->is_repeated())
+                message = reflection->MutableMessage(message, field);
+            else if (indexes[k] < reflection->FieldSize(*message, field))
+                message = reflection->MutableRepeatedMessage(message, field,
+                    indexes[k]);
+            else
+                message = reflection->AddMessage(message, field);
+        }
+    }
+}
+
+
+/// Return the fields in a given cell of the table. A column is read from its
+/// own table, and the message is reassembled from all of them.
+static int MODULE_FUNC(xColumn) (
+    sqlite3_vtab_cursor *cur,
+    sqlite3_context *ctx,
+    int i
+) {
+    shred_cursor *cursor = (shred_cursor *)cur;
+    shred_vtab *vtab = (shred_vtab *)cur->pVtab;
+    stats_call call(vtab->conn->stats, FUNCTION_SHRED, PHASE_RESULT, false);
+
+    if (static_cast<size_t>(i) < vtab->columns.size()) {
+        int r = cursor->reader_of[i];
+        if (r < 0)
+            sqlite3_result_null(ctx);
+        else
+            result_from_column(ctx, vtab->columns[i], cursor->readers[r]);
+        return SQLITE_OK;
+    }
+
+    if (!cursor->message)
+        cursor->message.reset(vtab->conn->factory.prototype(vtab->type)->New());
+    cursor->message->Clear();
+    for (const shred_reader& reader : cursor->readers)
+        assemble_column(cursor, vtab->columns[reader.column], reader);
+    if (!cursor->message->SerializePartialToString(&cursor->serialized)) {
+        sqlite3_result_error(ctx, "Failed to serialize message", -1);
+        return SQLITE_OK;
+    }
+    sqlite3_result_blob64(ctx, cursor->serialized.data(),
+        cursor->serialized.length(), SQLITE_TRANSIENT);
+    return SQLITE_OK;
+}
+
+
+/// Looks up rows by rowid if possible. Only the tables of the columns that
+/// the query uses are read, and they are listed in idxStr; the message column
+/// needs all of them.
+static int MODULE_FUNC(xBestIndex) (
+    sqlite3_vtab *tab,
+    sqlite3_index_info *pIdxInfo
+)
+{
+    shred_vtab *vtab = (shred_vtab *)tab;
+    int rowidEqConstraintIdx = -1;
+
+    const auto *constraint = pIdxInfo->aConstraint;
+    for (int i = 0; i < pIdxInfo->nConstraint; i ++, constraint ++) {
+        if (constraint->usable && constraint->iColumn < 0
+            && constraint->op == SQLITE_INDEX_CONSTRAINT_EQ)
+            rowidEqConstraintIdx = i;
+    }
+
+    // Columns past the 63rd share the last bit of the mask. A query that uses
+    // no column at all still reads the first one, to find the rows.
+    size_t count = vtab->columns.size();
+    auto used = [pIdxInfo](size_t column) {
+        return (pIdxInfo->colUsed >> (column < 63 ? column : 63)) & 1;
+    };
+    bool all = used(count);
+    std::string columns;
+    for (size_t c = 0; c < count; c ++) {
+        if (!all && !used(c)) continue;
+        columns += (columns.empty() ? "" : ",") + std::to_string(c);
+    }
+    if (columns.empty())
+        columns = "0";
+    size_t readers = std::count(columns.begin(), columns.end(), ',') + 1;
+
+    if (rowidEqConstraintIdx >= 0) {
+        pIdxInfo->aConstraintUsage[rowidEqConstraintIdx].argvIndex = 1;
+        pIdxInfo->aConstraintUsage[rowidEqConstraintIdx].omit = 1;
+        pIdxInfo->idxNum = LOOKUP_BY_ROWID;
+        pIdxInfo->estimatedCost = 10.0 * readers;
+        pIdxInfo->estimatedRows = 1;
+        pIdxInfo->idxFlags |= SQLITE_INDEX_SCAN_UNIQUE;
+    } else {
+        pIdxInfo->idxNum = LOOKUP_ALL;
+        pIdxInfo->estimatedCost = static_cast<double>(ESTIMATED_ROWS)
+            * readers;
+        pIdxInfo->estimatedRows = ESTIMATED_ROWS;
+    }
+
+    // The rows come out in rowid order
+    if (pIdxInfo->nOrderBy == 1 && pIdxInfo->aOrderBy[0].iColumn < 0
+        && !pIdxInfo->aOrderBy[0].desc)
+        pIdxInfo->orderByConsumed = 1;
+
+    pIdxInfo->idxStr = sqlite3_mprintf("%s", columns.c_str());
+    if (!pIdxInfo->idxStr)
+        return SQLITE_NOMEM;
+    pIdxInfo->needToFreeIdxStr = 1;
+    return SQLITE_OK;
+}
+
+
+/// Start reading the tables of the columns, reusing the statements from a
+/// previous call if they read the same columns in the same way
+static int MODULE_FUNC(xFilter) (
+    sqlite3_vtab_cursor *pVtabCursor,
+    int idxNum, const char *idxStr,
+    int argc, sqlite3_value **argv
+){
+    shred_cursor *cursor = (shred_cursor *)pVtabCursor;
+    shred_vtab *vtab = (shred_vtab *)pVtabCursor->pVtab;
+    if (vtab->stale)
+        return stale_error(vtab);
+
+    if (cursor->readersIdxNum == idxNum && cursor->readersIdxStr == idxStr) {
+        for (shred_reader& reader : cursor->readers)
+            sqlite3_reset(reader.stmt);
+    } else {
+        clear_readers(cursor);
+        cursor->reader_of.assign(vtab->columns.size(), -1);
+        for (const char *p = idxStr; p && *p; ) {
+            char *end;
+            shred_reader reader;
+            reader.column = static_cast<int>(strtol(p, &end, 10));
+            reader.stmt = nullptr;
+            reader.done = true;
+            reader.count = 0;
+            p = *end ? end + 1 : end;
+            if (reader.column < 0
+                || static_cast<size_t>(reader.column) >= vtab->columns.size())
+                continue;
+
+            bool repeated =
+                vtab->columns[reader.column].max_repetition() > 0;
+            int err = prepare(vtab->db, &reader.stmt,
+                "SELECT id, %s, d, value FROM \"%w\".\"%w_c%d\"%s "
+                "ORDER BY id%s",
+                repeated ? "r" : "0", vtab->schema.c_str(), vtab->name.c_str(),
+                reader.column,
+                idxNum == LOOKUP_BY_ROWID ? " WHERE id = ?" : "",
+                repeated ? ", seq" : "");
+            if (err != SQLITE_OK)
+                return database_error(&vtab->base, vtab->db, err);
+            cursor->reader_of[reader.column] =
+                static_cast<int>(cursor->readers.size());
+            cursor->readers.push_back(std::move(reader));
+        }
+        if (cursor->readers.empty())
+            return SQLITE_ERROR;
+        cursor->readersIdxNum = idxNum;
+        cursor->readersIdxStr = idxStr;
+    }
+
+    // Each reader starts on the first value it will return
+    for (shred_reader& reader : cursor->readers) {
+        if (idxNum == LOOKUP_BY_ROWID) {
+            int err = sqlite3_bind_value(reader.stmt, 1, argv[0]);
+            if (err != SQLITE_OK) return err;
+        }
+        int err = sqlite3_step(reader.stmt);
+        if (err != SQLITE_ROW && err != SQLITE_DONE)
+            return database_error(&vtab->base, vtab->db, err);
+        reader.done = err == SQLITE_DONE;
+    }
+
+    cursor->eof = false;
+    return MODULE_FUNC(xNext)(pVtabCursor);
+}
+
+
+/// Shreds a message written to the table, which is what the triggers on the
+/// underlying table do. The other columns cannot be written, and any values
+/// given for them are ignored.
+static int MODULE_FUNC(xUpdate) (
+    sqlite3_vtab *tab,
+    int argc, sqlite3_value **argv,
+    sqlite_int64 *pRowid
+) {
+    shred_vtab *vtab = (shred_vtab *)tab;
+    stats_call call(vtab->conn->stats, FUNCTION_SHRED);
+    if (vtab->stale)
+        return stale_error(vtab);
+
+    int err;
+    if (sqlite3_value_type(argv[0]) != SQLITE_NULL) {
+        err = remove_message(vtab, sqlite3_value_int64(argv[0]));
+        if (err != SQLITE_OK) return database_error(&vtab->base, vtab->db, err);
+        if (argc == 1) return SQLITE_OK;
+    }
+
+    if (sqlite3_value_type(argv[1]) != SQLITE_INTEGER) {
+        sqlite3_free(vtab->base.zErrMsg);
+        vtab->base.zErrMsg = sqlite3_mprintf("protobuf_shred requires the "
+            "rowid of the row in the underlying table");
+        return SQLITE_ERROR;
+    }
+    *pRowid = sqlite3_value_int64(argv[1]);
+
+    char *error_msg = nullptr;
+    err = shred_message(vtab, *pRowid, argv[2 + vtab->columns.size()],
+        &error_msg);
+    if (err != SQLITE_OK) {
+        sqlite3_free(vtab->base.zErrMsg);
+        vtab->base.zErrMsg = error_msg;
+    }
+    return err;
+}
+
+
+static sqlite3_module module = {
+  0,                         /* iVersion */
+  MODULE_FUNC(xCreate),      /* xCreate */
+  MODULE_FUNC(xConnect),     /* xConnect - required */
+  MODULE_FUNC(xBestIndex),   /* xBestIndex - required */
+  MODULE_FUNC(xDisconnect),  /* xDisconnect - required */
+  MODULE_FUNC(xDestroy),     /* xDestroy */
+  MODULE_FUNC(xOpen),        /* xOpen - open a cursor - required */
+  MODULE_FUNC(xClose),       /* xClose - close a cursor - required */
+  MODULE_FUNC(xFilter),      /* xFilter - configure scan constraints - required */
+  MODULE_FUNC(xNext),        /* xNext - advance a cursor - required */
+  MODULE_FUNC(xEof),         /* xEof - check for end of scan - required */
+  MODULE_FUNC(xColumn),      /* xColumn - read data - required */
+  MODULE_FUNC(xRowid),       /* xRowid - read data - required */
+  MODULE_FUNC(xUpdate),      /* xUpdate */
+  0,                         /* xBegin */
+  0,                         /* xSync */
+  0,                         /* xCommit */
+  0,                         /* xRollback */
+  0,                         /* xFindMethod */
+  0,                         /* xRename */
+};
+
+
+DECLARE_(protobuf_shred)
+{
+    return sqlite3_create_module_v2(db, "protobuf_shred", &module,
+        conn->retain(), connection::release);
+}
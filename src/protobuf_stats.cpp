@@ -0,0 +1,321 @@
+#include <string>
+#include <vector>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "connection.h"
+#include "header.h"
+#include "stats.h"
+
+
+// The column indexes, corresponding to the order of the columns in the CREATE
+// TABLE statement in xConnect
+enum {
+    COLUMN_NAME,
+    COLUMN_VALUE,
+    COLUMN_FUNCTION,
+    COLUMN_DETAIL,
+};
+
+
+/// Names for the values of stats_function
+static const char *function_names[] = {
+    "protobuf_array_avg",   // FUNCTION_ARRAY_AVG
+    "protobuf_array_count", // FUNCTION_ARRAY_COUNT
+    "protobuf_array_max",   // FUNCTION_ARRAY_MAX
+    "protobuf_array_min",   // FUNCTION_ARRAY_MIN
+    "protobuf_array_sum",   // FUNCTION_ARRAY_SUM
+    "protobuf_compress",    // FUNCTION_COMPRESS
+    "protobuf_decompress",  // FUNCTION_DECOMPRESS
+    "protobuf_each",        // FUNCTION_EACH
+    "protobuf_extract",     // FUNCTION_EXTRACT
+    "protobuf_extract_all", // FUNCTION_EXTRACT_ALL
+    "protobuf_extract_raw", // FUNCTION_EXTRACT_RAW
+    "protobuf_fields",      // FUNCTION_FIELDS
+    "protobuf_file",        // FUNCTION_FILE
+    "protobuf_index",       // FUNCTION_INDEX
+    "protobuf_match",       // FUNCTION_MATCH
+    "protobuf_remove",      // FUNCTION_REMOVE
+    "protobuf_set",         // FUNCTION_SET
+    "protobuf_shred",       // FUNCTION_SHRED
+    "protobuf_to_json",     // FUNCTION_TO_JSON
+    "protobuf_view",        // FUNCTION_VIEW
+};
+
+
+/// Names of the rows for the time spent in each stats_phase
+static const char *phase_names[] = {
+    "lookup_ns",  // PHASE_LOOKUP
+    "parse_ns",   // PHASE_PARSE
+    "walk_ns",    // PHASE_WALK
+    "result_ns",  // PHASE_RESULT
+};
+
+
+/// One row of the table. The function and detail are null if they are empty.
+struct stats_row {
+    std::string name;
+    sqlite3_int64 value;
+    std::string function;
+    std::string detail;
+};
+
+
+#define MODULE_FUNC(func) protobuf_stats ## _ ## func
+
+
+// stats_vtab is a subclass of sqlite3_vtab which remembers the connection
+// state whose counters are reported
+typedef struct stats_vtab stats_vtab;
+struct stats_vtab {
+    sqlite3_vtab base;
+    connection *conn;
+};
+
+
+// stats_cursor is a subclass of sqlite3_vtab_cursor which holds a snapshot of
+// the counters taken by xFilter, so that reading the table does not change
+// the values being read
+typedef struct stats_cursor stats_cursor;
+struct stats_cursor {
+    sqlite3_vtab_cursor base;
+    std::vector<stats_row> rows;
+    size_t index;
+};
+
+
+/// Connect to the eponymous virtual table
+static int MODULE_FUNC(xConnect) (
+    sqlite3 *db,
+    void *pAux,
+    int argc, const char * const *argv,
+    sqlite3_vtab **ppVtab,
+    char **pzErr
+) {
+    int err = sqlite3_declare_vtab(db,
+        "CREATE TABLE tbl("
+        "    name TEXT,"
+        "    value INTEGER,"
+        "    function TEXT,"
+        "    detail TEXT"
+        ")");
+    if (err != SQLITE_OK) return err;
+
+    stats_vtab *vtab = new stats_vtab();
+    vtab->conn = static_cast<connection *>(pAux);
+    *ppVtab = &vtab->base;
+    return SQLITE_OK;
+}
+
+
+/// Undoes xConnect
+static int MODULE_FUNC(xDisconnect) (sqlite3_vtab *pVtab)
+{
+    delete reinterpret_cast<stats_vtab *>(pVtab);
+    return SQLITE_OK;
+}
+
+
+/// Constructor stats_cursor objects
+static int MODULE_FUNC(xOpen) (sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor)
+{
+    stats_cursor *cursor = new stats_cursor();
+    cursor->index = 0;
+    *ppCursor = &cursor->base;
+    return SQLITE_OK;
+}
+
+/// Destructor stats_cursor objects
+static int MODULE_FUNC(xClose) (sqlite3_vtab_cursor *cur)
+{
+    delete reinterpret_cast<stats_cursor *>(cur);
+    return SQLITE_OK;
+}
+
+/// Advance to the next counter
+static int MODULE_FUNC(xNext) (sqlite3_vtab_cursor *cur)
+{
+    stats_cursor *cursor = (stats_cursor *)cur;
+    cursor->index += 1;
+    return SQLITE_OK;
+}
+
+
+/// Returns the current index
+static int MODULE_FUNC(xRowid) (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
+{
+    stats_cursor *cursor = (stats_cursor *)cur;
+    *pRowid = cursor->index;
+    return SQLITE_OK;
+}
+
+
+/// Returns true once every counter has been returned
+static int MODULE_FUNC(xEof) (sqlite3_vtab_cursor *cur)
+{
+    stats_cursor *cursor = (stats_cursor *)cur;
+    return cursor->index >= cursor->rows.size();
+}
+
+
+/// Return the fields in a given cell of the table
+static int MODULE_FUNC(xColumn) (
+    sqlite3_vtab_cursor *cur,
+    sqlite3_context *ctx,
+    int i
+) {
+    stats_cursor *cursor = (stats_cursor *)cur;
+    const stats_row& row = cursor->rows[cursor->index];
+    switch (i) {
+    case COLUMN_NAME:
+        sqlite3_result_text(ctx, row.name.c_str(), row.name.length(),
+            SQLITE_TRANSIENT);
+        break;
+    case COLUMN_VALUE:
+        sqlite3_result_int64(ctx, row.value);
+        break;
+    case COLUMN_FUNCTION:
+        if (!row.function.empty())
+            sqlite3_result_text(ctx, row.function.c_str(),
+                row.function.length(), SQLITE_TRANSIENT);
+        break;
+    case COLUMN_DETAIL:
+        if (!row.detail.empty())
+            sqlite3_result_text(ctx, row.detail.c_str(), row.detail.length(),
+                SQLITE_TRANSIENT);
+        break;
+    }
+    return SQLITE_OK;
+}
+
+
+/// There are at most a few hundred rows, so every query is a full scan
+static int MODULE_FUNC(xBestIndex) (
+    sqlite3_vtab *tab,
+    sqlite3_index_info *pIdxInfo
+)
+{
+    pIdxInfo->estimatedCost = 100;
+    pIdxInfo->estimatedRows = 100;
+    return SQLITE_OK;
+}
+
+
+/// Take a snapshot of the counters and position the cursor at the first one
+static int MODULE_FUNC(xFilter) (
+    sqlite3_vtab_cursor *pVtabCursor,
+    int idxNum, const char *idxStr,
+    int argc, sqlite3_value **argv
+){
+    stats_cursor *cursor = (stats_cursor *)pVtabCursor;
+    const connection *conn = ((stats_vtab *)pVtabCursor->pVtab)->conn;
+
+    const connection_stats& stats = conn->stats;
+
+    cursor->rows.clear();
+    cursor->rows.push_back({ "cache_hits", conn->cache.hits, "", "" });
+    cursor->rows.push_back({ "cache_misses", conn->cache.misses, "", "" });
+    cursor->rows.push_back({ "arena_high_water",
+        conn->factory.arena_high_water, "", "" });
+    cursor->rows.push_back({ "extractor_finds", conn->extractor_finds, "",
+        "" });
+    cursor->rows.push_back({ "decompressed_messages",
+        conn->compressor.messages, "", "" });
+    cursor->rows.push_back({ "decompressed_bytes", conn->compressor.bytes, "",
+        "" });
+
+    // Functions that have not been called since the last reset are left out
+    for (int f = 0; f < FUNCTION_COUNT; f ++) {
+        const function_stats& function = stats.functions[f];
+        if (!function.calls)
+            continue;
+        const char *name = function_names[f];
+        cursor->rows.push_back({ "calls", function.calls, name, "" });
+        cursor->rows.push_back({ "parse_failures", function.parse_failures,
+            name, "" });
+        cursor->rows.push_back({ "bytes", function.bytes, name, "" });
+        for (int p = 0; p < PHASE_COUNT; p ++)
+            cursor->rows.push_back({ phase_names[p], function.phase_ns[p],
+                name, "" });
+
+        // Bucket i counts calls shorter than 2^i microseconds
+        for (int b = 0; b < function_stats::HISTOGRAM_BUCKETS; b ++) {
+            if (!function.histogram[b])
+                continue;
+            std::string bucket = b + 1 < function_stats::HISTOGRAM_BUCKETS
+                ? "<" + std::to_string(1 << b) + "us"
+                : ">=" + std::to_string(1 << (b - 1)) + "us";
+            cursor->rows.push_back({ "time_histogram", function.histogram[b],
+                name, bucket });
+        }
+    }
+
+    for (const auto& entry : stats.type_calls) {
+        if (entry.second)
+            cursor->rows.push_back({ "type_calls", entry.second, "",
+                entry.first });
+    }
+    for (const auto& entry : stats.path_calls) {
+        if (entry.second)
+            cursor->rows.push_back({ "path_calls", entry.second, "",
+                entry.first.first + ":" + entry.first.second });
+    }
+
+    cursor->index = 0;
+    return SQLITE_OK;
+}
+
+
+/// Zeroes every counter reported by protobuf_stats for the current connection
+///
+///     SELECT protobuf_stats_reset();
+///
+static void protobuf_stats_reset(sqlite3_context *context,
+                                 int argc,
+                                 sqlite3_value **argv)
+{
+    connection *conn = connection::get(context);
+    conn->cache.hits = 0;
+    conn->cache.misses = 0;
+    conn->factory.arena_high_water = 0;
+    conn->extractor_finds = 0;
+    conn->compressor.messages = 0;
+    conn->compressor.bytes = 0;
+    conn->stats.reset();
+    sqlite3_result_null(context);
+}
+
+
+static sqlite3_module module = {
+  0,                         /* iVersion */
+  0,                         /* xCreate */
+  MODULE_FUNC(xConnect),     /* xConnect - required */
+  MODULE_FUNC(xBestIndex),   /* xBestIndex - required */
+  MODULE_FUNC(xDisconnect),  /* xDisconnect - required */
+  0,                         /* xDestroy */
+  MODULE_FUNC(xOpen),        /* xOpen - open a cursor - required */
+  MODULE_FUNC(xClose),       /* xClose - close a cursor - required */
+  MODULE_FUNC(xFilter),      /* xFilter - configure scan constraints - required */
+  MODULE_FUNC(xNext),        /* xNext - advance a cursor - required */
+  MODULE_FUNC(xEof),         /* xEof - check for end of scan - required */
+  MODULE_FUNC(xColumn),      /* xColumn - read data - required */
+  MODULE_FUNC(xRowid),       /* xRowid - read data - required */
+  0,                         /* xUpdate */
+  0,                         /* xBegin */
+  0,                         /* xSync */
+  0,                         /* xCommit */
+  0,                         /* xRollback */
+  0,                         /* xFindMethod */
+  0,                         /* xRename */
+};
+
+
+DECLARE_(protobuf_stats)
+{
+    int err = sqlite3_create_module_v2(db, "protobuf_stats", &module,
+        conn->retain(), connection::release);
+    if (err != SQLITE_OK) return err;
+    return create_function(db, conn, "protobuf_stats_reset", 0, SQLITE_UTF8,
+        protobuf_stats_reset);
+}
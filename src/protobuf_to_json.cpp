@@ -0,0 +1,111 @@
+#include <string>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include <google/protobuf/util/json_util.h>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "compression.h"
+#include "connection.h"
+#include "extract.h"
+#include "header.h"
+#include "json_writer.h"
+#include "stats.h"
+#include "utilities.h"
+
+using google::protobuf::Descriptor;
+using google::protobuf::Message;
+
+
+/// Converts a message to JSON, in the Protobuf JSON mapping
+///
+///     SELECT protobuf_to_json(data, "Person");
+///     SELECT protobuf_to_json(data, "Person", "preserve_proto_field_names");
+///
+/// The options are a comma-separated list of always_print_primitive_fields,
+/// always_print_enums_as_ints and preserve_proto_field_names, which mean what
+/// they do in util::JsonPrintOptions. The JSON is written straight from the
+/// wire format where possible, and otherwise from the parsed message.
+///
+/// @returns the JSON text, which the JSON1 functions accept as JSON, or NULL
+///          if the message is NULL
+static void protobuf_to_json(sqlite3_context *context,
+                             int argc,
+                             sqlite3_value **argv)
+{
+    connection *conn = connection::get(context);
+    stats_call call(conn->stats, FUNCTION_TO_JSON);
+
+    json_options options;
+    if (argc > 2 && sqlite3_value_type(argv[2]) != SQLITE_NULL
+            && !options.parse(string_from_sqlite3_value(argv[2]))) {
+        sqlite3_result_error(context, "Unknown option", -1);
+        return;
+    }
+
+    const Descriptor *type = conn->descriptors.find_message_type(
+        string_from_sqlite3_value(argv[1]));
+    if (!type) {
+        sqlite3_result_error(context, "Could not find message descriptor", -1);
+        return;
+    }
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    conn->stats.count_bytes(static_cast<size_t>(sqlite3_value_bytes(argv[0])));
+    const uint8_t *data;
+    size_t size;
+    if (!message_argument(context, conn, argv[0], &data, &size))
+        return;
+
+    conn->stats.enter_phase(PHASE_WALK);
+    bool written = conn->engine != ENGINE_REFLECTION
+        && conn->json.write(type, data, size, options);
+
+    if (!written) {
+        // Other calls on the same row can share the parsed message
+        parsed_message parsed(data, size, conn, &conn->cache);
+        const Message *message = parsed.get(type);
+        if (!message) {
+            sqlite3_result_error(context, "Failed to parse message", -1);
+            return;
+        }
+
+        conn->stats.enter_phase(PHASE_WALK);
+        google::protobuf::util::JsonPrintOptions print_options;
+        print_options.always_print_primitive_fields =
+            options.always_print_primitive_fields;
+        print_options.always_print_enums_as_ints =
+            options.always_print_enums_as_ints;
+        print_options.preserve_proto_field_names =
+            options.preserve_proto_field_names;
+
+        conn->json.output.clear();
+        if (!google::protobuf::util::MessageToJsonString(*message,
+                &conn->json.output, print_options).ok()) {
+            sqlite3_result_error(context, "Could not convert message to JSON",
+                -1);
+            return;
+        }
+    }
+
+    conn->stats.enter_phase(PHASE_RESULT);
+    sqlite3_result_text64(context, conn->json.output.data(),
+        conn->json.output.length(), SQLITE_TRANSIENT, SQLITE_UTF8);
+    sqlite3_result_subtype(context, 'J');
+}
+
+
+DECLARE_(protobuf_to_json)
+{
+    int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+    int err = create_function(db, conn, "protobuf_to_json", 2, flags,
+        protobuf_to_json);
+    if (err != SQLITE_OK) return err;
+    return create_function(db, conn, "protobuf_to_json", 3, flags,
+        protobuf_to_json);
+}
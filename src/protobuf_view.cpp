@@ -0,0 +1,650 @@
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "compression.h"
+#include "connection.h"
+#include "extract.h"
+#include "header.h"
+#include "message_factory.h"
+#include "path.h"
+#include "stats.h"
+#include "utilities.h"
+#include "value.h"
+#include "wire.h"
+
+using google::protobuf::FieldDescriptor;
+
+
+// The indexing strategies used by MODULE_FUNC(xBestIndex) and MODULE_FUNC(xFilter)
+enum {
+    LOOKUP_ALL,
+    LOOKUP_BY_ROWID,
+};
+
+// The estimated number of rows in the underlying table, which is not known
+#define ESTIMATED_ROWS 1000000
+
+
+#define MODULE_FUNC(func) protobuf_view ## _ ## func
+
+
+// view_vtab is a subclass of sqlite3_vtab which holds the table being viewed
+// and a compiled path for each column. The columns are the paths, in the order
+// they were given, followed by the hidden message column.
+typedef struct view_vtab view_vtab;
+struct view_vtab {
+    sqlite3_vtab base;
+    sqlite3 *db;
+    connection *conn;
+    std::string schema;
+    std::string table;
+    std::string column;
+    std::vector<std::unique_ptr<compiled_path>> paths;
+};
+
+
+// A constraint that xBestIndex passed down to xFilter, which is checked
+// against each row before any column is returned
+struct view_constraint {
+    int column;
+    int op;
+    sqlite3_value *value;
+};
+
+
+// view_cursor is a subclass of sqlite3_vtab_cursor which steps through the
+// underlying table. Each row's message is parsed at most once, into an arena
+// that is reused for the next row, and only if a column needs it.
+typedef struct view_cursor view_cursor;
+struct view_cursor {
+    sqlite3_vtab_cursor base;
+    sqlite3_stmt *stmt;
+    int stmtIdxNum;
+    std::vector<view_constraint> constraints;
+    parsed_message parsed;
+    std::string data;
+    message_arena arena;
+    bool eof;
+};
+
+
+/// Splits a column definition such as name='$.name' into its name and path.
+/// Returns false if there is no equals sign outside of the quoted name.
+static bool split_column(const std::string& text,
+                         std::string *name,
+                         std::string *path)
+{
+    size_t i = 0;
+    while (i < text.length() && isspace(static_cast<unsigned char>(text[i])))
+        i ++;
+
+    // Skip over a quoted name, which may itself contain an equals sign
+    if (i < text.length() && strchr("'\"`[", text[i])) {
+        char close = text[i] == '[' ? ']' : text[i];
+        for (i ++; i < text.length(); i ++) {
+            if (text[i] != close) continue;
+            if (close != ']' && i + 1 < text.length() && text[i + 1] == close)
+                i ++;
+            else
+                break;
+        }
+    }
+
+    size_t equals = text.find('=', i);
+    if (equals == std::string::npos)
+        return false;
+    *name = dequote(text.substr(0, equals));
+    *path = dequote(text.substr(equals + 1));
+    return !name->empty();
+}
+
+
+/// Returns the declared type of the column for a path, which SQLite uses to
+/// decide how to compare the column with other values
+static const char *column_type(const compiled_path& path)
+{
+    if (path.elements.empty())
+        return "BLOB";
+
+    const FieldDescriptor *field = path.elements.back().field;
+    switch (field->cpp_type()) {
+    case FieldDescriptor::CppType::CPPTYPE_INT32:
+    case FieldDescriptor::CppType::CPPTYPE_INT64:
+    case FieldDescriptor::CppType::CPPTYPE_UINT32:
+    case FieldDescriptor::CppType::CPPTYPE_UINT64:
+    case FieldDescriptor::CppType::CPPTYPE_BOOL:
+        return "INTEGER";
+    case FieldDescriptor::CppType::CPPTYPE_DOUBLE:
+    case FieldDescriptor::CppType::CPPTYPE_FLOAT:
+        return "REAL";
+    case FieldDescriptor::CppType::CPPTYPE_ENUM:
+        return path.enum_name ? "TEXT" : "INTEGER";
+    case FieldDescriptor::CppType::CPPTYPE_STRING:
+        return field->type() == FieldDescriptor::Type::TYPE_BYTES
+            ? "BLOB" : "TEXT";
+    case FieldDescriptor::CppType::CPPTYPE_MESSAGE:
+        return "BLOB";
+    }
+    return "";
+}
+
+
+/// Shared by xCreate and xConnect. The arguments are the table and column
+/// holding the messages, the message type, and a definition for each column:
+///
+///     CREATE VIRTUAL TABLE people_v USING protobuf_view(
+///         people, protobuf, 'Person', name='$.name', score='$.score');
+static int view_connect(
+    sqlite3 *db,
+    void *pAux,
+    int argc, const char * const *argv,
+    sqlite3_vtab **ppVtab,
+    char **pzErr
+) {
+    // The first three arguments are the module, database, and table names
+    if (argc < 7) {
+        *pzErr = sqlite3_mprintf("protobuf_view requires a table, a column, "
+            "a message type, and at least one column definition");
+        return SQLITE_ERROR;
+    }
+
+    std::unique_ptr<view_vtab> vtab(new view_vtab());
+    vtab->db = db;
+    vtab->conn = static_cast<connection *>(pAux);
+    vtab->schema = argv[1];
+    vtab->table = dequote(argv[3]);
+    vtab->column = dequote(argv[4]);
+    std::string type_name = dequote(argv[5]);
+
+    std::string schema = "CREATE TABLE tbl(";
+    for (int i = 6; i < argc; i ++) {
+        std::string name, path, error_msg;
+        if (!split_column(argv[i], &name, &path)) {
+            *pzErr = sqlite3_mprintf("Invalid column definition: %s", argv[i]);
+            return SQLITE_ERROR;
+        }
+
+        compiled_path *compiled = new_compiled_path(vtab->conn, type_name,
+            path, &error_msg);
+        if (!compiled) {
+            *pzErr = sqlite3_mprintf("%s: %s", error_msg.c_str(),
+                path.c_str());
+            return SQLITE_ERROR;
+        }
+        vtab->paths.emplace_back(compiled);
+
+        char *column = sqlite3_mprintf("\"%w\" %s, ", name.c_str(),
+            column_type(*compiled));
+        schema += column;
+        sqlite3_free(column);
+    }
+
+    // The message itself is a hidden column with the same name as in the
+    // underlying table
+    char *column = sqlite3_mprintf("\"%w\" HIDDEN)", vtab->column.c_str());
+    schema += column;
+    sqlite3_free(column);
+
+    int err = sqlite3_declare_vtab(db, schema.c_str());
+    if (err != SQLITE_OK) {
+        *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+        return err;
+    }
+
+    *ppVtab = &vtab.release()->base;
+    return SQLITE_OK;
+}
+
+
+/// Returns the query that reads the underlying table
+static std::string view_query(const view_vtab *vtab, int idxNum)
+{
+    // The column is qualified so that SQLite cannot mistake a missing one for
+    // a string literal, and the table is read from the view's own database
+    char *sql = sqlite3_mprintf(
+        "SELECT rowid, \"%w\".\"%w\" FROM \"%w\".\"%w\"%s",
+        vtab->table.c_str(), vtab->column.c_str(), vtab->schema.c_str(),
+        vtab->table.c_str(), idxNum == LOOKUP_BY_ROWID ? " WHERE rowid = ?" : "");
+    std::string result(sql ? sql : "");
+    sqlite3_free(sql);
+    return result;
+}
+
+
+/// Create a new view, checking that the underlying table can be read
+static int MODULE_FUNC(xCreate) (
+    sqlite3 *db,
+    void *pAux,
+    int argc, const char * const *argv,
+    sqlite3_vtab **ppVtab,
+    char **pzErr
+) {
+    int err = view_connect(db, pAux, argc, argv, ppVtab, pzErr);
+    if (err != SQLITE_OK) return err;
+
+    sqlite3_stmt *stmt;
+    std::string sql = view_query((view_vtab *)*ppVtab, LOOKUP_ALL);
+    err = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr);
+    if (err != SQLITE_OK) {
+        *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+        delete reinterpret_cast<view_vtab *>(*ppVtab);
+        *ppVtab = nullptr;
+        return err;
+    }
+    sqlite3_finalize(stmt);
+    return SQLITE_OK;
+}
+
+
+/// Connect to an existing view
+static int MODULE_FUNC(xConnect) (
+    sqlite3 *db,
+    void *pAux,
+    int argc, const char * const *argv,
+    sqlite3_vtab **ppVtab,
+    char **pzErr
+) {
+    return view_connect(db, pAux, argc, argv, ppVtab, pzErr);
+}
+
+
+/// Undoes xConnect
+static int MODULE_FUNC(xDisconnect) (sqlite3_vtab *pVtab)
+{
+    delete reinterpret_cast<view_vtab *>(pVtab);
+    return SQLITE_OK;
+}
+
+
+/// Frees the values of the constraints passed to the last call to xFilter
+static void clear_constraints(view_cursor *cursor)
+{
+    for (view_constraint& constraint : cursor->constraints)
+        sqlite3_value_free(constraint.value);
+    cursor->constraints.clear();
+}
+
+
+/// Constructor view_cursor objects
+static int MODULE_FUNC(xOpen) (sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor)
+{
+    view_cursor *cursor = new view_cursor();
+    cursor->stmt = nullptr;
+    cursor->stmtIdxNum = -1;
+    cursor->eof = true;
+    *ppCursor = &cursor->base;
+    return SQLITE_OK;
+}
+
+/// Destructor view_cursor objects
+static int MODULE_FUNC(xClose) (sqlite3_vtab_cursor *cur)
+{
+    view_cursor *cursor = (view_cursor *)cur;
+    clear_constraints(cursor);
+    sqlite3_finalize(cursor->stmt);
+    delete cursor;
+    return SQLITE_OK;
+}
+
+
+/// Compares a column value with the value of a constraint. Returns false if
+/// they are of different kinds, which SQLite may convert before comparing.
+static bool compare(const field_value& value, sqlite3_value *arg, int *result)
+{
+    int arg_type = sqlite3_value_type(arg);
+    if (value.type == SQLITE_INTEGER || value.type == SQLITE_FLOAT) {
+        if (arg_type == SQLITE_INTEGER && value.type == SQLITE_INTEGER) {
+            sqlite3_int64 other = sqlite3_value_int64(arg);
+            *result = value.i < other ? -1 : value.i > other ? 1 : 0;
+        } else if (arg_type == SQLITE_INTEGER) {
+            *result = -compare_int_double(sqlite3_value_int64(arg), value.d);
+        } else if (arg_type == SQLITE_FLOAT && value.type == SQLITE_INTEGER) {
+            *result = compare_int_double(value.i, sqlite3_value_double(arg));
+        } else if (arg_type == SQLITE_FLOAT) {
+            double other = sqlite3_value_double(arg);
+            *result = value.d < other ? -1 : value.d > other ? 1 : 0;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    // Text is only compared here when the collation is BINARY, which
+    // xBestIndex checks
+    if (arg_type != value.type)
+        return false;
+    const void *data = arg_type == SQLITE_TEXT
+        ? static_cast<const void *>(sqlite3_value_text(arg))
+        : sqlite3_value_blob(arg);
+    size_t size = static_cast<size_t>(sqlite3_value_bytes(arg));
+    int c = memcmp(value.data, data, value.size < size ? value.size : size);
+    *result = c != 0 ? c : value.size < size ? -1 : value.size > size ? 1 : 0;
+    return true;
+}
+
+
+/// Finds the value of a column in the current row with the wire engine.
+/// Returns false if the wire engine cannot decide what the value is.
+static bool wire_column_value(const view_vtab *vtab,
+                              int column,
+                              const parsed_message& parsed,
+                              field_value *value)
+{
+    const compiled_path& path = *vtab->paths[column];
+    if (vtab->conn->engine == ENGINE_REFLECTION || !path.wire_supported)
+        return false;
+
+    wire_value wire;
+    switch (wire_find(path, parsed.data, parsed.size, &wire)) {
+    case WIRE_FOUND:
+        return value_from_wire(path, wire, value);
+    case WIRE_DEFAULT:
+        return value_from_default(path, value);
+    case WIRE_NULL:
+        value->type = SQLITE_NULL;
+        return true;
+    case WIRE_FALLBACK:
+        break;
+    }
+    return false;
+}
+
+
+/// Returns true if a column value certainly does not satisfy a constraint
+static bool rejects(const field_value& value, const view_constraint& constraint)
+{
+    // Nothing compares true with null
+    if (value.type == SQLITE_NULL)
+        return true;
+
+    int c;
+    if (!compare(value, constraint.value, &c))
+        return false;
+    switch (constraint.op) {
+    case SQLITE_INDEX_CONSTRAINT_EQ: return c != 0;
+    case SQLITE_INDEX_CONSTRAINT_GT: return c <= 0;
+    case SQLITE_INDEX_CONSTRAINT_LE: return c > 0;
+    case SQLITE_INDEX_CONSTRAINT_LT: return c >= 0;
+    case SQLITE_INDEX_CONSTRAINT_GE: return c < 0;
+    }
+    return false;
+}
+
+
+/// Advance to the next row of the underlying table that is not rejected by
+/// any of the constraints
+static int MODULE_FUNC(xNext) (sqlite3_vtab_cursor *cur)
+{
+    view_cursor *cursor = (view_cursor *)cur;
+    view_vtab *vtab = (view_vtab *)cur->pVtab;
+    stats_call call(vtab->conn->stats, FUNCTION_VIEW, PHASE_WALK);
+
+    for (;;) {
+        int err = sqlite3_step(cursor->stmt);
+        if (err == SQLITE_DONE) {
+            cursor->eof = true;
+            return SQLITE_OK;
+        } else if (err != SQLITE_ROW) {
+            sqlite3_free(vtab->base.zErrMsg);
+            vtab->base.zErrMsg = sqlite3_mprintf("%s",
+                sqlite3_errmsg(vtab->db));
+            return err;
+        }
+
+        // The message stays valid until the statement is stepped again. If it
+        // is compressed, it is decompressed into a copy of its own, since the
+        // connection's buffer is reused by any other call on the row.
+        const uint8_t *data =
+            static_cast<const uint8_t *>(sqlite3_column_blob(cursor->stmt, 1));
+        size_t size = static_cast<size_t>(sqlite3_column_bytes(cursor->stmt, 1));
+        vtab->conn->stats.count_bytes(size);
+        if (is_compressed(data, size)) {
+            std::string error_msg;
+            if (!decompress_message(vtab->conn, vtab->db, &data, &size,
+                                    &error_msg)) {
+                sqlite3_free(vtab->base.zErrMsg);
+                vtab->base.zErrMsg = sqlite3_mprintf("%s", error_msg.c_str());
+                return SQLITE_ERROR;
+            }
+            cursor->data.assign(reinterpret_cast<const char *>(data), size);
+            data = reinterpret_cast<const uint8_t *>(cursor->data.data());
+        }
+        cursor->parsed = parsed_message(data, size, vtab->conn,
+            &cursor->arena);
+
+        // The constraints are sorted by column, so each column is only found
+        // once. Any row the wire engine cannot decide on is kept, and SQLite
+        // checks the constraints again on the columns that are returned.
+        int column = -1;
+        bool known = false;
+        bool rejected = false;
+        field_value value;
+        for (const view_constraint& constraint : cursor->constraints) {
+            if (constraint.column != column) {
+                column = constraint.column;
+                known = wire_column_value(vtab, column, cursor->parsed,
+                    &value);
+            }
+            if (known && rejects(value, constraint)) {
+                rejected = true;
+                break;
+            }
+        }
+        if (!rejected)
+            return SQLITE_OK;
+    }
+}
+
+
+/// Returns the rowid of the row in the underlying table
+static int MODULE_FUNC(xRowid) (sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid)
+{
+    view_cursor *cursor = (view_cursor *)cur;
+    *pRowid = sqlite3_column_int64(cursor->stmt, 0);
+    return SQLITE_OK;
+}
+
+
+/// Returns true once every row has been returned
+static int MODULE_FUNC(xEof) (sqlite3_vtab_cursor *cur)
+{
+    view_cursor *cursor = (view_cursor *)cur;
+    return cursor->eof;
+}
+
+
+/// Return the fields in a given cell of the table. Values are only extracted
+/// for the columns that the query actually reads.
+static int MODULE_FUNC(xColumn) (
+    sqlite3_vtab_cursor *cur,
+    sqlite3_context *ctx,
+    int i
+) {
+    view_cursor *cursor = (view_cursor *)cur;
+    view_vtab *vtab = (view_vtab *)cur->pVtab;
+    stats_call call(vtab->conn->stats, FUNCTION_VIEW, PHASE_RESULT, false);
+
+    if (static_cast<size_t>(i) < vtab->paths.size()) {
+        vtab->conn->stats.count_path(*vtab->paths[i]);
+        extract_path(ctx, vtab->conn, *vtab->paths[i], cursor->parsed);
+    } else {
+        sqlite3_result_value(ctx, sqlite3_column_value(cursor->stmt, 1));
+    }
+    return SQLITE_OK;
+}
+
+
+/// Looks up rows by rowid in the underlying table if possible. Equality and
+/// range constraints on the columns are passed to xFilter, which uses them to
+/// skip rows early; they are listed in idxStr as "column,op;" pairs.
+static int MODULE_FUNC(xBestIndex) (
+    sqlite3_vtab *tab,
+    sqlite3_index_info *pIdxInfo
+)
+{
+    view_vtab *vtab = (view_vtab *)tab;
+    int rowidEqConstraintIdx = -1;
+    int argIdx = 1;
+    std::string constraints;
+    double estimatedRows = ESTIMATED_ROWS;
+
+    const auto *constraint = pIdxInfo->aConstraint;
+    for (int i = 0; i < pIdxInfo->nConstraint; i ++, constraint ++) {
+        if (!constraint->usable) continue;
+        if (constraint->iColumn < 0) {
+            if (constraint->op == SQLITE_INDEX_CONSTRAINT_EQ)
+                rowidEqConstraintIdx = i;
+            continue;
+        }
+        if (static_cast<size_t>(constraint->iColumn) >= vtab->paths.size())
+            continue;
+
+        // Guess how many rows each kind of constraint leaves
+        double selectivity;
+        switch (constraint->op) {
+        case SQLITE_INDEX_CONSTRAINT_EQ:
+            selectivity = 0.1;
+            break;
+        case SQLITE_INDEX_CONSTRAINT_GT:
+        case SQLITE_INDEX_CONSTRAINT_LE:
+        case SQLITE_INDEX_CONSTRAINT_LT:
+        case SQLITE_INDEX_CONSTRAINT_GE:
+            selectivity = 0.5;
+            break;
+        default:
+            continue;
+        }
+
+        // Text is compared byte by byte, so other collations are left to
+        // SQLite
+        const char *collation = sqlite3_vtab_collation(pIdxInfo, i);
+        if (collation && sqlite3_stricmp(collation, "BINARY") != 0)
+            continue;
+
+        // SQLite still checks the constraint, since rows that the wire
+        // engine cannot decide on are not rejected
+        pIdxInfo->aConstraintUsage[i].argvIndex = argIdx ++;
+        pIdxInfo->aConstraintUsage[i].omit = 0;
+        estimatedRows *= selectivity;
+        constraints += std::to_string(constraint->iColumn) + ","
+            + std::to_string(constraint->op) + ";";
+    }
+
+    if (rowidEqConstraintIdx >= 0) {
+        pIdxInfo->aConstraintUsage[rowidEqConstraintIdx].argvIndex = argIdx ++;
+        pIdxInfo->aConstraintUsage[rowidEqConstraintIdx].omit = 1;
+        pIdxInfo->idxNum = LOOKUP_BY_ROWID;
+        pIdxInfo->estimatedCost = 10;
+        pIdxInfo->estimatedRows = 1;
+        pIdxInfo->idxFlags |= SQLITE_INDEX_SCAN_UNIQUE;
+    } else {
+        pIdxInfo->idxNum = LOOKUP_ALL;
+        pIdxInfo->estimatedCost = ESTIMATED_ROWS;
+        pIdxInfo->estimatedRows = static_cast<sqlite3_int64>(estimatedRows);
+    }
+
+    if (!constraints.empty()) {
+        pIdxInfo->idxStr = sqlite3_mprintf("%s", constraints.c_str());
+        if (!pIdxInfo->idxStr)
+            return SQLITE_NOMEM;
+        pIdxInfo->needToFreeIdxStr = 1;
+    }
+    return SQLITE_OK;
+}
+
+
+/// Start reading the underlying table, reusing the statement from a previous
+/// call if it has the same shape
+static int MODULE_FUNC(xFilter) (
+    sqlite3_vtab_cursor *pVtabCursor,
+    int idxNum, const char *idxStr,
+    int argc, sqlite3_value **argv
+){
+    view_cursor *cursor = (view_cursor *)pVtabCursor;
+    view_vtab *vtab = (view_vtab *)pVtabCursor->pVtab;
+    int err;
+
+    if (cursor->stmt && cursor->stmtIdxNum == idxNum) {
+        sqlite3_reset(cursor->stmt);
+    } else {
+        sqlite3_finalize(cursor->stmt);
+        cursor->stmt = nullptr;
+        std::string sql = view_query(vtab, idxNum);
+        err = sqlite3_prepare_v2(vtab->db, sql.c_str(), -1, &cursor->stmt,
+            nullptr);
+        if (err != SQLITE_OK) {
+            sqlite3_free(vtab->base.zErrMsg);
+            vtab->base.zErrMsg = sqlite3_mprintf("%s",
+                sqlite3_errmsg(vtab->db));
+            return err;
+        }
+        cursor->stmtIdxNum = idxNum;
+    }
+
+    // The arguments are only valid during this call, so keep copies
+    int argIdx = 0;
+    clear_constraints(cursor);
+    for (const char *p = idxStr; p && *p; ) {
+        view_constraint constraint;
+        char *end;
+        constraint.column = static_cast<int>(strtol(p, &end, 10));
+        constraint.op = static_cast<int>(strtol(end + 1, &end, 10));
+        constraint.value = sqlite3_value_dup(argv[argIdx ++]);
+        if (!constraint.value)
+            return SQLITE_NOMEM;
+        cursor->constraints.push_back(constraint);
+        p = end + 1;
+    }
+    std::stable_sort(cursor->constraints.begin(), cursor->constraints.end(),
+        [](const view_constraint& a, const view_constraint& b) {
+            return a.column < b.column;
+        });
+
+    if (idxNum == LOOKUP_BY_ROWID) {
+        err = sqlite3_bind_value(cursor->stmt, 1, argv[argIdx ++]);
+        if (err != SQLITE_OK) return err;
+    }
+
+    cursor->eof = false;
+    return MODULE_FUNC(xNext)(pVtabCursor);
+}
+
+
+static sqlite3_module module = {
+  0,                         /* iVersion */
+  MODULE_FUNC(xCreate),      /* xCreate */
+  MODULE_FUNC(xConnect),     /* xConnect - required */
+  MODULE_FUNC(xBestIndex),   /* xBestIndex - required */
+  MODULE_FUNC(xDisconnect),  /* xDisconnect - required */
+  MODULE_FUNC(xDisconnect),  /* xDestroy */
+  MODULE_FUNC(xOpen),        /* xOpen - open a cursor - required */
+  MODULE_FUNC(xClose),       /* xClose - close a cursor - required */
+  MODULE_FUNC(xFilter),      /* xFilter - configure scan constraints - required */
+  MODULE_FUNC(xNext),        /* xNext - advance a cursor - required */
+  MODULE_FUNC(xEof),         /* xEof - check for end of scan - required */
+  MODULE_FUNC(xColumn),      /* xColumn - read data - required */
+  MODULE_FUNC(xRowid),       /* xRowid - read data - required */
+  0,                         /* xUpdate */
+  0,                         /* xBegin */
+  0,                         /* xSync */
+  0,                         /* xCommit */
+  0,                         /* xRollback */
+  0,                         /* xFindMethod */
+  0,                         /* xRename */
+};
+
+
+DECLARE_(protobuf_view)
+{
+    return sqlite3_create_module_v2(db, "protobuf_view", &module,
+        conn->retain(), connection::release);
+}
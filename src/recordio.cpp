@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <google/protobuf/io/coded_stream.h>
+
+#include "recordio.h"
+
+using google::protobuf::io::CodedInputStream;
+
+
+/// The longest encoding of a varint
+static const uint64_t MAX_VARINT_SIZE = 10;
+
+/// The number of bytes read from the file at once, unless a record needs more
+static const uint64_t READ_SIZE = 64 * 1024;
+
+
+record_file::record_file()
+    : size(0), indexed(false), records(0), fd(-1)
+{
+}
+
+
+record_file::~record_file()
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+
+bool record_file::open(const std::string& path, std::string *error_msg)
+{
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        *error_msg = "Could not open file " + path + ": " + strerror(errno);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        *error_msg = "Could not open file " + path + ": " + strerror(errno);
+        return false;
+    }
+    this->path = path;
+    size = static_cast<uint64_t>(st.st_size);
+    return true;
+}
+
+
+bool record_file::fill(uint64_t offset,
+                       uint64_t count,
+                       record_buffer *buffer,
+                       std::string *error_msg) const
+{
+    if (offset >= buffer->offset
+            && offset + count <= buffer->offset + buffer->data.size())
+        return true;
+
+    // Read ahead, but no further than the end of the file
+    uint64_t wanted = std::min(std::max<uint64_t>(count, READ_SIZE),
+        size - offset);
+    buffer->data.resize(static_cast<size_t>(wanted));
+    buffer->offset = offset;
+    uint64_t done = 0;
+    while (done < wanted) {
+        ssize_t got = pread(fd, &buffer->data[done],
+            static_cast<size_t>(wanted - done),
+            static_cast<off_t>(offset + done));
+        if (got < 0 && errno == EINTR)
+            continue;
+
+        // Reading ahead stops early if the file has been truncated since it
+        // was opened, which is only an error if the bytes asked for are gone
+        if (got == 0 && done >= count) {
+            buffer->data.resize(static_cast<size_t>(done));
+            return true;
+        }
+        if (got <= 0) {
+            buffer->data.clear();
+            *error_msg = got < 0
+                ? "Could not read file " + path + ": " + strerror(errno)
+                : "File was truncated while it was open: " + path;
+            return false;
+        }
+        done += static_cast<uint64_t>(got);
+    }
+    return true;
+}
+
+
+bool record_file::read_length(uint64_t offset,
+                              record_buffer *buffer,
+                              uint64_t *start,
+                              uint64_t *length,
+                              std::string *error_msg) const
+{
+    if (offset >= size)
+        return false;
+
+    uint64_t header = std::min(size - offset, MAX_VARINT_SIZE);
+    if (!fill(offset, header, buffer, error_msg))
+        return false;
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(
+        buffer->data.data()) + (offset - buffer->offset);
+    CodedInputStream input(data, static_cast<int>(header));
+    if (!input.ReadVarint64(length))
+        return false;
+
+    *start = offset + static_cast<uint64_t>(input.CurrentPosition());
+    return *length <= size - *start;
+}
+
+
+bool record_file::read(uint64_t offset,
+                       record_buffer *buffer,
+                       const uint8_t **record,
+                       size_t *record_size,
+                       uint64_t *next,
+                       std::string *error_msg) const
+{
+    uint64_t start, length;
+    if (!read_length(offset, buffer, &start, &length, error_msg)
+            || !fill(start, length, buffer, error_msg))
+        return false;
+
+    *record = reinterpret_cast<const uint8_t *>(buffer->data.data())
+        + (start - buffer->offset);
+    *record_size = static_cast<size_t>(length);
+    *next = start + length;
+    return true;
+}
+
+
+bool record_file::build_index(std::string *error_msg)
+{
+    if (indexed)
+        return true;
+
+    // Only the lengths are read, so large records are stepped over
+    checkpoints.clear();
+    records = 0;
+    record_buffer buffer;
+    uint64_t offset = 0;
+    while (offset < size) {
+        uint64_t start, length;
+        if (!read_length(offset, &buffer, &start, &length, error_msg)) {
+            if (error_msg->empty())
+                *error_msg = "Truncated record at offset "
+                    + std::to_string(offset);
+            return false;
+        }
+        if (records % INDEX_INTERVAL == 0)
+            checkpoints.push_back(offset);
+        records ++;
+        offset = start + length;
+    }
+
+    indexed = true;
+    return true;
+}
+
+
+uint64_t record_file::seek(uint64_t offset, record_buffer *buffer) const
+{
+    if (offset >= size)
+        return size;
+
+    // Start from the last checkpoint at or before the offset, and step over
+    // the records after it
+    auto checkpoint = std::upper_bound(checkpoints.begin(), checkpoints.end(),
+        offset);
+    if (checkpoint == checkpoints.begin())
+        return 0;
+    uint64_t current = *(checkpoint - 1);
+    std::string error_msg;
+    while (current < offset) {
+        uint64_t start, length;
+        if (!read_length(current, buffer, &start, &length, &error_msg))
+            return size;
+        current = start + length;
+    }
+    return current;
+}
@@ -0,0 +1,90 @@
+#ifndef RECORDIO_H
+#define RECORDIO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+/// A window onto part of a record_file, which each reader keeps for itself so
+/// that records near each other are read from the file together
+struct record_buffer {
+    std::string data;
+    uint64_t offset;
+
+    record_buffer() : offset(0) {}
+};
+
+
+/// A file of messages, each preceded by its length as a varint, as written by
+/// util::SerializeDelimitedToOstream or writeDelimitedTo in Java. Records are
+/// read with pread into a buffer, in large blocks.
+///
+/// The size of the file is taken when it is opened. If the file is truncated
+/// while it is open, reading past its new end is an error.
+struct record_file {
+    /// The number of records between the entries of the sparse index
+    static const uint64_t INDEX_INTERVAL = 1024;
+
+    uint64_t size;
+
+    /// Set once build_index has checked the whole file
+    bool indexed;
+
+    /// The number of records, once the file is indexed
+    uint64_t records;
+
+    /// The offset of every INDEX_INTERVAL-th record, starting with the first
+    std::vector<uint64_t> checkpoints;
+
+    record_file();
+    ~record_file();
+
+    record_file(const record_file&) = delete;
+    record_file& operator=(const record_file&) = delete;
+
+    /// Opens the file. Returns false and sets error_msg on failure.
+    bool open(const std::string& path, std::string *error_msg);
+
+    /// Scans the length of every record to build the sparse index. Returns
+    /// false and sets error_msg if a record runs past the end of the file.
+    bool build_index(std::string *error_msg);
+
+    /// Reads the record that starts at offset into the buffer, setting next to
+    /// the offset of the record after it. Returns false at the end of the file
+    /// or if the record is malformed, and also sets error_msg if the file
+    /// could not be read.
+    bool read(uint64_t offset,
+              record_buffer *buffer,
+              const uint8_t **record,
+              size_t *record_size,
+              uint64_t *next,
+              std::string *error_msg) const;
+
+    /// Returns the offset of the first record that starts at or after offset,
+    /// or size if there is none. The file must be indexed.
+    uint64_t seek(uint64_t offset, record_buffer *buffer) const;
+
+private:
+    int fd;
+    std::string path;
+
+    /// Reads the length of the record at offset, setting start to the offset
+    /// of its contents. Returns false as read does.
+    bool read_length(uint64_t offset,
+                     record_buffer *buffer,
+                     uint64_t *start,
+                     uint64_t *length,
+                     std::string *error_msg) const;
+
+    /// Makes sure the buffer holds the bytes from offset to offset + count,
+    /// which must be within the file
+    bool fill(uint64_t offset,
+              uint64_t count,
+              record_buffer *buffer,
+              std::string *error_msg) const;
+};
+
+
+#endif
@@ -0,0 +1,80 @@
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "shadow.h"
+#include "utilities.h"
+
+
+static const char *const TRIGGERS[] = { "insert", "update", "delete" };
+
+
+int create_shadow(sqlite3 *db,
+                  const shadow_source& source,
+                  shadow_add add,
+                  void *vtab,
+                  char **pzErr)
+{
+    const char *schema = source.schema;
+    const char *name = source.name;
+    const char *table = source.table;
+    const char *column = source.column;
+    const char *hidden = source.hidden;
+
+    // Statements in triggers cannot name the database, but the tables they
+    // use are looked up in the database of the trigger
+    int err = exec_sql(db, pzErr,
+        "CREATE TRIGGER \"%w\".\"%w_insert\" AFTER INSERT ON \"%w\" BEGIN "
+        "INSERT INTO \"%w\" (rowid, \"%w\") VALUES (new.rowid, new.\"%w\"); "
+        "END",
+        schema, name, table, name, hidden, column);
+    if (err != SQLITE_OK) return err;
+    err = exec_sql(db, pzErr,
+        "CREATE TRIGGER \"%w\".\"%w_update\" AFTER UPDATE ON \"%w\" "
+        "WHEN old.rowid IS NOT new.rowid OR old.\"%w\" IS NOT new.\"%w\" BEGIN "
+        "DELETE FROM \"%w\" WHERE rowid = old.rowid; "
+        "INSERT INTO \"%w\" (rowid, \"%w\") VALUES (new.rowid, new.\"%w\"); "
+        "END",
+        schema, name, table, column, column, name, name, hidden, column);
+    if (err != SQLITE_OK) return err;
+    err = exec_sql(db, pzErr,
+        "CREATE TRIGGER \"%w\".\"%w_delete\" AFTER DELETE ON \"%w\" BEGIN "
+        "DELETE FROM \"%w\" WHERE rowid = old.rowid; "
+        "END",
+        schema, name, table, name);
+    if (err != SQLITE_OK) return err;
+
+    // The column is qualified so that SQLite cannot mistake a missing one for
+    // a string literal
+    sqlite3_stmt *stmt;
+    err = prepare(db, &stmt, "SELECT rowid, \"%w\".\"%w\" FROM \"%w\".\"%w\"",
+        table, column, schema, table);
+    if (err != SQLITE_OK) {
+        *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+        return err;
+    }
+    while ((err = sqlite3_step(stmt)) == SQLITE_ROW) {
+        err = add(vtab, sqlite3_column_int64(stmt, 0),
+            sqlite3_column_value(stmt, 1), pzErr);
+        if (err != SQLITE_OK) break;
+    }
+    if (err != SQLITE_DONE && !*pzErr)
+        *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    if (err != SQLITE_DONE)
+        return err == SQLITE_OK ? SQLITE_ERROR : err;
+    return SQLITE_OK;
+}
+
+
+int drop_shadow_triggers(sqlite3 *db,
+                         const char *schema,
+                         const char *name,
+                         char **pzErr)
+{
+    for (const char *trigger : TRIGGERS) {
+        int err = exec_sql(db, pzErr,
+            "DROP TRIGGER IF EXISTS \"%w\".\"%w_%s\"", schema, name, trigger);
+        if (err != SQLITE_OK) return err;
+    }
+    return SQLITE_OK;
+}
@@ -0,0 +1,48 @@
+#ifndef SHADOW_H
+#define SHADOW_H
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+
+/// Virtual tables such as protobuf_index and protobuf_shred keep a copy of
+/// what they derive from the messages in a column of an underlying table.
+/// Triggers on that table write each change to the virtual table, through a
+/// hidden column that takes the message, so the copy stays up to date.
+struct shadow_source {
+    const char *schema;     // database of the virtual table and the table
+    const char *name;       // name of the virtual table
+    const char *table;      // the underlying table
+    const char *column;     // the column of the underlying table
+    const char *hidden;     // the hidden column the message is written to
+};
+
+
+/// Adds a message of the underlying table to the virtual table. On failure,
+/// returns an error code and may set the error message.
+typedef int (*shadow_add)(void *vtab,
+                          sqlite3_int64 rowid,
+                          sqlite3_value *value,
+                          char **pzErr);
+
+
+/// Creates the triggers <name>_insert, <name>_update and <name>_delete on the
+/// underlying table, and passes each message it already holds to add. On
+/// failure, sets the error message.
+int create_shadow(sqlite3 *db,
+                  const shadow_source& source,
+                  shadow_add add,
+                  void *vtab,
+                  char **pzErr);
+
+
+/// Drops the triggers that create_shadow created. On failure, sets the error
+/// message.
+int drop_shadow_triggers(sqlite3 *db,
+                         const char *schema,
+                         const char *name,
+                         char **pzErr);
+
+
+
+#endif
@@ -0,0 +1,97 @@
+#include <cstring>
+
+#include "path.h"
+#include "stats.h"
+
+
+connection_stats::connection_stats()
+    : level(STATS_OFF), current(nullptr), phase(PHASE_LOOKUP)
+{
+    reset();
+}
+
+
+void connection_stats::reset()
+{
+    memset(functions, 0, sizeof(functions));
+    for (auto& entry : type_calls)
+        entry.second = 0;
+    for (auto& entry : path_calls)
+        entry.second = 0;
+}
+
+
+void connection_stats::count_path(const compiled_path& path)
+{
+    if (!current)
+        return;
+
+    // Look up the counters once for each compiled path
+    if (!path.type_calls) {
+        path.type_calls = &type_calls[path.type_name];
+        path.path_calls = &path_calls[std::make_pair(path.type_name,
+                                                     path.path)];
+    }
+    ++ *path.type_calls;
+    ++ *path.path_calls;
+}
+
+
+void connection_stats::switch_phase(stats_phase next)
+{
+    clock::time_point now = clock::now();
+    current->phase_ns[phase] += std::chrono::duration_cast<
+        std::chrono::nanoseconds>(now - phase_start).count();
+    phase = next;
+    phase_start = now;
+}
+
+
+stats_call::stats_call(connection_stats& stats, stats_function function,
+                       stats_phase phase, bool counts)
+    : stats(stats), previous(stats.current), previous_phase(stats.phase),
+      previous_call_start(stats.call_start),
+      previous_phase_start(stats.phase_start), counts(counts)
+{
+    if (stats.level == STATS_OFF) {
+        stats.current = nullptr;
+        return;
+    }
+
+    stats.current = &stats.functions[function];
+    stats.phase = phase;
+    if (counts)
+        stats.current->calls ++;
+    if (stats.level == STATS_TIMING)
+        stats.call_start = stats.phase_start =
+            connection_stats::clock::now();
+}
+
+
+stats_call::~stats_call()
+{
+    function_stats *function = stats.current;
+    if (function && stats.level == STATS_TIMING) {
+        stats.switch_phase(stats.phase);
+
+        // Sort the call into a bucket by its duration in microseconds
+        if (counts) {
+            int64_t us = std::chrono::duration_cast<
+                std::chrono::microseconds>(
+                    stats.phase_start - stats.call_start).count();
+            int bucket = 0;
+            while (bucket < function_stats::HISTOGRAM_BUCKETS - 1
+                   && us >= (int64_t(1) << bucket))
+                bucket ++;
+            function->histogram[bucket] ++;
+        }
+    }
+
+    // A call made from within another one, such as a function called by the
+    // statement that a protobuf_view cursor steps, hands the clock back to it,
+    // so the time of the outer call includes the inner one
+    stats.current = previous;
+    stats.phase = previous_phase;
+    stats.call_start = previous_call_start;
+    stats.phase_start = previous_phase_start;
+}
@@ -0,0 +1,145 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+
+struct compiled_path;
+
+
+/// How much a connection records, set with protobuf_config("stats", ...)
+enum stats_level {
+    STATS_OFF,
+    STATS_COUNTERS,
+    STATS_TIMING,
+};
+
+
+/// The functions and modules whose calls are recorded
+enum stats_function {
+    FUNCTION_ARRAY_AVG,
+    FUNCTION_ARRAY_COUNT,
+    FUNCTION_ARRAY_MAX,
+    FUNCTION_ARRAY_MIN,
+    FUNCTION_ARRAY_SUM,
+    FUNCTION_COMPRESS,
+    FUNCTION_DECOMPRESS,
+    FUNCTION_EACH,
+    FUNCTION_EXTRACT,
+    FUNCTION_EXTRACT_ALL,
+    FUNCTION_EXTRACT_RAW,
+    FUNCTION_FIELDS,
+    FUNCTION_FILE,
+    FUNCTION_INDEX,
+    FUNCTION_MATCH,
+    FUNCTION_REMOVE,
+    FUNCTION_SET,
+    FUNCTION_SHRED,
+    FUNCTION_TO_JSON,
+    FUNCTION_VIEW,
+    FUNCTION_COUNT,
+};
+
+
+/// The phases that the time of a call is divided into
+enum stats_phase {
+    /// Finding the message type and compiling the path
+    PHASE_LOOKUP,
+    /// Parsing the whole message
+    PHASE_PARSE,
+    /// Following the path, in the wire format or with reflection
+    PHASE_WALK,
+    /// Converting the value to an SQL result
+    PHASE_RESULT,
+    PHASE_COUNT,
+};
+
+
+/// The counters kept for one function
+struct function_stats {
+    /// Bucket i of the histogram counts calls that took less than 2^i
+    /// microseconds; the last bucket counts the rest
+    static const int HISTOGRAM_BUCKETS = 16;
+
+    int64_t calls;
+    int64_t parse_failures;
+    int64_t bytes;
+    int64_t phase_ns[PHASE_COUNT];
+    int64_t histogram[HISTOGRAM_BUCKETS];
+};
+
+
+/// Statistics about the calls made on a connection. Nothing is recorded unless
+/// they are turned on, and each recording method then returns at once.
+struct connection_stats {
+    stats_level level;
+    function_stats functions[FUNCTION_COUNT];
+
+    /// Calls by message type, and by message type and path, across all
+    /// functions. Entries are zeroed rather than erased, so compiled paths can
+    /// keep pointers to them.
+    std::map<std::string, int64_t> type_calls;
+    std::map<std::pair<std::string, std::string>, int64_t> path_calls;
+
+    connection_stats();
+
+    /// Zeroes every counter
+    void reset();
+
+    /// Records that the current call uses a path
+    void count_path(const compiled_path& path);
+
+    /// Records that the current call reads a message of some size
+    void count_bytes(size_t bytes) {
+        if (current) current->bytes += static_cast<int64_t>(bytes);
+    }
+
+    /// Records that the current call could not parse a message
+    void count_parse_failure() {
+        if (current) current->parse_failures ++;
+    }
+
+    /// Attributes the time from now on to a different phase of the current
+    /// call. Returns the phase it replaces.
+    stats_phase enter_phase(stats_phase next) {
+        stats_phase previous = phase;
+        if (current && level == STATS_TIMING) switch_phase(next);
+        return previous;
+    }
+
+private:
+    friend struct stats_call;
+    typedef std::chrono::steady_clock clock;
+
+    void switch_phase(stats_phase next);
+
+    function_stats *current;
+    stats_phase phase;
+    clock::time_point call_start;
+    clock::time_point phase_start;
+};
+
+
+/// Records a call of a function for as long as it is in scope. The time starts
+/// out in the given phase. For table-valued functions, each step of a cursor is
+/// recorded, and only the steps that move it to a new row count as calls.
+struct stats_call {
+    stats_call(connection_stats& stats, stats_function function,
+               stats_phase phase = PHASE_LOOKUP, bool counts = true);
+    ~stats_call();
+
+private:
+    connection_stats& stats;
+    function_stats *previous;
+    stats_phase previous_phase;
+    connection_stats::clock::time_point previous_call_start;
+    connection_stats::clock::time_point previous_phase_start;
+    bool counts;
+};
+
+
+#endif
@@ -1,11 +1,84 @@
+#include <cctype>
+#include <cstdarg>
 #include <string>
 
 #include <sqlite3ext.h>
 SQLITE_EXTENSION_INIT3
 
+#include "utilities.h"
+
 
 const std::string string_from_sqlite3_value(sqlite3_value *value)
 {
     return std::string(reinterpret_cast<const char*>(sqlite3_value_text(value)),
                         static_cast<size_t>(sqlite3_value_bytes(value)));
 }
+
+
+std::string dequote(const std::string& text)
+{
+    size_t begin = 0, end = text.length();
+    while (begin < end && isspace(static_cast<unsigned char>(text[begin])))
+        begin ++;
+    while (end > begin && isspace(static_cast<unsigned char>(text[end - 1])))
+        end --;
+    if (end - begin < 2)
+        return text.substr(begin, end - begin);
+
+    char open = text[begin], close = text[end - 1];
+    if (open == '[' && close == ']')
+        return text.substr(begin + 1, end - begin - 2);
+    if ((open != '\'' && open != '"' && open != '`') || close != open)
+        return text.substr(begin, end - begin);
+
+    // A doubled quote stands for a single one
+    std::string result;
+    for (size_t i = begin + 1; i < end - 1; i ++) {
+        result += text[i];
+        if (text[i] == open && text[i + 1] == open)
+            i ++;
+    }
+    return result;
+}
+
+
+int exec_sql(sqlite3 *db, char **pzErr, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    char *sql = sqlite3_vmprintf(format, args);
+    va_end(args);
+    if (!sql)
+        return SQLITE_NOMEM;
+
+    int err = sqlite3_exec(db, sql, nullptr, nullptr, nullptr);
+    sqlite3_free(sql);
+    if (err != SQLITE_OK) {
+        sqlite3_free(*pzErr);
+        *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    }
+    return err;
+}
+
+
+int prepare(sqlite3 *db, sqlite3_stmt **stmt, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    char *sql = sqlite3_vmprintf(format, args);
+    va_end(args);
+    if (!sql)
+        return SQLITE_NOMEM;
+
+    int err = sqlite3_prepare_v2(db, sql, -1, stmt, nullptr);
+    sqlite3_free(sql);
+    return err;
+}
+
+
+int database_error(sqlite3_vtab *vtab, sqlite3 *db, int err)
+{
+    sqlite3_free(vtab->zErrMsg);
+    vtab->zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    return err;
+}
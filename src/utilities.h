@@ -11,5 +11,23 @@ SQLITE_EXTENSION_INIT3
 const std::string string_from_sqlite3_value(sqlite3_value *value);
 
 
+/// Removes the quotes around an SQL string or identifier, if it has any, as
+/// virtual table arguments are passed with them
+std::string dequote(const std::string& text);
+
+
+/// Runs SQL formatted with sqlite3_mprintf. On failure, sets the error message.
+int exec_sql(sqlite3 *db, char **pzErr, const char *format, ...);
+
+
+/// Prepares a statement formatted with sqlite3_mprintf
+int prepare(sqlite3 *db, sqlite3_stmt **stmt, const char *format, ...);
+
+
+/// Sets the error message of a virtual table to that of the database, and
+/// returns the error code
+int database_error(sqlite3_vtab *vtab, sqlite3 *db, int err);
+
+
 
 #endif
@@ -0,0 +1,263 @@
+#include <cmath>
+#include <string>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+#include "json.h"
+#include "path.h"
+#include "value.h"
+#include "wire.h"
+
+using google::protobuf::EnumValueDescriptor;
+using google::protobuf::FieldDescriptor;
+using google::protobuf::Message;
+using google::protobuf::Reflection;
+
+
+bool value_from_wire(const compiled_path& path,
+                     const wire_value& wire,
+                     field_value *value)
+{
+    const FieldDescriptor *field = path.elements.back().field;
+    switch (field->cpp_type()) {
+    case FieldDescriptor::CppType::CPPTYPE_ENUM:
+        if (path.enum_name) {
+            const EnumValueDescriptor *enum_value =
+                field->enum_type()->FindValueByNumber(
+                    static_cast<int>(wire_decode_int(field, wire.bits)));
+            if (!enum_value)
+                return false;
+            value->type = SQLITE_TEXT;
+            value->data = enum_value->name().data();
+            value->size = enum_value->name().length();
+            return true;
+        }
+        // fall through
+    case FieldDescriptor::CppType::CPPTYPE_INT32:
+    case FieldDescriptor::CppType::CPPTYPE_INT64:
+    case FieldDescriptor::CppType::CPPTYPE_UINT32:
+    case FieldDescriptor::CppType::CPPTYPE_UINT64:
+    case FieldDescriptor::CppType::CPPTYPE_BOOL:
+        value->type = SQLITE_INTEGER;
+        value->i = wire_decode_int(field, wire.bits);
+        return true;
+    case FieldDescriptor::CppType::CPPTYPE_DOUBLE:
+    case FieldDescriptor::CppType::CPPTYPE_FLOAT:
+        // SQLite turns NaN into null
+        value->d = wire_decode_double(field, wire.bits);
+        value->type = std::isnan(value->d) ? SQLITE_NULL : SQLITE_FLOAT;
+        return true;
+    case FieldDescriptor::CppType::CPPTYPE_STRING:
+    case FieldDescriptor::CppType::CPPTYPE_MESSAGE:
+        value->type = field->type() == FieldDescriptor::Type::TYPE_STRING
+            ? SQLITE_TEXT : SQLITE_BLOB;
+        value->data = wire.data;
+        value->size = wire.size;
+        return true;
+    }
+    return false;
+}
+
+
+bool value_from_default(const compiled_path& path, field_value *value)
+{
+    return value_from_default(path.elements.back().field, path.enum_name,
+        value);
+}
+
+
+bool value_from_default(const FieldDescriptor *field,
+                        bool enum_name,
+                        field_value *value)
+{
+    switch (field->cpp_type()) {
+    case FieldDescriptor::CppType::CPPTYPE_ENUM:
+        if (enum_name) {
+            value->type = SQLITE_TEXT;
+            value->data = field->default_value_enum()->name().data();
+            value->size = field->default_value_enum()->name().length();
+        } else {
+            value->type = SQLITE_INTEGER;
+            value->i = field->default_value_enum()->number();
+        }
+        return true;
+    case FieldDescriptor::CppType::CPPTYPE_INT32:
+        value->type = SQLITE_INTEGER;
+        value->i = field->default_value_int32();
+        return true;
+    case FieldDescriptor::CppType::CPPTYPE_INT64:
+        value->type = SQLITE_INTEGER;
+        value->i = field->default_value_int64();
+        return true;
+    case FieldDescriptor::CppType::CPPTYPE_UINT32:
+        value->type = SQLITE_INTEGER;
+        value->i = field->default_value_uint32();
+        return true;
+    case FieldDescriptor::CppType::CPPTYPE_UINT64:
+        value->type = SQLITE_INTEGER;
+        value->i = static_cast<sqlite3_int64>(field->default_value_uint64());
+        return true;
+    case FieldDescriptor::CppType::CPPTYPE_BOOL:
+        value->type = SQLITE_INTEGER;
+        value->i = field->default_value_bool() ? 1 : 0;
+        return true;
+    case FieldDescriptor::CppType::CPPTYPE_DOUBLE:
+    case FieldDescriptor::CppType::CPPTYPE_FLOAT:
+        value->d = field->cpp_type() == FieldDescriptor::CppType::CPPTYPE_FLOAT
+            ? field->default_value_float() : field->default_value_double();
+        value->type = std::isnan(value->d) ? SQLITE_NULL : SQLITE_FLOAT;
+        return true;
+    case FieldDescriptor::CppType::CPPTYPE_STRING:
+        value->type = field->type() == FieldDescriptor::Type::TYPE_STRING
+            ? SQLITE_TEXT : SQLITE_BLOB;
+        value->data = field->default_value_string().data();
+        value->size = field->default_value_string().length();
+        return true;
+    case FieldDescriptor::CppType::CPPTYPE_MESSAGE:
+        value->type = SQLITE_NULL;
+        return true;
+    }
+    return false;
+}
+
+
+bool value_from_field(const Message& message,
+                      const FieldDescriptor *field,
+                      int index,
+                      bool enum_name,
+                      std::string *scratch,
+                      field_value *value)
+{
+    const Reflection *reflection = message.GetReflection();
+    bool repeated = field->is_repeated();
+
+    switch (field->cpp_type()) {
+    case FieldDescriptor::CppType::CPPTYPE_INT32:
+        value->type = SQLITE_INTEGER;
+        value->i = repeated
+            ? reflection->GetRepeatedInt32(message, field, index)
+            : reflection->GetInt32(message, field);
+        return true;
+    case FieldDescriptor::CppType::CPPTYPE_INT64:
+        value->type = SQLITE_INTEGER;
+        value->i = repeated
+            ? reflection->GetRepeatedInt64(message, field, index)
+            : reflection->GetInt64(message, field);
+        return true;
+    case FieldDescriptor::CppType::CPPTYPE_UINT32:
+        value->type = SQLITE_INTEGER;
+        value->i = repeated
+            ? reflection->GetRepeatedUInt32(message, field, index)
+            : reflection->GetUInt32(message, field);
+        return true;
+    case FieldDescriptor::CppType::CPPTYPE_UINT64:
+        value->type = SQLITE_INTEGER;
+        value->i = static_cast<sqlite3_int64>(repeated
+            ? reflection->GetRepeatedUInt64(message, field, index)
+            : reflection->GetUInt64(message, field));
+        return true;
+    case FieldDescriptor::CppType::CPPTYPE_BOOL:
+        value->type = SQLITE_INTEGER;
+        value->i = (repeated
+            ? reflection->GetRepeatedBool(message, field, index)
+            : reflection->GetBool(message, field)) ? 1 : 0;
+        return true;
+    case FieldDescriptor::CppType::CPPTYPE_DOUBLE:
+    case FieldDescriptor::CppType::CPPTYPE_FLOAT:
+        if (field->cpp_type() == FieldDescriptor::CppType::CPPTYPE_FLOAT)
+            value->d = repeated
+                ? reflection->GetRepeatedFloat(message, field, index)
+                : reflection->GetFloat(message, field);
+        else
+            value->d = repeated
+                ? reflection->GetRepeatedDouble(message, field, index)
+                : reflection->GetDouble(message, field);
+        value->type = std::isnan(value->d) ? SQLITE_NULL : SQLITE_FLOAT;
+        return true;
+    case FieldDescriptor::CppType::CPPTYPE_ENUM:
+    {
+        int number = repeated
+            ? reflection->GetRepeatedEnumValue(message, field, index)
+            : reflection->GetEnumValue(message, field);
+        if (!enum_name) {
+            value->type = SQLITE_INTEGER;
+            value->i = number;
+            return true;
+        }
+        const EnumValueDescriptor *enum_value =
+            field->enum_type()->FindValueByNumber(number);
+        if (!enum_value)
+            return false;
+        value->type = SQLITE_TEXT;
+        value->data = enum_value->name().data();
+        value->size = enum_value->name().length();
+        return true;
+    }
+    case FieldDescriptor::CppType::CPPTYPE_STRING:
+    {
+        const std::string& text = repeated
+            ? reflection->GetRepeatedStringReference(message, field, index,
+                scratch)
+            : reflection->GetStringReference(message, field, scratch);
+        value->type = field->type() == FieldDescriptor::Type::TYPE_STRING
+            ? SQLITE_TEXT : SQLITE_BLOB;
+        value->data = text.data();
+        value->size = text.length();
+        return true;
+    }
+    case FieldDescriptor::CppType::CPPTYPE_MESSAGE:
+        if (!(repeated
+              ? reflection->GetRepeatedMessage(message, field, index)
+              : reflection->GetMessage(message, field))
+                .SerializeToString(scratch))
+            return false;
+        value->type = SQLITE_BLOB;
+        value->data = scratch->data();
+        value->size = scratch->length();
+        return true;
+    }
+    return false;
+}
+
+
+void json_append_value(std::string *output,
+                       const FieldDescriptor *field,
+                       const field_value& value)
+{
+    switch (value.type) {
+    case SQLITE_INTEGER:
+        if (field->cpp_type() == FieldDescriptor::CppType::CPPTYPE_BOOL)
+            output->append(value.i ? "true" : "false");
+        else
+            output->append(std::to_string(value.i));
+        break;
+    case SQLITE_FLOAT:
+        json_append_double(output, value.d);
+        break;
+    case SQLITE_TEXT:
+        json_append_string(output, static_cast<const char *>(value.data),
+            value.size);
+        break;
+    case SQLITE_BLOB:
+        json_append_base64(output, value.data, value.size);
+        break;
+    default:
+        output->append("null");
+        break;
+    }
+}
+
+
+int compare_int_double(sqlite3_int64 i, double d)
+{
+    if (d < -9223372036854775808.0) return 1;
+    if (d >= 9223372036854775808.0) return -1;
+    sqlite3_int64 t = static_cast<sqlite3_int64>(d);
+    if (i != t) return i < t ? -1 : 1;
+    double fraction = d - static_cast<double>(t);
+    return fraction > 0 ? -1 : fraction < 0 ? 1 : 0;
+}
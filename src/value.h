@@ -0,0 +1,66 @@
+#ifndef VALUE_H
+#define VALUE_H
+
+#include <cstddef>
+#include <string>
+
+#include <google/protobuf/message.h>
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT3
+
+struct compiled_path;
+struct wire_value;
+
+
+/// A field value in the form SQLite would compare it, which is the value that
+/// protobuf_extract would return. Text and blobs point into the message or the
+/// descriptor the value came from.
+struct field_value {
+    int type;
+    sqlite3_int64 i;
+    double d;
+    const void *data;
+    size_t size;
+};
+
+
+/// Converts a field value found by the wire engine. Returns false if the
+/// value cannot be compared here.
+bool value_from_wire(const compiled_path& path,
+                     const wire_value& wire,
+                     field_value *value);
+
+
+/// Converts the default value of a field that is not present. Returns false
+/// if the value cannot be compared here.
+bool value_from_default(const compiled_path& path, field_value *value);
+bool value_from_default(const google::protobuf::FieldDescriptor *field,
+                        bool enum_name,
+                        field_value *value);
+
+
+/// Converts the value of a field of a parsed message. The index is ignored
+/// unless the field is repeated. Strings may be copied into scratch, and
+/// messages are serialized into it. Returns false if the value cannot be
+/// compared here.
+bool value_from_field(const google::protobuf::Message& message,
+                      const google::protobuf::FieldDescriptor *field,
+                      int index,
+                      bool enum_name,
+                      std::string *scratch,
+                      field_value *value);
+
+
+/// Appends a value to a JSON array, as protobuf_extract would return it.
+/// Booleans are written as true and false, and bytes and messages in base64.
+void json_append_value(std::string *output,
+                       const google::protobuf::FieldDescriptor *field,
+                       const field_value& value);
+
+
+/// Compares an integer with a real number exactly, as SQLite does
+int compare_int_double(sqlite3_int64 i, double d);
+
+
+#endif
@@ -0,0 +1,1257 @@
+#include <climits>
+#include <cstring>
+#include <set>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/stubs/common.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include "path.h"
+#include "wire.h"
+
+using google::protobuf::Descriptor;
+using google::protobuf::FieldDescriptor;
+using google::protobuf::FileDescriptor;
+using google::protobuf::OneofDescriptor;
+using google::protobuf::internal::WireFormatLite;
+using google::protobuf::io::CodedInputStream;
+
+
+/// Returns true if the message type, or any message type it contains, has
+/// required fields. Parsing fails if those are missing, which the wire engine
+/// would not notice.
+static bool has_required_fields(const Descriptor *descriptor,
+                                std::set<const Descriptor *>& visited)
+{
+    if (!visited.insert(descriptor).second)
+        return false;
+    for (int i = 0; i < descriptor->field_count(); i ++) {
+        const FieldDescriptor *field = descriptor->field(i);
+        if (field->is_required())
+            return true;
+        if (field->message_type()
+            && has_required_fields(field->message_type(), visited))
+            return true;
+    }
+    return false;
+}
+
+
+bool wire_can_follow_path(const compiled_path& path)
+{
+    // The root object is validated by a full parse
+    if (path.elements.empty())
+        return false;
+
+    for (const path_element& element : path.elements) {
+        // Map entries are deduplicated and groups are not length-delimited
+        if (element.field->is_map()
+            || element.field->type() == FieldDescriptor::TYPE_GROUP)
+            return false;
+    }
+    return true;
+}
+
+
+bool wire_supports_path(const compiled_path& path)
+{
+    if (!wire_can_follow_path(path))
+        return false;
+
+    std::set<const Descriptor *> visited;
+    return !has_required_fields(path.descriptor, visited);
+}
+
+
+bool wire_accepts_value(const FieldDescriptor *field, uint64_t bits)
+{
+    if (field->type() != FieldDescriptor::TYPE_ENUM)
+        return true;
+    if (field->enum_type()->file()->syntax() == FileDescriptor::SYNTAX_PROTO3)
+        return true;
+    return field->enum_type()->FindValueByNumber(
+        static_cast<int32_t>(bits)) != nullptr;
+}
+
+
+bool wire_accepts_string(const FieldDescriptor *field,
+                         const wire_value& value)
+{
+    return field->type() != FieldDescriptor::TYPE_STRING
+        || field->file()->syntax() != FileDescriptor::SYNTAX_PROTO3
+        || google::protobuf::internal::IsStructurallyValidUTF8(
+            reinterpret_cast<const char *>(value.data),
+            static_cast<int>(value.size));
+}
+
+
+bool wire_read_value(CodedInputStream& input,
+                     const uint8_t *base,
+                     WireFormatLite::WireType wire_type,
+                     wire_value *value)
+{
+    switch (wire_type) {
+    case WireFormatLite::WIRETYPE_VARINT:
+        return input.ReadVarint64(&value->bits);
+    case WireFormatLite::WIRETYPE_FIXED64:
+        return input.ReadLittleEndian64(&value->bits);
+    case WireFormatLite::WIRETYPE_FIXED32:
+    {
+        uint32_t bits;
+        if (!input.ReadLittleEndian32(&bits)) return false;
+        value->bits = bits;
+        return true;
+    }
+    case WireFormatLite::WIRETYPE_LENGTH_DELIMITED:
+    {
+        int length;
+        if (!input.ReadVarintSizeAsInt(&length)) return false;
+        value->data = base + input.CurrentPosition();
+        value->size = static_cast<size_t>(length);
+        return input.Skip(length);
+    }
+    default:
+        return false;
+    }
+}
+
+
+bool wire_skip_field(CodedInputStream& input, uint32_t tag)
+{
+    if (WireFormatLite::GetTagWireType(tag)
+        != WireFormatLite::WIRETYPE_LENGTH_DELIMITED)
+        return WireFormatLite::SkipField(&input, tag);
+    int length;
+    return input.ReadVarintSizeAsInt(&length) && input.Skip(length);
+}
+
+
+/// Finds the member of a oneof that a tag sets, if any. A value with the wrong
+/// wire type is an unknown field, which sets nothing. Returns false if that
+/// depends on the value, which is dropped if it is undefined in a closed enum.
+static bool oneof_member_set(const Descriptor *type,
+                             uint32_t tag,
+                             const FieldDescriptor **member)
+{
+    *member = nullptr;
+    const FieldDescriptor *field = type->FindFieldByNumber(
+        WireFormatLite::GetTagFieldNumber(tag));
+    if (!field || !field->real_containing_oneof()
+        || WireFormatLite::GetTagWireType(tag)
+               != WireFormatLite::WireTypeForFieldType(
+                   static_cast<WireFormatLite::FieldType>(field->type())))
+        return true;
+    if (field->type() == FieldDescriptor::TYPE_ENUM
+        && field->enum_type()->file()->syntax()
+               != FileDescriptor::SYNTAX_PROTO3)
+        return false;
+    *member = field;
+    return true;
+}
+
+
+/// Scans the elements of a repeated field, which may be split across any mix
+/// of packed and unpacked encodings. Stops at the element with the target
+/// index, or counts all elements if target is negative.
+static wire_status scan_repeated(const FieldDescriptor *field,
+                                 const uint8_t *data,
+                                 int size,
+                                 int target,
+                                 int *count,
+                                 wire_value *value)
+{
+    WireFormatLite::WireType wire_type =
+        WireFormatLite::WireTypeForFieldType(
+            static_cast<WireFormatLite::FieldType>(field->type()));
+    bool packable = field->is_packable();
+
+    CodedInputStream input(data, size);
+    *count = 0;
+    while (uint32_t tag = input.ReadTag()) {
+        int number = WireFormatLite::GetTagFieldNumber(tag);
+        WireFormatLite::WireType tag_type =
+            WireFormatLite::GetTagWireType(tag);
+
+        if (number == field->number() && tag_type == wire_type) {
+            if (!wire_read_value(input, data, wire_type, value))
+                return WIRE_FALLBACK;
+            if (!wire_accepts_value(field, value->bits))
+                continue;
+            if (*count == target)
+                return WIRE_FOUND;
+            (*count) ++;
+        } else if (number == field->number() && packable
+                   && tag_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+            wire_value packed;
+            if (!wire_read_value(input, data, tag_type, &packed))
+                return WIRE_FALLBACK;
+
+            // Fixed-width elements can be counted without decoding them
+            int width = wire_type == WireFormatLite::WIRETYPE_FIXED32 ? 4
+                : wire_type == WireFormatLite::WIRETYPE_FIXED64 ? 8 : 0;
+            if (width && packed.size % width != 0)
+                return WIRE_FALLBACK;
+            if (width && (target < *count
+                          || target - *count >= (int)(packed.size / width))) {
+                *count += packed.size / width;
+                continue;
+            }
+
+            CodedInputStream elements(packed.data,
+                static_cast<int>(packed.size));
+            while (elements.BytesUntilLimit() > 0) {
+                if (!wire_read_value(elements, packed.data, wire_type, value))
+                    return WIRE_FALLBACK;
+                if (!wire_accepts_value(field, value->bits))
+                    continue;
+                if (*count == target)
+                    return WIRE_FOUND;
+                (*count) ++;
+            }
+        } else if (!wire_skip_field(input, tag)) {
+            return WIRE_FALLBACK;
+        }
+    }
+
+    if (!input.ConsumedEntireMessage() || input.CurrentPosition() != size)
+        return WIRE_FALLBACK;
+    return WIRE_NULL;
+}
+
+
+/// Finds the last value of a non-repeated field, which is the one the parser
+/// keeps, taking into account other members of its oneof that override it
+static wire_status scan_singular(const FieldDescriptor *field,
+                                 const uint8_t *data,
+                                 int size,
+                                 wire_value *value)
+{
+    WireFormatLite::WireType wire_type =
+        WireFormatLite::WireTypeForFieldType(
+            static_cast<WireFormatLite::FieldType>(field->type()));
+    const OneofDescriptor *oneof = field->real_containing_oneof();
+    bool is_message =
+        field->cpp_type() == FieldDescriptor::CppType::CPPTYPE_MESSAGE;
+
+    CodedInputStream input(data, size);
+    int occurrences = 0;
+    int oneof_case = 0;
+    while (uint32_t tag = input.ReadTag()) {
+        int number = WireFormatLite::GetTagFieldNumber(tag);
+        WireFormatLite::WireType tag_type =
+            WireFormatLite::GetTagWireType(tag);
+
+        if (number == field->number() && tag_type == wire_type) {
+            wire_value candidate = wire_value();
+            if (!wire_read_value(input, data, wire_type, &candidate))
+                return WIRE_FALLBACK;
+            if (!wire_accepts_value(field, candidate.bits))
+                continue;
+
+            // Repeated occurrences of a message field are merged together
+            if (is_message && occurrences > 0)
+                return WIRE_FALLBACK;
+            *value = candidate;
+            occurrences ++;
+            oneof_case = number;
+            continue;
+        }
+
+        // Setting another member of the oneof clears this field
+        if (oneof) {
+            const FieldDescriptor *other;
+            if (!oneof_member_set(field->containing_type(), tag, &other))
+                return WIRE_FALLBACK;
+            if (other && other != field
+                && other->real_containing_oneof() == oneof)
+                oneof_case = number;
+        }
+
+        if (!wire_skip_field(input, tag))
+            return WIRE_FALLBACK;
+    }
+
+    if (!input.ConsumedEntireMessage() || input.CurrentPosition() != size)
+        return WIRE_FALLBACK;
+    if (occurrences == 0 || (oneof && oneof_case != field->number()))
+        return is_message ? WIRE_NULL : WIRE_DEFAULT;
+    return WIRE_FOUND;
+}
+
+
+/// Scans the occurrences of a field in a message without knowing its type. The
+/// message may be split across segments that are merged together. Only
+/// occurrences of the given wire type are counted, and the elements of packed
+/// runs if the field is packable; a negative wire type counts every occurrence
+/// except groups. Stops at the occurrence with the target index, or counts
+/// them all if target is negative, leaving the last one in value and adding
+/// each one to all if it is given.
+static wire_status scan_raw(const wire_value *segments,
+                            size_t segment_count,
+                            int number,
+                            int wire_type,
+                            bool packable,
+                            int target,
+                            int *count,
+                            wire_value *value,
+                            WireFormatLite::WireType *value_type,
+                            std::vector<wire_value> *all)
+{
+    int width = wire_type == WireFormatLite::WIRETYPE_FIXED32 ? 4
+        : wire_type == WireFormatLite::WIRETYPE_FIXED64 ? 8 : 0;
+
+    *count = 0;
+    for (size_t i = 0; i < segment_count; i ++) {
+        const wire_value& segment = segments[i];
+        CodedInputStream input(segment.data, static_cast<int>(segment.size));
+        while (uint32_t tag = input.ReadTag()) {
+            WireFormatLite::WireType tag_type =
+                WireFormatLite::GetTagWireType(tag);
+            if (WireFormatLite::GetTagFieldNumber(tag) != number
+                || tag_type == WireFormatLite::WIRETYPE_START_GROUP
+                || (wire_type >= 0 && tag_type != wire_type
+                    && !(packable && tag_type
+                         == WireFormatLite::WIRETYPE_LENGTH_DELIMITED))) {
+                if (!wire_skip_field(input, tag))
+                    return WIRE_FALLBACK;
+                continue;
+            }
+
+            wire_value found = wire_value();
+            if (!wire_read_value(input, segment.data, tag_type, &found))
+                return WIRE_FALLBACK;
+            if (wire_type < 0 || tag_type == wire_type) {
+                *value = found;
+                *value_type = tag_type;
+                if (all)
+                    all->push_back(found);
+                if (*count == target)
+                    return WIRE_FOUND;
+                (*count) ++;
+                continue;
+            }
+
+            // Fixed-width elements of a packed run can be counted without
+            // decoding them
+            if (width && found.size % width != 0)
+                return WIRE_FALLBACK;
+            if (width && target >= 0
+                && target - *count >= (int)(found.size / width)) {
+                *count += found.size / width;
+                continue;
+            }
+            CodedInputStream elements(found.data,
+                static_cast<int>(found.size));
+            while (elements.BytesUntilLimit() > 0) {
+                if (!wire_read_value(elements, found.data,
+                        static_cast<WireFormatLite::WireType>(wire_type),
+                        value))
+                    return WIRE_FALLBACK;
+                *value_type = static_cast<WireFormatLite::WireType>(wire_type);
+                if (*count == target)
+                    return WIRE_FOUND;
+                (*count) ++;
+            }
+        }
+        if (!input.ConsumedEntireMessage()
+            || input.CurrentPosition() != static_cast<int>(segment.size))
+            return WIRE_FALLBACK;
+    }
+    return WIRE_NULL;
+}
+
+
+wire_status wire_find_raw(const raw_path& path,
+                          const uint8_t *data,
+                          size_t size,
+                          wire_value *value,
+                          WireFormatLite::WireType *wire_type,
+                          std::string *merged)
+{
+    if (size > INT_MAX)
+        return WIRE_FALLBACK;
+
+    // Start with the entire message as the current value. A message that
+    // occurs several times is made of all of them, which are kept in parts.
+    wire_value current = wire_value();
+    current.data = data;
+    current.size = size;
+    std::vector<wire_value> parts;
+    const wire_value *segments = &current;
+    size_t segment_count = 1;
+    *wire_type = WireFormatLite::WIRETYPE_LENGTH_DELIMITED;
+
+    for (size_t i = 0; i < path.steps.size(); i ++) {
+        const raw_step& step = path.steps[i];
+        bool last = i + 1 == path.steps.size();
+
+        // The hint says how to read the last field; the others are messages
+        int type = WireFormatLite::WIRETYPE_LENGTH_DELIMITED;
+        bool packable = false;
+        bool message = !last;
+        if (last && !path.has_hint) {
+            type = -1;
+        } else if (last) {
+            type = WireFormatLite::WireTypeForFieldType(
+                static_cast<WireFormatLite::FieldType>(path.hint_type));
+            packable = type != WireFormatLite::WIRETYPE_LENGTH_DELIMITED;
+            message = path.hint_type == FieldDescriptor::TYPE_MESSAGE;
+        }
+
+        int count;
+        wire_status status;
+        if (message && !step.has_index) {
+            std::vector<wire_value> found;
+            status = scan_raw(segments, segment_count, step.number, type,
+                packable, -1, &count, value, wire_type, &found);
+            if (status != WIRE_NULL)
+                return status;
+            if (found.empty())
+                return WIRE_NULL;
+            parts.swap(found);
+            segments = parts.data();
+            segment_count = parts.size();
+            continue;
+        }
+
+        // Negative indexes need the number of occurrences first, and without
+        // an index the last one is selected
+        int index = step.index;
+        if (!step.has_index || index < 0) {
+            status = scan_raw(segments, segment_count, step.number, type,
+                packable, -1, &count, value, wire_type, nullptr);
+            if (status != WIRE_NULL)
+                return status;
+            if (count == 0)
+                return WIRE_NULL;
+            index = step.has_index ? index + count : count - 1;
+            if (index < 0)
+                return WIRE_NULL;
+        }
+        if (step.has_index) {
+            status = scan_raw(segments, segment_count, step.number, type,
+                packable, index, &count, value, wire_type, nullptr);
+            if (status != WIRE_FOUND)
+                return status;
+        }
+        current = *value;
+        segments = &current;
+        segment_count = 1;
+    }
+
+    // The occurrences of a message at the end are merged by concatenating them
+    if (segment_count > 1) {
+        merged->clear();
+        for (size_t i = 0; i < segment_count; i ++)
+            merged->append(reinterpret_cast<const char *>(segments[i].data),
+                segments[i].size);
+        value->data = reinterpret_cast<const uint8_t *>(merged->data());
+        value->size = merged->size();
+    } else {
+        *value = segments[0];
+    }
+    return WIRE_FOUND;
+}
+
+
+/// Follows the first count elements of a path from the root of the message
+static wire_status find_elements(const compiled_path& path,
+                                 size_t count,
+                                 const uint8_t *data,
+                                 size_t size,
+                                 wire_value *value)
+{
+    if (size > INT_MAX)
+        return WIRE_FALLBACK;
+
+    // Start with the entire message as the current value
+    value->data = data;
+    value->size = size;
+
+    for (size_t i = 0; i < count; i ++) {
+        const path_element& element = path.elements[i];
+        const FieldDescriptor *field = element.field;
+        const uint8_t *message = value->data;
+        int message_size = static_cast<int>(value->size);
+
+        wire_status status;
+        if (!field->is_repeated()) {
+            status = scan_singular(field, message, message_size, value);
+        } else {
+            // Negative indexes need the number of elements first
+            int index = element.index;
+            int count;
+            if (index < 0) {
+                status = scan_repeated(field, message, message_size, -1,
+                    &count, value);
+                if (status != WIRE_NULL)
+                    return status;
+                index += count;
+                if (index < 0)
+                    return WIRE_NULL;
+            }
+            status = scan_repeated(field, message, message_size, index,
+                &count, value);
+        }
+
+        if (status != WIRE_FOUND)
+            return status;
+    }
+
+    return WIRE_FOUND;
+}
+
+
+wire_status wire_find(const compiled_path& path,
+                      const uint8_t *data,
+                      size_t size,
+                      wire_value *value)
+{
+    wire_status status = find_elements(path, path.elements.size(), data, size,
+        value);
+    if (status != WIRE_FOUND)
+        return status;
+
+    // Parsing fails on invalid UTF-8 in proto3 strings, so let reflection
+    // report the error
+    if (!wire_accepts_string(path.elements.back().field, *value))
+        return WIRE_FALLBACK;
+    return WIRE_FOUND;
+}
+
+
+wire_status wire_find_container(const compiled_path& path,
+                                const uint8_t *data,
+                                size_t size,
+                                wire_value *value)
+{
+    return find_elements(path, path.elements.size() - 1, data, size, value);
+}
+
+
+wire_iterator::wire_iterator(const FieldDescriptor *field,
+                             const uint8_t *data,
+                             size_t size)
+    : field(field), data(data), size(size), offset(0),
+      packed(nullptr), packed_size(0)
+{
+}
+
+
+wire_status wire_iterator::next(wire_value *value)
+{
+    WireFormatLite::WireType wire_type =
+        WireFormatLite::WireTypeForFieldType(
+            static_cast<WireFormatLite::FieldType>(field->type()));
+
+    for (;;) {
+        // Finish the packed run before reading any more tags
+        while (packed_size > 0) {
+            CodedInputStream elements(packed, static_cast<int>(packed_size));
+            if (!wire_read_value(elements, packed, wire_type, value))
+                return WIRE_FALLBACK;
+            packed += elements.CurrentPosition();
+            packed_size -= elements.CurrentPosition();
+            if (wire_accepts_value(field, value->bits))
+                return WIRE_FOUND;
+        }
+
+        bool run;
+        wire_status status = next_run(value, &run);
+        if (status != WIRE_FOUND || !run)
+            return status;
+        packed = value->data;
+        packed_size = value->size;
+    }
+}
+
+
+wire_status wire_iterator::next_run(wire_value *value, bool *run)
+{
+    if (size > INT_MAX)
+        return WIRE_FALLBACK;
+
+    // Hand over the rest of a packed run that next has started
+    if (packed_size > 0) {
+        value->data = packed;
+        value->size = packed_size;
+        packed_size = 0;
+        *run = true;
+        return WIRE_FOUND;
+    }
+
+    WireFormatLite::WireType wire_type =
+        WireFormatLite::WireTypeForFieldType(
+            static_cast<WireFormatLite::FieldType>(field->type()));
+
+    const uint8_t *base = data + offset;
+    int remaining = static_cast<int>(size - offset);
+    CodedInputStream input(base, remaining);
+    while (uint32_t tag = input.ReadTag()) {
+        int number = WireFormatLite::GetTagFieldNumber(tag);
+        WireFormatLite::WireType tag_type = WireFormatLite::GetTagWireType(tag);
+
+        if (number == field->number() && tag_type == wire_type) {
+            if (!wire_read_value(input, base, wire_type, value))
+                return WIRE_FALLBACK;
+            if (!wire_accepts_value(field, value->bits))
+                continue;
+            if (!wire_accepts_string(field, *value))
+                return WIRE_FALLBACK;
+            offset += input.CurrentPosition();
+            *run = false;
+            return WIRE_FOUND;
+        } else if (number == field->number() && field->is_packable()
+                   && tag_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+            if (!wire_read_value(input, base, tag_type, value))
+                return WIRE_FALLBACK;
+            offset += input.CurrentPosition();
+            *run = true;
+            return WIRE_FOUND;
+        } else if (!wire_skip_field(input, tag)) {
+            return WIRE_FALLBACK;
+        }
+    }
+
+    if (!input.ConsumedEntireMessage() || input.CurrentPosition() != remaining)
+        return WIRE_FALLBACK;
+    offset = size;
+    return WIRE_NULL;
+}
+
+
+wire_scan::wire_scan(const std::vector<const compiled_path *>& paths)
+    : next(0)
+{
+    nodes.push_back(node());
+    nodes[0].field = nullptr;
+    nodes[0].number = 0;
+    nodes[0].index = 0;
+    nodes[0].oneofs = false;
+
+    // Paths that share a prefix share the nodes along it
+    for (const compiled_path *path : paths) {
+        size_t n = 0;
+        for (const path_element& element : path->elements) {
+            size_t child = 0;
+            for (size_t c : nodes[n].children) {
+                if (nodes[c].field == element.field
+                    && nodes[c].index == element.index) {
+                    child = c;
+                    break;
+                }
+            }
+            if (!child) {
+                child = nodes.size();
+                nodes.push_back(node());
+                nodes[child].field = element.field;
+                nodes[child].number = element.field->number();
+                nodes[child].index = element.index;
+                nodes[child].oneofs = false;
+                nodes[n].children.push_back(child);
+                if (element.field->real_containing_oneof())
+                    nodes[n].oneofs = true;
+            }
+            n = child;
+        }
+        leaves.push_back(n);
+    }
+}
+
+
+void wire_scan::start(const uint8_t *data, size_t size)
+{
+    for (node& n : nodes)
+        n.decided = false;
+    next = 0;
+
+    if (size > INT_MAX) {
+        decide(0, WIRE_FALLBACK);
+        return;
+    }
+    nodes[0].value.data = data;
+    nodes[0].value.size = size;
+    decide(0, WIRE_FOUND);
+}
+
+
+/// Settles the status of a node. If it has no value, neither do the nodes
+/// below it.
+void wire_scan::decide(size_t n, wire_status status)
+{
+    nodes[n].decided = true;
+    nodes[n].status = status;
+    if (status == WIRE_FOUND)
+        return;
+    for (size_t c : nodes[n].children)
+        decide(c, status == WIRE_FALLBACK ? WIRE_FALLBACK : WIRE_NULL);
+}
+
+
+/// Returns a mask of the numbers below 64 of the fields that the undecided
+/// children of a node select
+uint64_t wire_scan::wanted_fields(const node& parent) const
+{
+    uint64_t wanted = 0;
+    for (size_t c : parent.children)
+        if (!nodes[c].decided && nodes[c].number < 64)
+            wanted |= uint64_t(1) << nodes[c].number;
+    return wanted;
+}
+
+
+/// Gives one value of a field, in the order the parser would see it, to the
+/// children that select that field. Returns the number of them it decides,
+/// and updates the mask of wanted fields if it decides any.
+size_t wire_scan::feed(const node& parent,
+                       const FieldDescriptor *field,
+                       const wire_value& value,
+                       uint64_t *wanted)
+{
+    size_t decided = 0;
+    for (size_t c : parent.children) {
+        node& child = nodes[c];
+        if (child.field != field || child.decided)
+            continue;
+
+        if (field->is_repeated()) {
+            if (child.index < 0) {
+                child.elements.push_back(value);
+            } else if (child.count ++ == child.index) {
+                child.value = value;
+                child.decided = true;
+                child.status = wire_accepts_string(field, value)
+                    ? WIRE_FOUND : WIRE_FALLBACK;
+                decided ++;
+            }
+            continue;
+        }
+
+        // Repeated occurrences of a message field are merged together
+        if (field->cpp_type() == FieldDescriptor::CppType::CPPTYPE_MESSAGE
+            && child.occurrences > 0) {
+            child.decided = true;
+            child.status = WIRE_FALLBACK;
+            decided ++;
+            continue;
+        }
+        child.value = value;
+        child.occurrences ++;
+        child.oneof_case = field->number();
+    }
+
+    if (decided)
+        *wanted = wanted_fields(parent);
+    return decided;
+}
+
+
+/// Settles a child's status once the whole message has been scanned
+void wire_scan::finish(node& child)
+{
+    bool is_message =
+        child.field->cpp_type() == FieldDescriptor::CppType::CPPTYPE_MESSAGE;
+    wire_status status = WIRE_NULL;
+    if (child.field->is_repeated()) {
+        int index = child.index + static_cast<int>(child.elements.size());
+        if (child.index < 0 && index >= 0) {
+            child.value = child.elements[index];
+            status = WIRE_FOUND;
+        }
+    } else if (child.occurrences == 0
+               || (child.field->real_containing_oneof()
+                   && child.oneof_case != child.field->number())) {
+        status = is_message ? WIRE_NULL : WIRE_DEFAULT;
+    } else {
+        status = WIRE_FOUND;
+    }
+
+    if (status == WIRE_FOUND && !wire_accepts_string(child.field,
+                                                       child.value))
+        status = WIRE_FALLBACK;
+    child.decided = true;
+    child.status = status;
+}
+
+
+bool wire_scan::step()
+{
+    // A node's parent comes before it, so it is decided by the time it is
+    // reached
+    while (next < nodes.size()) {
+        const node& parent = nodes[next ++];
+        if (parent.status != WIRE_FOUND || parent.children.empty())
+            continue;
+
+        for (size_t c : parent.children) {
+            nodes[c].count = 0;
+            nodes[c].occurrences = 0;
+            nodes[c].oneof_case = 0;
+            nodes[c].elements.clear();
+        }
+
+        const uint8_t *data = parent.value.data;
+        int size = static_cast<int>(parent.value.size);
+        const Descriptor *descriptor =
+            nodes[parent.children[0]].field->containing_type();
+        CodedInputStream input(data, size);
+        size_t pending = parent.children.size();
+
+        // Keep these out of memory that the loop writes to
+        const size_t *children = parent.children.data();
+        size_t child_count = parent.children.size();
+        const node *base = nodes.data();
+        bool oneofs = parent.oneofs;
+        uint64_t wanted = wanted_fields(parent);
+        bool malformed = false;
+        while (pending > 0 && !malformed) {
+            uint32_t tag = input.ReadTag();
+            if (!tag) break;
+            int number = WireFormatLite::GetTagFieldNumber(tag);
+            WireFormatLite::WireType tag_type =
+                WireFormatLite::GetTagWireType(tag);
+
+            // Setting another member of a oneof clears the field
+            if (oneofs) {
+                const FieldDescriptor *other;
+                if (!oneof_member_set(descriptor, tag, &other)) {
+                    malformed = true;
+                    break;
+                }
+                const OneofDescriptor *oneof =
+                    other ? other->real_containing_oneof() : nullptr;
+                for (size_t c : parent.children)
+                    if (oneof && nodes[c].field != other
+                        && nodes[c].field->real_containing_oneof() == oneof)
+                        nodes[c].oneof_case = number;
+            }
+
+            // Only read the value if a path still needs it
+            const FieldDescriptor *field = nullptr;
+            if (number >= 64 || (wanted & (uint64_t(1) << number))) {
+                for (size_t i = 0; i < child_count; i ++) {
+                    const node& child = base[children[i]];
+                    if (child.number == number && !child.decided) {
+                        field = child.field;
+                        break;
+                    }
+                }
+            }
+            if (!field) {
+                malformed = !wire_skip_field(input, tag);
+                continue;
+            }
+
+            WireFormatLite::WireType wire_type =
+                WireFormatLite::WireTypeForFieldType(
+                    static_cast<WireFormatLite::FieldType>(field->type()));
+            if (tag_type == wire_type) {
+                wire_value value = wire_value();
+                if (!wire_read_value(input, data, wire_type, &value))
+                    malformed = true;
+                else if (wire_accepts_value(field, value.bits))
+                    pending -= feed(parent, field, value, &wanted);
+            } else if (field->is_packable()
+                       && tag_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+                wire_value run;
+                if (!wire_read_value(input, data, tag_type, &run)) {
+                    malformed = true;
+                    break;
+                }
+                CodedInputStream elements(run.data,
+                    static_cast<int>(run.size));
+                while (elements.BytesUntilLimit() > 0) {
+                    wire_value value = wire_value();
+                    if (!wire_read_value(elements, run.data, wire_type,
+                                         &value)) {
+                        malformed = true;
+                        break;
+                    }
+                    if (wire_accepts_value(field, value.bits))
+                        pending -= feed(parent, field, value, &wanted);
+                }
+            } else {
+                malformed = !wire_skip_field(input, tag);
+            }
+        }
+
+        // Stop once every element that is needed has been found
+        if (pending > 0 && (malformed || !input.ConsumedEntireMessage()
+                            || input.CurrentPosition() != size))
+            malformed = true;
+        for (size_t c : parent.children) {
+            if (!nodes[c].decided && malformed)
+                decide(c, WIRE_FALLBACK);
+            else if (!nodes[c].decided)
+                finish(nodes[c]);
+            if (nodes[c].status != WIRE_FOUND)
+                decide(c, nodes[c].status);
+        }
+        return true;
+    }
+    return false;
+}
+
+
+bool wire_scan::decided(size_t i) const
+{
+    return nodes[leaves[i]].decided;
+}
+
+
+wire_status wire_scan::status(size_t i) const
+{
+    return nodes[leaves[i]].status;
+}
+
+
+const wire_value& wire_scan::value(size_t i) const
+{
+    return nodes[leaves[i]].value;
+}
+
+
+void wire_append_varint(std::string *output, uint64_t value)
+{
+    while (value >= 0x80) {
+        output->push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    output->push_back(static_cast<char>(value));
+}
+
+
+/// Appends a field's tag followed by one encoded element
+static void append_field(std::string *output,
+                         const FieldDescriptor *field,
+                         WireFormatLite::WireType wire_type,
+                         const char *element,
+                         size_t size)
+{
+    wire_append_varint(output,
+        WireFormatLite::MakeTag(field->number(), wire_type));
+    output->append(element, size);
+}
+
+
+/// Appends a length-delimited field
+static void append_message(std::string *output,
+                           const FieldDescriptor *field,
+                           const std::string& message)
+{
+    wire_append_varint(output, WireFormatLite::MakeTag(field->number(),
+        WireFormatLite::WIRETYPE_LENGTH_DELIMITED));
+    wire_append_varint(output, message.size());
+    output->append(message);
+}
+
+
+static wire_edit_status edit_message(const compiled_path& path,
+                                     size_t depth,
+                                     const uint8_t *data,
+                                     int size,
+                                     const std::string *element,
+                                     std::string *output);
+
+
+/// Edits a non-repeated field. Every occurrence of the field is dropped and
+/// the new value is written where the first one was, or at the end. When
+/// setting it, other members of its oneof are dropped too.
+static wire_edit_status edit_singular(const compiled_path& path,
+                                      size_t depth,
+                                      const uint8_t *data,
+                                      int size,
+                                      const std::string *element,
+                                      std::string *output)
+{
+    const FieldDescriptor *field = path.elements[depth].field;
+    const OneofDescriptor *oneof = field->real_containing_oneof();
+    bool last = depth + 1 == path.elements.size();
+    WireFormatLite::WireType wire_type =
+        WireFormatLite::WireTypeForFieldType(
+            static_cast<WireFormatLite::FieldType>(field->type()));
+
+    // Occurrences of a message field are merged by concatenating them
+    std::string merged;
+    bool present = false;
+    size_t first = std::string::npos;
+
+    CodedInputStream input(data, size);
+    int copied = 0;
+    for (;;) {
+        int start = input.CurrentPosition();
+        uint32_t tag = input.ReadTag();
+        if (!tag) break;
+        int number = WireFormatLite::GetTagFieldNumber(tag);
+        WireFormatLite::WireType tag_type =
+            WireFormatLite::GetTagWireType(tag);
+
+        bool drop = false;
+        if (number == field->number() && tag_type == wire_type) {
+            wire_value value;
+            if (!wire_read_value(input, data, wire_type, &value))
+                return EDIT_MALFORMED;
+            drop = true;
+            present = true;
+            if (!last)
+                merged.append(reinterpret_cast<const char *>(value.data),
+                    value.size);
+        } else {
+            // A later member of the same oneof clears the field
+            const FieldDescriptor *other = oneof
+                ? field->containing_type()->FindFieldByNumber(number)
+                : nullptr;
+            if (other && other->real_containing_oneof() == oneof) {
+                present = false;
+                merged.clear();
+                drop = element != nullptr;
+            }
+            if (!wire_skip_field(input, tag))
+                return EDIT_MALFORMED;
+        }
+
+        if (drop) {
+            output->append(reinterpret_cast<const char *>(data + copied),
+                start - copied);
+            copied = input.CurrentPosition();
+
+            // A new value for the last field can be written right away
+            if (first == std::string::npos) {
+                first = output->size();
+                if (last && element)
+                    append_field(output, field, wire_type, element->data(),
+                        element->size());
+            }
+        }
+    }
+    if (!input.ConsumedEntireMessage() || input.CurrentPosition() != size)
+        return EDIT_MALFORMED;
+    output->append(reinterpret_cast<const char *>(data + copied),
+        size - copied);
+
+    if (last) {
+        if (!element)
+            return present ? EDIT_DONE : EDIT_NOT_FOUND;
+        if (first == std::string::npos)
+            append_field(output, field, wire_type, element->data(),
+                element->size());
+        return EDIT_DONE;
+    }
+
+    // Nothing can be removed from a message that is not present
+    if (!present && !element)
+        return EDIT_NOT_FOUND;
+
+    std::string message;
+    wire_edit_status status = edit_message(path, depth + 1,
+        reinterpret_cast<const uint8_t *>(merged.data()),
+        static_cast<int>(merged.size()), element, &message);
+    if (status != EDIT_DONE)
+        return status;
+
+    std::string field_bytes;
+    append_message(&field_bytes, field, message);
+    if (first == std::string::npos)
+        output->append(field_bytes);
+    else
+        output->insert(first, field_bytes);
+    return EDIT_DONE;
+}
+
+
+/// Edits one element of a repeated field, which may be in a packed run, or
+/// removes every element if the path has no index
+static wire_edit_status edit_repeated(const compiled_path& path,
+                                      size_t depth,
+                                      const uint8_t *data,
+                                      int size,
+                                      const std::string *element,
+                                      std::string *output)
+{
+    const path_element& path_element = path.elements[depth];
+    const FieldDescriptor *field = path_element.field;
+    bool last = depth + 1 == path.elements.size();
+    bool all = last && path.all_elements;
+    WireFormatLite::WireType wire_type =
+        WireFormatLite::WireTypeForFieldType(
+            static_cast<WireFormatLite::FieldType>(field->type()));
+
+    // Negative indexes need the number of elements first
+    int index = path_element.index;
+    if (!all && index < 0) {
+        int count;
+        wire_value value;
+        if (scan_repeated(field, data, size, -1, &count, &value) != WIRE_NULL)
+            return EDIT_MALFORMED;
+        index += count;
+        if (index < 0)
+            return EDIT_NOT_FOUND;
+    }
+
+    CodedInputStream input(data, size);
+    int copied = 0;
+    int count = 0;
+    for (;;) {
+        int start = input.CurrentPosition();
+        uint32_t tag = input.ReadTag();
+        if (!tag) break;
+        int number = WireFormatLite::GetTagFieldNumber(tag);
+        WireFormatLite::WireType tag_type =
+            WireFormatLite::GetTagWireType(tag);
+
+        if (number == field->number() && tag_type == wire_type) {
+            wire_value value;
+            if (!wire_read_value(input, data, wire_type, &value))
+                return EDIT_MALFORMED;
+            if (!all && (!wire_accepts_value(field, value.bits)
+                         || count ++ != index))
+                continue;
+
+            output->append(reinterpret_cast<const char *>(data + copied),
+                start - copied);
+            copied = input.CurrentPosition();
+            if (all)
+                continue;
+
+            // Replace or remove this element, or edit the message it holds
+            if (!last) {
+                std::string message;
+                wire_edit_status status = edit_message(path, depth + 1,
+                    value.data, static_cast<int>(value.size), element,
+                    &message);
+                if (status != EDIT_DONE)
+                    return status;
+                append_message(output, field, message);
+            } else if (element) {
+                append_field(output, field, wire_type, element->data(),
+                    element->size());
+            }
+            output->append(reinterpret_cast<const char *>(data + copied),
+                size - copied);
+            return EDIT_DONE;
+        } else if (number == field->number() && field->is_packable()
+                   && tag_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+            wire_value run;
+            if (!wire_read_value(input, data, tag_type, &run))
+                return EDIT_MALFORMED;
+            if (all) {
+                output->append(reinterpret_cast<const char *>(data + copied),
+                    start - copied);
+                copied = input.CurrentPosition();
+                continue;
+            }
+
+            // Look for the element in the run
+            CodedInputStream elements(run.data, static_cast<int>(run.size));
+            int element_start = -1, element_end = -1;
+            while (elements.BytesUntilLimit() > 0) {
+                int position = elements.CurrentPosition();
+                wire_value value;
+                if (!wire_read_value(elements, run.data, wire_type, &value))
+                    return EDIT_MALFORMED;
+                if (!wire_accepts_value(field, value.bits) || count ++ != index)
+                    continue;
+                element_start = position;
+                element_end = elements.CurrentPosition();
+                break;
+            }
+            if (element_start < 0)
+                continue;
+
+            // Write the run again with the element replaced or removed
+            std::string elements_bytes(
+                reinterpret_cast<const char *>(run.data), element_start);
+            if (element)
+                elements_bytes.append(*element);
+            elements_bytes.append(
+                reinterpret_cast<const char *>(run.data + element_end),
+                run.size - element_end);
+
+            output->append(reinterpret_cast<const char *>(data + copied),
+                start - copied);
+            if (!elements_bytes.empty())
+                append_message(output, field, elements_bytes);
+            copied = input.CurrentPosition();
+            output->append(reinterpret_cast<const char *>(data + copied),
+                size - copied);
+            return EDIT_DONE;
+        } else if (!wire_skip_field(input, tag)) {
+            return EDIT_MALFORMED;
+        }
+    }
+    if (!input.ConsumedEntireMessage() || input.CurrentPosition() != size)
+        return EDIT_MALFORMED;
+    output->append(reinterpret_cast<const char *>(data + copied),
+        size - copied);
+
+    // When removing every element, there may have been none
+    if (all && copied > 0)
+        return EDIT_DONE;
+    return EDIT_NOT_FOUND;
+}
+
+
+/// Edits the message selected by the first depth elements of the path
+static wire_edit_status edit_message(const compiled_path& path,
+                                     size_t depth,
+                                     const uint8_t *data,
+                                     int size,
+                                     const std::string *element,
+                                     std::string *output)
+{
+    if (path.elements[depth].field->is_repeated())
+        return edit_repeated(path, depth, data, size, element, output);
+    return edit_singular(path, depth, data, size, element, output);
+}
+
+
+wire_edit_status wire_edit(const compiled_path& path,
+                           const uint8_t *data,
+                           size_t size,
+                           const std::string *element,
+                           std::string *output)
+{
+    if (size > INT_MAX)
+        return EDIT_MALFORMED;
+    output->clear();
+    output->reserve(size + (element ? element->size() + 16 : 0));
+    return edit_message(path, 0, data, static_cast<int>(size), element,
+        output);
+}
+
+
+int64_t wire_decode_int(FieldDescriptor::Type type, uint64_t bits)
+{
+    switch (type) {
+    case FieldDescriptor::TYPE_INT32:
+    case FieldDescriptor::TYPE_SFIXED32:
+    case FieldDescriptor::TYPE_ENUM:
+        return static_cast<int32_t>(bits);
+    case FieldDescriptor::TYPE_UINT32:
+    case FieldDescriptor::TYPE_FIXED32:
+        return static_cast<uint32_t>(bits);
+    case FieldDescriptor::TYPE_SINT32:
+        return WireFormatLite::ZigZagDecode32(static_cast<uint32_t>(bits));
+    case FieldDescriptor::TYPE_SINT64:
+        return WireFormatLite::ZigZagDecode64(bits);
+    case FieldDescriptor::TYPE_BOOL:
+        return bits != 0;
+    default:
+        return static_cast<int64_t>(bits);
+    }
+}
+
+
+double wire_decode_double(FieldDescriptor::Type type, uint64_t bits)
+{
+    if (type == FieldDescriptor::TYPE_FLOAT) {
+        uint32_t narrow = static_cast<uint32_t>(bits);
+        float value;
+        memcpy(&value, &narrow, sizeof(value));
+        return value;
+    }
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
@@ -0,0 +1,262 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+
+struct compiled_path;
+struct raw_path;
+
+
+/// The outcome of looking up a path directly in the wire format
+enum wire_status {
+    /// The value of the last element of the path was found
+    WIRE_FOUND,
+    /// The last element of the path is a non-repeated field that is not
+    /// present, so it takes its default value
+    WIRE_DEFAULT,
+    /// An index was out of range, or a message on the path is not present
+    WIRE_NULL,
+    /// The message uses a feature the wire engine does not emulate, or is
+    /// malformed; use reflection to get the definitive answer
+    WIRE_FALLBACK,
+};
+
+
+/// A field value still in its wire encoding. Numeric values are in bits, as
+/// read from a varint or little-endian fixed-width field. Strings, bytes, and
+/// messages point into the original buffer.
+struct wire_value {
+    uint64_t bits;
+    const uint8_t *data;
+    size_t size;
+};
+
+
+/// Returns true if wire_find can follow the path, given a message that is
+/// known to parse. Map fields and groups cannot be followed.
+bool wire_can_follow_path(const compiled_path& path);
+
+
+/// Returns true if wire_find can evaluate the path. This is decided once when
+/// the path is compiled; the message type must not need anything that only a
+/// full parse can provide, such as checking for required fields.
+bool wire_supports_path(const compiled_path& path);
+
+
+/// Finds the value selected by a path in a serialized message, skipping over
+/// unrelated fields without decoding them. Parts of the message that are not
+/// on the path are not validated.
+wire_status wire_find(const compiled_path& path,
+                      const uint8_t *data,
+                      size_t size,
+                      wire_value *value);
+
+
+/// Finds the value selected by a path of field numbers, skipping over
+/// unrelated fields without knowing the message type. Occurrences of a field
+/// are counted if their wire type fits the hint, and with a numeric hint the
+/// elements of packed runs are counted too. Without an index, the last
+/// occurrence is selected, except that occurrences of a message are merged,
+/// as the parser would: those on the way are all searched, and if the hint
+/// is "message", the value is their concatenation, which is kept in merged.
+///
+/// Returns WIRE_FOUND and the wire type of the value, WIRE_NULL if there is no
+/// such occurrence, or WIRE_FALLBACK if the message is malformed.
+wire_status wire_find_raw(const raw_path& path,
+                          const uint8_t *data,
+                          size_t size,
+                          wire_value *value,
+                          google::protobuf::internal::WireFormatLite::WireType
+                              *wire_type,
+                          std::string *merged);
+
+
+/// Finds the message that contains the last element of a path, which is the
+/// whole message if the path has only one element. Returns WIRE_NULL if a
+/// message on the way is not present.
+wire_status wire_find_container(const compiled_path& path,
+                                const uint8_t *data,
+                                size_t size,
+                                wire_value *value);
+
+
+/// Reads the elements of a repeated field one at a time, in the order the
+/// parser would store them, across any mix of packed and unpacked encodings.
+/// The data must outlive the iterator.
+struct wire_iterator {
+    wire_iterator(const google::protobuf::FieldDescriptor *field,
+                  const uint8_t *data,
+                  size_t size);
+
+    /// Reads the next element. Returns WIRE_FOUND, WIRE_NULL if there are no
+    /// more elements, or WIRE_FALLBACK if the message is malformed.
+    wire_status next(wire_value *value);
+
+    /// Reads the next element, or the next packed run of elements as a whole,
+    /// and sets run to say which it is. The elements of a run are neither
+    /// decoded nor checked, so undefined values of closed enums are included.
+    wire_status next_run(wire_value *value, bool *run);
+
+private:
+    const google::protobuf::FieldDescriptor *field;
+    const uint8_t *data;
+    size_t size;
+    size_t offset;
+
+    // The rest of the packed run that is being read, if any
+    const uint8_t *packed;
+    size_t packed_size;
+};
+
+
+/// Finds the values selected by several paths in a single pass over a
+/// serialized message. The paths are merged into a tree in which each node is
+/// a message, or a value, reached by a common prefix of the paths, so fields
+/// shared by several paths are read once. Each step scans one message and
+/// settles the status of every field in it that is on a path.
+///
+/// A step may stop early once the elements it needs from repeated fields have
+/// been found, but a non-repeated field is not settled until the end of its
+/// message, since a later occurrence would override it. The paths and the data
+/// must outlive the scan.
+struct wire_scan {
+    explicit wire_scan(const std::vector<const compiled_path *>& paths);
+
+    /// Starts scanning a new message
+    void start(const uint8_t *data, size_t size);
+
+    /// Scans the next message on the paths. Returns false if there is nothing
+    /// left to scan, in which case every path is decided.
+    bool step();
+
+    /// Returns true if the value of the i-th path is known
+    bool decided(size_t i) const;
+
+    /// Returns the status and value of the i-th path, once it is decided
+    wire_status status(size_t i) const;
+    const wire_value& value(size_t i) const;
+
+private:
+    struct node {
+        /// The element that selects this node from its parent
+        const google::protobuf::FieldDescriptor *field;
+        int number;
+        int index;
+        std::vector<size_t> children;
+
+        /// True if any of the children is a member of a oneof
+        bool oneofs;
+
+        bool decided;
+        wire_status status;
+        wire_value value;
+
+        // While the parent is scanned: the number of elements seen of a
+        // repeated field, and the occurrences and oneof case of another field
+        int count;
+        int occurrences;
+        int oneof_case;
+        std::vector<wire_value> elements;
+    };
+
+    void decide(size_t n, wire_status status);
+    uint64_t wanted_fields(const node& parent) const;
+    size_t feed(const node& parent,
+                const google::protobuf::FieldDescriptor *field,
+                const wire_value& value,
+                uint64_t *wanted);
+    void finish(node& child);
+
+    std::vector<node> nodes;
+    std::vector<size_t> leaves;
+    size_t next;
+};
+
+
+/// The outcome of editing a serialized message
+enum wire_edit_status {
+    /// The message was edited
+    EDIT_DONE,
+    /// The path selects something that is not present, so there is nothing to
+    /// edit
+    EDIT_NOT_FOUND,
+    /// The message is malformed along the path
+    EDIT_MALFORMED,
+};
+
+
+/// Writes a copy of a serialized message to output in which the value selected
+/// by a path is replaced, or removed if element is NULL. The element is the
+/// encoding of one value without its tag: a varint, a fixed-width value, or a
+/// length-prefixed string. Messages on the path that are not present are
+/// created when setting a value.
+///
+/// Only the messages along the path are examined, and the rest of the bytes
+/// are copied as they are. Length prefixes of the enclosing messages are
+/// updated to match. If the path ends with a repeated field that has no index,
+/// removing it removes all of its elements.
+wire_edit_status wire_edit(const compiled_path& path,
+                           const uint8_t *data,
+                           size_t size,
+                           const std::string *element,
+                           std::string *output);
+
+
+/// Appends a value encoded as a varint
+void wire_append_varint(std::string *output, uint64_t value);
+
+
+/// Decodes the bits of a numeric wire_value according to the field type
+int64_t wire_decode_int(google::protobuf::FieldDescriptor::Type type,
+                        uint64_t bits);
+double wire_decode_double(google::protobuf::FieldDescriptor::Type type,
+                          uint64_t bits);
+
+inline int64_t wire_decode_int(const google::protobuf::FieldDescriptor *field,
+                               uint64_t bits)
+{
+    return wire_decode_int(field->type(), bits);
+}
+
+inline double wire_decode_double(
+    const google::protobuf::FieldDescriptor *field, uint64_t bits)
+{
+    return wire_decode_double(field->type(), bits);
+}
+
+
+/// Reads a single value of the given wire type. Length-delimited values are
+/// returned as a pointer into base, the buffer that the stream reads from.
+bool wire_read_value(google::protobuf::io::CodedInputStream& input,
+                     const uint8_t *base,
+                     google::protobuf::internal::WireFormatLite::WireType
+                         wire_type,
+                     wire_value *value);
+
+
+/// Skips over a field. Strings and messages, which are the most common fields
+/// to skip, are handled here rather than with a call into the library.
+bool wire_skip_field(google::protobuf::io::CodedInputStream& input,
+                     uint32_t tag);
+
+
+/// Returns true if the parser would store this value in the field. Values of
+/// closed (proto2) enums that are not defined are moved to the unknown fields.
+bool wire_accepts_value(const google::protobuf::FieldDescriptor *field,
+                        uint64_t bits);
+
+
+/// Returns false if the value is a string that the parser would reject, which
+/// makes the whole message fail to parse
+bool wire_accepts_string(const google::protobuf::FieldDescriptor *field,
+                         const wire_value& value);
+
+
+#endif
@@ -0,0 +1,224 @@
+#!/usr/bin/env python
+import random
+import unittest
+
+from utils import *
+
+
+def varint(value):
+  value &= (1 << 64) - 1
+  out = b''
+  while value >= 0x80:
+    out += bytes([value & 0x7f | 0x80])
+    value >>= 7
+  return out + bytes([value])
+
+
+class TestProtobufArray(SQLiteProtobufTestCase, unittest.TestCase):
+  __PROTOBUF__ = '''
+  syntax = "proto2";
+  message Sensor {
+    enum Kind {
+      LOW = 1;
+      HIGH = 2;
+    }
+
+    repeated double doubles = 1 [packed = true];
+    repeated float floats = 2 [packed = true];
+    repeated int32 int32s = 3 [packed = true];
+    repeated int64 int64s = 4 [packed = true];
+    repeated uint32 uint32s = 5 [packed = true];
+    repeated uint64 uint64s = 6 [packed = true];
+    repeated sint32 sint32s = 7 [packed = true];
+    repeated sint64 sint64s = 8 [packed = true];
+    repeated fixed32 fixed32s = 9 [packed = true];
+    repeated fixed64 fixed64s = 10 [packed = true];
+    repeated sfixed32 sfixed32s = 11 [packed = true];
+    repeated sfixed64 sfixed64s = 12 [packed = true];
+    repeated bool bools = 13 [packed = true];
+    repeated Kind kinds = 14 [packed = true];
+    repeated int32 unpacked = 15;
+    repeated Sensor children = 16;
+    optional Sensor child = 17;
+    optional string name = 18;
+  }
+  '''
+
+  FUNCTIONS = ('count', 'sum', 'min', 'max', 'avg')
+
+  # Random elements for each field. Real numbers are multiples of 1/4, so
+  # that they add up exactly in any order.
+  GENERATORS = {
+    'doubles': lambda r: r.randint(-4000, 4000) / 4,
+    'floats': lambda r: r.randint(-4000, 4000) / 4,
+    'int32s': lambda r: r.choice([r.randint(0, 100),
+                                  r.randint(-2**31, 2**31 - 1)]),
+    'int64s': lambda r: r.randint(-2**50, 2**50),
+    'uint32s': lambda r: r.choice([r.randint(0, 100),
+                                   r.randint(0, 2**32 - 1)]),
+    'uint64s': lambda r: r.randint(0, 2**50),
+    'sint32s': lambda r: r.choice([r.randint(-60, 60),
+                                   r.randint(-2**31, 2**31 - 1)]),
+    'sint64s': lambda r: r.randint(-2**50, 2**50),
+    'fixed32s': lambda r: r.randint(0, 2**32 - 1),
+    'fixed64s': lambda r: r.randint(0, 2**50),
+    'sfixed32s': lambda r: r.randint(-2**31, 2**31 - 1),
+    'sfixed64s': lambda r: r.randint(-2**50, 2**50),
+    'bools': lambda r: r.random() < 0.5,
+    'kinds': lambda r: r.choice([1, 2]),
+    'unpacked': lambda r: r.randint(-1000, 1000),
+  }
+
+  def query(self, sql, args=()):
+    c = self.db.cursor()
+    c.execute(sql, args)
+    return c.fetchall()
+
+  def array(self, function, data, path):
+    if hasattr(data, 'SerializeToString'):
+      data = data.SerializeToString()
+    return self.query('SELECT protobuf_array_%s(?, ?, ?)' % function,
+      (data, 'Sensor', path))[0][0]
+
+  def aggregates(self, data, path):
+    return [self.array(function, data, path) for function in self.FUNCTIONS]
+
+  def expected(self, data, path):
+    # The same aggregates over the rows of protobuf_each
+    if hasattr(data, 'SerializeToString'):
+      data = data.SerializeToString()
+    return list(self.query('''SELECT count(*), sum(value), min(value),
+                                      max(value), avg(value)
+                                 FROM protobuf_each(?, ?, ?)''',
+      (data, 'Sensor', path))[0])
+
+  def for_each_engine(self, test):
+    for engine in ('auto', 'reflection'):
+      self.db.execute('SELECT protobuf_config(?, ?)',
+        ('extract_engine', engine))
+      with self.subTest(engine=engine):
+        test()
+
+  def test_agrees_with_each(self):
+    r = random.Random(14)
+    for field, generate in self.GENERATORS.items():
+      # Lengths around the widths of the vectors and the decoding buffer
+      for length in (0, 1, 3, 4, 5, 15, 16, 17, 33, 255, 256, 300):
+        sensor = self.proto.Sensor()
+        getattr(sensor, field).extend(generate(r) for _ in range(length))
+        def test():
+          with self.subTest(field=field, length=length):
+            actual = self.aggregates(sensor, '$.' + field)
+            expected = self.expected(sensor, '$.' + field)
+            self.assertEqual(actual[:-1], expected[:-1])
+            # Large integers are averaged from their exact sum, which may be
+            # closer than adding them up as real numbers
+            if expected[-1] is None:
+              self.assertIsNone(actual[-1])
+            else:
+              self.assertAlmostEqual(actual[-1], expected[-1],
+                delta=abs(expected[-1]) * 1e-12)
+        self.for_each_engine(test)
+
+  def test_values(self):
+    sensor = self.proto.Sensor(doubles=[1.5, -2.5, 4], sint32s=[-3, 7, 0],
+                               bools=[True, False, True])
+    self.assertEqual(self.aggregates(sensor, '$.doubles'),
+      [3, 3.0, -2.5, 4.0, 1.0])
+    self.assertEqual(self.aggregates(sensor, '$.sint32s'),
+      [3, 4, -3, 7, 4 / 3])
+    self.assertEqual(self.aggregates(sensor, '$.bools'), [3, 2, 0, 1, 2 / 3])
+
+  def test_nested(self):
+    sensor = self.proto.Sensor()
+    sensor.child.int32s.extend([1, 2, 3])
+    sensor.children.add().int32s.extend([4])
+    sensor.children.add().int32s.extend([5, 6])
+    def test():
+      self.assertEqual(self.aggregates(sensor, '$.child.int32s'),
+        [3, 6, 1, 3, 2.0])
+      self.assertEqual(self.aggregates(sensor, '$.children[-1].int32s'),
+        [2, 11, 5, 6, 5.5])
+      self.assertEqual(self.aggregates(sensor, '$.children[2].int32s'),
+        [0, None, None, None, None])
+    self.for_each_engine(test)
+
+  def test_empty(self):
+    def test():
+      self.assertEqual(self.aggregates(b'', '$.doubles'),
+        [0, None, None, None, None])
+      self.assertEqual(self.aggregates(b'', '$.child.doubles'),
+        [0, None, None, None, None])
+      self.assertEqual(self.aggregates(None, '$.doubles'),
+        [None, None, None, None, None])
+    self.for_each_engine(test)
+
+  def test_mixed_encodings(self):
+    # Elements may be split across packed runs and single elements, with
+    # other fields in between
+    data = (self.proto.Sensor(int32s=[1, 200, -3]).SerializeToString()
+      + b'\x18' + varint(-40)
+      + self.proto.Sensor(name='x', int32s=[5]).SerializeToString()
+      + b'\x18\x06')
+    def test():
+      self.assertEqual(self.aggregates(data, '$.int32s'),
+        [6, 169, -40, 200, 169 / 6])
+      self.assertEqual(self.aggregates(data, '$.int32s'),
+        self.expected(data, '$.int32s'))
+    self.for_each_engine(test)
+
+  def test_closed_enum(self):
+    # The parser drops values that the enum does not define
+    data = b'\x72\x04\x01\x07\x02\x02' + b'\x70\x09'
+    def test():
+      self.assertEqual(self.aggregates(data, '$.kinds'), [3, 5, 1, 2, 5 / 3])
+    self.for_each_engine(test)
+
+  def test_nan(self):
+    # SQLite stores NaN as null, so it is only counted
+    sensor = self.proto.Sensor(floats=[float('nan'), 2, 1, 4, 8, 16],
+                               doubles=[float('nan')] * 5)
+    def test():
+      self.assertEqual(self.aggregates(sensor, '$.floats'),
+        [6, 31.0, 1.0, 16.0, 31 / 5])
+      self.assertEqual(self.aggregates(sensor, '$.doubles'),
+        [5, None, None, None, None])
+    self.for_each_engine(test)
+
+  def test_overflow(self):
+    sensor = self.proto.Sensor(int64s=[2**62, 2**62, 1])
+    def test():
+      with self.assertRaisesRegex(sqlite3.OperationalError, 'overflow'):
+        self.array('sum', sensor, '$.int64s')
+      self.assertEqual(self.array('avg', sensor, '$.int64s'), 2**63 / 3)
+      self.assertEqual(self.array('max', sensor, '$.int64s'), 2**62)
+    self.for_each_engine(test)
+
+  def test_malformed(self):
+    for data in (b'\x18\x02\x01\x80',  # last varint cut off
+                 b'\x18\x0b' + b'\xff' * 10 + b'\x01',  # varint too long
+                 b'\x18\x20' + b'\x01' * 15 + b'\x80' * 16 + b'\x01',
+                 b'\x4a\x03\x01\x02\x03',  # not a whole fixed32
+                 b'\x18\x05\x01'):  # run cut off
+      for function in self.FUNCTIONS:
+        with self.subTest(data=data, function=function):
+          with self.assertRaisesRegex(sqlite3.OperationalError, 'parse'):
+            self.array(function, data,
+                       '$.fixed32s' if data[0] == 0x4a else '$.int32s')
+
+  def test_errors(self):
+    for path, error in (('$.name', 'repeated'),
+                        ('$.int32s[0]', 'repeated'),
+                        ('$.children', 'numeric'),
+                        ('$.kinds.name', 'numeric'),
+                        ('$.nothing', 'Invalid field name'),
+                        ('doubles', 'Invalid path')):
+      with self.subTest(path=path):
+        with self.assertRaisesRegex(sqlite3.OperationalError, error):
+          self.array('sum', b'', path)
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'descriptor'):
+      self.query("SELECT protobuf_array_count(x'', 'Nobody', '$.doubles')")
+
+
+if __name__ == '__main__':
+  unittest.main()
@@ -0,0 +1,291 @@
+#!/usr/bin/env python
+import unittest
+import zlib
+
+from utils import *
+
+
+class TestProtobufCompress(SQLiteProtobufTestCase, unittest.TestCase):
+  __PROTOBUF__ = '''
+  syntax = "proto2";
+  message Person {
+    optional string name = 1;
+    optional int32 id = 2;
+    optional string email = 3;
+
+    enum PhoneType {
+      MOBILE = 0;
+      HOME = 1;
+      WORK = 2;
+    }
+
+    message PhoneNumber {
+      optional string number = 1;
+      optional PhoneType type = 2 [default = HOME];
+    }
+    repeated PhoneNumber phones = 4;
+    repeated int32 scores = 5;
+  }
+  '''
+
+  def person(self, i=0, phones=10):
+    msg = self.proto.Person()
+    msg.name = 'Person number %d' % i
+    msg.id = i
+    msg.email = 'person.number.%d@example.com' % i
+    for j in range(phones):
+      phone = msg.phones.add()
+      phone.number = '555-%04d' % (i + j)
+      phone.type = j % 3
+    msg.scores.extend(range(i, i + 5))
+    return msg
+
+  def compress(self, data, dictionary_id=None):
+    if hasattr(data, 'SerializeToString'):
+      data = data.SerializeToString()
+    c = self.db.cursor()
+    if dictionary_id is None:
+      c.execute('SELECT protobuf_compress(?)', (data,))
+    else:
+      c.execute('SELECT protobuf_compress(?, ?)', (data, dictionary_id))
+    return c.fetchone()[0]
+
+  def decompress(self, data):
+    c = self.db.cursor()
+    c.execute('SELECT protobuf_decompress(?)', (data,))
+    return c.fetchone()[0]
+
+  def stat(self, name):
+    c = self.db.cursor()
+    c.execute('''SELECT value FROM protobuf_stats
+                  WHERE name = ? AND function IS NULL''', (name,))
+    return c.fetchone()[0]
+
+  def add_dictionary(self, dictionary_id, samples):
+    c = self.db.cursor()
+    c.execute('''CREATE TABLE IF NOT EXISTS protobuf_dictionaries
+                   (id INTEGER PRIMARY KEY, dictionary BLOB)''')
+    c.execute('CREATE TEMP TABLE samples (data BLOB)')
+    c.executemany('INSERT INTO samples VALUES (?)',
+      [(s.SerializeToString(),) for s in samples])
+    c.execute('''INSERT OR REPLACE INTO protobuf_dictionaries
+                  SELECT ?, protobuf_train_dictionary(data) FROM samples''',
+      (dictionary_id,))
+    c.execute('DROP TABLE samples')
+
+  def test_round_trip(self):
+    data = self.person(phones=50).SerializeToString()
+    compressed = self.compress(data)
+    self.assertTrue(compressed.startswith(b'\x00pbz'))
+    self.assertLess(len(compressed), len(data))
+    self.assertEqual(data, self.decompress(compressed))
+
+  def test_format(self):
+    # The id of the dictionary and the size of the message follow the magic,
+    # and the rest is a zlib stream
+    data = self.person(phones=50).SerializeToString()
+    compressed = self.compress(data)
+    size = len(data)
+    self.assertEqual(b'\x00pbz\x00' + bytes([size & 0x7f | 0x80, size >> 7]),
+      compressed[:7])
+    self.assertEqual(data, zlib.decompress(compressed[7:]))
+
+    framed = b'\x00pbz\x00' + bytes([size & 0x7f | 0x80, size >> 7]) \
+      + zlib.compress(data, 1)
+    self.assertEqual(data, self.decompress(framed))
+
+  def test_not_smaller(self):
+    data = self.proto.Person(id=1).SerializeToString()
+    self.assertEqual(data, self.compress(data))
+
+  def test_empty_and_null(self):
+    self.assertEqual(b'', self.compress(b''))
+    self.assertIsNone(self.compress(None))
+    self.assertIsNone(self.decompress(None))
+    self.assertEqual(b'', self.decompress(b''))
+
+  def test_uncompressed_is_unchanged(self):
+    data = self.person().SerializeToString()
+    self.assertEqual(data, self.decompress(data))
+    compressed = self.compress(data)
+    self.assertEqual(compressed, self.compress(compressed))
+
+  def test_malformed(self):
+    data = self.person(phones=50).SerializeToString()
+    compressed = self.compress(data)
+    for bad in (b'\x00pbz', b'\x00pbz\x00', compressed[:-6],
+                compressed[:20] + b'\xff' * 20 + compressed[40:],
+                compressed[:5] + b'\x01' + compressed[6:]):
+      with self.assertRaisesRegex(sqlite3.OperationalError, 'Malformed'):
+        self.decompress(bad)
+      with self.assertRaisesRegex(sqlite3.OperationalError, 'Malformed'):
+        self.protobuf_extract(bad, 'Person', '$.name')
+
+  def test_untrusted_size(self):
+    # The size in the header is checked before anything is allocated for it
+    empty = zlib.compress(b'')
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'too large'):
+      self.decompress(b'\x00pbz\x00\xff\xff\xff\xff\x07' + empty)
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'Malformed'):
+      self.decompress(b'\x00pbz\x00\x80\x89\x7a' + empty)
+
+    # The buffer grows as the message is decompressed
+    data = self.person(phones=5000).SerializeToString()
+    compressed = self.compress(data)
+    self.assertEqual(
+      self.protobuf_extract(compressed, 'Person', '$.phones[4000].number'),
+      '555-4000')
+    self.assertEqual(data, self.decompress(compressed))
+
+    compressed = self.compress(self.person(1, phones=5000))
+    self.db.setlimit(sqlite3.SQLITE_LIMIT_LENGTH, len(data) - 1)
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'too large'):
+      self.decompress(compressed)
+
+  def test_readers(self):
+    msg = self.person(phones=20)
+    data = msg.SerializeToString()
+    compressed = self.compress(data)
+    c = self.db.cursor()
+
+    for path in ('$.name', '$.id', '$.phones[3].number', '$.phones[-1].type',
+                 '$.phones[2].type.name', '$.phones[0]', '$'):
+      self.assertEqual(self.protobuf_extract(data, 'Person', path),
+        self.protobuf_extract(compressed, 'Person', path), msg=path)
+
+    queries = [
+      'SELECT protobuf_extract_all(?, "Person", "$.phones[*].number")',
+      'SELECT protobuf_extract_raw(?, "$.#1", "string")',
+      'SELECT protobuf_array_sum(?, "Person", "$.scores")',
+      '''SELECT protobuf_match(?, "Person",
+            "$.id = 0 AND $.phones[1].type = HOME")''',
+      'SELECT protobuf_to_json(?, "Person")',
+      'SELECT protobuf_set(?, "Person", "$.id", 7)',
+      'SELECT protobuf_remove(?, "Person", "$.phones[0]")',
+      '''SELECT key, value FROM protobuf_each(?, "Person",
+            "$.phones[*].number")''',
+      '''SELECT value1, value2 FROM protobuf_fields(?, "Person",
+            "$.email", "$.phones[4].number")''',
+    ]
+    for query in queries:
+      c.execute(query, (data,))
+      expected = c.fetchall()
+      c.execute(query, (compressed,))
+      self.assertEqual(expected, c.fetchall(), msg=query)
+
+  def test_view(self):
+    c = self.db.cursor()
+    c.execute('CREATE TABLE people (protobuf BLOB)')
+    people = [self.person(i, phones=i % 5 + 5) for i in range(20)]
+    c.executemany('INSERT INTO people VALUES (protobuf_compress(?))',
+      [(p.SerializeToString(),) for p in people])
+    c.execute('''CREATE VIRTUAL TABLE people_v USING protobuf_view(
+                   people, protobuf, "Person",
+                   name="$.name", phone="$.phones[2].number")''')
+    c.execute('''SELECT name, phone,
+                        protobuf_extract(protobuf, "Person", "$.id")
+                   FROM people_v WHERE phone >= "555-0010" ORDER BY rowid''')
+    self.assertEqual(c.fetchall(), [
+      (p.name, p.phones[2].number, p.id) for p in people
+      if p.phones[2].number >= '555-0010'])
+
+  def test_prefix(self):
+    msg = self.person(phones=2000)
+    data = msg.SerializeToString()
+    compressed = self.compress(data)
+    self.db.execute('SELECT protobuf_stats_reset()')
+
+    self.assertEqual('555-0001',
+      self.protobuf_extract(compressed, 'Person', '$.phones[1].number'))
+    self.assertEqual(1, self.stat('decompressed_messages'))
+    self.assertLess(self.stat('decompressed_bytes'), len(data) // 4)
+
+    # A later call on the same message carries on where the last one stopped
+    self.assertEqual('555-1999',
+      self.protobuf_extract(compressed, 'Person', '$.phones[-1].number'))
+    self.assertEqual(msg.name,
+      self.protobuf_extract(compressed, 'Person', '$.name'))
+    self.assertEqual(1, self.stat('decompressed_messages'))
+    self.assertEqual(len(data), self.stat('decompressed_bytes'))
+
+  def test_prefix_past_the_end(self):
+    msg = self.person(phones=2000)
+    compressed = self.compress(msg)
+    self.assertIsNone(
+      self.protobuf_extract(compressed, 'Person', '$.phones[2000].number'))
+    self.assertEqual(msg.phones[1999].type,
+      self.protobuf_extract(compressed, 'Person', '$.phones[1999].type'))
+
+  def test_dictionary(self):
+    self.add_dictionary(1, [self.person(i, phones=2) for i in range(100)])
+    data = self.person(1000, phones=2).SerializeToString()
+    plain = self.compress(data)
+    compressed = self.compress(data, 1)
+    self.assertTrue(compressed.startswith(b'\x00pbz\x01'))
+    self.assertLess(len(compressed), len(plain))
+    self.assertEqual(data, self.decompress(compressed))
+    self.assertEqual('Person number 1000',
+      self.protobuf_extract(compressed, 'Person', '$.name'))
+
+  def test_dictionary_in_table(self):
+    self.add_dictionary(3, [self.person(i, phones=2) for i in range(100)])
+    c = self.db.cursor()
+    c.execute('CREATE TABLE people (protobuf BLOB)')
+    people = [self.person(i, phones=2) for i in range(100, 120)]
+    c.executemany('INSERT INTO people VALUES (protobuf_compress(?, 3))',
+      [(p.SerializeToString(),) for p in people])
+    c.execute('''SELECT protobuf_extract(protobuf, "Person", "$.email")
+                   FROM people ORDER BY rowid''')
+    self.assertEqual(c.fetchall(), [(p.email,) for p in people])
+
+  def test_missing_dictionary(self):
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'no such table'):
+      self.compress(self.person(), 1)
+    self.add_dictionary(1, [self.person(i) for i in range(10)])
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'not found'):
+      self.compress(self.person(), 2)
+    for dictionary_id in (0, -1, 'one', 1.5):
+      with self.assertRaisesRegex(sqlite3.OperationalError, 'dictionary id'):
+        self.compress(self.person(), dictionary_id)
+
+  def test_replaced_dictionary(self):
+    self.add_dictionary(1, [self.person(i) for i in range(10)])
+    first = self.compress(self.person(1, phones=2), 1)
+    self.assertEqual(1, self.protobuf_extract(first, 'Person', '$.id'))
+
+    # Messages are decompressed with the dictionary they were compressed with
+    self.add_dictionary(1, [self.person(i) for i in range(100, 110)])
+    second = self.compress(self.person(2, phones=2), 1)
+    self.assertEqual(2, self.protobuf_extract(second, 'Person', '$.id'))
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'not the one'):
+      self.protobuf_extract(first, 'Person', '$.id')
+
+    self.db.execute('DELETE FROM protobuf_dictionaries')
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'not found'):
+      self.decompress(first)
+
+  def test_train_dictionary(self):
+    c = self.db.cursor()
+    c.execute('CREATE TABLE people (protobuf BLOB)')
+    c.execute('SELECT protobuf_train_dictionary(protobuf) FROM people')
+    self.assertIsNone(c.fetchone()[0])
+
+    c.executemany('INSERT INTO people VALUES (?)',
+      [(self.person(i).SerializeToString(),) for i in range(200)])
+    c.execute('SELECT protobuf_train_dictionary(protobuf, 512) FROM people')
+    dictionary = c.fetchone()[0]
+    self.assertLessEqual(len(dictionary), 512)
+    self.assertIn(b'@example.com', dictionary)
+
+    # Compressed samples count as what they decompress to
+    c.execute('SELECT protobuf_train_dictionary(protobuf_compress(protobuf), '
+              '512) FROM people')
+    self.assertEqual(dictionary, c.fetchone()[0])
+
+    for size in (0, 32769):
+      with self.assertRaisesRegex(sqlite3.OperationalError, 'size'):
+        c.execute('SELECT protobuf_train_dictionary(protobuf, ?) FROM people',
+          (size,))
+
+if __name__ == '__main__':
+  unittest.main()
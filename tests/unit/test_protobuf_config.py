@@ -0,0 +1,42 @@
+#!/usr/bin/env python
+import unittest
+
+from utils import *
+
+
+class TestProtobufConfig(SQLiteProtobufTestCase, unittest.TestCase):
+  def protobuf_config(self, *args):
+    c = self.db.cursor()
+    c.execute('SELECT protobuf_config(%s)' % ', '.join('?' * len(args)), args)
+    return c.fetchone()[0]
+
+  def test_default_engine(self):
+    self.assertEqual('auto', self.protobuf_config('extract_engine'))
+
+  def test_set_engine(self):
+    self.assertEqual('reflection',
+      self.protobuf_config('extract_engine', 'reflection'))
+    self.assertEqual('reflection', self.protobuf_config('extract_engine'))
+    self.assertEqual('wire', self.protobuf_config('extract_engine', 'wire'))
+
+  def test_engine_is_per_connection(self):
+    self.protobuf_config('extract_engine', 'reflection')
+    other = sqlite3.connect(':memory:')
+    other.enable_load_extension(True)
+    other.load_extension(get_sqlite_protobuf_library())
+    c = other.cursor()
+    c.execute('SELECT protobuf_config(?)', ('extract_engine',))
+    self.assertEqual('auto', c.fetchone()[0])
+    other.close()
+
+  def test_bad_engine(self):
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'extract_engine'):
+      self.protobuf_config('extract_engine', 'bogus')
+
+  def test_bad_setting(self):
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'Unknown setting'):
+      self.protobuf_config('bogus')
+
+
+if __name__ == '__main__':
+  unittest.main()
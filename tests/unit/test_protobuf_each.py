@@ -0,0 +1,123 @@
+#!/usr/bin/env python
+import unittest
+
+from utils import *
+
+
+class TestProtobufEach(SQLiteProtobufTestCase, unittest.TestCase):
+  __PROTOBUF__ = '''
+  syntax = "proto2";
+  message TestMessage {
+    enum EnumValues {
+      A = 1;
+      B = 2;
+    }
+
+    optional int32 int32_field = 1;
+    repeated string repeated_string_field = 2;
+    repeated sint64 packed_sint64_field = 3 [packed = true];
+    repeated EnumValues repeated_enum_field = 4;
+    repeated TestMessage children = 5;
+    optional TestMessage optional_child = 6;
+    map<string, int32> map_field = 7;
+  }
+  '''
+
+  def make_message(self):
+    msg = self.proto.TestMessage()
+    msg.repeated_string_field.extend(['a', 'b', 'c'])
+    msg.packed_sint64_field.extend([-1, 0, 1])
+    msg.repeated_enum_field.extend([2, 1])
+    for i in range(3):
+      msg.children.add().int32_field = i
+    msg.optional_child.repeated_string_field.append('x')
+    return msg
+
+  def each(self, msg, path, columns='key, value', where=''):
+    c = self.db.cursor()
+    c.execute('SELECT %s FROM protobuf_each(?, ?, ?) %s' % (columns, where),
+      (msg.SerializeToString(), 'TestMessage', path))
+    return c.fetchall()
+
+  def test_each(self):
+    msg = self.make_message()
+    self.assertEqual(self.each(msg, '$.repeated_string_field'),
+      [(0, 'a'), (1, 'b'), (2, 'c')])
+    self.assertEqual(self.each(msg, '$.packed_sint64_field'),
+      [(0, -1), (1, 0), (2, 1)])
+    self.assertEqual(self.each(msg, '$.repeated_enum_field.name'),
+      [(0, 'B'), (1, 'A')])
+    self.assertEqual(self.each(msg, '$.optional_child.repeated_string_field'),
+      [(0, 'x')])
+
+  def test_each_messages(self):
+    msg = self.make_message()
+    rows = self.each(msg, '$.children', 'value, type, path')
+    self.assertEqual([(child.SerializeToString(), 'TestMessage',
+      '$.children[%i]' % i) for i, child in enumerate(msg.children)], rows)
+
+  def test_each_path_column(self):
+    msg = self.make_message()
+    c = self.db.cursor()
+    c.execute('''SELECT protobuf_extract(?1, 'TestMessage', path)
+                   FROM protobuf_each(?1, 'TestMessage',
+                                      '$.repeated_enum_field.name')''',
+      (msg.SerializeToString(),))
+    self.assertEqual(c.fetchall(), [('B',), ('A',)])
+
+  def test_each_empty(self):
+    msg = self.make_message()
+    self.assertEqual(self.each(msg, '$.optional_child.children'), [])
+    self.assertEqual(self.each(msg, '$.children[5].children'), [])
+    self.assertEqual(self.each(self.proto.TestMessage(), '$.children'), [])
+
+  def test_each_by_key(self):
+    msg = self.make_message()
+    self.assertEqual(self.each(msg, '$.repeated_string_field',
+      where='WHERE key = 1'), [(1, 'b')])
+    self.assertEqual(self.each(msg, '$.repeated_string_field',
+      where='WHERE key = 3'), [])
+    self.assertEqual(self.each(msg, '$.repeated_string_field',
+      where='WHERE key = -1'), [])
+    self.assertEqual(self.each(msg, '$.repeated_string_field',
+      where='WHERE key = 1.5'), [])
+
+  def test_each_join(self):
+    c = self.db.cursor()
+    c.execute('CREATE TABLE messages (protobuf BLOB)')
+    for i in range(3):
+      msg = self.proto.TestMessage()
+      msg.int32_field = i
+      msg.repeated_string_field.extend(str(i) * j for j in range(1, i + 1))
+      c.execute('INSERT INTO messages VALUES (?)', (msg.SerializeToString(),))
+    c.execute('''SELECT protobuf_extract(protobuf, 'TestMessage', '$.int32_field'),
+                        each.value
+                   FROM messages,
+                        protobuf_each(messages.protobuf, 'TestMessage',
+                                      '$.repeated_string_field') AS each
+                  ORDER BY messages.rowid, each.key''')
+    self.assertEqual(c.fetchall(), [(1, '1'), (2, '2'), (2, '22')])
+
+  def test_each_engines_agree(self):
+    msg = self.make_message()
+    msg.map_field['k'] = 1
+    paths = ['$.repeated_string_field', '$.packed_sint64_field',
+      '$.repeated_enum_field', '$.children', '$.map_field',
+      '$.children[-1].children']
+    results = {}
+    for engine in ('auto', 'reflection'):
+      self.db.execute('SELECT protobuf_config(?, ?)',
+        ('extract_engine', engine))
+      results[engine] = [self.each(msg, path, '*') for path in paths]
+    self.assertEqual(results['auto'], results['reflection'])
+
+  def test_each_bad_path(self):
+    msg = self.make_message()
+    for path in ('$', '$.int32_field', '$.children[0]',
+                 '$.children.int32_field'):
+      with self.assertRaises(sqlite3.OperationalError):
+        self.each(msg, path)
+
+
+if __name__ == '__main__':
+  unittest.main()
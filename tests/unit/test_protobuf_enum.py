@@ -60,6 +60,114 @@ class TestProtobufEnum(SQLiteProtobufTestCase, unittest.TestCase):
       ('TestEnumWithAliases', 1))
     self.assertEqual(c.fetchall(), [(1, 'A1'), (1, 'A2')])
   
+  def test_protobuf_enum_by_number_range(self):
+    c = self.db.cursor()
+    c.execute('SELECT * FROM protobuf_enum(?) WHERE number >= ?',
+      ('TestEnum', 2))
+    self.assertEqual(sorted(c.fetchall()), [(2, 'B'), (3, 'A')])
+    c.execute('SELECT * FROM protobuf_enum(?) WHERE number > ? AND number < ?',
+      ('TestEnum', 1.5, 3))
+    self.assertEqual(c.fetchall(), [(2, 'B')])
+    c.execute('SELECT * FROM protobuf_enum(?) WHERE number < ?',
+      ('TestEnum', 'x'))
+    self.assertEqual(sorted(c.fetchall()), [(1, 'C'), (2, 'B'), (3, 'A')])
+    c.execute('SELECT * FROM protobuf_enum(?) WHERE number > 3',
+      ('TestEnum',))
+    self.assertEqual(c.fetchall(), [])
+
+  def test_protobuf_enum_by_number_in(self):
+    c = self.db.cursor()
+    c.execute('''SELECT * FROM protobuf_enum(?)
+                  WHERE number IN (3, 1, 3, 7, '2.0', 'x') ORDER BY number''',
+      ('TestEnum',))
+    self.assertEqual(c.fetchall(), [(1, 'C'), (2, 'B'), (3, 'A')])
+    c.execute('''SELECT * FROM protobuf_enum(?)
+                  WHERE number IN (SELECT 1) AND number < 5''',
+      ('TestEnumWithAliases',))
+    self.assertEqual(c.fetchall(), [(1, 'A1'), (1, 'A2')])
+
+  def test_protobuf_enum_order_by_number(self):
+    c = self.db.cursor()
+    c.execute('SELECT * FROM protobuf_enum(?) ORDER BY number', ('TestEnum',))
+    self.assertEqual(c.fetchall(), [(1, 'C'), (2, 'B'), (3, 'A')])
+    c.execute('SELECT * FROM protobuf_enum(?) ORDER BY number DESC',
+      ('TestEnum',))
+    self.assertEqual(c.fetchall(), [(3, 'A'), (2, 'B'), (1, 'C')])
+
+    # The rows come out in order, so SQLite does not sort them again
+    c.execute('''EXPLAIN QUERY PLAN SELECT * FROM protobuf_enum('TestEnum')
+                  WHERE number > 1 ORDER BY number''')
+    self.assertNotIn('ORDER BY', ' '.join(row[-1] for row in c.fetchall()))
+
+  def test_protobuf_enum_join(self):
+    c = self.db.cursor()
+    c.execute('CREATE TABLE stored (value INTEGER)')
+    c.executemany('INSERT INTO stored VALUES (?)',
+      [(1,), (3,), (9,), (2,), (3,)])
+    c.execute('''SELECT stored.value, e.name FROM stored
+                   LEFT JOIN protobuf_enum('TestEnum') AS e
+                     ON e.number = stored.value
+                  ORDER BY stored.rowid''')
+    self.assertEqual(c.fetchall(),
+      [(1, 'C'), (3, 'A'), (9, None), (2, 'B'), (3, 'A')])
+
+  def test_protobuf_enum_name(self):
+    c = self.db.cursor()
+    c.execute('''SELECT protobuf_enum_name('TestEnum', 2),
+                        protobuf_enum_name('TestEnum', 9),
+                        protobuf_enum_name('TestEnum', '3'),
+                        protobuf_enum_name('TestEnum', NULL),
+                        protobuf_enum_name('TestEnumWithAliases', 1),
+                        protobuf_enum_name('TestMessage.EmbeddedTestEnum', 3)''')
+    self.assertEqual(c.fetchone(), ('B', None, 'A', None, 'A1', 'F'))
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'enum type'):
+      c.execute('SELECT protobuf_enum_name(?, 1)', ('BadEnum',))
+
+  def test_protobuf_enum_name_varying_type(self):
+    c = self.db.cursor()
+    c.execute('CREATE TABLE stored (type TEXT, value INTEGER)')
+    c.executemany('INSERT INTO stored VALUES (?, ?)',
+      [('TestEnum', 1), ('TestEnum', 3), ('TestMessage.EmbeddedTestEnum', 1),
+       ('TestEnum', 2)])
+    c.execute('''SELECT protobuf_enum_name(type, value) FROM stored
+                  ORDER BY rowid''')
+    self.assertEqual(c.fetchall(), [('C',), ('A',), ('D',), ('B',)])
+
+  def test_protobuf_enum_loaded_mid_query(self):
+    # A loaded type hides the compiled one as soon as it is loaded, even for
+    # cursors and rows that looked it up before
+    from google.protobuf import descriptor_pb2
+    def shadow(name, scope=None):
+      file_set = descriptor_pb2.FileDescriptorSet()
+      file = file_set.file.add(name=name + '.proto')
+      parent = file.message_type.add(name=scope) if scope else file
+      enum = parent.enum_type.add(name=name)
+      for number, value in ((1, 'X'), (2, 'Y'), (3, 'Z')):
+        enum.value.add(name=value, number=number)
+      return file_set.SerializeToString()
+
+    c = self.db.cursor()
+    c.execute('CREATE TABLE steps (value INTEGER, descriptors BLOB)')
+    c.executemany('INSERT INTO steps VALUES (?, ?)',
+      [(1, None), (2, shadow('TestEnum')), (3, None)])
+    c.execute('''SELECT value, e.name FROM steps
+                   LEFT JOIN protobuf_enum('TestEnum') AS e
+                     ON e.number = steps.value
+                  WHERE descriptors IS NULL
+                     OR protobuf_load_descriptors(descriptors)
+                  ORDER BY steps.rowid''')
+    self.assertEqual(c.fetchall(), [(1, 'C'), (2, 'Y'), (3, 'Z')])
+
+    c.execute('UPDATE steps SET descriptors = ? WHERE value = 2',
+      (shadow('EmbeddedTestEnum', 'TestMessage'),))
+    c.execute('''SELECT value,
+                        CASE WHEN descriptors IS NOT NULL
+                          THEN protobuf_load_descriptors(descriptors) END,
+                        protobuf_enum_name('TestMessage.EmbeddedTestEnum', value)
+                   FROM steps ORDER BY rowid''')
+    self.assertEqual(c.fetchall(),
+      [(1, None, 'D'), (2, 1, 'Y'), (3, None, 'Z')])
+
   def test_protobuf_bad_enum(self):
     c = self.db.cursor()
     with self.assertRaises(sqlite3.OperationalError):
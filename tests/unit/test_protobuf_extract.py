@@ -50,6 +50,23 @@ class TestProtobufExtract(SQLiteProtobufTestCase, unittest.TestCase):
     repeated TestMessage children = 1000;
     optional TestMessage optional_child = 1001;
   }
+
+  message Variants {
+    oneof choice {
+      int32 number = 1;
+      string text = 2;
+      TestMessage.EnumValues letter = 3;
+      TestMessage child = 4;
+    }
+    repeated int32 packed_int32 = 5 [packed=true];
+    repeated TestMessage.EnumValues packed_enum = 6 [packed=true];
+    repeated fixed32 packed_fixed32 = 7 [packed=true];
+  }
+
+  message RequiredMessage {
+    required int32 required_field = 1;
+    optional TestMessage optional_child = 2;
+  }
   '''
 
   protobuf_to_sql_types = {
@@ -195,6 +212,150 @@ class TestProtobufExtract(SQLiteProtobufTestCase, unittest.TestCase):
       self.protobuf_extract(msg, 'TestMessage', '$.enum_field.buzz')
     err2 = str(cm.exception)
     self.assertEqual(err1, err2)
+  
+  def test_extract_negative_index_out_of_range(self):
+    msg = self.proto.TestMessage()
+    msg.children.add().int32_field = 1
+    self.assertIsNone(
+      self.protobuf_extract(msg, 'TestMessage', '$.children[-2].int32_field'))
+    self.assertIsNone(
+      self.protobuf_extract(msg, 'TestMessage', '$.repeated_int32_field[-1]'))
+  
+  def test_extract_bool(self):
+    msg = self.proto.TestMessage()
+    msg.bool_field = True
+    msg.repeated_bool_field.extend([False, True])
+    self.assertEqual(1, self.protobuf_extract(msg, 'TestMessage', '$.bool_field'))
+    self.assertEqual(0,
+      self.protobuf_extract(msg, 'TestMessage', '$.repeated_bool_field[0]'))
+    self.assertEqual(1,
+      self.protobuf_extract(msg, 'TestMessage', '$.repeated_bool_field[1]'))
+  
+  def test_extract_field_numbers(self):
+    msg = self.proto.TestMessage()
+    msg.children.add().int32_field = 1337
+    msg.enum_field = self.proto.TestMessage.EnumValues.Value('B')
+    self.assertEqual(1337,
+      self.protobuf_extract(msg, 'TestMessage', '$.#1000[0].#3'))
+    self.assertEqual(1337,
+      self.protobuf_extract(msg, 'TestMessage', '$.children[0].#3'))
+    self.assertEqual('B',
+      self.protobuf_extract(msg, 'TestMessage', '$.#16.name'))
+    for path in ('$.#99', '$.#0', '$.#', '$.#3x'):
+      with self.assertRaisesRegex(sqlite3.OperationalError, 'field name'):
+        self.protobuf_extract(msg, 'TestMessage', path)
+
+  def test_extract_varying_path(self):
+    msg = self.proto.TestMessage()
+    msg.int32_field = 1337
+    msg.string_field = 'abc'
+    data = msg.SerializeToString()
+    c = self.db.cursor()
+    c.execute('CREATE TABLE paths (path TEXT)')
+    c.executemany('INSERT INTO paths VALUES (?)',
+      [('$.int32_field',), ('$.string_field',), ('$.int32_field',)])
+    c.execute('SELECT protobuf_extract(?, ?, path) FROM paths ORDER BY rowid',
+      (data, 'TestMessage'))
+    self.assertEqual(c.fetchall(), [(1337,), ('abc',), (1337,)])
+  
+  def test_extract_engines_agree(self):
+    msg = self.proto.TestMessage()
+    msg.int32_field = 5
+    msg.enum_field = self.proto.TestMessage.EnumValues.Value('B')
+    msg.repeated_sint64_field.extend([-1, 0, 1])
+    msg.repeated_string_field.extend(['a', 'b'])
+    msg.optional_child.children.add().double_field = 2.5
+    for i in range(3):
+      msg.children.add().string_field = str(i)
+    paths = [
+      '$.int32_field', '$.int64_field', '$.string_field', '$.enum_field.name',
+      '$.repeated_sint64_field[0]', '$.repeated_sint64_field[-1]',
+      '$.repeated_sint64_field[3]', '$.repeated_string_field[1]',
+      '$.optional_child.children[0].double_field', '$.children[-1]',
+      '$.children[1].string_field', '$.optional_child.optional_child',
+    ]
+    results = {}
+    for engine in ('auto', 'reflection'):
+      self.db.execute('SELECT protobuf_config(?, ?)',
+        ('extract_engine', engine))
+      results[engine] = [
+        self.protobuf_extract(msg, 'TestMessage', path) for path in paths]
+    self.assertEqual(results['auto'], results['reflection'])
+
+  def test_extract_child_message_is_slice(self):
+    # The child's fields are out of order, so serializing it again would
+    # give different bytes
+    child = b'\x72\x01a' + b'\x18\x05'
+    data = b'\x08\x01' + b'\x12' + bytes([len(child)]) + child
+    self.assertEqual(child,
+      self.protobuf_extract(data, 'RequiredMessage', '$.optional_child'))
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'parse'):
+      self.protobuf_extract(data[2:], 'RequiredMessage', '$.optional_child')
+
+  def test_extract_engines_agree_on_encodings(self):
+    # Encodings that serializing a message would not produce: oneof members
+    # overwriting each other, runs of packed and unpacked elements, undefined
+    # values of closed enums, merged messages, and messages that are cut short
+    def fixed32(*values):
+      return b''.join(v.to_bytes(4, 'little') for v in values)
+    encodings = [
+      b'\x08\x05\x12\x01a',
+      b'\x12\x01a\x08\x05',
+      b'\x08\x05\x18\x07',
+      b'\x08\x05\x18\x01',
+      b'\x08\x05\x1a\x00',
+      b'\x22\x02\x18\x05\x08\x05\x22\x02\x20\x06',
+      b'\x22\x02\x18\x05\x22\x02\x20\x06',
+      b'\x2a\x02\x01\x02\x28\x03\x2a\x01\x04',
+      b'\x32\x03\x01\x07\x02\x30\x09\x30\x01',
+      b'\x3a\x08' + fixed32(1, 2) + b'\x3d' + fixed32(3),
+      b'\x08',
+      b'\x2a\x05\x01',
+    ]
+    paths = [
+      '$.number', '$.text', '$.letter', '$.letter.name', '$.child',
+      '$.child.int32_field', '$.child.int64_field',
+    ] + ['$.packed_int32[%d]' % i for i in (0, 1, 3, 4, -1, -4, -5)] \
+      + ['$.packed_enum[%d]' % i for i in (0, 1, 2, 3, -1, -3)] \
+      + ['$.packed_fixed32[%d]' % i for i in (0, 2, 3, -1, -3, -4)]
+
+    def extract(data, path):
+      try:
+        return self.protobuf_extract(data, 'Variants', path)
+      except sqlite3.OperationalError as e:
+        return str(e)
+
+    results = {}
+    for engine in ('auto', 'wire', 'reflection'):
+      self.db.execute('SELECT protobuf_config(?, ?)',
+        ('extract_engine', engine))
+      results[engine] = [
+        [extract(data, path) for path in paths] for data in encodings]
+    self.assertEqual(results['auto'], results['reflection'])
+    self.assertEqual(results['wire'], results['reflection'])
+
+
+class TestProtobufExtractGenerated(TestProtobufExtract):
+  __EXTRACTORS__ = True
+
+  def extractor_finds(self):
+    c = self.db.cursor()
+    c.execute('''SELECT value FROM protobuf_stats
+                  WHERE name = 'extractor_finds' ''')
+    return c.fetchone()[0]
+
+  def test_extract_uses_extractors(self):
+    msg = self.proto.TestMessage()
+    msg.optional_child.int32_field = 1337
+    before = self.extractor_finds()
+    self.assertEqual(1337, self.protobuf_extract(msg, 'TestMessage',
+      '$.optional_child.int32_field'))
+    self.assertEqual(self.extractor_finds(), before + 1)
+
+    self.db.execute('SELECT protobuf_config(?, ?)', ('extract_engine', 'wire'))
+    self.assertEqual(1337, self.protobuf_extract(msg, 'TestMessage',
+      '$.optional_child.int32_field'))
+    self.assertEqual(self.extractor_finds(), before + 1)
 
 
 if __name__ == '__main__':
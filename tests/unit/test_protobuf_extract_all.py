@@ -0,0 +1,191 @@
+#!/usr/bin/env python
+import base64
+import json
+import unittest
+
+from utils import *
+
+
+class TestProtobufExtractAll(SQLiteProtobufTestCase, unittest.TestCase):
+  __PROTOBUF__ = '''
+  syntax = "proto2";
+  message Person {
+    enum PhoneType {
+      MOBILE = 0;
+      HOME = 1;
+    }
+
+    message PhoneNumber {
+      optional string number = 1;
+      optional PhoneType type = 2 [default = HOME];
+      optional int32 label = 3;
+    }
+
+    optional string name = 1;
+    repeated PhoneNumber phones = 2;
+    repeated Person friends = 3;
+    optional Person manager = 4;
+    repeated sint32 scores = 5 [packed = true];
+    repeated double weights = 6;
+    optional bytes photo = 7;
+    optional bool active = 8;
+    optional string label = 9;
+  }
+
+  message Scores {
+    repeated sint32 values = 1;
+  }
+
+  message Numbers {
+    repeated string values = 1;
+  }
+  '''
+
+  def make_person(self):
+    person = self.proto.Person(name='Ann', scores=[3, -1, 4],
+                               weights=[0.5, 2.0], photo=b'\x00\xff',
+                               active=True)
+    person.phones.add(number='1', type=0)
+    person.phones.add(number='2')
+    person.phones.add(number='3', type=1)
+    friend = person.friends.add(name='Bob')
+    friend.phones.add(number='4')
+    friend.friends.add(name='Cid').phones.add(number='5')
+    person.manager.name = 'Dee'
+    return person
+
+  def extract_all(self, data, path, *format):
+    if hasattr(data, 'SerializeToString'):
+      data = data.SerializeToString()
+    c = self.db.cursor()
+    c.execute('SELECT protobuf_extract_all(?, ?, ?%s)' % (', ?' * len(format)),
+      (data, 'Person', path) + format)
+    return c.fetchone()[0]
+
+  def json(self, data, path):
+    return json.loads(self.extract_all(data, path))
+
+  def test_wildcard(self):
+    person = self.make_person()
+    self.assertEqual(self.json(person, '$.phones[*].number'), ['1', '2', '3'])
+    self.assertEqual(self.json(person, '$.phones[*].type.name'),
+      ['MOBILE', 'HOME', 'HOME'])
+    self.assertEqual(self.json(person, '$.friends[*].friends[*].name'),
+      ['Cid'])
+    self.assertEqual(self.json(person, '$.scores'), [3, -1, 4])
+
+  def test_slice(self):
+    person = self.make_person()
+    for path, numbers in (('$.phones[0:2].number', ['1', '2']),
+                          ('$.phones[1:].number', ['2', '3']),
+                          ('$.phones[:-1].number', ['1', '2']),
+                          ('$.phones[-2:].number', ['2', '3']),
+                          ('$.phones[:].number', ['1', '2', '3']),
+                          ('$.phones[-9:9].number', ['1', '2', '3']),
+                          ('$.phones[2:1].number', []),
+                          ('$.phones[1].number', ['2']),
+                          ('$.phones[-1].number', ['3']),
+                          ('$.phones[5].number', [])):
+      with self.subTest(path=path):
+        self.assertEqual(self.json(person, path), numbers)
+
+  def test_recursive(self):
+    person = self.make_person()
+    # Each message is searched before the messages inside it
+    self.assertEqual(self.json(person, '$..name'), ['Ann', 'Bob', 'Cid', 'Dee'])
+    self.assertEqual(self.json(person, '$..number'),
+      ['1', '2', '3', '4', '5'])
+    self.assertEqual(self.json(person, '$..phones[0].number'),
+      ['1', '4', '5'])
+    self.assertEqual(self.json(person, '$.friends[*]..name'), ['Bob', 'Cid'])
+    self.assertEqual(self.json(person, '$..friends[*].name'), ['Bob', 'Cid'])
+    self.assertEqual(self.json(person, '$..manager'),
+      [base64.b64encode(person.manager.SerializeToString()).decode()])
+
+  def test_json_values(self):
+    person = self.make_person()
+    self.assertEqual(self.extract_all(person, '$.weights'), '[0.5,2.0]')
+    self.assertEqual(self.extract_all(person, '$.active'), '[true]')
+    self.assertEqual(self.json(person, '$.photo'), ['AP8='])
+    self.assertEqual(self.json(person, '$.phones[*].type'), [0, 1, 1])
+
+    # Strings are escaped, and real numbers convert back exactly
+    odd = self.proto.Person(name='"\\\n\x01é', weights=[0.1, 1e300, -2.5e-7])
+    self.assertEqual(self.json(odd, '$.name'), ['"\\\n\x01é'])
+    self.assertEqual(self.json(odd, '$.weights'), [0.1, 1e300, -2.5e-7])
+
+    # Unset fields that are not messages give their defaults
+    self.assertEqual(self.json(self.proto.Person(), '$.name'), [''])
+    self.assertEqual(self.json(self.proto.Person(), '$.manager'), [])
+
+  def test_json1(self):
+    c = self.db.cursor()
+    c.execute('''SELECT value FROM json_each(
+                   protobuf_extract_all(?, 'Person', '$..number'))''',
+      (self.make_person().SerializeToString(),))
+    self.assertEqual([row[0] for row in c], ['1', '2', '3', '4', '5'])
+
+  def test_packed(self):
+    person = self.make_person()
+    scores = self.extract_all(person, '$..scores', 'packed')
+    self.assertEqual(list(self.proto.Scores.FromString(scores).values),
+      [3, -1, 4])
+    numbers = self.extract_all(person, '$..number', 'packed')
+    self.assertEqual(list(self.proto.Numbers.FromString(numbers).values),
+      ['1', '2', '3', '4', '5'])
+    self.assertEqual(self.extract_all(person, '$.friends[9].name', 'packed'),
+      b'')
+
+    # The packed values can be unnested again
+    c = self.db.cursor()
+    c.execute('''SELECT value FROM protobuf_each(
+                   protobuf_extract_all(?, 'Person', '$.scores[1:]', 'packed'),
+                   'Scores', '$.values')''', (person.SerializeToString(),))
+    self.assertEqual([row[0] for row in c], [-1, 4])
+
+  def test_packed_types(self):
+    # A recursive descent can find fields of different types with one name
+    person = self.proto.Person(label='x')
+    person.phones.add(label=1)
+    self.assertEqual(self.json(person, '$..label'), ['x', 1])
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'same type'):
+      self.extract_all(person, '$..label', 'packed')
+
+  def test_null(self):
+    self.assertIsNone(self.extract_all(None, '$..name'))
+
+  def test_errors(self):
+    for path, error in (('$.phones[*', 'Invalid path'),
+                        ('$.phones[]', 'Invalid path'),
+                        ('$.phones[1:x]', 'Invalid path'),
+                        ('$...name', 'Invalid path'),
+                        ('$..nothing', 'Invalid field name'),
+                        ('$.phones[*].nothing', 'Invalid field name'),
+                        ('$.phones.number', 'Expected index'),
+                        ('$.name.first', 'non-message'),
+                        ('$', 'does not select a field')):
+      with self.subTest(path=path):
+        with self.assertRaisesRegex(sqlite3.OperationalError, error):
+          self.extract_all(b'', path)
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'format'):
+      self.extract_all(b'', '$.name', 'xml')
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'parse'):
+      self.extract_all(b'\xff', '$.name')
+
+  def test_each(self):
+    person = self.make_person()
+    c = self.db.cursor()
+    c.execute('''SELECT key, value, type, path
+                   FROM protobuf_each(?, 'Person', '$..phones[1:].type.name')''',
+      (person.SerializeToString(),))
+    self.assertEqual(c.fetchall(), [
+      (0, 'HOME', 'Person.PhoneType', '$.phones[1].type.name'),
+      (1, 'HOME', 'Person.PhoneType', '$.phones[2].type.name'),
+    ])
+    c.execute('''SELECT value, path FROM protobuf_each(?, 'Person', '$..name')
+                  WHERE key = 2''', (person.SerializeToString(),))
+    self.assertEqual(c.fetchall(), [('Cid', '$.friends[0].friends[0].name')])
+
+
+if __name__ == '__main__':
+  unittest.main()
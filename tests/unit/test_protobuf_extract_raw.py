@@ -0,0 +1,176 @@
+#!/usr/bin/env python
+import struct
+import unittest
+
+from utils import *
+
+
+class TestProtobufExtractRaw(SQLiteProtobufTestCase, unittest.TestCase):
+  __PROTOBUF__ = '''
+  syntax = "proto2";
+  message Person {
+    optional string name = 1;
+    optional int32 id = 2;
+    optional sint64 offset = 3;
+    optional double score = 4;
+    optional fixed32 flags = 5;
+
+    message PhoneNumber {
+      optional string number = 1;
+      optional int32 type = 2;
+    }
+    repeated PhoneNumber phones = 6;
+    repeated int32 readings = 7 [packed=true];
+    repeated float samples = 8 [packed=true];
+    optional PhoneNumber primary = 9;
+  }
+  '''
+
+  def protobuf_extract_raw(self, data, path, hint=None):
+    if hasattr(data, 'SerializeToString'):
+      data = data.SerializeToString()
+    c = self.db.cursor()
+    if hint is None:
+      c.execute('SELECT protobuf_extract_raw(?, ?)', (data, path))
+    else:
+      c.execute('SELECT protobuf_extract_raw(?, ?, ?)', (data, path, hint))
+    return c.fetchone()[0]
+
+  def person(self):
+    msg = self.proto.Person()
+    msg.name = 'Kaila'
+    msg.id = -7
+    msg.offset = -3
+    msg.score = 98.6
+    msg.flags = 0xffffffff
+    for number in ('555-1000', '555-1001', '555-1002'):
+      msg.phones.add().number = number
+    msg.phones[1].type = 2
+    msg.readings.extend([5, 300, 70000])
+    msg.samples.extend([0.5, 1.5])
+    return msg
+
+  def test_root(self):
+    msg = self.person()
+    self.assertEqual(msg.SerializeToString(),
+      self.protobuf_extract_raw(msg, '$'))
+
+  def test_without_hint(self):
+    msg = self.person()
+    self.assertEqual(b'Kaila', self.protobuf_extract_raw(msg, '$.#1'))
+    self.assertEqual(-7, self.protobuf_extract_raw(msg, '$.#2'))
+    self.assertEqual(5, self.protobuf_extract_raw(msg, '$.#3'))
+    self.assertEqual(0xffffffff, self.protobuf_extract_raw(msg, '$.#5'))
+    self.assertEqual(struct.unpack('<q', struct.pack('<d', 98.6))[0],
+      self.protobuf_extract_raw(msg, '$.#4'))
+
+  def test_hints(self):
+    msg = self.person()
+    self.assertEqual('Kaila', self.protobuf_extract_raw(msg, '$.#1', 'string'))
+    self.assertEqual(b'Kaila', self.protobuf_extract_raw(msg, '$.#1', 'bytes'))
+    self.assertEqual(-7, self.protobuf_extract_raw(msg, '$.#2', 'int32'))
+    self.assertEqual(-3, self.protobuf_extract_raw(msg, '$.#3', 'sint64'))
+    self.assertEqual(98.6, self.protobuf_extract_raw(msg, '$.#4', 'double'))
+    self.assertEqual(-1, self.protobuf_extract_raw(msg, '$.#5', 'sfixed32'))
+    self.assertEqual(1, self.protobuf_extract_raw(msg, '$.#2', 'bool'))
+
+  def test_wrong_wire_type_is_skipped(self):
+    msg = self.person()
+    self.assertIsNone(self.protobuf_extract_raw(msg, '$.#5', 'int32'))
+    self.assertIsNone(self.protobuf_extract_raw(msg, '$.#2', 'fixed64'))
+    self.assertIsNone(self.protobuf_extract_raw(msg, '$.#2', 'string'))
+    self.assertIsNone(self.protobuf_extract_raw(msg, '$.#2.#1'))
+
+  def test_nested(self):
+    msg = self.person()
+    self.assertEqual('555-1001',
+      self.protobuf_extract_raw(msg, '$.#6[1].#1', 'string'))
+    self.assertEqual(2, self.protobuf_extract_raw(msg, '$.#6[1].#2'))
+    self.assertEqual(b'555-1002', self.protobuf_extract_raw(msg, '$.#6[-1].#1'))
+    self.assertEqual(msg.phones[0].SerializeToString(),
+      self.protobuf_extract_raw(msg, '$.#6[0]'))
+    self.assertIsNone(self.protobuf_extract_raw(msg, '$.#6[3].#1'))
+    self.assertIsNone(self.protobuf_extract_raw(msg, '$.#6[-4].#1'))
+    self.assertIsNone(self.protobuf_extract_raw(msg, '$.#9.#1'))
+
+  def test_packed(self):
+    msg = self.person()
+    self.assertEqual(300, self.protobuf_extract_raw(msg, '$.#7[1]', 'int32'))
+    self.assertEqual(70000,
+      self.protobuf_extract_raw(msg, '$.#7[-1]', 'int32'))
+    self.assertEqual(70000, self.protobuf_extract_raw(msg, '$.#7', 'int32'))
+    self.assertIsNone(self.protobuf_extract_raw(msg, '$.#7[3]', 'int32'))
+    self.assertEqual(1.5, self.protobuf_extract_raw(msg, '$.#8[1]', 'float'))
+    self.assertIsNone(self.protobuf_extract_raw(msg, '$.#8[2]', 'float'))
+
+    # Without a hint, the packed run is a single occurrence
+    self.assertEqual(b'\x05\xac\x02\xf0\xa2\x04',
+      self.protobuf_extract_raw(msg, '$.#7[0]'))
+
+  def test_packed_and_unpacked(self):
+    data = b'\x3a\x02\x01\x02' + b'\x38\x03' + b'\x3a\x01\x04'
+    self.assertEqual([1, 2, 3, 4, None], [
+      self.protobuf_extract_raw(data, '$.#7[%d]' % i, 'int32')
+      for i in range(5)])
+    self.assertEqual(2, self.protobuf_extract_raw(data, '$.#7[-3]', 'uint64'))
+
+  def test_last_occurrence(self):
+    data = b'\x10\x01\x10\x02'
+    self.assertEqual(2, self.protobuf_extract_raw(data, '$.#2'))
+    self.assertEqual(1, self.protobuf_extract_raw(data, '$.#2[0]'))
+
+  def test_messages_are_merged(self):
+    first = self.proto.Person.PhoneNumber(number='555-1000')
+    second = self.proto.Person.PhoneNumber(type=3)
+    data = b''.join(b'\x4a' + bytes([len(part)]) + part for part in
+      (first.SerializeToString(), second.SerializeToString()))
+    self.assertEqual('555-1000',
+      self.protobuf_extract_raw(data, '$.#9.#1', 'string'))
+    self.assertEqual(3, self.protobuf_extract_raw(data, '$.#9.#2'))
+    merged = self.protobuf_extract_raw(data, '$.#9', 'message')
+    self.assertEqual(self.proto.Person.PhoneNumber(number='555-1000', type=3),
+      self.proto.Person.PhoneNumber.FromString(merged))
+    self.assertEqual(second.SerializeToString(),
+      self.protobuf_extract_raw(data, '$.#9'))
+
+  def test_unknown_fields(self):
+    # A field that is not in the message type, added by a newer producer
+    data = self.person().SerializeToString() + b'\xa2\x06\x03new'
+    self.assertEqual('new', self.protobuf_extract_raw(data, '$.#100', 'string'))
+
+  def test_empty(self):
+    self.assertEqual(b'', self.protobuf_extract_raw(b'', '$'))
+    self.assertIsNone(self.protobuf_extract_raw(b'', '$.#1'))
+    self.assertEqual(b'', self.protobuf_extract_raw(b'\x0a\x00', '$.#1'))
+    self.assertIsNone(self.protobuf_extract_raw(None, '$.#1'))
+
+  def test_malformed(self):
+    for data in (b'\x0a\x05ab', b'\x10', b'\x3a\x02\x01', b'\x00\x01'):
+      with self.assertRaisesRegex(sqlite3.OperationalError, 'parse'):
+        self.protobuf_extract_raw(data, '$.#7[9]', 'int32')
+
+  def test_bad_path(self):
+    msg = self.person()
+    for path in ('#1', '$.name', '$.#', '$.#-1', '$.#0', '$.#536870912',
+                 '$.#1x', '$.#1[', '$.#1[a]', '$..#1'):
+      with self.assertRaises(sqlite3.OperationalError, msg=path):
+        self.protobuf_extract_raw(msg, path)
+
+  def test_bad_hint(self):
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'hint'):
+      self.protobuf_extract_raw(self.person(), '$.#1', 'group')
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'hint'):
+      self.protobuf_extract_raw(self.person(), '$.#1', 'text')
+
+  def test_varying_hint(self):
+    data = self.person().SerializeToString()
+    c = self.db.cursor()
+    c.execute('CREATE TABLE hints (hint TEXT)')
+    c.executemany('INSERT INTO hints VALUES (?)',
+      [('string',), (None,), ('bytes',)])
+    c.execute('''SELECT protobuf_extract_raw(?, '$.#1', hint) FROM hints
+                  ORDER BY rowid''', (data,))
+    self.assertEqual(c.fetchall(), [('Kaila',), (b'Kaila',), (b'Kaila',)])
+
+if __name__ == '__main__':
+  unittest.main()
@@ -0,0 +1,88 @@
+#!/usr/bin/env python
+import unittest
+
+from utils import *
+
+
+class TestProtobufFields(SQLiteProtobufTestCase, unittest.TestCase):
+  __PROTOBUF__ = '''
+  syntax = "proto2";
+  message TestMessage {
+    enum EnumValues {
+      A = 1;
+      B = 2;
+    }
+
+    optional int32 int32_field = 1;
+    optional string string_field = 2;
+    optional EnumValues enum_field = 3;
+    repeated TestMessage children = 4;
+  }
+  '''
+
+  def make_message(self):
+    msg = self.proto.TestMessage()
+    msg.int32_field = 1337
+    msg.string_field = 'abc'
+    msg.enum_field = self.proto.TestMessage.EnumValues.Value('B')
+    msg.children.add().int32_field = 42
+    return msg
+
+  def test_fields(self):
+    data = self.make_message().SerializeToString()
+    c = self.db.cursor()
+    c.execute('''SELECT value1, value2, value3, value4
+                   FROM protobuf_fields(?, ?, ?, ?, ?, ?)''',
+      (data, 'TestMessage', '$.int32_field', '$.string_field',
+       '$.enum_field.name', '$.children[0].int32_field'))
+    self.assertEqual(c.fetchall(), [(1337, 'abc', 'B', 42)])
+
+  def test_unused_columns_are_null(self):
+    data = self.make_message().SerializeToString()
+    c = self.db.cursor()
+    c.execute('SELECT value1, value2 FROM protobuf_fields(?, ?, ?)',
+      (data, 'TestMessage', '$.int32_field'))
+    self.assertEqual(c.fetchall(), [(1337, None)])
+
+  def test_fields_join(self):
+    c = self.db.cursor()
+    c.execute('CREATE TABLE messages (protobuf BLOB)')
+    for i in range(3):
+      msg = self.proto.TestMessage()
+      msg.int32_field = i
+      msg.string_field = str(i)
+      c.execute('INSERT INTO messages VALUES (?)', (msg.SerializeToString(),))
+    c.execute('''SELECT f.value1, f.value2
+                   FROM messages,
+                        protobuf_fields(messages.protobuf, 'TestMessage',
+                                        '$.int32_field', '$.string_field') AS f
+                  ORDER BY messages.rowid''')
+    self.assertEqual(c.fetchall(), [(0, '0'), (1, '1'), (2, '2')])
+
+  def test_fields_match_extract(self):
+    msg = self.make_message()
+    paths = ['$.int32_field', '$.string_field', '$.enum_field',
+             '$.children[0]', '$.children[1]']
+    c = self.db.cursor()
+    c.execute('SELECT value1, value2, value3, value4, value5 '
+              'FROM protobuf_fields(?, ?, ?, ?, ?, ?, ?)',
+      [msg.SerializeToString(), 'TestMessage'] + paths)
+    self.assertEqual(list(c.fetchone()),
+      [self.protobuf_extract(msg, 'TestMessage', p) for p in paths])
+
+  def test_bad_path(self):
+    c = self.db.cursor()
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'Invalid field'):
+      c.execute('SELECT * FROM protobuf_fields(?, ?, ?)',
+        (b'', 'TestMessage', '$.bogus'))
+
+  def test_bad_message(self):
+    c = self.db.cursor()
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'parse'):
+      c.execute('SELECT value1 FROM protobuf_fields(?, ?, ?)',
+        (b'\xff\xff', 'TestMessage', '$.int32_field'))
+      c.fetchall()
+
+
+if __name__ == '__main__':
+  unittest.main()
@@ -0,0 +1,169 @@
+#!/usr/bin/env python
+import os
+import tempfile
+import unittest
+
+from google.protobuf.internal.encoder import _VarintBytes
+
+from utils import *
+
+
+class TestProtobufFile(SQLiteProtobufTestCase, unittest.TestCase):
+  __PROTOBUF__ = '''
+  syntax = "proto2";
+  message Person {
+    optional string name = 1;
+    optional int32 id = 2;
+  }
+  '''
+
+  def setUp(self):
+    super().setUp()
+    self.workdir = tempfile.mkdtemp()
+    self.addCleanup(shutil.rmtree, self.workdir)
+
+  def write_file(self, records, name='people.pb'):
+    """Writes length-delimited records, returning the path and offsets"""
+    path = os.path.join(self.workdir, name)
+    offsets = []
+    with open(path, 'wb') as f:
+      for record in records:
+        if hasattr(record, 'SerializeToString'):
+          record = record.SerializeToString()
+        offsets.append(f.tell())
+        f.write(_VarintBytes(len(record)) + record)
+    return path, offsets
+
+  def make_people(self, count):
+    return [self.proto.Person(name='p%d' % i, id=i) for i in range(count)]
+
+  def create(self, path, name='people'):
+    self.db.execute("CREATE VIRTUAL TABLE %s USING protobuf_file('%s', "
+      "'Person')" % (name, path.replace("'", "''")))
+
+  def query(self, sql, args=()):
+    return self.db.execute(sql, args).fetchall()
+
+  def test_scan(self):
+    people = self.make_people(3000)
+    path, offsets = self.write_file(people)
+    self.create(path)
+    rows = self.query('''SELECT rowid, protobuf_extract(protobuf, 'Person',
+                                                        '$.name')
+                           FROM people''')
+    self.assertEqual(rows, [(offset, person.name)
+                            for offset, person in zip(offsets, people)])
+    self.assertEqual(self.query('SELECT protobuf FROM people LIMIT 1'),
+      [(people[0].SerializeToString(),)])
+
+  def test_rowid(self):
+    people = self.make_people(3000)
+    path, offsets = self.write_file(people)
+    self.create(path)
+
+    # Records past several entries of the sparse index
+    for i in (0, 1, 1023, 1024, 2500, 2999):
+      with self.subTest(i=i):
+        self.assertEqual(self.query('''SELECT protobuf FROM people
+                                         WHERE rowid = ?''', (offsets[i],)),
+          [(people[i].SerializeToString(),)])
+
+    # Offsets that are not the start of a record find nothing
+    for rowid in (1, offsets[1500] + 1, offsets[-1] + 1, -1, 10**12, 2.5,
+                  'x', None):
+      with self.subTest(rowid=rowid):
+        self.assertEqual(self.query('SELECT 1 FROM people WHERE rowid = ?',
+          (rowid,)), [])
+
+  def test_rowid_ranges(self):
+    people = self.make_people(3000)
+    path, offsets = self.write_file(people)
+    self.create(path)
+    for where, args, expected in (
+        ('rowid >= ?', (offsets[2000],), offsets[2000:]),
+        ('rowid > ?', (offsets[2000],), offsets[2001:]),
+        ('rowid > ?', (offsets[2000] - 1,), offsets[2000:]),
+        ('rowid < ?', (offsets[5],), offsets[:5]),
+        ('rowid <= ?', (offsets[5],), offsets[:6]),
+        ('rowid BETWEEN ? AND ?', (offsets[10], offsets[12]), offsets[10:13]),
+        ('rowid > ? AND rowid < ?', (offsets[10] + 0.5, offsets[12] - 0.5),
+         offsets[11:12]),
+        ('rowid >= ?', (offsets[-1] + 1,), []),
+        ('rowid < ?', (0,), []),
+        ('rowid < ?', ('x',), offsets),
+        ('rowid > ?', (-5.5,), offsets)):
+      with self.subTest(where=where, args=args):
+        self.assertEqual(self.query('SELECT rowid FROM people WHERE ' + where,
+          args), [(offset,) for offset in expected])
+
+  def test_insert_select(self):
+    people = self.make_people(100)
+    path, _ = self.write_file(people)
+    self.create(path)
+    self.db.execute('CREATE TABLE copy (protobuf BLOB)')
+    self.db.execute('INSERT INTO copy SELECT protobuf FROM people')
+    self.assertEqual(self.query('''SELECT count(*),
+                                          sum(protobuf_extract(protobuf,
+                                                               'Person', '$.id'))
+                                     FROM copy'''),
+      [(100, sum(range(100)))])
+
+  def test_records(self):
+    # Empty records, and a record with a length that takes several bytes
+    records = [b'', self.proto.Person(name='x' * 300), b'']
+    path, offsets = self.write_file(records)
+    self.create(path)
+    self.assertEqual(self.query('SELECT rowid, length(protobuf) FROM people'),
+      [(offsets[0], 0), (offsets[1], len(records[1].SerializeToString())),
+       (offsets[2], 0)])
+
+    path, _ = self.write_file([], 'empty.pb')
+    self.create(path, 'empty')
+    self.assertEqual(self.query('SELECT * FROM empty'), [])
+
+  def test_errors(self):
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'Could not open'):
+      self.create(os.path.join(self.workdir, 'missing.pb'))
+    path, _ = self.write_file(self.make_people(1))
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'descriptor'):
+      self.db.execute("CREATE VIRTUAL TABLE t USING protobuf_file('%s', "
+        "'Nobody')" % path)
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'requires'):
+      self.db.execute("CREATE VIRTUAL TABLE t USING protobuf_file('%s')"
+        % path)
+
+    # A record that runs past the end of the file is reported when the file
+    # is first read
+    with open(path, 'ab') as f:
+      f.write(b'\x05ab')
+    self.create(path)
+    with self.assertRaisesRegex(sqlite3.DatabaseError, 'Truncated record'):
+      self.query('SELECT * FROM people')
+
+  def test_truncated_while_open(self):
+    people = self.make_people(20000)
+    path, offsets = self.write_file(people)
+    self.create(path)
+    self.assertEqual(self.query('SELECT count(*) FROM people'), [(20000,)])
+
+    # Reading past the new end is an error rather than a crash
+    os.truncate(path, offsets[100])
+    self.assertEqual(
+      self.query('SELECT count(*) FROM people WHERE rowid < ?', (offsets[50],)),
+      [(50,)])
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'truncated'):
+      self.query('SELECT count(*) FROM people')
+
+  def test_direct_only(self):
+    path, _ = self.write_file(self.make_people(3))
+    self.create(path)
+    self.assertEqual(self.query('SELECT count(*) FROM people'), [(3,)])
+
+    # A database could otherwise read any file through its own schema
+    self.db.execute('CREATE VIEW people_view AS SELECT * FROM people')
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'unsafe use'):
+      self.query('SELECT count(*) FROM people_view')
+
+
+if __name__ == '__main__':
+  unittest.main()
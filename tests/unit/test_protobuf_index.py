@@ -0,0 +1,240 @@
+#!/usr/bin/env python
+import unittest
+
+from utils import *
+
+
+class TestProtobufIndex(SQLiteProtobufTestCase, unittest.TestCase):
+  __PROTOBUF__ = '''
+  syntax = "proto2";
+  message Person {
+    enum PhoneType {
+      MOBILE = 0;
+      HOME = 1;
+    }
+
+    message PhoneNumber {
+      optional string number = 1;
+      optional PhoneType type = 2 [default = HOME];
+    }
+
+    optional string name = 1;
+    optional int32 id = 2;
+    repeated PhoneNumber phones = 4;
+    repeated int32 scores = 6;
+  }
+  '''
+
+  def person(self, i):
+    person = self.proto.Person()
+    person.name = 'Person %d' % i
+    person.id = i
+    for j in range(i % 4):
+      phone = person.phones.add()
+      phone.number = '555-%04d' % (i * 10 + j)
+      if j == 1:
+        phone.type = self.proto.Person.MOBILE
+    person.scores.extend([i % 5, i % 7, i % 5])
+    return person
+
+  def setUp(self):
+    super().setUp()
+    self.people = [self.person(i) for i in range(20)]
+    self.db.execute('CREATE TABLE people (protobuf BLOB)')
+    self.db.executemany('INSERT INTO people VALUES (?)',
+      [(p.SerializeToString(),) for p in self.people])
+    self.db.execute('''CREATE VIRTUAL TABLE phone_idx USING protobuf_index(
+      people, protobuf, 'Person', '$.phones[*].number')''')
+
+  def query(self, sql, args=()):
+    c = self.db.cursor()
+    c.execute(sql, args)
+    return c.fetchall()
+
+  def phones(self, people=None, predicate=lambda number: True):
+    # The (number, rowid) pairs in the order of the index
+    return sorted(
+      (phone.number, rowid)
+      for rowid, person in (people or enumerate(self.people, 1))
+      for phone in person.phones if predicate(phone.number))
+
+  def test_contents(self):
+    self.assertEqual(self.query('SELECT value, rowid FROM phone_idx'),
+      self.phones())
+    self.assertEqual(
+      self.query('SELECT name, type FROM pragma_table_xinfo("phone_idx")'),
+      [('value', 'TEXT'), ('phone_idx', '')])
+
+  def test_equality(self):
+    self.assertEqual(
+      self.query('SELECT rowid FROM phone_idx WHERE value = "555-0151"'),
+      [(16,)])
+    self.assertEqual(
+      self.query('SELECT rowid FROM phone_idx WHERE phone_idx MATCH "555-0151"'),
+      [(16,)])
+    self.assertEqual(
+      self.query('SELECT rowid FROM phone_idx WHERE value = "555-9999"'), [])
+
+  def test_prefix(self):
+    self.assertEqual(
+      self.query('SELECT value, rowid FROM phone_idx WHERE value MATCH "555-01*"'),
+      self.phones(predicate=lambda n: n.startswith('555-01')))
+    self.assertEqual(
+      self.query('SELECT value FROM phone_idx WHERE phone_idx MATCH "*"'),
+      [(n,) for n, _ in self.phones()])
+
+  def test_pattern(self):
+    self.assertEqual(
+      self.query('SELECT value, rowid FROM phone_idx WHERE phone_idx MATCH "*1"'),
+      self.phones(predicate=lambda n: n.endswith('1')))
+    self.assertEqual(
+      self.query('SELECT value FROM phone_idx WHERE phone_idx MATCH "555-*3*"'),
+      [(n,) for n, _ in self.phones(predicate=lambda n: '3' in n[4:])])
+
+  def test_range(self):
+    self.assertEqual(
+      self.query('''SELECT value, rowid FROM phone_idx
+                     WHERE value >= "555-0100" AND value < "555-0150"'''),
+      self.phones(predicate=lambda n: '555-0100' <= n < '555-0150'))
+
+  def test_rowid(self):
+    self.assertEqual(self.query('SELECT value FROM phone_idx WHERE rowid = 4'),
+      [('555-0030',), ('555-0031',), ('555-0032',)])
+
+  def test_join(self):
+    self.assertEqual(
+      self.query('''SELECT protobuf_extract(protobuf, "Person", "$.name")
+                      FROM people WHERE rowid IN
+                        (SELECT rowid FROM phone_idx WHERE phone_idx MATCH "*2")
+                     ORDER BY rowid'''),
+      [('Person %d' % i,) for i in range(3, 20, 4)])
+
+  def test_plan(self):
+    plan = self.query('''EXPLAIN QUERY PLAN SELECT rowid FROM phone_idx
+                          WHERE phone_idx MATCH "555-01*"''')
+    self.assertIn('VIRTUAL TABLE INDEX 0:m', plan[0][-1])
+
+  def test_reads_no_messages(self):
+    self.db.execute('SELECT protobuf_config(?, ?)', ('stats', 'counters'))
+    self.db.execute('SELECT protobuf_stats_reset()')
+    self.query('SELECT rowid FROM phone_idx WHERE phone_idx MATCH "555-01*"')
+    self.query('SELECT rowid FROM phone_idx WHERE value = "555-0151"')
+    self.assertEqual(
+      self.query('''SELECT name, function, value FROM protobuf_stats
+                     WHERE name IN ('parse_failures', 'bytes')'''),
+      [('parse_failures', 'protobuf_index', 0),
+       ('bytes', 'protobuf_index', 0)])
+
+    # Nor does it look at the underlying table at all
+    self.db.execute('DROP TRIGGER phone_idx_update')
+    self.db.execute('UPDATE people SET protobuf = NULL')
+    self.assertEqual(
+      self.query('SELECT rowid FROM phone_idx WHERE value = "555-0151"'),
+      [(16,)])
+
+  def test_triggers(self):
+    c = self.db.cursor()
+    c.execute('INSERT INTO people VALUES (?)',
+      (self.person(101).SerializeToString(),))
+    rowid = c.lastrowid
+    c.execute('UPDATE people SET protobuf = ? WHERE rowid = 2',
+      (self.person(102).SerializeToString(),))
+    c.execute('DELETE FROM people WHERE rowid = 5')
+    c.execute('UPDATE people SET rowid = 50 WHERE rowid = 6')
+
+    people = dict(enumerate(self.people, 1))
+    people[rowid] = self.person(101)
+    people[2] = self.person(102)
+    del people[5]
+    people[50] = people.pop(6)
+    self.assertEqual(self.query('SELECT value, rowid FROM phone_idx'),
+      self.phones(people.items()))
+
+  def test_duplicates(self):
+    self.db.execute('''CREATE VIRTUAL TABLE score_idx USING protobuf_index(
+      people, protobuf, 'Person', '$.scores')''')
+    self.assertEqual(
+      self.query('SELECT name, type FROM pragma_table_xinfo("score_idx")')[0],
+      ('value', 'INTEGER'))
+
+    # A value that appears twice in a message is indexed once
+    self.assertEqual(self.query('SELECT rowid FROM score_idx WHERE value = 6'),
+      [(7,), (14,)])
+    self.assertEqual(
+      self.query('SELECT count(*) FROM score_idx WHERE value BETWEEN 2 AND 3'),
+      [(len([p for p in self.people if set(p.scores) & {2, 3}])
+        + len([p for p in self.people if {2, 3} <= set(p.scores)]),)])
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'unable to use'):
+      self.query('SELECT rowid FROM score_idx WHERE score_idx MATCH "1*"')
+
+  def test_enum_names(self):
+    self.db.execute('''CREATE VIRTUAL TABLE type_idx USING protobuf_index(
+      people, protobuf, 'Person', '$.phones[*].type.name')''')
+    self.assertEqual(
+      self.query('SELECT rowid FROM type_idx WHERE type_idx MATCH "MOB*"'),
+      [(rowid,) for rowid, p in enumerate(self.people, 1)
+       if len(p.phones) > 1])
+
+  def test_null_and_compressed(self):
+    c = self.db.cursor()
+    c.execute('INSERT INTO people VALUES (NULL)')
+    c.execute('UPDATE people SET protobuf = protobuf_compress(?) '
+              'WHERE rowid = ?', (self.person(103).SerializeToString(),
+                                  c.lastrowid))
+    self.assertEqual(
+      self.query('SELECT value FROM phone_idx WHERE rowid = ?', (c.lastrowid,)),
+      [('555-1030',), ('555-1031',), ('555-1032',)])
+
+  def test_malformed(self):
+    # Messages that cannot be read have no values, rather than stopping them
+    # from being written
+    c = self.db.cursor()
+    c.execute('INSERT INTO people VALUES (x\'ffff\')')
+    bad = c.lastrowid
+    c.execute('UPDATE people SET protobuf = x\'ffff\' WHERE rowid = 4')
+    c.execute('UPDATE people SET protobuf = x\'0070627a0700\' WHERE rowid = 8')
+    self.assertEqual(self.query('SELECT count(*) FROM people'), [(21,)])
+    people = dict(enumerate(self.people, 1))
+    del people[4], people[8]
+    self.assertEqual(self.query('SELECT value, rowid FROM phone_idx'),
+      self.phones(people.items()))
+
+    c.execute('UPDATE people SET protobuf = ? WHERE rowid = ?',
+      (self.person(103).SerializeToString(), bad))
+    self.assertEqual(
+      self.query('SELECT value FROM phone_idx WHERE rowid = ?', (bad,)),
+      [('555-1030',), ('555-1031',), ('555-1032',)])
+
+    # Nor do they stop the index from being created
+    self.db.execute('DROP TABLE phone_idx')
+    self.db.execute('''CREATE VIRTUAL TABLE phone_idx USING protobuf_index(
+      people, protobuf, 'Person', '$.phones[*].number')''')
+    people[bad] = self.person(103)
+    self.assertEqual(self.query('SELECT value, rowid FROM phone_idx'),
+      self.phones(people.items()))
+
+  def test_drop(self):
+    self.db.execute('DROP TABLE phone_idx')
+    self.assertEqual(
+      self.query('''SELECT name FROM sqlite_master
+                     WHERE name LIKE 'phone_idx%' '''), [])
+    self.db.execute('INSERT INTO people VALUES (NULL)')
+
+  def test_arguments(self):
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'requires'):
+      self.db.execute('CREATE VIRTUAL TABLE bad USING protobuf_index(people)')
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'descriptor'):
+      self.db.execute('''CREATE VIRTUAL TABLE bad USING protobuf_index(
+        people, protobuf, 'Nobody', '$.name')''')
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'Invalid'):
+      self.db.execute('''CREATE VIRTUAL TABLE bad USING protobuf_index(
+        people, protobuf, 'Person', '$.nope')''')
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'select a field'):
+      self.db.execute('''CREATE VIRTUAL TABLE bad USING protobuf_index(
+        people, protobuf, 'Person', '$')''')
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'no such column'):
+      self.db.execute('''CREATE VIRTUAL TABLE bad USING protobuf_index(
+        people, missing, 'Person', '$.name')''')
+
+if __name__ == '__main__':
+  unittest.main()
@@ -19,6 +19,27 @@ class TestProtobufLoad(SQLiteProtobufTestCase, unittest.TestCase):
     with self.assertRaisesRegex(sqlite3.OperationalError, 'Extension loading'):
       self.protobuf_load(self.proto.protobuf_library)
 
+  def test_load_after_lookup(self):
+    # A type that a connection failed to find is found once another
+    # connection loads a library with it
+    other = sqlite3.connect(':memory:')
+    self.addCleanup(other.close)
+    other.enable_load_extension(True)
+    other.load_extension(get_sqlite_protobuf_library())
+    query = "SELECT protobuf_extract(X'', 'later.Later', '$.id')"
+    for db in (self.db, other):
+      with self.assertRaisesRegex(sqlite3.OperationalError, 'descriptor'):
+        db.execute(query)
+
+    later = compile_proto('''
+    syntax = "proto2";
+    package later;
+    message Later { optional int32 id = 1; }
+    ''', name='later')
+    self.protobuf_load(later.protobuf_library)
+    for db in (self.db, other):
+      self.assertEqual(db.execute(query).fetchone(), (0,))
+
 
 if __name__ == '__main__':
   unittest.main()
@@ -0,0 +1,154 @@
+#!/usr/bin/env python
+import unittest
+
+from google.protobuf import descriptor_pb2
+
+from utils import *
+
+
+class TestProtobufLoadDescriptors(SQLiteProtobufTestCase, unittest.TestCase):
+  DEFINITIONS = '''
+  syntax = "proto2";
+  package loaded;
+  import "google/protobuf/timestamp.proto";
+
+  message Person {
+    enum PhoneType {
+      MOBILE = 0;
+      HOME = 1;
+    }
+
+    message PhoneNumber {
+      optional string number = 1;
+      optional PhoneType type = 2;
+    }
+
+    optional string name = 1;
+    repeated PhoneNumber phones = 2;
+    optional google.protobuf.Timestamp updated = 3;
+  }
+  '''
+
+  @classmethod
+  def setUpClass(cls):
+    # The library is not loaded; only the descriptors are
+    cls.proto = compile_proto(cls.DEFINITIONS)
+
+  def file_set(self, *files):
+    file_set = descriptor_pb2.FileDescriptorSet()
+    for serialized in files:
+      file_set.file.add().ParseFromString(serialized)
+    return file_set.SerializeToString()
+
+  def load(self, data, db=None):
+    c = (db or self.db).cursor()
+    c.execute('SELECT protobuf_load_descriptors(?)', (data,))
+    return c.fetchone()[0]
+
+  def make_person(self):
+    person = self.proto.Person()
+    person.name = 'Kaila'
+    person.phones.add(number='555-1000', type=self.proto.Person.HOME)
+    person.updated.seconds = 1234
+    return person
+
+  def test_load(self):
+    self.assertEqual(self.load(self.file_set(
+      self.proto.DESCRIPTOR.serialized_pb)), 1)
+    person = self.make_person()
+    self.assertEqual(self.protobuf_extract(person, 'loaded.Person', '$.name'),
+      'Kaila')
+    self.assertEqual(self.protobuf_extract(person, 'loaded.Person',
+      '$.phones[0].type.name'), 'HOME')
+    self.assertEqual(self.protobuf_extract(person, 'loaded.Person',
+      '$.updated.seconds'), 1234)
+
+  def test_enum(self):
+    self.load(self.file_set(self.proto.DESCRIPTOR.serialized_pb))
+    c = self.db.cursor()
+    c.execute('''SELECT number, name FROM protobuf_enum(?)''',
+      ('loaded.Person.PhoneType',))
+    self.assertEqual(c.fetchall(), [(0, 'MOBILE'), (1, 'HOME')])
+
+  def test_table_functions(self):
+    self.load(self.file_set(self.proto.DESCRIPTOR.serialized_pb))
+    data = self.make_person().SerializeToString()
+    c = self.db.cursor()
+    c.execute('''SELECT type FROM protobuf_each(?, 'loaded.Person',
+                                                '$.phones')''', (data,))
+    self.assertEqual(c.fetchall(), [('loaded.Person.PhoneNumber',)])
+    c.execute('''SELECT value1 FROM protobuf_fields(?, 'loaded.Person',
+                                                    '$.name')''', (data,))
+    self.assertEqual(c.fetchall(), [('Kaila',)])
+
+  def test_load_from_table(self):
+    self.db.execute('CREATE TABLE schema (descriptors BLOB)')
+    self.db.execute('INSERT INTO schema VALUES (?)',
+      (self.file_set(self.proto.DESCRIPTOR.serialized_pb),))
+    c = self.db.cursor()
+    c.execute('SELECT protobuf_load_descriptors(descriptors) FROM schema')
+    self.assertEqual(c.fetchone()[0], 1)
+
+  def test_load_again(self):
+    data = self.file_set(self.proto.DESCRIPTOR.serialized_pb)
+    self.assertEqual(self.load(data), 1)
+    self.assertEqual(self.load(data), 0)
+
+    # The same file in a different set is not loaded again either
+    timestamp = descriptor_pb2.FileDescriptorProto()
+    self.proto.DESCRIPTOR.dependencies[0].CopyToProto(timestamp)
+    self.assertEqual(self.load(self.file_set(timestamp.SerializeToString(),
+      self.proto.DESCRIPTOR.serialized_pb)), 1)
+
+  def test_conflicting_file(self):
+    self.load(self.file_set(self.proto.DESCRIPTOR.serialized_pb))
+    changed = descriptor_pb2.FileDescriptorProto()
+    changed.ParseFromString(self.proto.DESCRIPTOR.serialized_pb)
+    changed.message_type[0].field[0].name = 'full_name'
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'different'):
+      self.load(self.file_set(changed.SerializeToString()))
+    self.assertEqual(self.protobuf_extract(self.make_person(),
+      'loaded.Person', '$.name'), 'Kaila')
+
+  def test_partly_loaded(self):
+    # A set whose second file clashes with its first still loads the first,
+    # and a type that was missing before is found in it
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'descriptor'):
+      self.protobuf_extract(b'', 'loaded.Person', '$.name')
+    clash = descriptor_pb2.FileDescriptorProto()
+    clash.ParseFromString(self.proto.DESCRIPTOR.serialized_pb)
+    clash.name = 'clash.proto'
+    del clash.dependency[:]
+    del clash.message_type[0].field[2]
+    timestamp = descriptor_pb2.FileDescriptorProto()
+    self.proto.DESCRIPTOR.dependencies[0].CopyToProto(timestamp)
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'clash.proto'):
+      self.load(self.file_set(timestamp.SerializeToString(),
+        self.proto.DESCRIPTOR.serialized_pb, clash.SerializeToString()))
+    self.assertEqual(self.protobuf_extract(self.make_person(),
+      'loaded.Person', '$.name'), 'Kaila')
+
+  def test_invalid(self):
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'parse'):
+      self.load(b'\xff')
+
+  def test_unknown_type(self):
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'descriptor'):
+      self.protobuf_extract(b'', 'loaded.Person', '$.name')
+    self.load(self.file_set(self.proto.DESCRIPTOR.serialized_pb))
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'descriptor'):
+      self.protobuf_extract(b'', 'loaded.Nobody', '$.name')
+
+  def test_per_connection(self):
+    self.load(self.file_set(self.proto.DESCRIPTOR.serialized_pb))
+    other = sqlite3.connect(':memory:')
+    other.enable_load_extension(True)
+    other.load_extension(get_sqlite_protobuf_library())
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'descriptor'):
+      other.execute('''SELECT protobuf_extract(x'', 'loaded.Person',
+                                               '$.name')''')
+    other.close()
+
+
+if __name__ == '__main__':
+  unittest.main()
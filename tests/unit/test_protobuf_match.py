@@ -0,0 +1,233 @@
+#!/usr/bin/env python
+import unittest
+
+from utils import *
+
+
+class TestProtobufMatch(SQLiteProtobufTestCase, unittest.TestCase):
+  __PROTOBUF__ = '''
+  syntax = "proto2";
+  message Person {
+    enum PhoneType {
+      MOBILE = 0;
+      HOME = 1;
+    }
+
+    message PhoneNumber {
+      optional string number = 1;
+      optional PhoneType type = 2 [default = HOME];
+    }
+
+    optional string name = 1;
+    optional int32 id = 2;
+    optional double score = 3;
+    repeated PhoneNumber phones = 4;
+    repeated int32 lucky = 5 [packed = true];
+    optional bytes avatar = 6;
+    optional bool active = 7;
+
+    oneof contact {
+      string email = 8;
+      PhoneNumber pager = 9;
+    }
+  }
+  '''
+
+  PEOPLE = [
+    ('Alice', 1, 3.5, [('555-1000', 0)], [7, 11], True),
+    ('Bob', 2, None, [], [], False),
+    ('Carol', 3, 1.0, [('555-3000', 1), ('555-3001', 0)], [3], None),
+    (None, 4, -2.0, [('555-4000', None)], [1, 2, 3], True),
+  ]
+
+  FILTERS = [
+    ("$.name = 'Alice'", "name = 'Alice'"),
+    ("$.name == 'Bob' OR $.id >= 3", "name = 'Bob' OR id >= 3"),
+    ("$.name != ''", "name != ''"),
+    ("$.name <> 'Carol' AND $.active = 1", "name <> 'Carol' AND active = 1"),
+    ("$.name ^= 'Ca'", "substr(name, 1, 2) = 'Ca'"),
+    ("$.name ^= ''", "1"),
+    ("$.id < 3 AND $.score > 1", "id < 3 AND score > 1"),
+    ("$.id <= 2.5", "id <= 2.5"),
+    ("$.score = 1", "score = 1"),
+    ("$.score IN (1, 3.5, -2)", "score IN (1, 3.5, -2)"),
+    ("$.id NOT IN (1, 4)", "id NOT IN (1, 4)"),
+    ("NOT ($.id = 1 OR $.id = 2)", "NOT (id = 1 OR id = 2)"),
+    ("not $.id = 1 and $.id != 3", "NOT id = 1 AND id != 3"),
+    ("$.phones[0].number = '555-3000'", "number = '555-3000'"),
+    ("$.phones[0].type = HOME", "phone_type = 1"),
+    ("$.phones[0].type.name = HOME", "phone_type = 1"),
+    ("$.phones[0].type.name IN ('MOBILE')", "phone_type = 0"),
+    ("$.phones[-1].number ^= '555-30'", "last_phone LIKE '555-30%'"),
+    ("$.phones[0] IS NULL", "phone IS NULL"),
+    ("$.phones[0] IS NOT NULL AND $.phones[1] IS NULL",
+     "phone IS NOT NULL AND second_phone IS NULL"),
+    ("$.phones[1].type = 0", "second_phone_type = 0"),
+    ("$.lucky[1] > 2", "second_lucky > 2"),
+    ("$.lucky[-1] = 3", "last_lucky = 3"),
+    ("$.active = TRUE", "active = 1"),
+    ("$.active = false", "active = 0"),
+    ("$.name > 5", "name > 5"),
+    ("$.id < 'x'", "id < 'x'"),
+    ("$.phones[1].number = '555-3001' OR $.name = 'Bob'",
+     "second_number = '555-3001' OR name = 'Bob'"),
+    ("$.#2 = 3", "id = 3"),
+    ("$.#4[0].#1 = '555-3000' OR $.phones[1].#2 = 0",
+     "number = '555-3000' OR second_phone_type = 0"),
+  ]
+
+  def setUp(self):
+    super().setUp()
+    self.db.execute('CREATE TABLE people (protobuf BLOB)')
+    for name, id, score, phones, lucky, active in self.PEOPLE:
+      person = self.proto.Person()
+      if name is not None:
+        person.name = name
+      person.id = id
+      if score is not None:
+        person.score = score
+      for number, type in phones:
+        phone = person.phones.add(number=number)
+        if type is not None:
+          phone.type = type
+      person.lucky.extend(lucky)
+      if active is not None:
+        person.active = active
+      self.db.execute('INSERT INTO people VALUES (?)',
+        (person.SerializeToString(),))
+
+  def query(self, sql, args=()):
+    c = self.db.cursor()
+    c.execute(sql, args)
+    return c.fetchall()
+
+  def match(self, data, filter):
+    if hasattr(data, 'SerializeToString'):
+      data = data.SerializeToString()
+    return self.query('SELECT protobuf_match(?, ?, ?)',
+      (data, 'Person', filter))[0][0]
+
+  def extracted(self, where):
+    return self.query('''SELECT rowid, ''' + where + ''' FROM (SELECT rowid,
+      protobuf_extract(protobuf, 'Person', '$.name') AS name,
+      protobuf_extract(protobuf, 'Person', '$.id') AS id,
+      protobuf_extract(protobuf, 'Person', '$.score') AS score,
+      protobuf_extract(protobuf, 'Person', '$.active') AS active,
+      protobuf_extract(protobuf, 'Person', '$.phones[0]') AS phone,
+      protobuf_extract(protobuf, 'Person', '$.phones[0].number') AS number,
+      protobuf_extract(protobuf, 'Person', '$.phones[0].type') AS phone_type,
+      protobuf_extract(protobuf, 'Person', '$.phones[1]') AS second_phone,
+      protobuf_extract(protobuf, 'Person',
+                       '$.phones[1].number') AS second_number,
+      protobuf_extract(protobuf, 'Person',
+                       '$.phones[1].type') AS second_phone_type,
+      protobuf_extract(protobuf, 'Person',
+                       '$.phones[-1].number') AS last_phone,
+      protobuf_extract(protobuf, 'Person', '$.lucky[1]') AS second_lucky,
+      protobuf_extract(protobuf, 'Person', '$.lucky[-1]') AS last_lucky
+      FROM people)''')
+
+  def test_agrees_with_extract(self):
+    for filter, where in self.FILTERS:
+      for engine in ('auto', 'reflection'):
+        with self.subTest(filter=filter, engine=engine):
+          self.db.execute('SELECT protobuf_config(?, ?)',
+            ('extract_engine', engine))
+          self.assertEqual(
+            self.query('''SELECT rowid, protobuf_match(protobuf, 'Person', ?)
+                            FROM people''', (filter,)),
+            self.extracted(where))
+
+  def test_engines_agree(self):
+    results = {}
+    for engine in ('auto', 'reflection'):
+      self.db.execute('SELECT protobuf_config(?, ?)',
+        ('extract_engine', engine))
+      results[engine] = [self.query('''SELECT protobuf_match(protobuf,
+                                         'Person', ?) FROM people''',
+                                    (filter,))
+                         for filter, _ in self.FILTERS]
+    self.assertEqual(results['auto'], results['reflection'])
+
+  def test_where(self):
+    self.assertEqual(self.query('''SELECT rowid FROM people
+                                    WHERE protobuf_match(protobuf, 'Person', ?)''',
+      ("$.phones[0].type = HOME AND $.name ^= 'C'",)), [(3,)])
+
+  def test_null(self):
+    # Comparisons with a missing message are unknown, as in SQL
+    person = self.proto.Person(id=1)
+    self.assertIsNone(self.match(person, '$.phones[0].number = 1'))
+    self.assertIsNone(self.match(person, 'NOT $.phones[0].number = 1'))
+    self.assertEqual(self.match(person, '$.phones[0].number = 1 OR $.id = 1'),
+      1)
+    self.assertEqual(self.match(person, '$.phones[0].number = 1 AND $.id = 2'),
+      0)
+    self.assertIsNone(self.match(None, '$.id = 1'))
+
+  def test_literals(self):
+    person = self.proto.Person(name="O'Brien", id=-5, avatar=b'\x01\x02')
+    self.assertEqual(self.match(person, "$.name = 'O''Brien'"), 1)
+    self.assertEqual(self.match(person, '$.name = "O\'Brien"'), 1)
+    self.assertEqual(self.match(person, '$.id = -5 AND $.id > -5.5'), 1)
+    self.assertEqual(self.match(person, '$.id < -1e0'), 1)
+    self.assertEqual(self.match(person, "$.avatar = '\x01\x02'"), 1)
+    self.assertEqual(self.match(person, "$.avatar ^= '\x01'"), 1)
+
+  def test_last_value_wins(self):
+    first = self.proto.Person(id=1, email='a@example.com')
+    second = self.proto.Person(id=2)
+    second.pager.number = '555-9000'
+    data = first.SerializeToString() + second.SerializeToString()
+    self.assertEqual(self.match(data, '$.id = 2'), 1)
+    self.assertEqual(self.match(data, '$.email IS NULL'), 0)
+    self.assertEqual(self.match(data, "$.email = ''"), 1)
+    self.assertEqual(self.match(data, "$.pager.number = '555-9000'"), 1)
+
+    # A message field that occurs twice is merged by the parser
+    merged = (self.proto.Person(phones=[{'number': '1'}]).SerializeToString()
+      + self.proto.Person(pager={'number': '2'}).SerializeToString()
+      + self.proto.Person(pager={'type': 0}).SerializeToString())
+    self.assertEqual(self.match(merged, "$.pager.number = '2'"), 1)
+    self.assertEqual(self.match(merged, '$.pager.type = MOBILE'), 1)
+
+  def test_early_exit(self):
+    # The filter is decided by the first field, before the malformed phone
+    # would be reached
+    data = self.proto.Person(id=1).SerializeToString() + b'\x22\x02\xff\xff'
+    self.assertEqual(self.match(data, "$.id = 2 AND $.phones[0].number = ''"),
+      0)
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'parse'):
+      self.match(data, "$.id = 1 AND $.phones[0].number = ''")
+
+  def test_malformed(self):
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'parse'):
+      self.match(b'\xff', '$.id = 1')
+
+  def test_errors(self):
+    for filter, error in (('', 'Invalid filter'),
+                          ('$.id', 'Invalid filter'),
+                          ('$.id = ', 'Invalid filter'),
+                          ('$.id = 1 AND', 'Invalid filter'),
+                          ('($.id = 1', 'Invalid filter'),
+                          ('$.id = 1)', 'Invalid filter'),
+                          ('$.id IN ()', 'Invalid filter'),
+                          ('$.id IS 1', 'Invalid filter'),
+                          ('$ = 1', 'Invalid path'),
+                          ('$.nothing = 1', 'Invalid field name'),
+                          ('$.phones.number = 1', 'index'),
+                          ("$.name = 'Alice", 'Unterminated'),
+                          ('$.id ^= 1', 'string'),
+                          ('$.id = HOME', 'Invalid filter'),
+                          ('$.phones[0].type = WORK', 'Enum value'),
+                          ('$.id = 1x', 'number'),
+                          ('$.id ~ 1', 'Invalid filter')):
+      with self.subTest(filter=filter):
+        with self.assertRaisesRegex(sqlite3.OperationalError, error):
+          self.match(b'', filter)
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'descriptor'):
+      self.query("SELECT protobuf_match(x'', 'Nobody', '$.id = 1')")
+
+
+if __name__ == '__main__':
+  unittest.main()
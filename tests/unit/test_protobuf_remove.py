@@ -0,0 +1,105 @@
+#!/usr/bin/env python
+import unittest
+
+from utils import *
+
+
+class TestProtobufRemove(SQLiteProtobufTestCase, unittest.TestCase):
+  __PROTOBUF__ = '''
+  syntax = "proto2";
+  message Person {
+    message PhoneNumber {
+      optional string number = 1;
+    }
+
+    optional string name = 1;
+    optional int32 id = 2;
+    repeated PhoneNumber phones = 3;
+    repeated int32 scores = 4 [packed = true];
+    optional PhoneNumber work = 5;
+  }
+  '''
+
+  def make_person(self):
+    person = self.proto.Person()
+    person.name = 'Kaila'
+    person.id = 7
+    for number in ('555-1000', '555-2000', '555-3000'):
+      person.phones.add(number=number)
+    person.scores.extend([1, 2, 3])
+    person.work.number = '555-4000'
+    return person
+
+  def protobuf_remove(self, data, path):
+    if hasattr(data, 'SerializeToString'):
+      data = data.SerializeToString()
+    c = self.db.cursor()
+    c.execute('SELECT protobuf_remove(?, ?, ?)', (data, 'Person', path))
+    result = c.fetchone()[0]
+    person = self.proto.Person()
+    person.ParseFromString(result)
+    return person
+
+  def test_field(self):
+    expected = self.make_person()
+    expected.ClearField('name')
+    self.assertEqual(self.protobuf_remove(self.make_person(), '$.name'),
+      expected)
+
+  def test_nested(self):
+    expected = self.make_person()
+    expected.work.ClearField('number')
+    person = self.protobuf_remove(self.make_person(), '$.work.number')
+    self.assertEqual(person, expected)
+    self.assertTrue(person.HasField('work'))
+
+  def test_element(self):
+    for index, remaining in ((0, ['555-2000', '555-3000']),
+                             (1, ['555-1000', '555-3000']),
+                             (-1, ['555-1000', '555-2000'])):
+      with self.subTest(index=index):
+        person = self.protobuf_remove(self.make_person(),
+          '$.phones[%d]' % index)
+        self.assertEqual([p.number for p in person.phones], remaining)
+
+  def test_packed(self):
+    person = self.protobuf_remove(self.make_person(), '$.scores[1]')
+    self.assertEqual(list(person.scores), [1, 3])
+    for i in range(3):
+      person = self.protobuf_remove(person, '$.scores[0]')
+    self.assertEqual(list(person.scores), [])
+    expected = self.make_person()
+    expected.ClearField('scores')
+    self.assertEqual(person.SerializeToString(), expected.SerializeToString())
+
+  def test_all_elements(self):
+    expected = self.make_person()
+    expected.ClearField('phones')
+    self.assertEqual(self.protobuf_remove(self.make_person(), '$.phones'),
+      expected)
+    expected.ClearField('scores')
+    self.assertEqual(self.protobuf_remove(expected, '$.scores'), expected)
+
+  def test_inside_element(self):
+    person = self.protobuf_remove(self.make_person(), '$.phones[1].number')
+    self.assertEqual(len(person.phones), 3)
+    self.assertFalse(person.phones[1].HasField('number'))
+
+  def test_not_present(self):
+    data = self.proto.Person(id=1).SerializeToString()
+    for path in ('$.name', '$.work.number', '$.phones[0]', '$.phones',
+                 '$.scores[-1]'):
+      with self.subTest(path=path):
+        c = self.db.cursor()
+        c.execute('SELECT protobuf_remove(?, ?, ?)', (data, 'Person', path))
+        self.assertEqual(c.fetchone()[0], data)
+
+  def test_bad_paths(self):
+    for path in ('$', '$.phones.number', '$.nothing'):
+      with self.subTest(path=path):
+        with self.assertRaises(sqlite3.OperationalError):
+          self.protobuf_remove(self.make_person(), path)
+
+
+if __name__ == '__main__':
+  unittest.main()
@@ -0,0 +1,166 @@
+#!/usr/bin/env python
+import base64
+import csv
+import io
+import json
+import os
+import tempfile
+import unittest
+
+from google.protobuf import descriptor_pb2
+
+from utils import *
+
+
+def get_protobuf_scan():
+  return os.path.join(os.environ['CMAKE_CURRENT_BINARY_DIR'], '..', 'tools',
+    'protobuf_scan')
+
+
+class TestProtobufScan(SQLiteProtobufTestCase, unittest.TestCase):
+  __PROTOBUF__ = '''
+  syntax = "proto2";
+  message Person {
+    optional string name = 1;
+    optional int32 id = 2;
+    optional double score = 3;
+    optional bytes photo = 4;
+  }
+  '''
+
+  def setUp(self):
+    super().setUp()
+    self.workdir = tempfile.mkdtemp()
+    self.addCleanup(shutil.rmtree, self.workdir)
+
+    # Leave gaps in the rowids, so that some chunks are empty
+    self.people = {}
+    for i in range(1, 500):
+      rowid = i if i < 300 else i * 7
+      self.people[rowid] = self.proto.Person(name='p"%d,' % i, id=i,
+        score=i / 4, photo=bytes([i % 256]))
+    self.people[5].ClearField('name')
+
+    self.path = os.path.join(self.workdir, 'people.db')
+    db = sqlite3.connect(self.path)
+    db.execute('PRAGMA journal_mode=WAL')
+    db.execute('CREATE TABLE people (protobuf BLOB)')
+    db.executemany('INSERT INTO people (rowid, protobuf) VALUES (?, ?)',
+      [(rowid, person.SerializeToString())
+       for rowid, person in self.people.items()])
+    db.commit()
+    db.close()
+
+  def scan(self, *args, load=True):
+    cmd = [get_protobuf_scan()]
+    if load:
+      cmd += ['--load', self.proto.protobuf_library]
+    cmd += list(args)
+    return subprocess.run(cmd, stdout=subprocess.PIPE,
+      stderr=subprocess.PIPE, universal_newlines=True)
+
+  def expected(self):
+    return [(rowid, person.name, person.id)
+            for rowid, person in sorted(self.people.items())]
+
+  def test_csv(self):
+    for threads in ('1', '4'):
+      with self.subTest(threads=threads):
+        result = self.scan('--threads', threads, '--chunk-size', '16',
+          self.path, 'people', 'protobuf', 'Person', 'name=$.name', '$.id')
+        self.assertEqual(result.returncode, 0, result.stderr)
+        rows = list(csv.reader(io.StringIO(result.stdout, newline='')))
+        self.assertEqual(rows[0], ['rowid', 'name', '$.id'])
+        self.assertEqual(rows[1:], [[str(rowid), name or '', str(id)]
+                                    for rowid, name, id in self.expected()])
+
+  def test_ndjson(self):
+    result = self.scan('--threads', '3', '--chunk-size', '50', '--format',
+      'ndjson', self.path, 'people', 'protobuf', 'Person', 'name=$.name',
+      'id=$.id', 'score=$.score', 'photo=$.photo')
+    self.assertEqual(result.returncode, 0, result.stderr)
+    rows = [json.loads(line) for line in result.stdout.splitlines()]
+    self.assertEqual(rows, [{
+        'rowid': rowid,
+        'name': person.name,
+        'id': person.id,
+        'score': person.score,
+        'photo': base64.b64encode(person.photo).decode('ascii'),
+      } for rowid, person in sorted(self.people.items())])
+
+  def test_table(self):
+    target = os.path.join(self.workdir, 'target.db')
+    output = os.path.join(self.workdir, 'ignored.csv')
+    result = self.scan('--threads', '4', '--chunk-size', '7', '--table',
+      target + ':names', '--output', output, self.path, 'people', 'protobuf',
+      'Person', 'name=$.name', 'id=$.id')
+    self.assertEqual(result.returncode, 0, result.stderr)
+    db = sqlite3.connect(target)
+    self.addCleanup(db.close)
+    self.assertEqual(db.execute('SELECT rowid, name, id FROM names').fetchall(),
+      self.expected())
+
+  def test_descriptors(self):
+    descriptors = os.path.join(self.workdir, 'descriptors.pb')
+    with open(descriptors, 'wb') as f:
+      f.write(descriptor_pb2.FileDescriptorSet(file=[
+        descriptor_pb2.FileDescriptorProto.FromString(
+          self.proto.DESCRIPTOR.serialized_pb)]).SerializeToString())
+    result = self.scan('--descriptors', descriptors, self.path, 'people',
+      'protobuf', 'Person', 'id=$.id', load=False)
+    self.assertEqual(result.returncode, 0, result.stderr)
+    self.assertEqual(len(result.stdout.splitlines()), len(self.people) + 1)
+
+  def test_empty(self):
+    db = sqlite3.connect(self.path)
+    db.execute('DELETE FROM people')
+    db.commit()
+    db.close()
+    result = self.scan(self.path, 'people', 'protobuf', 'Person', '$.id')
+    self.assertEqual(result.returncode, 0, result.stderr)
+    self.assertEqual(result.stdout, 'rowid,$.id\n')
+
+  def test_sparse(self):
+    # The gaps between rowids are skipped, however wide
+    db = sqlite3.connect(self.path)
+    db.execute('DELETE FROM people')
+    self.people = {
+      rowid: self.proto.Person(name='p%d' % i, id=i)
+      for i, rowid in enumerate((-2**63, -5, 1, 10**12, 2**63 - 1))}
+    db.executemany('INSERT INTO people (rowid, protobuf) VALUES (?, ?)',
+      [(rowid, person.SerializeToString())
+       for rowid, person in self.people.items()])
+    db.commit()
+    db.close()
+    result = subprocess.run([get_protobuf_scan(), '--load',
+      self.proto.protobuf_library, '--threads', '2', '--chunk-size', '1',
+      self.path, 'people', 'protobuf', 'Person', 'name=$.name', '$.id'],
+      stdout=subprocess.PIPE, stderr=subprocess.PIPE, universal_newlines=True,
+      timeout=30)
+    self.assertEqual(result.returncode, 0, result.stderr)
+    rows = list(csv.reader(io.StringIO(result.stdout, newline='')))
+    self.assertEqual(rows[1:], [[str(rowid), name, str(id)]
+                                for rowid, name, id in self.expected()])
+
+  def test_errors(self):
+    for args, message in (
+        ((self.path, 'people', 'protobuf', 'Nobody', '$.id'), 'descriptor'),
+        ((self.path, 'people', 'protobuf', 'Person', '$.nothing'),
+         'Invalid field name'),
+        ((self.path, 'nobody', 'protobuf', 'Person', '$.id'), 'no such table'),
+        ((os.path.join(self.workdir, 'missing.db'), 'people', 'protobuf',
+          'Person', '$.id'), 'unable to open'),
+        (('--threads', '0', self.path, 'people', 'protobuf', 'Person',
+          '$.id'), 'positive'),
+        (('--format', 'xml', self.path, 'people', 'protobuf', 'Person',
+          '$.id'), 'unknown format'),
+        ((self.path, 'people', 'protobuf', 'Person'), 'usage')):
+      with self.subTest(args=args):
+        result = self.scan(*args)
+        self.assertNotEqual(result.returncode, 0)
+        self.assertIn(message, result.stderr)
+        self.assertEqual(result.stdout, '')
+
+
+if __name__ == '__main__':
+  unittest.main()
@@ -0,0 +1,186 @@
+#!/usr/bin/env python
+import unittest
+
+from utils import *
+
+
+class TestProtobufSet(SQLiteProtobufTestCase, unittest.TestCase):
+  __PROTOBUF__ = '''
+  syntax = "proto2";
+  message Person {
+    enum PhoneType {
+      MOBILE = 0;
+      HOME = 1;
+    }
+
+    message PhoneNumber {
+      optional string number = 1;
+      optional PhoneType type = 2;
+    }
+
+    optional string name = 1;
+    optional int32 id = 2;
+    repeated PhoneNumber phones = 3;
+    repeated int32 scores = 4 [packed = true];
+    optional sint64 balance = 5;
+    optional double height = 6;
+    optional fixed32 flags = 7;
+    optional bool active = 8;
+    optional bytes avatar = 9;
+    optional PhoneNumber work = 10;
+
+    oneof contact {
+      string email = 11;
+      PhoneNumber pager = 12;
+    }
+  }
+  '''
+
+  def make_person(self):
+    person = self.proto.Person()
+    person.name = 'Kaila'
+    person.id = 7
+    person.phones.add(number='555-1000', type=self.proto.Person.HOME)
+    person.phones.add(number='555-2000')
+    person.scores.extend([1, 2, 3])
+    return person
+
+  def protobuf_set(self, data, path, value):
+    if hasattr(data, 'SerializeToString'):
+      data = data.SerializeToString()
+    c = self.db.cursor()
+    c.execute('SELECT protobuf_set(?, ?, ?, ?)', (data, 'Person', path, value))
+    result = c.fetchone()[0]
+    person = self.proto.Person()
+    person.ParseFromString(result)
+    return person
+
+  def test_scalars(self):
+    expected = self.make_person()
+    expected.name = 'Kaila Smith'
+    expected.id = -3
+    expected.balance = -12345678901
+    expected.height = 1.75
+    expected.flags = 0xdeadbeef
+    expected.active = True
+    expected.avatar = b'\x00\xff'
+    person = self.make_person()
+    for path, value in (('$.name', 'Kaila Smith'), ('$.id', -3),
+                        ('$.balance', -12345678901), ('$.height', 1.75),
+                        ('$.flags', 0xdeadbeef), ('$.active', 1),
+                        ('$.avatar', b'\x00\xff')):
+      person = self.protobuf_set(person, path, value)
+    self.assertEqual(person, expected)
+
+  def test_repeated(self):
+    expected = self.make_person()
+    expected.phones[1].number = '555-2001'
+    expected.phones[0].type = self.proto.Person.MOBILE
+    person = self.protobuf_set(self.make_person(), '$.phones[-1].number',
+      '555-2001')
+    person = self.protobuf_set(person, '$.phones[0].type', 0)
+    self.assertEqual(person, expected)
+
+  def test_packed(self):
+    expected = self.make_person()
+    expected.scores[1] = 300
+    person = self.protobuf_set(self.make_person(), '$.scores[1]', 300)
+    self.assertEqual(person, expected)
+    self.assertEqual(person.SerializeToString(), expected.SerializeToString())
+
+  def test_enum_name(self):
+    person = self.protobuf_set(self.make_person(), '$.phones[1].type.name',
+      'HOME')
+    self.assertEqual(person.phones[1].type, self.proto.Person.HOME)
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'Enum'):
+      self.protobuf_set(self.make_person(), '$.phones[1].type.name', 'PAGER')
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'Enum'):
+      self.protobuf_set(self.make_person(), '$.phones[1].type', 5)
+
+  def test_creates_messages(self):
+    person = self.protobuf_set(b'', '$.work.number', '555-3000')
+    self.assertEqual(person.work.number, '555-3000')
+    person = self.protobuf_set(person, '$.work.type', 1)
+    self.assertEqual(person.work.number, '555-3000')
+    self.assertEqual(person.work.type, self.proto.Person.HOME)
+
+  def test_whole_message(self):
+    phone = self.proto.Person.PhoneNumber(number='555-4000')
+    person = self.protobuf_set(self.make_person(), '$.phones[0]',
+      phone.SerializeToString())
+    self.assertEqual(person.phones[0], phone)
+    self.assertEqual(len(person.phones), 2)
+
+  def test_oneof(self):
+    person = self.make_person()
+    person.email = 'kaila@example.com'
+    person = self.protobuf_set(person, '$.pager.number', '555-5000')
+    self.assertEqual(person.WhichOneof('contact'), 'pager')
+    self.assertEqual(person.pager.number, '555-5000')
+    person = self.protobuf_set(person, '$.email', 'k@example.com')
+    self.assertEqual(person.WhichOneof('contact'), 'email')
+
+  def test_repeated_occurrences(self):
+    # The last occurrence of a field wins, and a submessage split across
+    # several occurrences is merged
+    first = self.proto.Person(id=1, work={'number': '555-1000'})
+    second = self.proto.Person(id=2, work={'type': 'HOME'})
+    data = first.SerializeToString() + second.SerializeToString()
+    person = self.protobuf_set(data, '$.id', 3)
+    self.assertEqual(person.id, 3)
+    person = self.protobuf_set(data, '$.work.number', '555-2000')
+    self.assertEqual(person.work.number, '555-2000')
+    self.assertEqual(person.work.type, self.proto.Person.HOME)
+
+  def test_out_of_range(self):
+    data = self.make_person().SerializeToString()
+    for path, value in (('$.phones[2].number', '555-3000'),
+                        ('$.phones[-3].number', '555-3000'),
+                        ('$.scores[3]', 4)):
+      with self.subTest(path=path):
+        c = self.db.cursor()
+        c.execute('SELECT protobuf_set(?, ?, ?, ?)',
+          (data, 'Person', path, value))
+        self.assertEqual(c.fetchone()[0], data)
+
+  def test_null(self):
+    person = self.protobuf_set(self.make_person(), '$.name', None)
+    self.assertFalse(person.HasField('name'))
+    c = self.db.cursor()
+    c.execute('''SELECT protobuf_set(NULL, 'Person', '$.name', 'Kaila')''')
+    self.assertIsNone(c.fetchone()[0])
+
+  def test_bad_values(self):
+    for path, value in (('$.id', 'seven'), ('$.id', 2**31), ('$.id', 1.5),
+                        ('$.flags', -1), ('$.height', b'tall'),
+                        ('$.work', 'text')):
+      with self.subTest(path=path, value=value):
+        with self.assertRaises(sqlite3.OperationalError):
+          self.protobuf_set(self.make_person(), path, value)
+
+  def test_bad_paths(self):
+    for path in ('$', '$.phones', '$.nothing'):
+      with self.subTest(path=path):
+        with self.assertRaises(sqlite3.OperationalError):
+          self.protobuf_set(self.make_person(), path, 1)
+
+  def test_malformed(self):
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'parse'):
+      self.protobuf_set(b'\x0a\x05ab', '$.id', 1)
+
+  def test_update(self):
+    self.db.execute('CREATE TABLE people (protobuf BLOB)')
+    for i in range(5):
+      self.db.execute('INSERT INTO people VALUES (?)',
+        (self.proto.Person(id=i).SerializeToString(),))
+    self.db.execute('''UPDATE people
+                          SET protobuf = protobuf_set(protobuf, 'Person',
+                                                      '$.name', 'id' || rowid)''')
+    c = self.db.cursor()
+    c.execute('''SELECT protobuf_extract(protobuf, 'Person', '$.name')
+                   FROM people''')
+    self.assertEqual(c.fetchall(), [('id%d' % i,) for i in range(1, 6)])
+
+
+if __name__ == '__main__':
+  unittest.main()
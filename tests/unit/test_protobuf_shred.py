@@ -0,0 +1,337 @@
+#!/usr/bin/env python
+import os
+import tempfile
+import unittest
+
+from utils import *
+
+
+class TestProtobufShred(SQLiteProtobufTestCase, unittest.TestCase):
+  __PROTOBUF__ = '''
+  syntax = "proto2";
+  message Person {
+    enum PhoneType {
+      MOBILE = 0;
+      HOME = 1;
+    }
+
+    message PhoneNumber {
+      optional string number = 1;
+      optional PhoneType type = 2 [default = HOME];
+    }
+
+    optional string name = 1;
+    optional int32 id = 2;
+    optional double score = 3;
+    repeated PhoneNumber phones = 4;
+    optional bytes avatar = 5;
+    repeated int32 scores = 6;
+    optional bool active = 7;
+  }
+
+  message Document {
+    required int64 doc_id = 1;
+
+    message Links {
+      repeated int64 backward = 1;
+      repeated int64 forward = 2;
+    }
+    optional Links links = 2;
+
+    message Language {
+      required string code = 1;
+      optional string country = 2;
+    }
+    message Name {
+      repeated Language language = 1;
+      optional string url = 2;
+    }
+    repeated Name name = 3;
+  }
+
+  message Node {
+    optional int32 value = 1;
+    repeated Node children = 2;
+  }
+  '''
+
+  COLUMNS = [
+    ('name', 'TEXT', '$.name'),
+    ('id', 'INTEGER', '$.id'),
+    ('score', 'REAL', '$.score'),
+    ('phones_number', 'TEXT', '$.phones[*].number'),
+    ('phones_type', 'TEXT', '$.phones[*].type'),
+    ('avatar', 'BLOB', '$.avatar'),
+    ('scores', 'TEXT', '$.scores[*]'),
+    ('active', 'INTEGER', '$.active'),
+  ]
+
+  def person(self, i):
+    person = self.proto.Person()
+    if i % 4 != 3:
+      person.name = 'Person %d' % i
+    person.id = i
+    if i % 3 == 0:
+      person.score = i / 2
+    for j in range(i % 4):
+      phone = person.phones.add()
+      if j != 1:
+        phone.number = '555-%04d' % (i * 10 + j)
+      if j == 2:
+        phone.type = self.proto.Person.MOBILE
+    if i % 5 == 0:
+      person.avatar = bytes([i, 0, 255])
+    person.scores.extend(range(i % 3))
+    if i % 2:
+      person.active = i % 3 == 0
+    return person
+
+  def setUp(self):
+    super().setUp()
+    self.people = [self.person(i) for i in range(20)]
+    self.db.execute('CREATE TABLE people (protobuf BLOB)')
+    self.db.executemany('INSERT INTO people VALUES (?)',
+      [(p.SerializeToString(),) for p in self.people])
+    self.db.execute('''CREATE VIRTUAL TABLE people_cols USING protobuf_shred(
+      people, protobuf, 'Person')''')
+
+  def query(self, sql, args=()):
+    c = self.db.cursor()
+    c.execute(sql, args)
+    return c.fetchall()
+
+  def test_columns(self):
+    self.assertEqual(
+      self.query('''SELECT name, type FROM pragma_table_xinfo('people_cols')'''),
+      [(name, type) for name, type, _ in self.COLUMNS] + [('protobuf', '')])
+    self.assertEqual(
+      self.query('SELECT id, name, path FROM people_cols_columns'),
+      [(i, name, path) for i, (name, _, path) in enumerate(self.COLUMNS)])
+
+  def test_values(self):
+    # Each column holds what protobuf_extract would return for its path, or
+    # protobuf_extract_all for a path with a repeated field
+    for name, _, path in self.COLUMNS:
+      function = 'protobuf_extract_all' if '[*]' in path else 'protobuf_extract'
+      self.assertEqual(
+        self.query('SELECT rowid, "%s" FROM people_cols' % name),
+        self.query('SELECT rowid, %s(protobuf, "Person", ?) FROM people'
+          % function, (path,)),
+        msg=name)
+
+  def test_message(self):
+    rows = self.query('SELECT rowid, protobuf FROM people_cols')
+    self.assertEqual([rowid for rowid, _ in rows], list(range(1, 21)))
+    for (_, data), person in zip(rows, self.people):
+      self.assertEqual(self.proto.Person.FromString(data), person)
+
+  def test_rowid(self):
+    self.assertEqual(
+      self.query('SELECT name, phones_number FROM people_cols WHERE rowid = 3'),
+      [('Person 2', '["555-0020",""]')])
+    self.assertEqual(
+      self.query('SELECT protobuf FROM people_cols WHERE rowid = 3'),
+      [(self.people[2].SerializeToString(),)])
+    self.assertEqual(
+      self.query('SELECT name FROM people_cols WHERE rowid = 100'), [])
+
+  def test_join(self):
+    self.assertEqual(
+      self.query('''SELECT p.rowid, c.id FROM people p
+                      JOIN people_cols c ON c.rowid = p.rowid
+                     WHERE p.rowid % 7 = 0 ORDER BY p.rowid'''),
+      [(7, 6), (14, 13)])
+
+  def test_aggregate(self):
+    self.assertEqual(self.query('''SELECT count(*), sum(id), max(score)
+                                     FROM people_cols'''),
+      [(20, sum(range(20)), 9.0)])
+
+  def test_reads_only_used_columns(self):
+    # Without the table of one column, the others can still be read
+    self.db.execute('DROP TABLE people_cols_c3')
+    self.assertEqual(self.query('SELECT count(name) FROM people_cols'), [(20,)])
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'no such table'):
+      self.query('SELECT phones_number FROM people_cols')
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'no such table'):
+      self.query('SELECT protobuf FROM people_cols')
+
+  def test_triggers(self):
+    c = self.db.cursor()
+    new = self.person(101)
+    c.execute('INSERT INTO people VALUES (?)', (new.SerializeToString(),))
+    rowid = c.lastrowid
+    c.execute('UPDATE people SET protobuf = ? WHERE rowid = 2',
+      (self.person(102).SerializeToString(),))
+    c.execute('DELETE FROM people WHERE rowid = 5')
+    c.execute('UPDATE people SET rowid = 50 WHERE rowid = 6')
+    self.assertLess(rowid, 50)
+
+    self.assertEqual(
+      self.query('SELECT rowid, id FROM people_cols WHERE rowid IN (2, 5, 6, 50)'
+                 ' OR rowid = ? ORDER BY rowid', (rowid,)),
+      [(2, 102), (rowid, 101), (50, 5)])
+    self.assertEqual(self.query('SELECT rowid, protobuf FROM people_cols'),
+      self.query('SELECT rowid, protobuf FROM people ORDER BY rowid'))
+
+  def test_null_and_compressed(self):
+    c = self.db.cursor()
+    c.execute('INSERT INTO people VALUES (NULL)')
+    self.assertEqual(self.query('SELECT count(*) FROM people_cols'), [(20,)])
+
+    c.execute('UPDATE people SET protobuf = protobuf_compress(?) '
+              'WHERE rowid = ?', (self.person(103).SerializeToString(),
+                                  c.lastrowid))
+    self.assertEqual(
+      self.query('SELECT id, phones_number FROM people_cols WHERE rowid = ?',
+        (c.lastrowid,)), [(103, '["555-1030","","555-1032"]')])
+
+  def test_malformed(self):
+    # Messages that cannot be read are left out, rather than stopping them
+    # from being written
+    c = self.db.cursor()
+    c.execute('INSERT INTO people VALUES (x\'ffff\')')
+    bad = c.lastrowid
+    c.execute('UPDATE people SET protobuf = x\'ffff\' WHERE rowid = 2')
+    c.execute('UPDATE people SET protobuf = x\'0070627a0700\' WHERE rowid = 3')
+    self.assertEqual(self.query('SELECT count(*) FROM people'), [(21,)])
+    self.assertEqual(self.query('SELECT rowid FROM people_cols'),
+      [(rowid,) for rowid in range(1, 21) if rowid not in (2, 3)])
+
+    c.execute('UPDATE people SET protobuf = ? WHERE rowid = ?',
+      (self.person(104).SerializeToString(), bad))
+    self.assertEqual(
+      self.query('SELECT id FROM people_cols WHERE rowid = ?', (bad,)),
+      [(104,)])
+
+    # Nor do they stop the table from being created
+    self.db.execute('DROP TABLE people_cols')
+    self.db.execute('''CREATE VIRTUAL TABLE people_cols USING protobuf_shred(
+      people, protobuf, 'Person')''')
+    self.assertEqual(self.query('SELECT count(*) FROM people_cols'), [(19,)])
+
+  def test_drop(self):
+    self.db.execute('DROP TABLE people_cols')
+    self.assertEqual(
+      self.query('''SELECT name FROM sqlite_master
+                     WHERE name LIKE 'people_cols%' '''), [])
+    self.db.execute('INSERT INTO people VALUES (NULL)')
+
+  def test_arguments(self):
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'requires'):
+      self.db.execute('CREATE VIRTUAL TABLE bad USING protobuf_shred(people)')
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'descriptor'):
+      self.db.execute('''CREATE VIRTUAL TABLE bad USING protobuf_shred(
+        people, protobuf, 'Nobody')''')
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'no such column'):
+      self.db.execute('''CREATE VIRTUAL TABLE bad USING protobuf_shred(
+        people, missing, 'Person')''')
+
+  def test_levels(self):
+    # The example from the Dremel paper
+    Document = self.proto.Document
+    r1 = Document(doc_id=10)
+    r1.links.forward.extend([20, 40, 60])
+    name = r1.name.add(url='http://A')
+    name.language.add(code='en-us', country='us')
+    name.language.add(code='en')
+    r1.name.add(url='http://B')
+    r1.name.add().language.add(code='en-gb', country='gb')
+    r2 = Document(doc_id=20)
+    r2.links.backward.extend([10, 30])
+    r2.links.forward.append(80)
+    r2.name.add(url='http://C')
+
+    c = self.db.cursor()
+    c.execute('CREATE TABLE documents (protobuf BLOB)')
+    c.executemany('INSERT INTO documents VALUES (?)',
+      [(r1.SerializeToString(),), (r2.SerializeToString(),)])
+    c.execute('''CREATE VIRTUAL TABLE documents_cols USING protobuf_shred(
+      documents, protobuf, 'Document')''')
+
+    self.assertEqual(self.query('SELECT name, path FROM documents_cols_columns'),
+      [('doc_id', '$.doc_id'),
+       ('links_backward', '$.links.backward[*]'),
+       ('links_forward', '$.links.forward[*]'),
+       ('name_language_code', '$.name[*].language[*].code'),
+       ('name_language_country', '$.name[*].language[*].country'),
+       ('name_url', '$.name[*].url')])
+
+    def levels(column):
+      return self.query('SELECT id, value, r, d FROM documents_cols_c%d'
+        % column)
+    self.assertEqual(levels(1),
+      [(1, None, 0, 1), (2, 10, 0, 2), (2, 30, 1, 2)])
+    self.assertEqual(levels(3), [
+      (1, 'en-us', 0, 2), (1, 'en', 2, 2), (1, None, 1, 1), (1, 'en-gb', 1, 2),
+      (2, None, 0, 1)])
+    self.assertEqual(levels(4), [
+      (1, 'us', 0, 3), (1, None, 2, 2), (1, None, 1, 1), (1, 'gb', 1, 3),
+      (2, None, 0, 1)])
+    self.assertEqual(levels(5), [
+      (1, 'http://A', 0, 2), (1, 'http://B', 1, 2), (1, None, 1, 1),
+      (2, 'http://C', 0, 2)])
+
+    self.assertEqual(
+      self.query('SELECT name_language_code, name_url FROM documents_cols'),
+      [('["en-us","en","en-gb"]', '["http://A","http://B",""]'),
+       ('[]', '["http://C"]')])
+    self.assertEqual(
+      [Document.FromString(data)
+       for data, in self.query('SELECT protobuf FROM documents_cols')],
+      [r1, r2])
+
+  def test_recursive(self):
+    root = self.proto.Node(value=1)
+    child = root.children.add(value=2)
+    child.children.add(value=3)
+    root.children.add()
+
+    c = self.db.cursor()
+    c.execute('CREATE TABLE nodes (protobuf BLOB)')
+    c.execute('INSERT INTO nodes VALUES (?)', (root.SerializeToString(),))
+    c.execute('''CREATE VIRTUAL TABLE nodes_cols USING protobuf_shred(
+      nodes, protobuf, 'Node')''')
+
+    # A message of a type on the way to it is stored whole
+    self.assertEqual(
+      self.query('''SELECT name, type FROM pragma_table_xinfo('nodes_cols')'''),
+      [('value', 'INTEGER'), ('children', 'TEXT'), ('protobuf', '')])
+    self.assertEqual(
+      self.query('SELECT children FROM nodes_cols'),
+      self.query('''SELECT protobuf_extract_all(protobuf, 'Node',
+                      '$.children[*]') FROM nodes'''))
+    self.assertEqual(
+      self.proto.Node.FromString(
+        self.query('SELECT protobuf FROM nodes_cols')[0][0]), root)
+
+  def test_stale(self):
+    path = tempfile.mktemp(suffix='.db')
+    self.addCleanup(os.remove, path)
+    db = sqlite3.connect(path)
+    db.enable_load_extension(True)
+    db.load_extension(get_sqlite_protobuf_library())
+    db.execute('SELECT protobuf_load(?)', (self.proto.protobuf_library,))
+    db.execute('CREATE TABLE people (protobuf BLOB)')
+    db.execute('''CREATE VIRTUAL TABLE people_cols USING protobuf_shred(
+      people, protobuf, 'Person')''')
+    db.execute('UPDATE people_cols_columns SET path = \'$.other\' '
+               'WHERE id = 0')
+    db.commit()
+    db.close()
+
+    db = sqlite3.connect(path)
+    self.addCleanup(db.close)
+    db.enable_load_extension(True)
+    db.load_extension(get_sqlite_protobuf_library())
+    db.execute('SELECT protobuf_load(?)', (self.proto.protobuf_library,))
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'have changed'):
+      db.execute('SELECT * FROM people_cols')
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'have changed'):
+      db.execute('INSERT INTO people VALUES (NULL)')
+    db.execute('DROP TABLE people_cols')
+    self.assertEqual(db.execute('SELECT count(*) FROM sqlite_master').fetchone(),
+      (1,))
+
+if __name__ == '__main__':
+  unittest.main()
@@ -0,0 +1,198 @@
+#!/usr/bin/env python
+import unittest
+
+from utils import *
+
+
+class TestProtobufStats(SQLiteProtobufTestCase, unittest.TestCase):
+  __PROTOBUF__ = '''
+  syntax = "proto2";
+  message TestMessage {
+    optional int32 int32_field = 1;
+    optional string string_field = 2;
+    repeated OtherMessage children = 3;
+  }
+
+  message OtherMessage {
+    optional int64 int64_field = 1;
+  }
+  '''
+
+  def stats(self):
+    c = self.db.cursor()
+    c.execute('SELECT name, value FROM protobuf_stats')
+    return dict(c.fetchall())
+
+  def function_stats(self, function):
+    c = self.db.cursor()
+    c.execute('''SELECT name, value FROM protobuf_stats
+                  WHERE function = ? AND detail IS NULL''', (function,))
+    return dict(c.fetchall())
+
+  def detail_stats(self, name):
+    c = self.db.cursor()
+    c.execute('SELECT detail, value FROM protobuf_stats WHERE name = ?',
+      (name,))
+    return dict(c.fetchall())
+
+  def extract_all(self):
+    c = self.db.cursor()
+    c.execute('''SELECT protobuf_extract(protobuf, 'TestMessage', '$.int32_field')
+                   FROM messages''')
+    return c.fetchall()
+
+  def setUp(self):
+    super().setUp()
+    self.db.execute('SELECT protobuf_config(?, ?)',
+      ('extract_engine', 'reflection'))
+    self.db.execute('CREATE TABLE messages (protobuf BLOB)')
+    for i in range(3):
+      msg = self.proto.TestMessage()
+      msg.int32_field = i
+      msg.string_field = str(i)
+      self.db.execute('INSERT INTO messages VALUES (?)',
+        (msg.SerializeToString(),))
+
+  def test_cache_counters(self):
+    before = self.stats()
+    c = self.db.cursor()
+    c.execute('''SELECT protobuf_extract(protobuf, 'TestMessage', '$.int32_field'),
+                        protobuf_extract(protobuf, 'TestMessage', '$.string_field')
+                   FROM messages
+                  ORDER BY rowid''')
+    self.assertEqual(c.fetchall(), [(0, '0'), (1, '1'), (2, '2')])
+    after = self.stats()
+    self.assertEqual(after['cache_misses'] - before['cache_misses'], 3)
+    self.assertEqual(after['cache_hits'] - before['cache_hits'], 3)
+
+  def test_cache_distinguishes_types(self):
+    msg = self.proto.TestMessage()
+    msg.int32_field = 7
+    data = msg.SerializeToString()
+    before = self.stats()
+    c = self.db.cursor()
+    c.execute('''SELECT protobuf_extract(?1, 'TestMessage', '$.int32_field'),
+                        protobuf_extract(?1, 'OtherMessage', '$.int64_field'),
+                        protobuf_extract(?1, 'TestMessage', '$')''', (data,))
+    self.assertEqual(c.fetchone()[:2], (7, 7))
+    after = self.stats()
+    self.assertEqual(after['cache_misses'] - before['cache_misses'], 2)
+    self.assertEqual(after['cache_hits'] - before['cache_hits'], 1)
+
+  def test_arena_high_water(self):
+    msg = self.proto.TestMessage()
+    for i in range(1000):
+      msg.children.add().int64_field = i
+    c = self.db.cursor()
+    c.execute('''SELECT protobuf_extract(?, 'TestMessage',
+                                         '$.children[-1].int64_field')''',
+      (msg.SerializeToString(),))
+    self.assertEqual(c.fetchone()[0], 999)
+    self.assertGreater(self.stats()['arena_high_water'], 16000)
+
+  def test_wire_engine_skips_cache(self):
+    self.db.execute('SELECT protobuf_config(?, ?)', ('extract_engine', 'auto'))
+    before = self.stats()
+    c = self.db.cursor()
+    c.execute('''SELECT protobuf_extract(protobuf, 'TestMessage', '$.int32_field')
+                   FROM messages''')
+    c.fetchall()
+    self.assertEqual(self.stats(), before)
+
+  def test_off_by_default(self):
+    self.extract_all()
+    self.assertEqual(self.function_stats('protobuf_extract'), {})
+
+  def test_counters(self):
+    self.db.execute('SELECT protobuf_config(?, ?)', ('stats', 'counters'))
+    self.extract_all()
+    c = self.db.cursor()
+    c.execute('SELECT sum(length(protobuf)) FROM messages')
+    size = c.fetchone()[0]
+    stats = self.function_stats('protobuf_extract')
+    self.assertEqual(stats['calls'], 3)
+    self.assertEqual(stats['parse_failures'], 0)
+    self.assertEqual(stats['bytes'], size)
+    self.assertEqual(stats['parse_ns'], 0)
+    self.assertEqual(self.detail_stats('type_calls'), {'TestMessage': 3})
+    self.assertEqual(self.detail_stats('path_calls'),
+      {'TestMessage:$.int32_field': 3})
+    self.assertEqual(self.detail_stats('time_histogram'), {})
+
+  def test_timing(self):
+    self.db.execute('SELECT protobuf_config(?, ?)', ('stats', 'timing'))
+    self.extract_all()
+    stats = self.function_stats('protobuf_extract')
+    self.assertGreater(stats['lookup_ns'], 0)
+    self.assertGreater(stats['parse_ns'], 0)
+    self.assertEqual(sum(self.detail_stats('time_histogram').values()), 3)
+
+  def test_nested_timing(self):
+    # The view steps a statement that calls protobuf_decompress, after a
+    # slow function whose time still belongs to the view
+    import time
+    self.db.create_function('slow', 1, lambda x: time.sleep(0.02) or x)
+    self.db.execute('''CREATE VIEW slow_messages AS
+                         SELECT rowid AS rowid,
+                                protobuf_decompress(slow(protobuf)) AS protobuf
+                           FROM messages''')
+    self.db.execute('''CREATE VIRTUAL TABLE v USING protobuf_view(
+      slow_messages, protobuf, 'TestMessage', n='$.int32_field')''')
+    self.db.execute('SELECT protobuf_config(?, ?)', ('stats', 'timing'))
+    c = self.db.cursor()
+    c.execute('SELECT n FROM v')
+    self.assertEqual(c.fetchall(), [(0,), (1,), (2,)])
+    self.assertGreaterEqual(self.function_stats('protobuf_view')['walk_ns'],
+      3 * 20000000)
+    c.execute('''SELECT sum(value) FROM protobuf_stats
+                  WHERE name = 'time_histogram' AND function = 'protobuf_view'
+                    AND detail = ?''', ('>=16384us',))
+    self.assertEqual(c.fetchone()[0], 3)
+
+  def test_parse_failures(self):
+    self.db.execute('SELECT protobuf_config(?, ?)', ('stats', 'counters'))
+    with self.assertRaises(sqlite3.OperationalError):
+      self.protobuf_extract(b'\xff', 'TestMessage', '$.int32_field')
+    self.assertEqual(
+      self.function_stats('protobuf_extract')['parse_failures'], 1)
+
+  def test_table_functions(self):
+    self.db.execute('SELECT protobuf_config(?, ?)', ('stats', 'counters'))
+    msg = self.proto.TestMessage()
+    for i in range(4):
+      msg.children.add().int64_field = i
+    c = self.db.cursor()
+    c.execute('''SELECT value FROM protobuf_each(?, 'TestMessage',
+                                                 '$.children')''',
+      (msg.SerializeToString(),))
+    self.assertEqual(len(c.fetchall()), 4)
+    # One call moves the cursor to each element, and one past the end
+    self.assertEqual(self.function_stats('protobuf_each')['calls'], 5)
+    self.assertEqual(self.detail_stats('path_calls'),
+      {'TestMessage:$.children': 1})
+
+  def test_reset(self):
+    self.db.execute('SELECT protobuf_config(?, ?)', ('stats', 'counters'))
+    self.extract_all()
+    self.db.execute('SELECT protobuf_stats_reset()')
+    stats = self.stats()
+    self.assertEqual(stats['cache_misses'], 0)
+    self.assertEqual(self.function_stats('protobuf_extract'), {})
+    self.assertEqual(self.detail_stats('path_calls'), {})
+    self.extract_all()
+    self.assertEqual(self.function_stats('protobuf_extract')['calls'], 3)
+
+  def test_switch_off(self):
+    self.db.execute('SELECT protobuf_config(?, ?)', ('stats', 'counters'))
+    self.extract_all()
+    self.db.execute('SELECT protobuf_config(?, ?)', ('stats', 'off'))
+    self.extract_all()
+    self.assertEqual(self.function_stats('protobuf_extract')['calls'], 3)
+
+  def test_unknown_level(self):
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'stats'):
+      self.db.execute('SELECT protobuf_config(?, ?)', ('stats', 'verbose'))
+
+
+if __name__ == '__main__':
+  unittest.main()
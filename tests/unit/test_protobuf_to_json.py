@@ -0,0 +1,290 @@
+#!/usr/bin/env python
+import json
+import math
+import unittest
+
+from google.protobuf import descriptor_pb2
+from google.protobuf import descriptor_pool
+from google.protobuf import json_format
+from google.protobuf import text_format
+
+try:
+  from google.protobuf.message_factory import GetMessageClass
+except ImportError:
+  from google.protobuf.message_factory import MessageFactory
+  GetMessageClass = lambda descriptor: \
+    MessageFactory(descriptor.file.pool).GetPrototype(descriptor)
+
+from utils import *
+
+
+# A proto3 file, which is loaded as descriptors so that it does not clash with
+# the proto2 file compiled for the test case
+PROTO3 = '''
+name: "open.proto"
+package: "open"
+syntax: "proto3"
+message_type {
+  name: "Item"
+  field { name: "id" number: 1 label: LABEL_OPTIONAL type: TYPE_INT64
+          json_name: "id" }
+  field { name: "item_name" number: 2 label: LABEL_OPTIONAL type: TYPE_STRING
+          json_name: "itemName" }
+  field { name: "kind" number: 3 label: LABEL_OPTIONAL type: TYPE_ENUM
+          type_name: ".open.Kind" json_name: "kind" }
+  field { name: "ratio" number: 4 label: LABEL_OPTIONAL type: TYPE_DOUBLE
+          json_name: "ratio" }
+  field { name: "tags" number: 5 label: LABEL_REPEATED type: TYPE_INT32
+          json_name: "tags" }
+  field { name: "count" number: 6 label: LABEL_OPTIONAL type: TYPE_UINT32
+          json_name: "count" oneof_index: 0 proto3_optional: true }
+  field { name: "child" number: 7 label: LABEL_OPTIONAL type: TYPE_MESSAGE
+          type_name: ".open.Item" json_name: "child" }
+  oneof_decl { name: "_count" }
+}
+enum_type {
+  name: "Kind"
+  value { name: "NONE" number: 0 }
+  value { name: "BIG" number: 1 }
+}
+'''
+
+
+class TestProtobufToJson(SQLiteProtobufTestCase, unittest.TestCase):
+  __PROTOBUF__ = '''
+  syntax = "proto2";
+  import "google/protobuf/timestamp.proto";
+
+  message Person {
+    enum PhoneType {
+      MOBILE = 0;
+      HOME = 1;
+    }
+
+    message PhoneNumber {
+      optional string number = 1;
+      optional PhoneType type = 2 [default = HOME];
+    }
+
+    optional string name = 1;
+    optional int32 id = 2 [default = 7];
+    repeated PhoneNumber phones = 3;
+    repeated sint32 scores = 4 [packed = true];
+    repeated PhoneType types = 5;
+    optional bytes photo = 6;
+    optional bool active = 7;
+    optional float height = 8;
+    optional double weight = 9 [default = 1.5];
+    optional uint64 big = 10;
+    optional sfixed64 small = 11;
+    map<string, int32> counts = 12;
+    map<int64, PhoneNumber> numbers = 13;
+    map<bool, PhoneType> flags = 14;
+    optional Person manager = 15;
+    oneof contact {
+      string email = 16;
+      PhoneNumber phone = 17;
+    }
+    optional string display_name = 18;
+    optional fixed32 code = 1000000;
+  }
+
+  message Wrapped {
+    optional google.protobuf.Timestamp when = 1;
+  }
+
+  message Grouped {
+    optional group G = 1 {
+      optional int32 x = 2;
+    }
+  }
+  '''
+
+  OPTIONS = ('', 'always_print_primitive_fields', 'always_print_enums_as_ints',
+             'preserve_proto_field_names',
+             'always_print_primitive_fields,preserve_proto_field_names')
+
+  def make_person(self):
+    person = self.proto.Person(name='Ann "A"\n', id=0, scores=[3, -1, 4],
+                               types=[1, 0], photo=b'\x00\xff', active=False,
+                               height=0.1, weight=1e300, big=2**64 - 1,
+                               small=-2**63, email='a@b', display_name='Annie',
+                               code=9)
+    person.phones.add(number='1', type=0)
+    person.phones.add(number='2')
+    person.counts['b'] = 2
+    person.counts['a'] = 1
+    person.numbers[-5].number = '5'
+    person.numbers[3].SetInParent()
+    person.flags[True] = 0
+    person.manager.name = 'Dee'
+    return person
+
+  def to_json(self, data, type='Person', *options):
+    if hasattr(data, 'SerializeToString'):
+      data = data.SerializeToString()
+    c = self.db.cursor()
+    c.execute('SELECT protobuf_to_json(?, ?%s)' % (', ?' * len(options)),
+      (data, type) + options)
+    return c.fetchone()[0]
+
+  def both(self, data, type='Person', *options):
+    """Returns the JSON from the wire format and from a full parse"""
+    auto = self.to_json(data, type, *options)
+    self.db.execute('SELECT protobuf_config(?, ?)',
+      ('extract_engine', 'reflection'))
+    try:
+      return auto, self.to_json(data, type, *options)
+    finally:
+      self.db.execute('SELECT protobuf_config(?, ?)',
+        ('extract_engine', 'auto'))
+
+  def assertSameJson(self, data, type='Person', *options):
+    auto, reflection = self.both(data, type, *options)
+    self.assertEqual(json.loads(auto), json.loads(reflection))
+    return json.loads(auto)
+
+  def test_person(self):
+    person = self.make_person()
+    for options in self.OPTIONS:
+      with self.subTest(options=options):
+        self.assertSameJson(person, 'Person', options)
+
+    parsed = self.assertSameJson(person)
+    self.assertEqual(parsed['name'], 'Ann "A"\n')
+    self.assertEqual(parsed['big'], '18446744073709551615')
+    self.assertEqual(parsed['small'], '-9223372036854775808')
+    self.assertEqual(parsed['height'], 0.1)
+    self.assertEqual(parsed['photo'], 'AP8=')
+    self.assertEqual(parsed['types'], ['HOME', 'MOBILE'])
+    self.assertEqual(parsed['counts'], {'a': 1, 'b': 2})
+    self.assertEqual(parsed['numbers'], {'-5': {'number': '5'}, '3': {}})
+    self.assertEqual(parsed['flags'], {'true': 'MOBILE'})
+    self.assertEqual(parsed['displayName'], 'Annie')
+
+  def test_matches_json_format(self):
+    person = self.make_person()
+    person.ClearField('height')
+    self.assertEqual(json.loads(self.to_json(person)),
+      json.loads(json_format.MessageToJson(person)))
+    self.assertEqual(
+      json.loads(self.to_json(person, 'Person', 'preserve_proto_field_names')),
+      json.loads(json_format.MessageToJson(person,
+        preserving_proto_field_name=True)))
+
+  def test_defaults(self):
+    # Proto2 fields that are set are written even if they hold the default
+    self.assertEqual(json.loads(self.to_json(self.proto.Person(id=7))),
+      {'id': 7})
+    parsed = self.assertSameJson(b'', 'Person', 'always_print_primitive_fields')
+    self.assertEqual(parsed['id'], 7)
+    self.assertEqual(parsed['weight'], 1.5)
+    self.assertEqual(parsed['scores'], [])
+    self.assertEqual(parsed['counts'], {})
+    self.assertNotIn('manager', parsed)
+    self.assertNotIn('email', parsed)
+
+  def test_real_numbers(self):
+    for value in (0.0, -0.0, 1 / 3, 1e10, -2.5e-7, math.inf, -math.inf,
+                  math.nan):
+      with self.subTest(value=value):
+        person = self.proto.Person(height=value, weight=value)
+        auto, reflection = self.both(person)
+        self.assertEqual(auto, reflection)
+
+  def test_wire_quirks(self):
+    person = self.make_person().SerializeToString()
+
+    # Fields out of order, repeated values of singular fields, and a oneof
+    # member that is overridden by another
+    phone = self.proto.Person.PhoneNumber(number='9').SerializeToString()
+    shuffled = (self.proto.Person(id=3).SerializeToString() + person
+                + self.proto.Person(name='Zed').SerializeToString()
+                + b'\x8a\x01' + bytes([len(phone)]) + phone)
+    parsed = self.assertSameJson(shuffled)
+    self.assertEqual(parsed['name'], 'Zed')
+    self.assertEqual(parsed['phone'], {'number': '9'})
+    self.assertNotIn('email', parsed)
+
+    # Unpacked elements of a packed field, and a repeated map key
+    counts = self.proto.Person(counts={'a': 5}).SerializeToString()
+    parsed = self.assertSameJson(person + b'\x20\x04' + counts)
+    self.assertEqual(parsed['scores'], [3, -1, 4, 2])
+    self.assertEqual(parsed['counts'], {'a': 5, 'b': 2})
+
+    # Undefined values of a closed enum become unknown fields, which are left
+    # out. A full parse writes them as a second key of the same name.
+    parsed = json.loads(self.to_json(person + b'\x28\x09\x2a\x02\x01\x09'))
+    self.assertEqual(parsed['types'], ['HOME', 'MOBILE', 'HOME'])
+
+    # Unknown fields and a field with the wrong wire type are ignored
+    self.assertSameJson(person + b'\xf8\x07\x01' + b'\x0d\x00\x00\x00\x00')
+
+    # A message field in several pieces is merged by the parser
+    manager = self.proto.Person(manager=self.proto.Person(id=1))
+    parsed = self.assertSameJson(person + manager.SerializeToString())
+    self.assertEqual(parsed['manager'], {'name': 'Dee', 'id': 1})
+
+  def test_proto3(self):
+    file = text_format.Parse(PROTO3, descriptor_pb2.FileDescriptorProto())
+    pool = descriptor_pool.DescriptorPool()
+    pool.Add(file)
+    Item = GetMessageClass(pool.FindMessageTypeByName('open.Item'))
+    c = self.db.cursor()
+    c.execute('SELECT protobuf_load_descriptors(?)',
+      (descriptor_pb2.FileDescriptorSet(file=[file]).SerializeToString(),))
+
+    for item in (Item(), Item(id=0, item_name='', kind=0, ratio=0.0),
+                 Item(count=0), Item(id=-1, kind=1, ratio=-0.0, tags=[1, 2]),
+                 Item(child=Item(item_name='x', count=5))):
+      for options in self.OPTIONS:
+        with self.subTest(item=str(item), options=options):
+          parsed = self.assertSameJson(item, 'open.Item', options)
+          self.assertEqual(parsed, json.loads(json_format.MessageToJson(item,
+            including_default_value_fields='primitive' in options,
+            use_integers_for_enums='as_ints' in options,
+            preserving_proto_field_name='preserve' in options)))
+
+    # Open enums keep values that are not defined
+    data = Item(kind=1).SerializeToString()[:-1] + b'\x07'
+    self.assertEqual(json.loads(self.to_json(data, 'open.Item')), {'kind': 7})
+
+    # Strings must be UTF-8 in proto3
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'parse'):
+      self.to_json(b'\x12\x01\xff', 'open.Item')
+
+  def test_fallback(self):
+    # Well-known types and groups have their own forms, which the full parse
+    # handles
+    wrapped = self.proto.Wrapped()
+    wrapped.when.seconds = 1
+    self.assertEqual(json.loads(self.to_json(wrapped, 'Wrapped')),
+      {'when': '1970-01-01T00:00:01Z'})
+    grouped = self.proto.Grouped()
+    grouped.g.x = 1
+    self.assertSameJson(grouped, 'Grouped')
+
+  def test_json1(self):
+    c = self.db.cursor()
+    c.execute('''SELECT json_extract(protobuf_to_json(?, 'Person'),
+                                     '$.phones[1].number'),
+                        json_array(protobuf_to_json(?, 'Person'))''',
+      (self.make_person().SerializeToString(), b''))
+    self.assertEqual(c.fetchone(), ('2', '[{}]'))
+
+  def test_null(self):
+    self.assertIsNone(self.to_json(None))
+
+  def test_errors(self):
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'descriptor'):
+      self.to_json(b'', 'Nobody')
+    with self.assertRaisesRegex(sqlite3.OperationalError, 'option'):
+      self.to_json(b'', 'Person', 'pretty')
+    for data in (b'\xff', b'\x0a\x05ab', b'\x1a\x02\x08'):
+      with self.subTest(data=data):
+        with self.assertRaisesRegex(sqlite3.OperationalError, 'parse'):
+          self.to_json(data)
+
+
+if __name__ == '__main__':
+  unittest.main()
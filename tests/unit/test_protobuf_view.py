@@ -0,0 +1,185 @@
+#!/usr/bin/env python
+import unittest
+
+from utils import *
+
+
+class TestProtobufView(SQLiteProtobufTestCase, unittest.TestCase):
+  __PROTOBUF__ = '''
+  syntax = "proto2";
+  message Person {
+    enum PhoneType {
+      MOBILE = 0;
+      HOME = 1;
+    }
+
+    message PhoneNumber {
+      optional string number = 1;
+      optional PhoneType type = 2 [default = HOME];
+    }
+
+    optional string name = 1;
+    optional int32 id = 2;
+    optional double score = 3;
+    repeated PhoneNumber phones = 4;
+    optional bytes avatar = 5;
+  }
+  '''
+
+  PEOPLE = [
+    ('Alice', 1, 3.5, ['555-1000']),
+    ('Bob', 2, 1.0, []),
+    ('Carol', 3, None, ['555-3000', '555-3001']),
+    (None, 4, 2.0, ['555-4000']),
+  ]
+
+  def setUp(self):
+    super().setUp()
+    self.db.execute('CREATE TABLE people (protobuf BLOB)')
+    for name, id, score, phones in self.PEOPLE:
+      person = self.proto.Person()
+      if name is not None:
+        person.name = name
+      person.id = id
+      if score is not None:
+        person.score = score
+      for number in phones:
+        person.phones.add().number = number
+      self.db.execute('INSERT INTO people VALUES (?)',
+        (person.SerializeToString(),))
+    self.db.execute('''CREATE VIRTUAL TABLE people_v USING protobuf_view(
+      people, protobuf, 'Person',
+      name='$.name', id='$.id', score='$.score',
+      phone='$.phones[0].number', phone_type='$.phones[0].type.name',
+      "first phone"='$.phones[0]')''')
+
+  def query(self, sql, args=()):
+    c = self.db.cursor()
+    c.execute(sql, args)
+    return c.fetchall()
+
+  def test_columns(self):
+    self.assertEqual(self.query('''SELECT rowid, name, id, score, phone,
+                                          phone_type
+                                     FROM people_v''' ), [
+      (1, 'Alice', 1, 3.5, '555-1000', 'HOME'),
+      (2, 'Bob', 2, 1.0, None, None),
+      (3, 'Carol', 3, 0.0, '555-3000', 'HOME'),
+      (4, '', 4, 2.0, '555-4000', 'HOME'),
+    ])
+
+  def test_column_types(self):
+    c = self.db.cursor()
+    c.execute('SELECT * FROM people_v LIMIT 1')
+    self.assertEqual([d[0] for d in c.description],
+      ['name', 'id', 'score', 'phone', 'phone_type', 'first phone'])
+    self.assertEqual(
+      self.query('''SELECT name, type FROM pragma_table_xinfo('people_v')'''),
+      [('name', 'TEXT'), ('id', 'INTEGER'), ('score', 'REAL'),
+       ('phone', 'TEXT'), ('phone_type', 'TEXT'), ('first phone', 'BLOB'),
+       ('protobuf', '')])
+
+  def test_message_column(self):
+    rows = self.query('SELECT protobuf, "first phone" FROM people_v')
+    expected = self.query('SELECT protobuf FROM people')
+    self.assertEqual([row[0] for row in rows], [row[0] for row in expected])
+    phone = self.proto.Person.PhoneNumber()
+    phone.ParseFromString(rows[2][1])
+    self.assertEqual(phone.number, '555-3000')
+
+  def test_constraints(self):
+    queries = [
+      ('id = 2', ()), ('id > 2', ()), ('id <= 2', ()), ('id < 2.5', ()),
+      ('id >= ?', (3,)), ('score = 1', ()), ('score > 1.5', ()),
+      ('name = ?', ('Carol',)), ('name > ?', ('B',)), ('name = ?', ('',)),
+      ('phone = ?', ('555-1000',)), ('phone < ?', ('555-4',)),
+      ('phone_type = ?', ('HOME',)),
+      ('name = ? COLLATE NOCASE', ('alice',)), ('id > 1 AND id < 4', ()),
+      ('id = ?', (None,)), ('name LIKE ?', ('%o%',)),
+      ('"first phone" IS NULL', ()),
+    ]
+    for where, args in queries:
+      with self.subTest(where=where):
+        self.assertEqual(
+          self.query('SELECT rowid FROM people_v WHERE ' + where, args),
+          self.query('''SELECT rowid FROM (SELECT rowid,
+                          protobuf_extract(protobuf, 'Person', '$.name') AS name,
+                          protobuf_extract(protobuf, 'Person', '$.id') AS id,
+                          protobuf_extract(protobuf, 'Person', '$.score') AS score,
+                          protobuf_extract(protobuf, 'Person',
+                                           '$.phones[0].number') AS phone,
+                          protobuf_extract(protobuf, 'Person',
+                                           '$.phones[0].type.name') AS phone_type,
+                          protobuf_extract(protobuf, 'Person',
+                                           '$.phones[0]') AS "first phone"
+                          FROM people) WHERE ''' + where, args))
+
+  def test_column_affinity(self):
+    self.assertEqual(self.query('SELECT rowid FROM people_v WHERE id = ?',
+      ('2',)), [(2,)])
+    self.assertEqual(self.query('SELECT rowid FROM people_v WHERE score = ?',
+      ('2',)), [(4,)])
+
+  def test_rowid_lookup(self):
+    self.assertEqual(self.query('SELECT name FROM people_v WHERE rowid = 3'),
+      [('Carol',)])
+    self.assertEqual(self.query('SELECT name FROM people_v WHERE rowid = 9'),
+      [])
+
+  def test_join(self):
+    self.db.execute('CREATE TABLE wanted (id INTEGER)')
+    self.db.executemany('INSERT INTO wanted VALUES (?)', [(3,), (1,)])
+    self.assertEqual(self.query('''SELECT people_v.name
+                                     FROM wanted, people_v
+                                    WHERE people_v.id = wanted.id
+                                    ORDER BY wanted.rowid'''),
+      [('Carol',), ('Alice',)])
+
+  def test_engines_agree(self):
+    results = {}
+    for engine in ('auto', 'reflection'):
+      self.db.execute('SELECT protobuf_config(?, ?)',
+        ('extract_engine', engine))
+      results[engine] = self.query('SELECT * FROM people_v WHERE id >= 2')
+    self.assertEqual(results['auto'], results['reflection'])
+
+  def test_follows_table(self):
+    person = self.proto.Person()
+    person.name = 'Dan'
+    self.db.execute('INSERT INTO people VALUES (?)',
+      (person.SerializeToString(),))
+    self.db.execute('DELETE FROM people WHERE rowid = 1')
+    self.assertEqual(self.query('SELECT name FROM people_v'),
+      [('Bob',), ('Carol',), ('',), ('Dan',)])
+
+  def test_attached_database(self):
+    # The underlying table is looked up in the view's own database, even if
+    # the main database has one with the same name
+    self.db.execute('ATTACH DATABASE ":memory:" AS other')
+    self.db.execute('CREATE TABLE other.people (protobuf BLOB)')
+    self.db.execute('INSERT INTO other.people VALUES (?)',
+      (self.proto.Person(name='Eve').SerializeToString(),))
+    self.db.execute('''CREATE VIRTUAL TABLE other.people_v USING protobuf_view(
+      people, protobuf, 'Person', name='$.name')''')
+    self.assertEqual(self.query('SELECT name FROM other.people_v'),
+      [('Eve',)])
+    self.assertEqual(
+      self.query('SELECT name FROM other.people_v WHERE rowid = 1'),
+      [('Eve',)])
+
+  def test_bad_definitions(self):
+    for args in ("people, protobuf, 'Person'",
+                 "people, protobuf, 'Person', name",
+                 "people, protobuf, 'Nobody', name='$.name'",
+                 "people, protobuf, 'Person', name='$.nothing'",
+                 "nowhere, protobuf, 'Person', name='$.name'",
+                 "people, nothing, 'Person', name='$.name'",
+                 "people, protobuf, 'Person', a='$.name', a='$.id'"):
+      with self.subTest(args=args):
+        with self.assertRaises(sqlite3.OperationalError):
+          self.db.execute(
+            'CREATE VIRTUAL TABLE bad USING protobuf_view(%s)' % args)
+
+
+if __name__ == '__main__':
+  unittest.main()
@@ -29,15 +29,23 @@ def get_compiler():
   raise Exception('No C++ compiler found')
 
 
-def compile_proto(proto):
+def get_protoc_plugin():
+  return os.path.join(os.environ['CMAKE_CURRENT_BINARY_DIR'], '..', 'tools',
+    'protoc-gen-sqlite_protobuf')
+
+
+def compile_proto(proto, name='definitions', extractors=False):
   workdir = tempfile.mkdtemp()
-  with open(os.path.join(workdir, 'definitions.proto'), 'w') as f:
+  with open(os.path.join(workdir, name + '.proto'), 'w') as f:
     f.write(proto)
-  subprocess.check_call(['protoc', '--cpp_out=.', '--python_out=.',
-    'definitions.proto'], cwd=workdir)
+  cmd = ['protoc', '--cpp_out=.', '--python_out=.']
+  if extractors:
+    cmd.extend(['--plugin=protoc-gen-sqlite_protobuf=' + get_protoc_plugin(),
+      '--sqlite_protobuf_out=.'])
+  subprocess.check_call(cmd + [name + '.proto'], cwd=workdir)
 
   pypath = next(glob.iglob(os.path.join(glob.escape(workdir), '*_pb2.py')))
-  cxxpath = next(glob.iglob(os.path.join(glob.escape(workdir), '*.pb.cc')))
+  cxxpaths = glob.glob(os.path.join(glob.escape(workdir), '*.cc'))
 
   spec = importlib.util.spec_from_file_location('protobuf', pypath)
   module = importlib.util.module_from_spec(spec)
@@ -53,16 +61,16 @@ def compile_proto(proto):
 
   # Add platform-specific flags
   if sys.platform == 'darwin':
-    library = os.path.join(workdir, 'definitions.dylib')
+    library = os.path.join(workdir, name + '.dylib')
     cmd.append('-dynamiclib')
   else:
-    library = os.path.join(workdir, 'definitions.so')
+    library = os.path.join(workdir, name + '.so')
     cmd.append('-shared')
   cmd.extend(['-o', library])
   module.protobuf_library = library
 
   # Invoke the compiler
-  cmd.append(cxxpath)
+  cmd.extend(cxxpaths)
   subprocess.check_call(cmd)
 
   atexit.register(shutil.rmtree, workdir)
@@ -76,7 +84,8 @@ class SQLiteProtobufTestCase(unittest.TestCase):
     self.db.load_extension(get_sqlite_protobuf_library())
     
     if hasattr(self, '__PROTOBUF__'):
-      self.proto = compile_proto(self.__PROTOBUF__)
+      self.proto = compile_proto(self.__PROTOBUF__,
+        extractors=getattr(self, '__EXTRACTORS__', False))
       self.protobuf_load(self.proto.protobuf_library)
   
   def tearDown(self):
@@ -0,0 +1,675 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sqlite3.h>
+
+#include "json.h"
+#include "parallel_scan.h"
+
+
+extern "C"
+int sqlite3_sqliteprotobuf_init(sqlite3 *db,
+                                char **pzErrMsg,
+                                const sqlite3_api_routines *pApi);
+
+
+scan_options::scan_options() : threads(0), chunk_size(10000)
+{
+}
+
+
+namespace {
+
+/// Runs a statement with an optional text or blob argument, to completion
+bool run(sqlite3 *db,
+         const std::string& sql,
+         const std::string *arg,
+         bool blob,
+         std::string *error_msg)
+{
+    sqlite3_stmt *stmt;
+    int err = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr);
+    if (err == SQLITE_OK && arg) {
+        err = blob
+            ? sqlite3_bind_blob64(stmt, 1, arg->data(), arg->size(),
+                  SQLITE_STATIC)
+            : sqlite3_bind_text64(stmt, 1, arg->data(), arg->size(),
+                  SQLITE_STATIC, SQLITE_UTF8);
+    }
+    while (err == SQLITE_OK || err == SQLITE_ROW)
+        err = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (err != SQLITE_DONE) {
+        *error_msg = sqlite3_errmsg(db);
+        return false;
+    }
+    return true;
+}
+
+
+/// Opens a read-only connection with the extension and the message types
+/// loaded
+sqlite3 *open_connection(const scan_options& options, std::string *error_msg)
+{
+    // Every connection opened from now on has the extension
+    static std::once_flag registered;
+    std::call_once(registered, [] {
+        sqlite3_auto_extension(
+            reinterpret_cast<void (*)(void)>(sqlite3_sqliteprotobuf_init));
+    });
+
+    sqlite3 *db = nullptr;
+    int err = sqlite3_open_v2(options.database.c_str(), &db,
+        SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr);
+    if (err != SQLITE_OK) {
+        *error_msg = db ? sqlite3_errmsg(db) : sqlite3_errstr(err);
+        sqlite3_close(db);
+        return nullptr;
+    }
+
+    bool loaded = true;
+    if (!options.libraries.empty())
+        sqlite3_db_config(db, SQLITE_DBCONFIG_ENABLE_LOAD_EXTENSION, 1,
+            nullptr);
+    for (const std::string& library : options.libraries) {
+        loaded = loaded
+            && run(db, "SELECT protobuf_load(?)", &library, false, error_msg);
+    }
+    for (const std::string& path : options.descriptor_sets) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            *error_msg = "Could not open file " + path;
+            loaded = false;
+            break;
+        }
+        std::stringstream contents;
+        contents << file.rdbuf();
+        const std::string data = contents.str();
+        loaded = loaded && run(db, "SELECT protobuf_load_descriptors(?)",
+            &data, true, error_msg);
+    }
+    if (!loaded) {
+        sqlite3_close(db);
+        return nullptr;
+    }
+    return db;
+}
+
+
+/// Returns the query that reads the rows of a chunk, with the rowids it
+/// covers as parameters
+std::string chunk_query(const scan_options& options)
+{
+    std::string sql = "SELECT rowid";
+    for (const scan_column& column : options.columns) {
+        char *value = sqlite3_mprintf(", protobuf_extract(\"%w\", %Q, %Q)",
+            options.column.c_str(), options.type.c_str(),
+            column.path.c_str());
+        sql += value;
+        sqlite3_free(value);
+    }
+    char *from = sqlite3_mprintf(
+        " FROM \"%w\" WHERE rowid BETWEEN ?1 AND ?2 ORDER BY rowid",
+        options.table.c_str());
+    sql += from;
+    sqlite3_free(from);
+    return sql;
+}
+
+
+/// Returns the query that finds the first rowid after the given one, where the
+/// next chunk starts
+std::string seek_query(const scan_options& options)
+{
+    char *sql = sqlite3_mprintf(
+        "SELECT rowid FROM \"%w\" WHERE rowid > ?1 ORDER BY rowid LIMIT 1",
+        options.table.c_str());
+    std::string result = sql;
+    sqlite3_free(sql);
+    return result;
+}
+
+
+/// The state shared by the workers and the thread running the scan
+struct scan_state {
+    const scan_options& options;
+    scan_output *output;
+
+    /// How far ahead of the next chunk to be written the workers may go,
+    /// which bounds the output held in memory
+    uint64_t window;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+
+    /// The next chunk to be taken and the rowid it starts at, which is one
+    /// that exists, so that gaps in the rowids do not make empty chunks. Once
+    /// the last chunk has been taken, more is false.
+    uint64_t next_chunk;
+    int64_t next_rowid;
+    bool more;
+
+    /// The output of chunks that are done but not yet written
+    std::map<uint64_t, std::string> done;
+    uint64_t written;
+
+    bool failed;
+    std::string error_msg;
+
+    scan_state(const scan_options& options, scan_output *output)
+        : options(options), output(output), window(0), next_chunk(0),
+          next_rowid(0), more(false), written(0), failed(false) {}
+
+    void fail(const std::string& message) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!failed) {
+            failed = true;
+            error_msg = message;
+        }
+        changed.notify_all();
+    }
+
+    /// Takes the next chunk, and the range of rowids it covers. Waits while
+    /// it is too far ahead of the output. The worker finds where the chunk
+    /// after it starts with the seek statement, on its own connection.
+    /// Returns false once there is nothing left to do.
+    bool take(sqlite3 *db, sqlite3_stmt *seek, uint64_t *chunk,
+              int64_t *first, int64_t *last) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!failed && more && next_chunk >= written + window)
+            changed.wait(lock);
+        if (failed || !more)
+            return false;
+
+        *chunk = next_chunk ++;
+        *first = next_rowid;
+        if (next_rowid > INT64_MAX - (options.chunk_size - 1)) {
+            *last = INT64_MAX;
+            more = false;
+            changed.notify_all();
+            return true;
+        }
+        *last = next_rowid + (options.chunk_size - 1);
+
+        sqlite3_bind_int64(seek, 1, *last);
+        int err = sqlite3_step(seek);
+        if (err == SQLITE_ROW) {
+            next_rowid = sqlite3_column_int64(seek, 0);
+        } else {
+            more = false;
+            changed.notify_all();
+        }
+        if (err != SQLITE_ROW && err != SQLITE_DONE) {
+            failed = true;
+            error_msg = sqlite3_errmsg(db);
+        }
+        sqlite3_reset(seek);
+        return !failed;
+    }
+
+    void finish_chunk(uint64_t chunk, std::string& buffer) {
+        std::lock_guard<std::mutex> lock(mutex);
+        done[chunk].swap(buffer);
+        changed.notify_all();
+    }
+};
+
+
+/// Reads the chunks a worker takes, on a connection of its own
+void run_worker(scan_state *state)
+{
+    std::string error_msg;
+    sqlite3 *db = open_connection(state->options, &error_msg);
+    if (!db) {
+        state->fail(error_msg);
+        return;
+    }
+
+    sqlite3_stmt *stmt = nullptr, *seek = nullptr;
+    std::string sql = chunk_query(state->options);
+    std::string seek_sql = seek_query(state->options);
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK
+        || sqlite3_prepare_v2(db, seek_sql.c_str(), -1, &seek, nullptr)
+            != SQLITE_OK) {
+        state->fail(sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        sqlite3_close(db);
+        return;
+    }
+
+    uint64_t chunk;
+    int64_t first, last;
+    std::string buffer;
+    while (state->take(db, seek, &chunk, &first, &last)) {
+        sqlite3_bind_int64(stmt, 1, first);
+        sqlite3_bind_int64(stmt, 2, last);
+
+        buffer.clear();
+        int err;
+        while ((err = sqlite3_step(stmt)) == SQLITE_ROW)
+            state->output->encode(stmt, &buffer);
+        sqlite3_reset(stmt);
+        if (err != SQLITE_DONE) {
+            state->fail(sqlite3_errmsg(db));
+            break;
+        }
+        state->finish_chunk(chunk, buffer);
+    }
+
+    sqlite3_finalize(stmt);
+    sqlite3_finalize(seek);
+    sqlite3_close(db);
+}
+
+
+/// Appends a value as a CSV field, quoting it if it needs to be
+void append_csv(std::string *buffer, sqlite3_stmt *stmt, int column)
+{
+    switch (sqlite3_column_type(stmt, column)) {
+    case SQLITE_INTEGER:
+        buffer->append(std::to_string(sqlite3_column_int64(stmt, column)));
+        break;
+    case SQLITE_FLOAT:
+        json_append_double(buffer, sqlite3_column_double(stmt, column));
+        break;
+    case SQLITE_TEXT: {
+        const char *text = reinterpret_cast<const char *>(
+            sqlite3_column_text(stmt, column));
+        size_t size = static_cast<size_t>(sqlite3_column_bytes(stmt, column));
+        if (strcspn(text, ",\"\r\n") == size) {
+            buffer->append(text, size);
+            break;
+        }
+        buffer->push_back('"');
+        for (size_t i = 0; i < size; i ++) {
+            if (text[i] == '"')
+                buffer->push_back('"');
+            buffer->push_back(text[i]);
+        }
+        buffer->push_back('"');
+        break;
+    }
+    case SQLITE_BLOB:
+        json_append_base64(buffer, sqlite3_column_blob(stmt, column),
+            static_cast<size_t>(sqlite3_column_bytes(stmt, column)));
+        break;
+    default:
+        break;
+    }
+}
+
+
+/// Appends a value as JSON
+void append_json(std::string *buffer, sqlite3_stmt *stmt, int column)
+{
+    switch (sqlite3_column_type(stmt, column)) {
+    case SQLITE_INTEGER:
+        buffer->append(std::to_string(sqlite3_column_int64(stmt, column)));
+        break;
+    case SQLITE_FLOAT:
+        json_append_double(buffer, sqlite3_column_double(stmt, column));
+        break;
+    case SQLITE_TEXT:
+        json_append_string(buffer, reinterpret_cast<const char *>(
+                sqlite3_column_text(stmt, column)),
+            static_cast<size_t>(sqlite3_column_bytes(stmt, column)));
+        break;
+    case SQLITE_BLOB:
+        json_append_base64(buffer, sqlite3_column_blob(stmt, column),
+            static_cast<size_t>(sqlite3_column_bytes(stmt, column)));
+        break;
+    default:
+        buffer->append("null");
+        break;
+    }
+}
+
+
+bool write_file(FILE *file, const std::string& buffer, std::string *error_msg)
+{
+    if (fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size()) {
+        *error_msg = std::string("Could not write output: ") + strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+
+csv_output::csv_output(FILE *file) : file(file)
+{
+}
+
+
+bool csv_output::start(const scan_options& options, std::string *error_msg)
+{
+    std::string header = "rowid";
+    for (const scan_column& column : options.columns) {
+        header.push_back(',');
+        if (strcspn(column.name.c_str(), ",\"\r\n") == column.name.size()) {
+            header += column.name;
+            continue;
+        }
+        header.push_back('"');
+        for (char c : column.name) {
+            if (c == '"')
+                header.push_back('"');
+            header.push_back(c);
+        }
+        header.push_back('"');
+    }
+    header += "\r\n";
+    return write_file(file, header, error_msg);
+}
+
+
+void csv_output::encode(sqlite3_stmt *stmt, std::string *buffer)
+{
+    for (int i = 0; i < sqlite3_column_count(stmt); i ++) {
+        if (i > 0)
+            buffer->push_back(',');
+        append_csv(buffer, stmt, i);
+    }
+    buffer->append("\r\n");
+}
+
+
+bool csv_output::write(const std::string& buffer, std::string *error_msg)
+{
+    return write_file(file, buffer, error_msg);
+}
+
+
+bool csv_output::finish(std::string *error_msg)
+{
+    if (fflush(file) != 0) {
+        *error_msg = std::string("Could not write output: ") + strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+
+ndjson_output::ndjson_output(FILE *file) : file(file)
+{
+}
+
+
+bool ndjson_output::start(const scan_options& options, std::string *error_msg)
+{
+    keys.clear();
+    keys.push_back("\"rowid\":");
+    for (const scan_column& column : options.columns) {
+        std::string key;
+        json_append_string(&key, column.name.data(), column.name.size());
+        key.push_back(':');
+        keys.push_back(key);
+    }
+    return true;
+}
+
+
+void ndjson_output::encode(sqlite3_stmt *stmt, std::string *buffer)
+{
+    buffer->push_back('{');
+    for (size_t i = 0; i < keys.size(); i ++) {
+        if (i > 0)
+            buffer->push_back(',');
+        buffer->append(keys[i]);
+        append_json(buffer, stmt, static_cast<int>(i));
+    }
+    buffer->append("}\n");
+}
+
+
+bool ndjson_output::write(const std::string& buffer, std::string *error_msg)
+{
+    return write_file(file, buffer, error_msg);
+}
+
+
+bool ndjson_output::finish(std::string *error_msg)
+{
+    if (fflush(file) != 0) {
+        *error_msg = std::string("Could not write output: ") + strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+
+table_output::table_output(sqlite3 *db, const std::string& table)
+    : db(db), table(table), insert(nullptr), columns(0), in_transaction(false)
+{
+}
+
+
+table_output::~table_output()
+{
+    sqlite3_finalize(insert);
+    if (in_transaction)
+        sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+}
+
+
+bool table_output::start(const scan_options& options, std::string *error_msg)
+{
+    char *sql = sqlite3_mprintf(
+        "CREATE TABLE IF NOT EXISTS \"%w\" (rowid INTEGER PRIMARY KEY",
+        table.c_str());
+    std::string create = sql;
+    sqlite3_free(sql);
+    sql = sqlite3_mprintf("INSERT INTO \"%w\" VALUES (?", table.c_str());
+    std::string values = sql;
+    sqlite3_free(sql);
+    for (const scan_column& column : options.columns) {
+        sql = sqlite3_mprintf(", \"%w\"", column.name.c_str());
+        create += sql;
+        sqlite3_free(sql);
+        values += ", ?";
+    }
+    create += ")";
+    values += ")";
+    columns = options.columns.size() + 1;
+
+    if (!run(db, "BEGIN", nullptr, false, error_msg))
+        return false;
+    in_transaction = true;
+    if (!run(db, create, nullptr, false, error_msg))
+        return false;
+    if (sqlite3_prepare_v2(db, values.c_str(), -1, &insert, nullptr)
+            != SQLITE_OK) {
+        *error_msg = sqlite3_errmsg(db);
+        return false;
+    }
+    return true;
+}
+
+
+/// Encodes each value as its type, followed by the value in native byte
+/// order, or by the length and the bytes of text and blobs
+void table_output::encode(sqlite3_stmt *stmt, std::string *buffer)
+{
+    for (size_t i = 0; i < columns; i ++) {
+        int column = static_cast<int>(i);
+        int type = sqlite3_column_type(stmt, column);
+        buffer->push_back(static_cast<char>(type));
+        if (type == SQLITE_INTEGER) {
+            sqlite3_int64 value = sqlite3_column_int64(stmt, column);
+            buffer->append(reinterpret_cast<const char *>(&value),
+                sizeof(value));
+        } else if (type == SQLITE_FLOAT) {
+            double value = sqlite3_column_double(stmt, column);
+            buffer->append(reinterpret_cast<const char *>(&value),
+                sizeof(value));
+        } else if (type == SQLITE_TEXT || type == SQLITE_BLOB) {
+            const void *data = type == SQLITE_TEXT
+                ? static_cast<const void *>(sqlite3_column_text(stmt, column))
+                : sqlite3_column_blob(stmt, column);
+            uint64_t size = static_cast<uint64_t>(
+                sqlite3_column_bytes(stmt, column));
+            buffer->append(reinterpret_cast<const char *>(&size),
+                sizeof(size));
+            buffer->append(static_cast<const char *>(data), size);
+        }
+    }
+}
+
+
+bool table_output::write(const std::string& buffer, std::string *error_msg)
+{
+    const char *p = buffer.data();
+    const char *end = p + buffer.size();
+    while (p < end) {
+        for (size_t i = 0; i < columns; i ++) {
+            int param = static_cast<int>(i) + 1;
+            int type = *p ++;
+            if (type == SQLITE_INTEGER) {
+                sqlite3_int64 value;
+                memcpy(&value, p, sizeof(value));
+                p += sizeof(value);
+                sqlite3_bind_int64(insert, param, value);
+            } else if (type == SQLITE_FLOAT) {
+                double value;
+                memcpy(&value, p, sizeof(value));
+                p += sizeof(value);
+                sqlite3_bind_double(insert, param, value);
+            } else if (type == SQLITE_TEXT || type == SQLITE_BLOB) {
+                uint64_t size;
+                memcpy(&size, p, sizeof(size));
+                p += sizeof(size);
+                if (type == SQLITE_TEXT)
+                    sqlite3_bind_text64(insert, param, p, size, SQLITE_STATIC,
+                        SQLITE_UTF8);
+                else
+                    sqlite3_bind_blob64(insert, param, p, size, SQLITE_STATIC);
+                p += size;
+            } else {
+                sqlite3_bind_null(insert, param);
+            }
+        }
+        int err = sqlite3_step(insert);
+        sqlite3_reset(insert);
+        if (err != SQLITE_DONE) {
+            *error_msg = sqlite3_errmsg(db);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+bool table_output::finish(std::string *error_msg)
+{
+    sqlite3_finalize(insert);
+    insert = nullptr;
+    if (!run(db, "COMMIT", nullptr, false, error_msg))
+        return false;
+    in_transaction = false;
+    return true;
+}
+
+
+bool parallel_scan(const scan_options& options,
+                   scan_output *output,
+                   std::string *error_msg)
+{
+    if (options.columns.empty() || options.chunk_size < 1) {
+        *error_msg = "A scan needs at least one path and a positive chunk size";
+        return false;
+    }
+
+    // Find the first rowid, and check the paths before starting any work
+    sqlite3 *db = open_connection(options, error_msg);
+    if (!db)
+        return false;
+    scan_state state(options, output);
+    sqlite3_stmt *stmt;
+    char *sql = sqlite3_mprintf("SELECT min(rowid) FROM \"%w\"",
+        options.table.c_str());
+    int err = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+    sqlite3_free(sql);
+    if (err == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW
+            && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+        state.next_rowid = sqlite3_column_int64(stmt, 0);
+        state.more = true;
+    }
+    sqlite3_finalize(stmt);
+    std::string query = chunk_query(options);
+    if (err == SQLITE_OK)
+        err = sqlite3_prepare_v2(db, query.c_str(), -1, &stmt, nullptr);
+    if (err == SQLITE_OK) {
+        // Extract from the first message, so that a bad type or path is
+        // reported before anything is written
+        sqlite3_bind_int64(stmt, 1, state.next_rowid);
+        sqlite3_bind_int64(stmt, 2, state.next_rowid);
+        err = sqlite3_step(stmt);
+        if (err == SQLITE_ROW)
+            err = SQLITE_DONE;
+        sqlite3_finalize(stmt);
+    }
+    if (err != SQLITE_OK && err != SQLITE_DONE) {
+        *error_msg = sqlite3_errmsg(db);
+        sqlite3_close(db);
+        return false;
+    }
+    sqlite3_close(db);
+
+    if (!output->start(options, error_msg))
+        return false;
+
+    // The chunks are taken in order as the workers are ready for them, so
+    // that nothing is kept for each chunk until it is read
+    size_t threads = options.threads > 0
+        ? static_cast<size_t>(options.threads)
+        : std::max(1u, std::thread::hardware_concurrency());
+    if (!state.more)
+        threads = 0;
+    state.window = 4 * threads;
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < threads; i ++)
+        workers.emplace_back(run_worker, &state);
+
+    // Write the chunks in order as they are done
+    std::unique_lock<std::mutex> lock(state.mutex);
+    while (!state.failed && (state.more || state.written < state.next_chunk)) {
+        auto next = state.done.find(state.written);
+        if (next == state.done.end()) {
+            state.changed.wait(lock);
+            continue;
+        }
+        std::string buffer;
+        buffer.swap(next->second);
+        state.done.erase(next);
+
+        lock.unlock();
+        std::string write_error;
+        bool written = output->write(buffer, &write_error);
+        lock.lock();
+        if (!written) {
+            state.failed = true;
+            state.error_msg = write_error;
+        }
+        state.written ++;
+        state.changed.notify_all();
+    }
+    lock.unlock();
+
+    for (std::thread& worker : workers)
+        worker.join();
+    if (state.failed) {
+        *error_msg = state.error_msg;
+        return false;
+    }
+    return output->finish(error_msg);
+}
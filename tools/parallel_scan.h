@@ -0,0 +1,132 @@
+#ifndef PARALLEL_SCAN_H
+#define PARALLEL_SCAN_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <sqlite3.h>
+
+
+/// A column of the output, with the value of a path in each message
+struct scan_column {
+    std::string name;
+    std::string path;
+};
+
+
+/// What to scan, and how to divide the work
+struct scan_options {
+    /// The database, which each worker opens read-only, and the table and
+    /// column holding the messages
+    std::string database;
+    std::string table;
+    std::string column;
+    std::string type;
+    std::vector<scan_column> columns;
+
+    /// Libraries for protobuf_load, and FileDescriptorSet files for
+    /// protobuf_load_descriptors, which are loaded on every connection
+    std::vector<std::string> libraries;
+    std::vector<std::string> descriptor_sets;
+
+    /// The number of worker threads, or 0 for one per core
+    int threads;
+
+    /// The number of rowids in each chunk of work
+    int64_t chunk_size;
+
+    scan_options();
+};
+
+
+/// Where the rows of a scan go. The workers encode the rows of each chunk into
+/// a buffer at the same time, and the buffers are then written one at a time,
+/// in rowid order, by the thread running the scan.
+struct scan_output {
+    virtual ~scan_output() {}
+
+    /// Called before anything is written
+    virtual bool start(const scan_options& options, std::string *error_msg) = 0;
+
+    /// Appends the current row of a statement to the buffer of a chunk. Column
+    /// 0 is the rowid, followed by a column for each path. This is called by
+    /// several workers at once.
+    virtual void encode(sqlite3_stmt *stmt, std::string *buffer) = 0;
+
+    /// Writes the buffer of a chunk
+    virtual bool write(const std::string& buffer, std::string *error_msg) = 0;
+
+    /// Called after the last chunk is written
+    virtual bool finish(std::string *error_msg) = 0;
+};
+
+
+/// Writes the rows as CSV, with a header row. Blobs are encoded in base64.
+struct csv_output : scan_output {
+    explicit csv_output(FILE *file);
+
+    bool start(const scan_options& options, std::string *error_msg) override;
+    void encode(sqlite3_stmt *stmt, std::string *buffer) override;
+    bool write(const std::string& buffer, std::string *error_msg) override;
+    bool finish(std::string *error_msg) override;
+
+private:
+    FILE *file;
+};
+
+
+/// Writes each row as a JSON object on a line of its own. Blobs are encoded in
+/// base64.
+struct ndjson_output : scan_output {
+    explicit ndjson_output(FILE *file);
+
+    bool start(const scan_options& options, std::string *error_msg) override;
+    void encode(sqlite3_stmt *stmt, std::string *buffer) override;
+    bool write(const std::string& buffer, std::string *error_msg) override;
+    bool finish(std::string *error_msg) override;
+
+private:
+    FILE *file;
+
+    /// The key of each column, quoted and followed by a colon
+    std::vector<std::string> keys;
+};
+
+
+/// Inserts the rows into a table, which is created if it does not exist. The
+/// rowid of each row is the rowid of the message. Everything is inserted in a
+/// single transaction, which is rolled back if the scan fails.
+struct table_output : scan_output {
+    table_output(sqlite3 *db, const std::string& table);
+    ~table_output();
+
+    bool start(const scan_options& options, std::string *error_msg) override;
+    void encode(sqlite3_stmt *stmt, std::string *buffer) override;
+    bool write(const std::string& buffer, std::string *error_msg) override;
+    bool finish(std::string *error_msg) override;
+
+private:
+    sqlite3 *db;
+    std::string table;
+    sqlite3_stmt *insert;
+    size_t columns;
+    bool in_transaction;
+};
+
+
+/// Runs the scan. The rowids from the least to the greatest are split into
+/// chunks, which the workers take in order. Each chunk starts at a rowid that
+/// exists, found when the chunk before it is taken, so gaps in the rowids are
+/// skipped over. Each worker has its own read-only connection with the
+/// extension loaded, and the output of a chunk is written once every chunk
+/// before it has been.
+///
+/// Returns false and sets error_msg if the scan fails.
+bool parallel_scan(const scan_options& options,
+                   scan_output *output,
+                   std::string *error_msg);
+
+
+#endif
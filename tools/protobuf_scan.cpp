@@ -0,0 +1,164 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include <sqlite3.h>
+
+#include "parallel_scan.h"
+
+
+static const char usage[] =
+"usage: protobuf_scan [options] DATABASE TABLE COLUMN TYPE [NAME=]PATH...\n"
+"\n"
+"Extracts the value of each path from the messages in a column, splitting\n"
+"the table into chunks of rowids that are read by several threads at once.\n"
+"The rows are written in rowid order, with the rowid first.\n"
+"\n"
+"options:\n"
+"  --threads N        number of worker threads (default: one per core)\n"
+"  --chunk-size N     number of rowids in each chunk (default: 10000)\n"
+"  --load LIBRARY     load message types with protobuf_load\n"
+"  --descriptors FILE load a FileDescriptorSet with\n"
+"                     protobuf_load_descriptors\n"
+"  --format FORMAT    csv or ndjson (default: csv)\n"
+"  --output FILE      write to a file rather than standard output\n"
+"  --table DB:TABLE   insert the rows into a table of another database\n";
+
+
+/// Parses a positive integer option, or exits
+static int64_t parse_count(const char *option, const char *value)
+{
+    char *end;
+    errno = 0;
+    long long count = strtoll(value, &end, 10);
+    if (errno != 0 || *value == '\0' || *end != '\0' || count < 1) {
+        fprintf(stderr, "protobuf_scan: %s must be a positive integer\n",
+            option);
+        exit(2);
+    }
+    return count;
+}
+
+
+int main(int argc, char **argv)
+{
+    scan_options options;
+    std::string format = "csv";
+    std::string output_path;
+    std::string table;
+    std::vector<std::string> positional;
+
+    for (int i = 1; i < argc; i ++) {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            fputs(usage, stdout);
+            return 0;
+        }
+        if (arg.size() < 2 || arg.compare(0, 2, "--") != 0) {
+            positional.push_back(arg);
+            continue;
+        }
+        if (i + 1 == argc) {
+            fprintf(stderr, "protobuf_scan: %s requires a value\n", argv[i]);
+            return 2;
+        }
+        const char *value = argv[++ i];
+        if (arg == "--threads") {
+            options.threads = static_cast<int>(
+                std::min<int64_t>(parse_count(argv[i - 1], value), 1024));
+        } else if (arg == "--chunk-size") {
+            options.chunk_size = parse_count(argv[i - 1], value);
+        } else if (arg == "--load") {
+            options.libraries.push_back(value);
+        } else if (arg == "--descriptors") {
+            options.descriptor_sets.push_back(value);
+        } else if (arg == "--format") {
+            format = value;
+        } else if (arg == "--output") {
+            output_path = value;
+        } else if (arg == "--table") {
+            table = value;
+        } else {
+            fprintf(stderr, "protobuf_scan: unknown option %s\n%s",
+                argv[i - 1], usage);
+            return 2;
+        }
+    }
+
+    if (positional.size() < 5) {
+        fputs(usage, stderr);
+        return 2;
+    }
+    options.database = positional[0];
+    options.table = positional[1];
+    options.column = positional[2];
+    options.type = positional[3];
+
+    // A path may be preceded by the name of its column, which is otherwise
+    // the path itself
+    for (size_t i = 4; i < positional.size(); i ++) {
+        const std::string& arg = positional[i];
+        size_t equals = arg.find('=');
+        if (arg[0] != '$' && equals != std::string::npos) {
+            options.columns.push_back({arg.substr(0, equals),
+                                       arg.substr(equals + 1)});
+        } else {
+            options.columns.push_back({arg, arg});
+        }
+    }
+
+    std::unique_ptr<scan_output> output;
+    FILE *file = stdout;
+    sqlite3 *db = nullptr;
+    if (!table.empty()) {
+        size_t colon = table.rfind(':');
+        if (colon == std::string::npos || colon == 0
+                || colon + 1 == table.size()) {
+            fprintf(stderr, "protobuf_scan: --table must be DB:TABLE\n");
+            return 2;
+        }
+        std::string path = table.substr(0, colon);
+        if (sqlite3_open(path.c_str(), &db) != SQLITE_OK) {
+            fprintf(stderr, "protobuf_scan: %s\n", sqlite3_errmsg(db));
+            sqlite3_close(db);
+            return 1;
+        }
+        output.reset(new table_output(db, table.substr(colon + 1)));
+    } else {
+        if (format != "csv" && format != "ndjson") {
+            fprintf(stderr, "protobuf_scan: unknown format %s\n",
+                format.c_str());
+            return 2;
+        }
+        if (!output_path.empty()) {
+            file = fopen(output_path.c_str(), "wb");
+            if (!file) {
+                fprintf(stderr, "protobuf_scan: could not open %s: %s\n",
+                    output_path.c_str(), strerror(errno));
+                return 1;
+            }
+        }
+        if (format == "csv")
+            output.reset(new csv_output(file));
+        else
+            output.reset(new ndjson_output(file));
+    }
+
+    std::string error_msg;
+    bool scanned = parallel_scan(options, output.get(), &error_msg);
+    output.reset();
+    if (db)
+        sqlite3_close(db);
+    if (file != stdout && fclose(file) != 0 && scanned) {
+        error_msg = std::string("could not write output: ") + strerror(errno);
+        scanned = false;
+    }
+    if (!scanned) {
+        fprintf(stderr, "protobuf_scan: %s\n", error_msg.c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,692 @@
+#include <cstdio>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include "plugin.pb.h"
+
+using google::protobuf::Descriptor;
+using google::protobuf::DescriptorPool;
+using google::protobuf::EnumDescriptor;
+using google::protobuf::FieldDescriptor;
+using google::protobuf::FileDescriptor;
+using google::protobuf::FileDescriptorProto;
+using google::protobuf::OneofDescriptor;
+using google::protobuf::internal::WireFormatLite;
+using sqlite_protobuf::plugin::CodeGeneratorRequest;
+using sqlite_protobuf::plugin::CodeGeneratorResponse;
+
+
+// The start of every generated file: the declarations of extractors.h, and the
+// templates that the extractor of each message type is built from. Each
+// template scans one message for one field, with its tag, its wire type, and
+// the values it accepts fixed at compile time. The answers must be the same as
+// those of wire_find in wire.cpp, but anything unusual falls back, since the
+// extension then finds the answer another way.
+static const char runtime[] = R"(
+#include <cstddef>
+#include <cstdint>
+
+
+extern "C" {
+
+struct sqlite_protobuf_step {
+    int32_t number;
+    int32_t index;
+};
+
+struct sqlite_protobuf_value {
+    uint64_t bits;
+    const uint8_t *data;
+    size_t size;
+};
+
+typedef int (*sqlite_protobuf_find)(const uint8_t *data,
+                                    size_t size,
+                                    const sqlite_protobuf_step *path,
+                                    size_t count,
+                                    sqlite_protobuf_value *value);
+
+struct sqlite_protobuf_extractor {
+    const char *type_name;
+    sqlite_protobuf_find find;
+};
+
+}
+
+
+namespace {
+
+// The outcome of a search, as in wire_status
+enum {
+    FOUND,
+    DEFAULT,
+    NOT_PRESENT,
+    FALLBACK,
+};
+
+enum {
+    VARINT = 0,
+    FIXED64 = 1,
+    LENGTH_DELIMITED = 2,
+    FIXED32 = 5,
+};
+
+// What the member of a oneof that a tag sets does to the field being scanned
+enum {
+    KEEPS,
+    CLEARS,
+    MAY_CLEAR,
+};
+
+
+inline bool read_varint(const uint8_t *&p, const uint8_t *end,
+                        uint64_t *value, int max_bytes)
+{
+    uint64_t result = 0;
+    for (int i = 0; i < max_bytes && p < end; i ++) {
+        uint8_t byte = *p ++;
+        result |= static_cast<uint64_t>(byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            // The tenth byte only holds the top bit
+            if (i == 9 && byte > 1)
+                return false;
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+inline bool read_tag(const uint8_t *&p, const uint8_t *end, uint32_t *tag)
+{
+    uint64_t value;
+    if (!read_varint(p, end, &value, 5) || value > 0xffffffffu
+            || (value >> 3) == 0)
+        return false;
+    *tag = static_cast<uint32_t>(value);
+    return true;
+}
+
+
+template <int WireType>
+bool read_value(const uint8_t *&p, const uint8_t *end,
+                sqlite_protobuf_value *value);
+
+template <>
+inline bool read_value<VARINT>(const uint8_t *&p, const uint8_t *end,
+                               sqlite_protobuf_value *value)
+{
+    return read_varint(p, end, &value->bits, 10);
+}
+
+template <>
+inline bool read_value<FIXED64>(const uint8_t *&p, const uint8_t *end,
+                                sqlite_protobuf_value *value)
+{
+    if (end - p < 8)
+        return false;
+    uint64_t bits = 0;
+    for (int i = 7; i >= 0; i --)
+        bits = bits << 8 | p[i];
+    value->bits = bits;
+    p += 8;
+    return true;
+}
+
+template <>
+inline bool read_value<FIXED32>(const uint8_t *&p, const uint8_t *end,
+                                sqlite_protobuf_value *value)
+{
+    if (end - p < 4)
+        return false;
+    uint64_t bits = 0;
+    for (int i = 3; i >= 0; i --)
+        bits = bits << 8 | p[i];
+    value->bits = bits;
+    p += 4;
+    return true;
+}
+
+template <>
+inline bool read_value<LENGTH_DELIMITED>(const uint8_t *&p,
+                                         const uint8_t *end,
+                                         sqlite_protobuf_value *value)
+{
+    uint64_t length;
+    if (!read_varint(p, end, &length, 5) || length > 0x7fffffff
+            || length > static_cast<uint64_t>(end - p))
+        return false;
+    value->data = p;
+    value->size = static_cast<size_t>(length);
+    p += length;
+    return true;
+}
+
+
+// Groups are not skipped, so that messages with them fall back
+inline bool skip_field(const uint8_t *&p, const uint8_t *end, uint32_t tag)
+{
+    sqlite_protobuf_value value;
+    switch (tag & 7) {
+    case VARINT:
+        return read_value<VARINT>(p, end, &value);
+    case FIXED64:
+        return read_value<FIXED64>(p, end, &value);
+    case LENGTH_DELIMITED:
+        return read_value<LENGTH_DELIMITED>(p, end, &value);
+    case FIXED32:
+        return read_value<FIXED32>(p, end, &value);
+    default:
+        return false;
+    }
+}
+
+
+// Rejects overlong encodings, surrogates, and code points past U+10FFFF
+inline bool valid_utf8(const uint8_t *p, size_t size)
+{
+    const uint8_t *end = p + size;
+    while (p < end) {
+        uint8_t c = *p ++;
+        if (c < 0x80)
+            continue;
+        int more;
+        uint32_t min;
+        uint32_t code;
+        if (c >= 0xc2 && c <= 0xdf) {
+            more = 1; min = 0x80; code = c & 0x1f;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            more = 2; min = 0x800; code = c & 0x0f;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            more = 3; min = 0x10000; code = c & 0x07;
+        } else {
+            return false;
+        }
+        if (end - p < more)
+            return false;
+        for (int i = 0; i < more; i ++) {
+            if ((p[i] & 0xc0) != 0x80)
+                return false;
+            code = code << 6 | (p[i] & 0x3f);
+        }
+        if (code < min || code > 0x10ffff
+                || (code >= 0xd800 && code <= 0xdfff))
+            return false;
+        p += more;
+    }
+    return true;
+}
+
+
+// The parser rejects a message with invalid UTF-8 in a proto3 string
+inline int valid_string(int status, const sqlite_protobuf_value *value)
+{
+    if (status == FOUND && !valid_utf8(value->data, value->size))
+        return FALLBACK;
+    return status;
+}
+
+
+inline bool accept_all(uint64_t)
+{
+    return true;
+}
+
+
+inline int no_oneof(uint32_t)
+{
+    return KEEPS;
+}
+
+
+// Finds the last value of a non-repeated field, which is the one the parser
+// keeps, unless another member of its oneof is set after it
+template <uint32_t Tag, bool (*Accept)(uint64_t), int (*Oneof)(uint32_t),
+          bool IsMessage>
+int scan_singular(const uint8_t *p, const uint8_t *end,
+                  sqlite_protobuf_value *value)
+{
+    int occurrences = 0;
+    bool present = false;
+    while (p < end) {
+        uint32_t tag;
+        if (!read_tag(p, end, &tag))
+            return FALLBACK;
+        if (tag == Tag) {
+            sqlite_protobuf_value candidate = { 0, nullptr, 0 };
+            if (!read_value<Tag & 7>(p, end, &candidate))
+                return FALLBACK;
+            if (!Accept(candidate.bits))
+                continue;
+
+            // Repeated occurrences of a message field are merged together
+            if (IsMessage && occurrences > 0)
+                return FALLBACK;
+            *value = candidate;
+            occurrences ++;
+            present = true;
+            continue;
+        }
+
+        switch (Oneof(tag)) {
+        case CLEARS:
+            present = false;
+            break;
+        case MAY_CLEAR:
+            return FALLBACK;
+        }
+        if (!skip_field(p, end, tag))
+            return FALLBACK;
+    }
+
+    if (!present)
+        return IsMessage ? NOT_PRESENT : DEFAULT;
+    return FOUND;
+}
+
+
+// Scans the elements of a repeated field, which may be split across any mix
+// of packed and unpacked encodings. Stops at the element with the target
+// index, or counts all elements if target is negative.
+template <uint32_t Tag, bool Packable, bool (*Accept)(uint64_t)>
+int scan_repeated(const uint8_t *p, const uint8_t *end, int target,
+                  int *count, sqlite_protobuf_value *value)
+{
+    const uint32_t packed_tag = (Tag & ~7u) | LENGTH_DELIMITED;
+    const int width = (Tag & 7) == FIXED32 ? 4 : (Tag & 7) == FIXED64 ? 8 : 0;
+
+    *count = 0;
+    while (p < end) {
+        uint32_t tag;
+        if (!read_tag(p, end, &tag))
+            return FALLBACK;
+
+        if (tag == Tag) {
+            if (!read_value<Tag & 7>(p, end, value))
+                return FALLBACK;
+            if (!Accept(value->bits))
+                continue;
+            if (*count == target)
+                return FOUND;
+            (*count) ++;
+        } else if (Packable && tag == packed_tag) {
+            sqlite_protobuf_value packed;
+            if (!read_value<LENGTH_DELIMITED>(p, end, &packed))
+                return FALLBACK;
+            const uint8_t *element = packed.data;
+            const uint8_t *packed_end = packed.data + packed.size;
+
+            // Fixed-width elements can be counted, and the target found,
+            // without reading the others
+            if (width) {
+                if (packed.size % width != 0)
+                    return FALLBACK;
+                int elements = static_cast<int>(packed.size / width);
+                if (target < *count || target - *count >= elements) {
+                    *count += elements;
+                    continue;
+                }
+                element += (target - *count) * width;
+                read_value<Tag & 7>(element, packed_end, value);
+                return FOUND;
+            }
+
+            while (element < packed_end) {
+                if (!read_value<Tag & 7>(element, packed_end, value))
+                    return FALLBACK;
+                if (!Accept(value->bits))
+                    continue;
+                if (*count == target)
+                    return FOUND;
+                (*count) ++;
+            }
+        } else if (!skip_field(p, end, tag)) {
+            return FALLBACK;
+        }
+    }
+    return NOT_PRESENT;
+}
+
+
+// Finds an element of a repeated field, counting from the end if the index is
+// negative
+template <uint32_t Tag, bool Packable, bool (*Accept)(uint64_t)>
+int find_repeated(const uint8_t *p, const uint8_t *end, int index,
+                  sqlite_protobuf_value *value)
+{
+    int count;
+    if (index < 0) {
+        int status = scan_repeated<Tag, Packable, Accept>(p, end, -1, &count,
+            value);
+        if (status != NOT_PRESENT)
+            return status;
+        index += count;
+        if (index < 0)
+            return NOT_PRESENT;
+    }
+    return scan_repeated<Tag, Packable, Accept>(p, end, index, &count, value);
+}
+)";
+
+
+/// Writes the extractors of the message types in a set of files
+struct generator {
+    explicit generator(const std::vector<const FileDescriptor *>& files);
+
+    /// Returns the generated file
+    std::string generate();
+
+private:
+    void add_message(const Descriptor *type);
+    std::string accept_function(const FieldDescriptor *field);
+    std::string oneof_function(const FieldDescriptor *field);
+    std::string find_function(const Descriptor *type);
+    void generate_message(const Descriptor *type);
+
+    std::vector<const FileDescriptor *> files;
+    std::vector<const Descriptor *> messages;
+    std::map<const Descriptor *, size_t> message_ids;
+    std::map<const EnumDescriptor *, std::string> accept_functions;
+
+    // The code of the helper functions, and of the extractors
+    std::string helpers;
+    std::string extractors;
+};
+
+
+/// Returns the tag of a field that is not packed
+static uint32_t field_tag(const FieldDescriptor *field)
+{
+    return WireFormatLite::MakeTag(field->number(),
+        WireFormatLite::WireTypeForFieldType(
+            static_cast<WireFormatLite::FieldType>(field->type())));
+}
+
+
+/// Returns true if the wire engine follows the field. Map entries are
+/// deduplicated and groups are not length-delimited.
+static bool is_supported(const FieldDescriptor *field)
+{
+    return !field->is_map() && field->type() != FieldDescriptor::TYPE_GROUP;
+}
+
+
+/// Returns true if the parser moves undefined values of the field to the
+/// unknown fields
+static bool is_closed_enum(const FieldDescriptor *field)
+{
+    return field->type() == FieldDescriptor::TYPE_ENUM
+        && field->enum_type()->file()->syntax()
+               != FileDescriptor::SYNTAX_PROTO3;
+}
+
+
+generator::generator(const std::vector<const FileDescriptor *>& files)
+    : files(files)
+{
+    for (const FileDescriptor *file : files) {
+        for (int i = 0; i < file->message_type_count(); i ++)
+            add_message(file->message_type(i));
+    }
+}
+
+
+void generator::add_message(const Descriptor *type)
+{
+    message_ids[type] = messages.size();
+    messages.push_back(type);
+    for (int i = 0; i < type->nested_type_count(); i ++)
+        add_message(type->nested_type(i));
+}
+
+
+std::string generator::find_function(const Descriptor *type)
+{
+    return "find_" + std::to_string(message_ids.at(type));
+}
+
+
+/// Returns the function that says whether a value of the field is kept,
+/// writing it first if it is needed
+std::string generator::accept_function(const FieldDescriptor *field)
+{
+    if (!is_closed_enum(field))
+        return "accept_all";
+    const EnumDescriptor *type = field->enum_type();
+    auto existing = accept_functions.find(type);
+    if (existing != accept_functions.end())
+        return existing->second;
+
+    std::string name = "accept_" + std::to_string(accept_functions.size());
+    accept_functions[type] = name;
+
+    // Aliases share a number, which can only be a case once
+    std::set<int> numbers;
+    for (int i = 0; i < type->value_count(); i ++)
+        numbers.insert(type->value(i)->number());
+
+    helpers += "\n\n// " + type->full_name() + "\n";
+    helpers += "bool " + name + "(uint64_t bits)\n{\n";
+    helpers += "    switch (static_cast<int32_t>(bits)) {\n";
+    for (int number : numbers)
+        helpers += "    case " + std::to_string(number) + ":\n";
+    helpers += "        return true;\n";
+    helpers += "    default:\n        return false;\n    }\n}\n";
+    return name;
+}
+
+
+/// Returns the function that says what the other members of the field's oneof
+/// do to it, writing it first if it is needed
+std::string generator::oneof_function(const FieldDescriptor *field)
+{
+    const OneofDescriptor *oneof = field->real_containing_oneof();
+    if (!oneof || oneof->field_count() < 2)
+        return "no_oneof";
+
+    // Only a value that the parser keeps sets the oneof, so a member that is
+    // a closed enum may or may not clear the field
+    std::string name = "oneof_" + std::to_string(message_ids.at(
+        field->containing_type())) + "_" + std::to_string(field->number());
+    helpers += "\n\n// " + field->full_name() + "\n";
+    helpers += "int " + name + "(uint32_t tag)\n{\n";
+    helpers += "    switch (tag) {\n";
+    std::string may_clear;
+    for (int i = 0; i < oneof->field_count(); i ++) {
+        const FieldDescriptor *member = oneof->field(i);
+        if (member == field)
+            continue;
+        std::string label = "    case " + std::to_string(field_tag(member))
+            + "u:  // " + member->name() + "\n";
+        if (is_closed_enum(member)
+                || member->type() == FieldDescriptor::TYPE_GROUP)
+            may_clear += label;
+        else
+            helpers += label;
+    }
+    helpers += "        return CLEARS;\n";
+    if (!may_clear.empty())
+        helpers += may_clear + "        return MAY_CLEAR;\n";
+    helpers += "    default:\n        return KEEPS;\n    }\n}\n";
+    return name;
+}
+
+
+void generator::generate_message(const Descriptor *type)
+{
+    std::string cases;
+    bool descends = false;
+    for (int i = 0; i < type->field_count(); i ++) {
+        const FieldDescriptor *field = type->field(i);
+        if (!is_supported(field))
+            continue;
+
+        std::string tag = std::to_string(field_tag(field)) + "u";
+        std::string accept = accept_function(field);
+        std::string scan;
+        if (field->is_repeated()) {
+            scan = "find_repeated<" + tag + ", "
+                + (field->is_packable() ? "true" : "false") + ", " + accept
+                + ">(data, end, path->index, value)";
+        } else {
+            bool is_message = field->cpp_type()
+                == FieldDescriptor::CPPTYPE_MESSAGE;
+            scan = "scan_singular<" + tag + ", " + accept + ", "
+                + oneof_function(field) + ", "
+                + (is_message ? "true" : "false") + ">(data, end, value)";
+        }
+
+        cases += "    case " + std::to_string(field->number()) + ":  // "
+            + field->name() + "\n";
+        if (field->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE) {
+            if (field->type() == FieldDescriptor::TYPE_STRING
+                    && field->file()->syntax() == FileDescriptor::SYNTAX_PROTO3)
+                scan = "valid_string(" + scan + ", value)";
+            cases += "        if (count > 1)\n";
+            cases += "            return FALLBACK;\n";
+            cases += "        return " + scan + ";\n";
+            continue;
+        }
+
+        // Descend into the message found, if its type is generated here
+        descends = true;
+        cases += "        status = " + scan + ";\n";
+        cases += "        if (status != FOUND || count == 1)\n";
+        cases += "            return status;\n";
+        if (message_ids.count(field->message_type())) {
+            cases += "        return "
+                + find_function(field->message_type())
+                + "(value->data, value->size, path + 1, count - 1, "
+                  "value);\n";
+        } else {
+            cases += "        return FALLBACK;\n";
+        }
+    }
+
+    extractors += "\n\n// " + type->full_name() + "\n";
+    extractors += "int " + find_function(type) + "(const uint8_t *data, "
+        "size_t size, const sqlite_protobuf_step *path,\n"
+        "    size_t count, sqlite_protobuf_value *value)\n{\n";
+    extractors += "    const uint8_t *end = data + size;\n";
+    if (descends)
+        extractors += "    int status;\n";
+    if (cases.empty())
+        extractors += "    (void)end;\n";
+    extractors += "    switch (path->number) {\n" + cases;
+    extractors += "    default:\n        return FALLBACK;\n    }\n}\n";
+}
+
+
+std::string generator::generate()
+{
+    std::string output = "// Generated by protoc-gen-sqlite_protobuf from";
+    for (const FileDescriptor *file : files)
+        output += " " + file->name();
+    output += ". DO NOT EDIT!\n//\n"
+        "// Extractors for protobuf_extract, which protobuf_load finds through "
+        "the\n// sqlite_protobuf_extractors function when this is built into a "
+        "library.\n";
+    output += runtime;
+
+    output += "\n";
+    for (const Descriptor *type : messages) {
+        output += "\nint " + find_function(type) + "(const uint8_t *data, "
+            "size_t size, const sqlite_protobuf_step *path,\n"
+            "    size_t count, sqlite_protobuf_value *value);";
+    }
+    for (const Descriptor *type : messages)
+        generate_message(type);
+    output += helpers + extractors;
+
+    output += "\n\n";
+    if (!messages.empty()) {
+        output += "const sqlite_protobuf_extractor extractors[] = {\n";
+        for (const Descriptor *type : messages) {
+            output += "    { \"" + type->full_name() + "\", "
+                + find_function(type) + " },\n";
+        }
+        output += "};\n\n";
+    }
+    output += "}  // namespace\n\n\n";
+
+    output +=
+        "extern \"C\" __attribute__((visibility(\"default\")))\n"
+        "const sqlite_protobuf_extractor *sqlite_protobuf_extractors(int "
+        "version,\n"
+        "                                                            size_t "
+        "*count)\n"
+        "{\n"
+        "    if (version != 1)\n"
+        "        return nullptr;\n";
+    if (messages.empty()) {
+        output += "    *count = 0;\n    return nullptr;\n}\n";
+    } else {
+        output +=
+            "    *count = sizeof(extractors) / sizeof(extractors[0]);\n"
+            "    return extractors;\n}\n";
+    }
+    return output;
+}
+
+
+/// Generates the extractors of every file that protoc asks for into a single
+/// file, named after the first, since a library can only export one
+/// sqlite_protobuf_extractors function
+static void run(const CodeGeneratorRequest& request,
+                CodeGeneratorResponse *response)
+{
+    // Proto3 optional fields are handled like other fields with presence
+    response->set_supported_features(1);
+
+    DescriptorPool pool;
+    for (const FileDescriptorProto& file : request.proto_file()) {
+        if (!pool.BuildFile(file)) {
+            response->set_error("Could not build " + file.name());
+            return;
+        }
+    }
+
+    std::vector<const FileDescriptor *> files;
+    for (const std::string& name : request.file_to_generate())
+        files.push_back(pool.FindFileByName(name));
+    if (files.empty())
+        return;
+
+    std::string name = files[0]->name();
+    if (name.size() > 6 && name.compare(name.size() - 6, 6, ".proto") == 0)
+        name.resize(name.size() - 6);
+    CodeGeneratorResponse::File *output = response->add_file();
+    output->set_name(name + ".extractors.cc");
+    output->set_content(generator(files).generate());
+}
+
+
+int main(int argc, char **argv)
+{
+    std::cin >> std::noskipws;
+    std::string input((std::istreambuf_iterator<char>(std::cin)),
+                      std::istreambuf_iterator<char>());
+    CodeGeneratorRequest request;
+    if (!request.ParseFromString(input)) {
+        fprintf(stderr, "%s: could not parse the request from protoc\n",
+            argv[0]);
+        return 1;
+    }
+
+    CodeGeneratorResponse response;
+    run(request, &response);
+    if (!response.SerializeToOstream(&std::cout)) {
+        fprintf(stderr, "%s: could not write the response\n", argv[0]);
+        return 1;
+    }
+    return 0;
+}